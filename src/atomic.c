@@ -2,6 +2,7 @@
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#pragma comment(lib, "Synchronization.lib")
 
 int atomic_increment(int* address)
 {
@@ -18,12 +19,57 @@ int atomic_compare_and_exchange(int* dest, int compare, int exchange)
 	return InterlockedCompareExchange(dest, exchange, compare);
 }
 
+int atomic_exchange(int* address, int value)
+{
+	return InterlockedExchange(address, value);
+}
+
+void* atomic_compare_and_exchange_ptr(void** dest, void* compare, void* exchange)
+{
+	return InterlockedCompareExchangePointer(dest, exchange, compare);
+}
+
+void* atomic_exchange_ptr(void** address, void* value)
+{
+	return InterlockedExchangePointer(address, value);
+}
+
 int atomic_load(int* address)
 {
 	return *(volatile int*)address;
 }
 
+int64_t atomic_load64_relaxed(int64_t* address)
+{
+	return *(volatile int64_t*)address;
+}
+
+void* atomic_load_ptr(void** address)
+{
+	return *(void* volatile*)address;
+}
+
 void atomic_store(int* address, int value)
 {
 	*(volatile int*)address = value;
 }
+
+void atomic_store64_relaxed(int64_t* address, int64_t value)
+{
+	*(volatile int64_t*)address = value;
+}
+
+void atomic_wait(int* address, int value)
+{
+	WaitOnAddress(address, &value, sizeof(value), INFINITE);
+}
+
+void atomic_wake_one(int* address)
+{
+	WakeByAddressSingle(address);
+}
+
+void atomic_wake_all(int* address)
+{
+	WakeByAddressAll(address);
+}
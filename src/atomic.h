@@ -1,6 +1,8 @@
 #pragma once
 
-// Atomic operations on 32-bit integers.
+#include <stdint.h>
+
+// Atomic operations on 32-bit integers and pointers, and reads of 64-bit counters.
 
 // Increment a number atomically.
 // Returns the old value of the number.
@@ -20,10 +22,48 @@ int atomic_decrement(int* address);
 //   int old_value = *address; if (*address == compare) *address = exchange; return old_value;
 int atomic_compare_and_exchange(int* dest, int compare, int exchange);
 
+// Exchange a number atomically.
+// Returns the old value of the number.
+// Acts as a full memory barrier.
+int atomic_exchange(int* address, int value);
+
+// Compare two pointers atomically and assign if equal.
+// Returns the old value of the pointer.
+// Performs the following operation atomically:
+//   void* old_value = *address; if (*address == compare) *address = exchange; return old_value;
+void* atomic_compare_and_exchange_ptr(void** dest, void* compare, void* exchange);
+
+// Exchange a pointer atomically.
+// Returns the old value of the pointer.
+// Acts as a full memory barrier.
+void* atomic_exchange_ptr(void** address, void* value);
+
 // Reads an integer from an address.
 // All writes that occurred before the last atomic_store to this address are flushed.
 int atomic_load(int* address);
 
+// Reads a 64-bit counter from an address, with no ordering against other memory.
+// The read is atomic, so a counter another thread is updating is never seen half written.
+int64_t atomic_load64_relaxed(int64_t* address);
+
+// Reads a pointer from an address.
+// Paired with atomic_compare_and_exchange_ptr or atomic_exchange_ptr, sees writes made before them.
+void* atomic_load_ptr(void** address);
+
 // Writes an integer.
 // Paired with an atomic_load, can guarantee ordering and visibility.
 void atomic_store(int* address, int value);
+
+// Writes a 64-bit counter to an address, with no ordering against other memory.
+// The write is atomic, so atomic_load64_relaxed on another thread never sees it half written.
+void atomic_store64_relaxed(int64_t* address, int64_t value);
+
+// Blocks the calling thread while the integer at address equals value.
+// May return spuriously; callers re-check their condition and wait again.
+void atomic_wait(int* address, int value);
+
+// Wakes one thread blocked in atomic_wait on address.
+void atomic_wake_one(int* address);
+
+// Wakes all threads blocked in atomic_wait on address.
+void atomic_wake_all(int* address);
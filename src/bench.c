@@ -0,0 +1,56 @@
+#include "bench.h"
+
+#include "debug.h"
+#include "thread.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+typedef struct bench_t
+{
+	const char* name;
+	void (*function)(heap_t* heap);
+} bench_t;
+
+static const bench_t k_benches[] =
+{
+	{ "cull", cull_bench_run },
+	{ "ecs", ecs_bench_run },
+	{ "ecs_query", ecs_query_bench_run },
+	{ "ecs_systems", ecs_systems_bench_run },
+	{ "frame_allocator", frame_allocator_bench_run },
+	{ "gpu_allocator", gpu_allocator_bench_run },
+	{ "heap", heap_bench_run },
+	{ "jobs", job_bench_run },
+	{ "object_pool", object_pool_bench_run },
+	{ "queue", queue_bench_run },
+#if defined(GPU_NULL)
+	{ "render", render_bench_run },
+	{ "render_cache", render_cache_bench_run },
+	{ "render_record", render_record_bench_run },
+#endif
+	{ "spsc_queue", spsc_queue_bench_run },
+};
+
+bool bench_run(heap_t* heap, const char* name)
+{
+	// Timings depend on the machine, so say what ran them.
+	debug_print(k_print_info, "Benchmarks on %d logical cores. Rows with more threads than cores measure contention, not scaling.\n",
+		thread_get_core_count());
+
+	bool found = false;
+	for (int i = 0; i < _countof(k_benches); ++i)
+	{
+		if (strcmp(name, "all") == 0 || strcmp(name, k_benches[i].name) == 0)
+		{
+			debug_print(k_print_info, "=== bench: %s ===\n", k_benches[i].name);
+			k_benches[i].function(heap);
+			found = true;
+		}
+	}
+	if (!found)
+	{
+		debug_print(k_print_warning, "Unknown benchmark: %s\n", name);
+	}
+	return found;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+// Benchmarks
+// Timed runs of engine subsystems in isolation.
+// Results are logged with debug_print().
+
+#include <stdbool.h>
+
+typedef struct heap_t heap_t;
+
+// Run the named benchmark, or all of them if name is "all".
+// Logs the machine's logical core count first.
+// Returns false if no benchmark matches the name.
+bool bench_run(heap_t* heap, const char* name);
+
+// Measure frustum culling of bounding spheres against a camera at 1k, 100k, and 1M entities.
+// Reports visible and culled counts, and ns/entity to move bounds to world space and to test them, scalar and SSE.
+void cull_bench_run(heap_t* heap);
+
+// Compare ECS query iteration over archetype chunks against a flat per-component-array layout.
+// Runs at 1k, 100k, and 1M entities.
+void ecs_bench_run(heap_t* heap);
+
+// Compare the per-entity ECS query path against the chunk query path.
+// Reports ns/entity for each at 1k, 100k, and 1M entities.
+void ecs_query_bench_run(heap_t* heap);
+
+// Measure ECS system scheduler frame time as worker threads are added.
+// Runs movement systems over 1M entities with 0 to N-1 workers and reports scaling over serial.
+void ecs_systems_bench_run(heap_t* heap);
+
+// Compare per-frame scratch allocation from job system jobs on the heap against the frame allocator.
+// Runs the frame allocator with no frame delay and with two, and reports ns/alloc and peak bytes and pages per frame.
+void frame_allocator_bench_run(heap_t* heap);
+
+// Measure the GPU memory sub-allocator under random alloc/free churn in one 64MB block.
+// Reports ns per alloc/free pair and fragmentation at three levels of occupancy.
+void gpu_allocator_bench_run(heap_t* heap);
+
+// Compare heap throughput with and without thread caches, and with leak tracking, at 1 to 16 threads.
+// Threads either free their own blocks, or hand each block to the next thread to free.
+// Reports millions of alloc/free pairs per second.
+void heap_bench_run(heap_t* heap);
+
+// Measure job system throughput with fan-out jobs that stress submission and stealing.
+// Reports jobs/sec and scaling from 1 to N cores, counting the waiting thread as a core.
+void job_bench_run(heap_t* heap);
+
+// Measure per-call alloc and free latency for structs converted to object pools: trace events, packets, and fs work.
+// Compares the locked heap, the thread cached heap, and an object pool, from 1 thread and from 4 sharing one pool.
+void object_pool_bench_run(heap_t* heap);
+
+// Compare the lock-free queue against the semaphore queue under contention.
+// Reports push and pop ops/sec with 1 to 16 producers and as many consumers.
+void queue_bench_run(heap_t* heap);
+
+// Measure producer stall time for render-style submission.
+// Compares the old 3-item semaphore queue against the frame-limited SPSC ring
+// at 100, 1k, and 10k draws per frame.
+void spsc_queue_bench_run(heap_t* heap);
+
+// Drive render_t with synthetic scenes of 10k entities, and 100k for the instanced path.
+// Scenes with a view push camera data once and a 48 byte transform per entity, in place of three matrices.
+// Reports frame time, draw and submit throughput, state changes and binds saved by sorting, bytes pushed and
+// uploaded, and GPU object churn per frame.
+// Requires the null GPU backend (GPU_NULL).
+void render_bench_run(heap_t* heap);
+
+// Drive render_t with synthetic scenes of 1k, 10k, and 50k instances.
+// Reports ms/frame with a steady scene and with 10% of instances replaced each frame.
+// Requires the null GPU backend (GPU_NULL).
+void render_cache_bench_run(heap_t* heap);
+
+// Measure render thread recording time as recording jobs are added, at 20k and 100k draws per frame.
+// Runs with no job system, then 1 to N-1 workers, and reports scaling over the serial run.
+// Requires the null GPU backend (GPU_NULL).
+void render_record_bench_run(heap_t* heap);
@@ -0,0 +1,152 @@
+#include "cull.h"
+
+#include "gpu.h"
+#include "mat4f.h"
+#include "transform.h"
+
+#include <float.h>
+#include <math.h>
+
+#include <xmmintrin.h>
+
+static size_t get_vertex_stride(gpu_mesh_layout_t layout);
+
+void cull_frustum_from_matrix(cull_frustum_t* frustum, const mat4f_t* view_projection)
+{
+	// Each plane is w plus or minus one row of the matrix (Gribb and Hartmann), except near, which is z alone.
+	// Matrix data is stored column first, so row r is data[0..3][r].
+	static const struct { int row; float w; float sign; } k_planes[k_cull_plane_count] =
+	{
+		{ 0, 1.0f, 1.0f }, { 0, 1.0f, -1.0f }, // left, right: -w <= x <= w
+		{ 1, 1.0f, 1.0f }, { 1, 1.0f, -1.0f }, // bottom, top: -w <= y <= w
+		{ 2, 0.0f, 1.0f }, { 2, 1.0f, -1.0f }, // near, far: 0 <= z <= w
+	};
+	for (int i = 0; i < k_cull_plane_count; ++i)
+	{
+		float plane[4];
+		for (int col = 0; col < 4; ++col)
+		{
+			plane[col] = view_projection->data[col][3] * k_planes[i].w + view_projection->data[col][k_planes[i].row] * k_planes[i].sign;
+		}
+
+		float length = sqrtf(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+		float scale = length > FLT_EPSILON ? 1.0f / length : 1.0f;
+		frustum->a[i] = plane[0] * scale;
+		frustum->b[i] = plane[1] * scale;
+		frustum->c[i] = plane[2] * scale;
+		frustum->d[i] = plane[3] * scale;
+	}
+}
+
+void cull_sphere_from_mesh(cull_sphere_t* sphere, const gpu_mesh_info_t* mesh)
+{
+	// Positions come first in every vertex layout.
+	size_t stride = get_vertex_stride(mesh->layout);
+	size_t vertex_count = stride ? mesh->vertex_data_size / stride : 0;
+	if (vertex_count == 0)
+	{
+		sphere->center = vec3f_zero();
+		sphere->radius = 0.0f;
+		return;
+	}
+
+	const char* vertex_data = mesh->vertex_data;
+	vec3f_t min = *(const vec3f_t*)vertex_data;
+	vec3f_t max = min;
+	for (size_t i = 1; i < vertex_count; ++i)
+	{
+		const vec3f_t* position = (const vec3f_t*)(vertex_data + i * stride);
+		min = vec3f_min(min, *position);
+		max = vec3f_max(max, *position);
+	}
+
+	// Center on the bounding box, then grow to reach the farthest vertex.
+	sphere->center = vec3f_scale(vec3f_add(min, max), 0.5f);
+	float radius_squared = 0.0f;
+	for (size_t i = 0; i < vertex_count; ++i)
+	{
+		vec3f_t offset = vec3f_sub(*(const vec3f_t*)(vertex_data + i * stride), sphere->center);
+		radius_squared = fmaxf(radius_squared, vec3f_dot(offset, offset));
+	}
+	sphere->radius = sqrtf(radius_squared);
+}
+
+void cull_sphere_transform(cull_sphere_t* result, const cull_sphere_t* sphere, const transform_t* transform)
+{
+	float scale = fmaxf(fabsf(transform->scale.x), fmaxf(fabsf(transform->scale.y), fabsf(transform->scale.z)));
+	result->center = transform_transform_vec3(transform, sphere->center);
+	result->radius = sphere->radius * scale;
+}
+
+int cull_spheres(const cull_frustum_t* frustum, const float* x, const float* y, const float* z, const float* radius, int count, uint8_t* visible)
+{
+	__m128 a[k_cull_plane_count];
+	__m128 b[k_cull_plane_count];
+	__m128 c[k_cull_plane_count];
+	__m128 d[k_cull_plane_count];
+	for (int p = 0; p < k_cull_plane_count; ++p)
+	{
+		a[p] = _mm_set1_ps(frustum->a[p]);
+		b[p] = _mm_set1_ps(frustum->b[p]);
+		c[p] = _mm_set1_ps(frustum->c[p]);
+		d[p] = _mm_set1_ps(frustum->d[p]);
+	}
+
+	int visible_count = 0;
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 px = _mm_loadu_ps(x + i);
+		__m128 py = _mm_loadu_ps(y + i);
+		__m128 pz = _mm_loadu_ps(z + i);
+		__m128 negative_radius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(radius + i));
+
+		// A sphere is visible while its center is no farther than its radius outside every plane.
+		__m128 inside = _mm_cmpeq_ps(_mm_setzero_ps(), _mm_setzero_ps());
+		for (int p = 0; p < k_cull_plane_count; ++p)
+		{
+			__m128 distance = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(a[p], px), _mm_mul_ps(b[p], py)),
+				_mm_add_ps(_mm_mul_ps(c[p], pz), d[p]));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negative_radius));
+		}
+
+		int mask = _mm_movemask_ps(inside);
+		visible[i + 0] = (uint8_t)(mask & 1);
+		visible[i + 1] = (uint8_t)((mask >> 1) & 1);
+		visible[i + 2] = (uint8_t)((mask >> 2) & 1);
+		visible[i + 3] = (uint8_t)((mask >> 3) & 1);
+		visible_count += visible[i + 0] + visible[i + 1] + visible[i + 2] + visible[i + 3];
+	}
+
+	// Fewer than four left over.
+	return visible_count + cull_spheres_scalar(frustum, x + i, y + i, z + i, radius + i, count - i, visible + i);
+}
+
+int cull_spheres_scalar(const cull_frustum_t* frustum, const float* x, const float* y, const float* z, const float* radius, int count, uint8_t* visible)
+{
+	int visible_count = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		uint8_t inside = 1;
+		for (int p = 0; p < k_cull_plane_count; ++p)
+		{
+			// Summed in the same order as cull_spheres(), so both agree on spheres touching a plane.
+			float distance = (frustum->a[p] * x[i] + frustum->b[p] * y[i]) + (frustum->c[p] * z[i] + frustum->d[p]);
+			inside &= distance >= -radius[i];
+		}
+		visible[i] = inside;
+		visible_count += inside;
+	}
+	return visible_count;
+}
+
+static size_t get_vertex_stride(gpu_mesh_layout_t layout)
+{
+	switch (layout)
+	{
+	case k_gpu_mesh_layout_tri_p444_i2: return sizeof(float) * 3;
+	case k_gpu_mesh_layout_tri_p444_c444_i2: return sizeof(float) * 6;
+	default: return 0;
+	}
+}
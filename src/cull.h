@@ -0,0 +1,54 @@
+#pragma once
+
+// Frustum Culling
+// Tests bounding spheres against the six planes of a camera frustum.
+// Spheres are tested four at a time with SSE, so their centers and radii are passed as
+// separate arrays (structure of arrays) rather than as an array of spheres.
+
+#include "vec3f.h"
+
+#include <stdint.h>
+
+typedef struct gpu_mesh_info_t gpu_mesh_info_t;
+typedef struct mat4f_t mat4f_t;
+typedef struct transform_t transform_t;
+
+enum
+{
+	k_cull_plane_count = 6,
+};
+
+// Frustum planes, one coefficient per array. Normals point inward and are unit length,
+// so a * x + b * y + c * z + d is a point's distance inside plane i.
+typedef struct cull_frustum_t
+{
+	float a[k_cull_plane_count];
+	float b[k_cull_plane_count];
+	float c[k_cull_plane_count];
+	float d[k_cull_plane_count];
+} cull_frustum_t;
+
+// Bounding sphere.
+typedef struct cull_sphere_t
+{
+	vec3f_t center;
+	float radius;
+} cull_sphere_t;
+
+// Extract the frustum planes of a combined projection * view matrix.
+// Clip space depth runs from 0 to w, as in Vulkan.
+void cull_frustum_from_matrix(cull_frustum_t* frustum, const mat4f_t* view_projection);
+
+// Compute a model space sphere enclosing every vertex position of a mesh.
+void cull_sphere_from_mesh(cull_sphere_t* sphere, const gpu_mesh_info_t* mesh);
+
+// Move a model space sphere into world space. The radius grows by the largest scale axis.
+void cull_sphere_transform(cull_sphere_t* result, const cull_sphere_t* sphere, const transform_t* transform);
+
+// Test count spheres against a frustum, four at a time.
+// Writes 1 to visible[i] for each sphere that touches the frustum and 0 for each wholly outside a plane.
+// Returns the number of visible spheres.
+int cull_spheres(const cull_frustum_t* frustum, const float* x, const float* y, const float* z, const float* radius, int count, uint8_t* visible);
+
+// Same as cull_spheres(), one sphere at a time without SSE.
+int cull_spheres_scalar(const cull_frustum_t* frustum, const float* x, const float* y, const float* z, const float* radius, int count, uint8_t* visible);
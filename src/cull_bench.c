@@ -0,0 +1,133 @@
+#include "bench.h"
+
+#include "cull.h"
+#include "debug.h"
+#include "heap.h"
+#include "mat4f.h"
+#include "timer.h"
+#include "transform.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define _USE_MATH_DEFINES
+#include <math.h>
+
+enum
+{
+	// Each entity count repeats until about this many spheres have been tested.
+	k_bench_sphere_tests = 8 * 1024 * 1024,
+};
+
+static const int k_entity_counts[] = { 1000, 100 * 1000, 1000 * 1000 };
+
+static uint32_t bench_random(uint32_t* state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+static float bench_random_float(uint32_t* state, float min, float max)
+{
+	return min + (max - min) * (float)(bench_random(state) & 0xffffff) / (float)0x1000000;
+}
+
+static double bench_ns_per_entity(uint64_t ticks, int count, int iterations)
+{
+	return (double)ticks * 1e9 / (double)timer_get_ticks_per_second() / ((double)count * iterations);
+}
+
+void cull_bench_run(heap_t* heap)
+{
+	// A camera in the middle of the scene, so most entities are behind it, off to the side, or past its far plane.
+	mat4f_t projection;
+	mat4f_t view;
+	mat4f_make_perspective(&projection, (float)M_PI / 2.0f, 16.0f / 9.0f, 0.1f, 100.0f);
+	vec3f_t eye = vec3f_zero();
+	vec3f_t forward = vec3f_forward();
+	vec3f_t up = vec3f_up();
+	mat4f_make_lookat(&view, &eye, &forward, &up);
+
+	mat4f_t view_projection;
+	mat4f_mul(&view_projection, &view, &projection);
+	cull_frustum_t frustum;
+	cull_frustum_from_matrix(&frustum, &view_projection);
+
+	// Bounds of a unit cube, as final_game's models have.
+	cull_sphere_t local_bounds = { .center = vec3f_zero(), .radius = 0.5f * sqrtf(3.0f) };
+
+	for (int c = 0; c < _countof(k_entity_counts); ++c)
+	{
+		int count = k_entity_counts[c];
+		int iterations = __max(1, k_bench_sphere_tests / count);
+		transform_t* transforms = heap_alloc(heap, sizeof(transform_t) * count, 8);
+		float* x = heap_alloc(heap, sizeof(float) * count, 16);
+		float* y = heap_alloc(heap, sizeof(float) * count, 16);
+		float* z = heap_alloc(heap, sizeof(float) * count, 16);
+		float* radius = heap_alloc(heap, sizeof(float) * count, 16);
+		uint8_t* visible = heap_alloc(heap, count, 16);
+		uint8_t* scalar_visible = heap_alloc(heap, count, 16);
+
+		uint32_t state = 0x9e3779b9;
+		for (int i = 0; i < count; ++i)
+		{
+			transform_identity(&transforms[i]);
+			transforms[i].translation.x = bench_random_float(&state, -200.0f, 200.0f);
+			transforms[i].translation.y = bench_random_float(&state, -200.0f, 200.0f);
+			transforms[i].translation.z = bench_random_float(&state, -200.0f, 200.0f);
+			transforms[i].scale = vec3f_scale(vec3f_one(), bench_random_float(&state, 0.5f, 4.0f));
+		}
+
+		// Model bounds to world space, laid out for the test.
+		uint64_t start = timer_get_ticks();
+		for (int it = 0; it < iterations; ++it)
+		{
+			for (int i = 0; i < count; ++i)
+			{
+				cull_sphere_t bounds;
+				cull_sphere_transform(&bounds, &local_bounds, &transforms[i]);
+				x[i] = bounds.center.x;
+				y[i] = bounds.center.y;
+				z[i] = bounds.center.z;
+				radius[i] = bounds.radius;
+			}
+		}
+		uint64_t bounds_ticks = timer_get_ticks() - start;
+
+		int scalar_visible_count = 0;
+		start = timer_get_ticks();
+		for (int it = 0; it < iterations; ++it)
+		{
+			scalar_visible_count = cull_spheres_scalar(&frustum, x, y, z, radius, count, scalar_visible);
+		}
+		uint64_t scalar_ticks = timer_get_ticks() - start;
+
+		int visible_count = 0;
+		start = timer_get_ticks();
+		for (int it = 0; it < iterations; ++it)
+		{
+			visible_count = cull_spheres(&frustum, x, y, z, radius, count, visible);
+		}
+		uint64_t simd_ticks = timer_get_ticks() - start;
+
+		double scalar_ns = bench_ns_per_entity(scalar_ticks, count, iterations);
+		double simd_ns = bench_ns_per_entity(simd_ticks, count, iterations);
+		debug_print(k_print_info, "  %7d entities: %7d visible, %7d culled; bounds %5.2f ns/entity, test %5.2f ns/entity scalar, %5.2f ns/entity SSE (%4.2fx)%s\n",
+			count, visible_count, count - visible_count,
+			bench_ns_per_entity(bounds_ticks, count, iterations),
+			scalar_ns, simd_ns, scalar_ns / simd_ns,
+			visible_count == scalar_visible_count && memcmp(visible, scalar_visible, count) == 0 ? "" : " MISMATCH");
+
+		heap_free(heap, scalar_visible);
+		heap_free(heap, visible);
+		heap_free(heap, radius);
+		heap_free(heap, z);
+		heap_free(heap, y);
+		heap_free(heap, x);
+		heap_free(heap, transforms);
+	}
+}
@@ -1,6 +1,7 @@
 #include "debug.h"
 
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
 
 #define WIN32_LEAN_AND_MEAN
@@ -8,6 +9,7 @@
 #include <DbgHelp.h>
 
 static uint32_t s_mask = 0xffffffff;
+static bool s_symbols_loaded = false;
 
 static LONG debug_exception_handler(LPEXCEPTION_POINTERS info)
 {
@@ -74,36 +76,38 @@ void debug_print(uint32_t type, _Printf_format_string_ const char* format, ...)
 	WriteConsoleA(out, buffer, bytes, &written, NULL);
 }
 
-void debug_backtrace_print(void* ptr, size_t size, int used, void* user)
+int debug_backtrace(void** frames, int count, int skip)
 {
-	#define MAX_POOL 10
-
-	//Prints size of the leak
-	printf("Memory leak of size %d bytes with callstack:\n", (unsigned int)size);
-
-	SymSetOptions(0x00000002 | 0x00000004);
+	// Skip this function too.
+	return CaptureStackBackTrace(skip + 1, count, frames, NULL);
+}
 
+void debug_backtrace_print(void** frames, int count)
+{
 	HANDLE process = GetCurrentProcess();
-	SymInitialize(process, NULL, TRUE);
+	if (!s_symbols_loaded)
+	{
+		SymSetOptions(SYMOPT_UNDNAME | SYMOPT_DEFERRED_LOADS);
+		SymInitialize(process, NULL, TRUE);
+		s_symbols_loaded = true;
+	}
 
-	void* maxPool[10];
-	unsigned short stacks = CaptureStackBackTrace(4, MAX_POOL, maxPool, NULL);
 	char buffer[sizeof(SYMBOL_INFO) + MAX_SYM_NAME * sizeof(TCHAR)];
-	PSYMBOL_INFO pSymbol = (PSYMBOL_INFO)buffer;
-
-	pSymbol->SizeOfStruct = sizeof(SYMBOL_INFO);
-	pSymbol->MaxNameLen = MAX_SYM_NAME;
+	PSYMBOL_INFO symbol = (PSYMBOL_INFO)buffer;
+	symbol->SizeOfStruct = sizeof(SYMBOL_INFO);
+	symbol->MaxNameLen = MAX_SYM_NAME;
 
-	int toF = 0;
-
-	//Prints call stack, and stops at the main frame.
-	for (int i = 0; i < MAX_POOL; i++)
+	for (int i = 0; i < count; ++i)
 	{
-		SymFromAddr(process, (DWORD64)(maxPool[i]), 0, pSymbol);
-		printf("[%d] %s \n", i, pSymbol->Name);
-		int ee = strcmp(pSymbol->Name, "main");
-
-		if (toF == 1) { break; }
-		if (ee) { toF = 1; }
+		if (!SymFromAddr(process, (DWORD64)frames[i], 0, symbol))
+		{
+			debug_print(k_print_error, "  [%d] %p\n", i, frames[i]);
+			continue;
+		}
+		debug_print(k_print_error, "  [%d] %s\n", i, symbol->Name);
+		if (strcmp(symbol->Name, "main") == 0)
+		{
+			break;
+		}
 	}
 }
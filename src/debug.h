@@ -26,7 +26,10 @@ void debug_set_print_mask(uint32_t mask);
 void debug_print(uint32_t type, _Printf_format_string_ const char* format, ...);
 
 
+// Capture the calling thread's stack as return addresses, innermost first.
+// Skips the innermost skip frames above the caller. Returns the number of frames captured, at most count.
+int debug_backtrace(void** frames, int count, int skip);
 
-//This function is called when non-freed memory is about to be leaked
-//Prints the call stack and number of bytes lost.
-void debug_backtrace_print(void* ptr, size_t size, int used, void* user);
+// Log a captured stack, one symbol per line, stopping after main.
+// Symbols are loaded on the first call, so capturing stays cheap until something is printed.
+void debug_backtrace_print(void** frames, int count);
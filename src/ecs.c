@@ -1,14 +1,23 @@
 #include "ecs.h"
 
+#include "atomic.h"
 #include "debug.h"
 #include "heap.h"
+#include "job.h"
+#include "mutex.h"
 
 #include <string.h>
 
 enum
 {
 	k_max_component_types = 64,
-	k_max_entities = 512,
+	k_chunk_size = 16 * 1024,
+	k_chunk_alignment = 64,
+	k_initial_entity_capacity = 512,
+	k_initial_archetype_capacity = 16,
+	k_initial_chunk_capacity = 4,
+	k_max_systems = 64,
+	k_initial_task_capacity = 64,
 };
 
 typedef enum entity_state_t
@@ -19,69 +28,195 @@ typedef enum entity_state_t
 	k_entity_pending_remove,
 } entity_state_t;
 
+typedef struct ecs_archetype_t ecs_archetype_t;
+
+// A fixed size block of memory holding entities that share a component mask.
+// Entity indices, entity states, and component data are each stored as one array (SoA).
+// Layout is described by the owning archetype.
+typedef struct ecs_chunk_t
+{
+	ecs_archetype_t* archetype;
+	int count;
+} ecs_chunk_t;
+
+// A unique set of component types and the chunks storing its entities.
+// All chunks but the last are full; removal moves the last entity into the hole.
+typedef struct ecs_archetype_t
+{
+	uint64_t component_mask;
+	size_t chunk_size;
+	int chunk_entity_capacity;
+	size_t entities_offset;
+	size_t states_offset;
+	size_t component_offsets[k_max_component_types];
+
+	ecs_chunk_t** chunks;
+	int chunk_count;
+	int chunk_capacity;
+} ecs_archetype_t;
+
+// Where an entity lives.
+// State is mirrored in the chunk so queries can skip entities without leaving the chunk.
+typedef struct entity_t
+{
+	int sequence;
+	entity_state_t state;
+	ecs_chunk_t* chunk;
+	int index;
+} entity_t;
+
+typedef struct ecs_system_t
+{
+	char name[32];
+	uint64_t read_mask;
+	uint64_t write_mask;
+	uint32_t flags;
+	ecs_system_function_t function;
+	void* user;
+	int level;
+} ecs_system_t;
+
+// One unit of scheduled work: a single run of a parallel system,
+// or every run of a serial system.
+typedef struct ecs_task_t
+{
+	ecs_system_t* system;
+	ecs_query_chunk_t query;
+	bool all_runs;
+} ecs_task_t;
+
 typedef struct ecs_t
 {
 	heap_t* heap;
 	int global_sequence;
 
-	int sequences[k_max_entities];
-	entity_state_t entity_states[k_max_entities];
-	uint64_t component_masks[k_max_entities];
+	entity_t* entities;
+	int entity_count;
+	int entity_capacity;
 
-	void* components[k_max_component_types];
+	int* free_entities;
+	int free_entity_count;
+
+	int* pending_entities;
+	int pending_entity_count;
+	int pending_entity_capacity;
+
+	ecs_archetype_t** archetypes;
+	int archetype_count;
+	int archetype_capacity;
+
+	int component_type_count;
 	size_t component_type_sizes[k_max_component_types];
+	size_t component_type_alignments[k_max_component_types];
 	char component_type_names[k_max_component_types][32];
+
+	mutex_t* pending_mutex;
+
+	ecs_system_t systems[k_max_systems];
+	int system_count;
+
+	ecs_task_t* tasks;
+	int task_count;
+	int task_capacity;
+	int next_task;
+
+	job_system_t* jobs;
 } ecs_t;
 
+static void* grow_array(heap_t* heap, void* array, int count, int* capacity, size_t element_size);
+static ecs_archetype_t* find_or_create_archetype(ecs_t* ecs, uint64_t component_mask);
+static void archetype_destroy(ecs_t* ecs, ecs_archetype_t* archetype);
+static void archetype_add_entity(ecs_t* ecs, ecs_archetype_t* archetype, int entity);
+static void archetype_remove_entity(ecs_t* ecs, int entity);
+static void entity_set_state(ecs_t* ecs, int entity, entity_state_t state);
+static void run_tasks(ecs_t* ecs);
+static void run_tasks_job(void* user);
+
+static inline int* chunk_get_entities(ecs_chunk_t* chunk)
+{
+	return (int*)((char*)chunk + chunk->archetype->entities_offset);
+}
+
+static inline uint8_t* chunk_get_states(ecs_chunk_t* chunk)
+{
+	return (uint8_t*)chunk + chunk->archetype->states_offset;
+}
+
+static inline void* chunk_get_component(ecs_t* ecs, ecs_chunk_t* chunk, int index, int component_type)
+{
+	char* components = (char*)chunk + chunk->archetype->component_offsets[component_type];
+	return &components[ecs->component_type_sizes[component_type] * index];
+}
+
 ecs_t* ecs_create(heap_t* heap)
 {
-	ecs_t* ecs = heap_alloc(heap, sizeof(ecs_t), 8);
+	ecs_t* ecs = heap_alloc_tagged(heap, sizeof(ecs_t), 8, k_heap_tag_ecs);
 	memset(ecs, 0, sizeof(*ecs));
 	ecs->heap = heap;
 	ecs->global_sequence = 1;
+
+	ecs->entity_capacity = k_initial_entity_capacity;
+	ecs->entities = heap_alloc_tagged(heap, sizeof(entity_t) * ecs->entity_capacity, 8, k_heap_tag_ecs);
+	ecs->free_entities = heap_alloc_tagged(heap, sizeof(int) * ecs->entity_capacity, 8, k_heap_tag_ecs);
+
+	ecs->pending_entity_capacity = k_initial_entity_capacity;
+	ecs->pending_entities = heap_alloc_tagged(heap, sizeof(int) * ecs->pending_entity_capacity, 8, k_heap_tag_ecs);
+
+	ecs->archetype_capacity = k_initial_archetype_capacity;
+	ecs->archetypes = heap_alloc_tagged(heap, sizeof(ecs_archetype_t*) * ecs->archetype_capacity, 8, k_heap_tag_ecs);
+
+	ecs->pending_mutex = mutex_create();
+
+	ecs->task_capacity = k_initial_task_capacity;
+	ecs->tasks = heap_alloc_tagged(heap, sizeof(ecs_task_t) * ecs->task_capacity, 8, k_heap_tag_ecs);
 	return ecs;
 }
 
 void ecs_destroy(ecs_t* ecs)
 {
-	for (int i = 0; i < _countof(ecs->components); ++i)
+	heap_free(ecs->heap, ecs->tasks);
+	mutex_destroy(ecs->pending_mutex);
+
+	for (int i = 0; i < ecs->archetype_count; ++i)
 	{
-		if (ecs->components[i])
-		{
-			heap_free(ecs->heap, ecs->components[i]);
-		}
+		archetype_destroy(ecs, ecs->archetypes[i]);
 	}
+	heap_free(ecs->heap, ecs->archetypes);
+	heap_free(ecs->heap, ecs->pending_entities);
+	heap_free(ecs->heap, ecs->free_entities);
+	heap_free(ecs->heap, ecs->entities);
 	heap_free(ecs->heap, ecs);
 }
 
 void ecs_update(ecs_t* ecs)
 {
-	for (int i = 0; i < _countof(ecs->entity_states); ++i)
+	for (int i = 0; i < ecs->pending_entity_count; ++i)
 	{
-		if (ecs->entity_states[i] == k_entity_pending_add)
+		int entity = ecs->pending_entities[i];
+		if (ecs->entities[entity].state == k_entity_pending_add)
 		{
-			ecs->entity_states[i] = k_entity_active;
+			entity_set_state(ecs, entity, k_entity_active);
 		}
-		else if (ecs->entity_states[i] == k_entity_pending_remove)
+		else if (ecs->entities[entity].state == k_entity_pending_remove)
 		{
-			ecs->entity_states[i] = k_entity_unused;
+			archetype_remove_entity(ecs, entity);
+			entity_set_state(ecs, entity, k_entity_unused);
+			ecs->free_entities[ecs->free_entity_count++] = entity;
 		}
 	}
+	ecs->pending_entity_count = 0;
 }
 
 int ecs_register_component_type(ecs_t* ecs, const char* name, size_t size_per_component, size_t alignment)
 {
-	for (int i = 0; i < _countof(ecs->components); ++i)
+	if (ecs->component_type_count < k_max_component_types)
 	{
-		if (ecs->components[i] == NULL)
-		{
-			size_t aligned_size = (size_per_component + (alignment - 1)) & ~(alignment - 1);
-			strcpy_s(ecs->component_type_names[i], sizeof(ecs->component_type_names[i]), name);
-			ecs->component_type_sizes[i] = aligned_size;
-			ecs->components[i] = heap_alloc(ecs->heap, aligned_size * k_max_entities, alignment);
-			memset(ecs->components[i], 0, aligned_size * k_max_entities);
-			return i;
-		}
+		int i = ecs->component_type_count++;
+		size_t aligned_size = (size_per_component + (alignment - 1)) & ~(alignment - 1);
+		strcpy_s(ecs->component_type_names[i], sizeof(ecs->component_type_names[i]), name);
+		ecs->component_type_sizes[i] = aligned_size;
+		ecs->component_type_alignments[i] = alignment;
+		return i;
 	}
 	debug_print(k_print_warning, "Out of component types.");
 	return -1;
@@ -94,25 +229,52 @@ size_t ecs_get_component_type_size(ecs_t* ecs, int component_type)
 
 ecs_entity_ref_t ecs_entity_add(ecs_t* ecs, uint64_t component_mask)
 {
-	for (int i = 0; i < _countof(ecs->entity_states); ++i)
+	ecs_archetype_t* archetype = find_or_create_archetype(ecs, component_mask);
+
+	int entity;
+	if (ecs->free_entity_count > 0)
 	{
-		if (ecs->entity_states[i] == k_entity_unused)
+		entity = ecs->free_entities[--ecs->free_entity_count];
+	}
+	else
+	{
+		if (ecs->entity_count == ecs->entity_capacity)
 		{
-			ecs->entity_states[i] = k_entity_pending_add;
-			ecs->sequences[i] = ecs->global_sequence++;
-			ecs->component_masks[i] = component_mask;
-			return (ecs_entity_ref_t) { .entity = i, .sequence = ecs->sequences[i] };
+			int capacity = ecs->entity_capacity;
+			ecs->free_entities = grow_array(ecs->heap, ecs->free_entities, ecs->free_entity_count, &capacity, sizeof(int));
+			ecs->entities = grow_array(ecs->heap, ecs->entities, ecs->entity_count, &ecs->entity_capacity, sizeof(entity_t));
 		}
+		entity = ecs->entity_count++;
 	}
-	debug_print(k_print_warning, "Out of entities.");
-	return (ecs_entity_ref_t) { .entity = -1, .sequence = -1 };
+
+	if (ecs->pending_entity_count == ecs->pending_entity_capacity)
+	{
+		ecs->pending_entities = grow_array(ecs->heap, ecs->pending_entities, ecs->pending_entity_count, &ecs->pending_entity_capacity, sizeof(int));
+	}
+	ecs->pending_entities[ecs->pending_entity_count++] = entity;
+
+	ecs->entities[entity].sequence = ecs->global_sequence++;
+	archetype_add_entity(ecs, archetype, entity);
+	entity_set_state(ecs, entity, k_entity_pending_add);
+
+	return (ecs_entity_ref_t) { .entity = entity, .sequence = ecs->entities[entity].sequence };
 }
 
 void ecs_entity_remove(ecs_t* ecs, ecs_entity_ref_t ref, bool allow_pending_add)
 {
 	if (ecs_is_entity_ref_valid(ecs, ref, allow_pending_add))
 	{
-		ecs->entity_states[ref.entity] = k_entity_pending_remove;
+		mutex_lock(ecs->pending_mutex);
+		if (ecs->entities[ref.entity].state == k_entity_active)
+		{
+			if (ecs->pending_entity_count == ecs->pending_entity_capacity)
+			{
+				ecs->pending_entities = grow_array(ecs->heap, ecs->pending_entities, ecs->pending_entity_count, &ecs->pending_entity_capacity, sizeof(int));
+			}
+			ecs->pending_entities[ecs->pending_entity_count++] = ref.entity;
+		}
+		entity_set_state(ecs, ref.entity, k_entity_pending_remove);
+		mutex_unlock(ecs->pending_mutex);
 	}
 	else
 	{
@@ -123,52 +285,452 @@ void ecs_entity_remove(ecs_t* ecs, ecs_entity_ref_t ref, bool allow_pending_add)
 bool ecs_is_entity_ref_valid(ecs_t* ecs, ecs_entity_ref_t ref, bool allow_pending_add)
 {
 	return ref.entity >= 0 &&
-		ecs->sequences[ref.entity] == ref.sequence &&
-		ecs->entity_states[ref.entity] >= (allow_pending_add ? k_entity_pending_add : k_entity_active);
+		ref.entity < ecs->entity_count &&
+		ecs->entities[ref.entity].sequence == ref.sequence &&
+		ecs->entities[ref.entity].state >= (allow_pending_add ? k_entity_pending_add : k_entity_active);
 }
 
 void* ecs_entity_get_component(ecs_t* ecs, ecs_entity_ref_t ref, int component_type, bool allow_pending_add)
 {
-	if (ecs_is_entity_ref_valid(ecs, ref, allow_pending_add) && ecs->components[component_type])
+	if (ecs_is_entity_ref_valid(ecs, ref, allow_pending_add))
 	{
-		char* components = ecs->components[component_type];
-		return &components[ecs->component_type_sizes[component_type] * ref.entity];
+		entity_t* entity = &ecs->entities[ref.entity];
+		if (entity->chunk->archetype->component_mask & (1ULL << component_type))
+		{
+			return chunk_get_component(ecs, entity->chunk, entity->index, component_type);
+		}
 	}
 	return NULL;
 }
 
 ecs_query_t ecs_query_create(ecs_t* ecs, uint64_t mask)
 {
-	ecs_query_t query = { .component_mask = mask, .entity = -1 };
+	ecs_query_t query = { .component_mask = mask, .archetype = 0, .chunk_index = 0, .chunk = NULL, .index = -1 };
 	ecs_query_next(ecs, &query);
 	return query;
 }
 
 bool ecs_query_is_valid(ecs_t* ecs, ecs_query_t* query)
 {
-	return query->entity >= 0;
+	return query->chunk != NULL;
 }
 
 void ecs_query_next(ecs_t* ecs, ecs_query_t* query)
 {
-	for (int i = query->entity + 1; i < _countof(ecs->component_masks); ++i)
+	// Common case: the next active entity is in the current chunk.
+	if (query->chunk)
 	{
-		if ((ecs->component_masks[i] & query->component_mask) == query->component_mask && ecs->entity_states[i] >= k_entity_active)
+		uint8_t* states = chunk_get_states(query->chunk);
+		for (int i = query->index + 1; i < query->chunk->count; ++i)
 		{
-			query->entity = i;
-			return;
+			if (states[i] >= k_entity_active)
+			{
+				query->index = i;
+				return;
+			}
 		}
+		query->chunk_index++;
 	}
-	query->entity = -1;
+
+	for (int a = query->archetype; a < ecs->archetype_count; ++a)
+	{
+		ecs_archetype_t* archetype = ecs->archetypes[a];
+		if ((archetype->component_mask & query->component_mask) == query->component_mask)
+		{
+			for (int c = query->chunk_index; c < archetype->chunk_count; ++c)
+			{
+				ecs_chunk_t* chunk = archetype->chunks[c];
+				uint8_t* states = chunk_get_states(chunk);
+				for (int i = 0; i < chunk->count; ++i)
+				{
+					if (states[i] >= k_entity_active)
+					{
+						query->archetype = a;
+						query->chunk_index = c;
+						query->chunk = chunk;
+						query->index = i;
+						return;
+					}
+				}
+			}
+		}
+		query->chunk_index = 0;
+	}
+	query->archetype = ecs->archetype_count;
+	query->chunk = NULL;
+	query->index = -1;
 }
 
 void* ecs_query_get_component(ecs_t* ecs, ecs_query_t* query, int component_type)
 {
-	char* components = ecs->components[component_type];
-	return &components[ecs->component_type_sizes[component_type] * query->entity];
+	if (!query->chunk)
+	{
+		return NULL;
+	}
+	return chunk_get_component(ecs, query->chunk, query->index, component_type);
 }
 
 ecs_entity_ref_t ecs_query_get_entity(ecs_t* ecs, ecs_query_t* query)
 {
-	return (ecs_entity_ref_t) { .entity = query->entity, .sequence = ecs->sequences[query->entity] };
+	int entity = chunk_get_entities(query->chunk)[query->index];
+	return (ecs_entity_ref_t) { .entity = entity, .sequence = ecs->entities[entity].sequence };
+}
+
+ecs_query_chunk_t ecs_query_chunk_create(ecs_t* ecs, uint64_t mask)
+{
+	ecs_query_chunk_t query = { .component_mask = mask, .archetype = 0, .chunk_index = 0, .chunk = NULL, .start = 0, .count = 0 };
+	ecs_query_chunk_next(ecs, &query);
+	return query;
+}
+
+bool ecs_query_chunk_is_valid(ecs_t* ecs, ecs_query_chunk_t* query)
+{
+	return query->chunk != NULL;
+}
+
+void ecs_query_chunk_next(ecs_t* ecs, ecs_query_chunk_t* query)
+{
+	int from = query->chunk ? query->start + query->count : 0;
+	for (int a = query->archetype; a < ecs->archetype_count; ++a)
+	{
+		ecs_archetype_t* archetype = ecs->archetypes[a];
+		if ((archetype->component_mask & query->component_mask) == query->component_mask)
+		{
+			for (int c = query->chunk_index; c < archetype->chunk_count; ++c)
+			{
+				// A run is a span of active entities. Pending adds break runs.
+				ecs_chunk_t* chunk = archetype->chunks[c];
+				uint8_t* states = chunk_get_states(chunk);
+				int start = from;
+				while (start < chunk->count && states[start] < k_entity_active)
+				{
+					++start;
+				}
+				int end = start;
+				while (end < chunk->count && states[end] >= k_entity_active)
+				{
+					++end;
+				}
+				if (end > start)
+				{
+					query->archetype = a;
+					query->chunk_index = c;
+					query->chunk = chunk;
+					query->start = start;
+					query->count = end - start;
+					return;
+				}
+				from = 0;
+			}
+		}
+		query->chunk_index = 0;
+		from = 0;
+	}
+	query->archetype = ecs->archetype_count;
+	query->chunk = NULL;
+	query->start = 0;
+	query->count = 0;
+}
+
+void* ecs_query_chunk_get_components(ecs_t* ecs, ecs_query_chunk_t* query, int component_type)
+{
+	if (!query->chunk)
+	{
+		return NULL;
+	}
+	return chunk_get_component(ecs, query->chunk, query->start, component_type);
+}
+
+ecs_entity_ref_t ecs_query_chunk_get_entity(ecs_t* ecs, ecs_query_chunk_t* query, int index)
+{
+	int entity = chunk_get_entities(query->chunk)[query->start + index];
+	return (ecs_entity_ref_t) { .entity = entity, .sequence = ecs->entities[entity].sequence };
+}
+
+int ecs_system_register(ecs_t* ecs, const char* name, uint64_t read_mask, uint64_t write_mask, uint32_t flags, ecs_system_function_t function, void* user)
+{
+	if (ecs->system_count < k_max_systems)
+	{
+		int i = ecs->system_count++;
+		strcpy_s(ecs->systems[i].name, sizeof(ecs->systems[i].name), name);
+		ecs->systems[i].read_mask = read_mask;
+		ecs->systems[i].write_mask = write_mask;
+		ecs->systems[i].flags = flags;
+		ecs->systems[i].function = function;
+		ecs->systems[i].user = user;
+		ecs->systems[i].level = 0;
+		return i;
+	}
+	debug_print(k_print_warning, "Out of systems.");
+	return -1;
+}
+
+void ecs_system_set_job_system(ecs_t* ecs, job_system_t* jobs)
+{
+	ecs->jobs = jobs;
+}
+
+void ecs_system_run_all(ecs_t* ecs)
+{
+	// Build the dependency graph as levels: a system runs one level after
+	// the latest earlier system it conflicts with.
+	int level_count = 0;
+	for (int i = 0; i < ecs->system_count; ++i)
+	{
+		ecs_system_t* system = &ecs->systems[i];
+		system->level = 0;
+		for (int j = 0; j < i; ++j)
+		{
+			ecs_system_t* prior = &ecs->systems[j];
+			bool conflict =
+				(prior->write_mask & (system->read_mask | system->write_mask)) ||
+				(prior->read_mask & system->write_mask);
+			if (conflict && prior->level + 1 > system->level)
+			{
+				system->level = prior->level + 1;
+			}
+		}
+		level_count = __max(level_count, system->level + 1);
+	}
+
+	for (int level = 0; level < level_count; ++level)
+	{
+		ecs->task_count = 0;
+		for (int i = 0; i < ecs->system_count; ++i)
+		{
+			ecs_system_t* system = &ecs->systems[i];
+			if (system->level != level)
+			{
+				continue;
+			}
+
+			uint64_t mask = system->read_mask | system->write_mask;
+			if (system->flags & k_ecs_system_parallel)
+			{
+				for (ecs_query_chunk_t query = ecs_query_chunk_create(ecs, mask);
+					ecs_query_chunk_is_valid(ecs, &query);
+					ecs_query_chunk_next(ecs, &query))
+				{
+					if (ecs->task_count == ecs->task_capacity)
+					{
+						ecs->tasks = grow_array(ecs->heap, ecs->tasks, ecs->task_count, &ecs->task_capacity, sizeof(ecs_task_t));
+					}
+					ecs->tasks[ecs->task_count++] = (ecs_task_t) { .system = system, .query = query, .all_runs = false };
+				}
+			}
+			else
+			{
+				if (ecs->task_count == ecs->task_capacity)
+				{
+					ecs->tasks = grow_array(ecs->heap, ecs->tasks, ecs->task_count, &ecs->task_capacity, sizeof(ecs_task_t));
+				}
+				ecs->tasks[ecs->task_count++] = (ecs_task_t) { .system = system, .query = ecs_query_chunk_create(ecs, mask), .all_runs = true };
+			}
+		}
+
+		// Each helper job drains the shared task list; the calling thread does too.
+		ecs->next_task = 0;
+		job_counter_t counter = { 0 };
+		int helper_count = ecs->jobs ? __min(job_system_get_worker_count(ecs->jobs), ecs->task_count - 1) : 0;
+		for (int i = 0; i < helper_count; ++i)
+		{
+			job_submit(ecs->jobs, run_tasks_job, ecs, &counter);
+		}
+		run_tasks(ecs);
+		if (helper_count > 0)
+		{
+			job_wait(ecs->jobs, &counter);
+		}
+	}
+}
+
+static void* grow_array(heap_t* heap, void* array, int count, int* capacity, size_t element_size)
+{
+	int new_capacity = *capacity ? *capacity * 2 : 1;
+	void* new_array = heap_alloc_tagged(heap, element_size * new_capacity, 8, k_heap_tag_ecs);
+	memcpy(new_array, array, element_size * count);
+	heap_free(heap, array);
+	*capacity = new_capacity;
+	return new_array;
+}
+
+static bool archetype_layout(ecs_t* ecs, ecs_archetype_t* archetype, int capacity, size_t chunk_size)
+{
+	size_t offset = (sizeof(ecs_chunk_t) + (k_chunk_alignment - 1)) & ~((size_t)k_chunk_alignment - 1);
+	archetype->entities_offset = offset;
+	offset += sizeof(int) * capacity;
+	archetype->states_offset = offset;
+	offset += sizeof(uint8_t) * capacity;
+
+	for (int i = 0; i < ecs->component_type_count; ++i)
+	{
+		if (archetype->component_mask & (1ULL << i))
+		{
+			size_t alignment = ecs->component_type_alignments[i];
+			offset = (offset + (alignment - 1)) & ~(alignment - 1);
+			archetype->component_offsets[i] = offset;
+			offset += ecs->component_type_sizes[i] * capacity;
+		}
+	}
+	return offset <= chunk_size;
+}
+
+static ecs_archetype_t* find_or_create_archetype(ecs_t* ecs, uint64_t component_mask)
+{
+	for (int i = 0; i < ecs->archetype_count; ++i)
+	{
+		if (ecs->archetypes[i]->component_mask == component_mask)
+		{
+			return ecs->archetypes[i];
+		}
+	}
+
+	ecs_archetype_t* archetype = heap_alloc_tagged(ecs->heap, sizeof(ecs_archetype_t), 8, k_heap_tag_ecs);
+	memset(archetype, 0, sizeof(*archetype));
+	archetype->component_mask = component_mask;
+
+	// Fit as many entities as possible in a chunk, accounting for alignment padding.
+	// Components too large to fit even once get a chunk sized for a single entity.
+	size_t entity_size = sizeof(int) + sizeof(uint8_t);
+	size_t padding = 0;
+	for (int i = 0; i < ecs->component_type_count; ++i)
+	{
+		if (component_mask & (1ULL << i))
+		{
+			entity_size += ecs->component_type_sizes[i];
+			padding += ecs->component_type_alignments[i];
+		}
+	}
+	archetype->chunk_size = k_chunk_size;
+	int capacity = (int)(k_chunk_size / entity_size);
+	while (capacity > 0 && !archetype_layout(ecs, archetype, capacity, archetype->chunk_size))
+	{
+		--capacity;
+	}
+	if (capacity == 0)
+	{
+		capacity = 1;
+		archetype->chunk_size = k_chunk_alignment + entity_size + padding;
+		archetype_layout(ecs, archetype, capacity, archetype->chunk_size);
+	}
+	archetype->chunk_entity_capacity = capacity;
+
+	archetype->chunk_capacity = k_initial_chunk_capacity;
+	archetype->chunks = heap_alloc_tagged(ecs->heap, sizeof(ecs_chunk_t*) * archetype->chunk_capacity, 8, k_heap_tag_ecs);
+
+	if (ecs->archetype_count == ecs->archetype_capacity)
+	{
+		ecs->archetypes = grow_array(ecs->heap, ecs->archetypes, ecs->archetype_count, &ecs->archetype_capacity, sizeof(ecs_archetype_t*));
+	}
+	ecs->archetypes[ecs->archetype_count++] = archetype;
+	return archetype;
+}
+
+static void archetype_destroy(ecs_t* ecs, ecs_archetype_t* archetype)
+{
+	for (int i = 0; i < archetype->chunk_count; ++i)
+	{
+		heap_free(ecs->heap, archetype->chunks[i]);
+	}
+	heap_free(ecs->heap, archetype->chunks);
+	heap_free(ecs->heap, archetype);
+}
+
+static void archetype_add_entity(ecs_t* ecs, ecs_archetype_t* archetype, int entity)
+{
+	ecs_chunk_t* chunk = archetype->chunk_count ? archetype->chunks[archetype->chunk_count - 1] : NULL;
+	if (!chunk || chunk->count == archetype->chunk_entity_capacity)
+	{
+		if (archetype->chunk_count == archetype->chunk_capacity)
+		{
+			archetype->chunks = grow_array(ecs->heap, archetype->chunks, archetype->chunk_count, &archetype->chunk_capacity, sizeof(ecs_chunk_t*));
+		}
+		chunk = heap_alloc_tagged(ecs->heap, archetype->chunk_size, k_chunk_alignment, k_heap_tag_ecs);
+		chunk->archetype = archetype;
+		chunk->count = 0;
+		archetype->chunks[archetype->chunk_count++] = chunk;
+	}
+
+	int index = chunk->count++;
+	chunk_get_entities(chunk)[index] = entity;
+	for (int i = 0; i < ecs->component_type_count; ++i)
+	{
+		if (archetype->component_mask & (1ULL << i))
+		{
+			memset(chunk_get_component(ecs, chunk, index, i), 0, ecs->component_type_sizes[i]);
+		}
+	}
+
+	ecs->entities[entity].chunk = chunk;
+	ecs->entities[entity].index = index;
+}
+
+static void archetype_remove_entity(ecs_t* ecs, int entity)
+{
+	ecs_chunk_t* chunk = ecs->entities[entity].chunk;
+	int index = ecs->entities[entity].index;
+	ecs_archetype_t* archetype = chunk->archetype;
+
+	// Keep chunks packed by moving the archetype's last entity into the hole.
+	ecs_chunk_t* last_chunk = archetype->chunks[archetype->chunk_count - 1];
+	int last_index = last_chunk->count - 1;
+	if (last_chunk != chunk || last_index != index)
+	{
+		int moved_entity = chunk_get_entities(last_chunk)[last_index];
+		chunk_get_entities(chunk)[index] = moved_entity;
+		chunk_get_states(chunk)[index] = chunk_get_states(last_chunk)[last_index];
+		for (int i = 0; i < ecs->component_type_count; ++i)
+		{
+			if (archetype->component_mask & (1ULL << i))
+			{
+				memcpy(chunk_get_component(ecs, chunk, index, i),
+					chunk_get_component(ecs, last_chunk, last_index, i),
+					ecs->component_type_sizes[i]);
+			}
+		}
+		ecs->entities[moved_entity].chunk = chunk;
+		ecs->entities[moved_entity].index = index;
+	}
+
+	if (--last_chunk->count == 0)
+	{
+		heap_free(ecs->heap, last_chunk);
+		archetype->chunk_count--;
+	}
+
+	ecs->entities[entity].chunk = NULL;
+	ecs->entities[entity].index = -1;
+}
+
+static void entity_set_state(ecs_t* ecs, int entity, entity_state_t state)
+{
+	ecs->entities[entity].state = state;
+	if (ecs->entities[entity].chunk)
+	{
+		chunk_get_states(ecs->entities[entity].chunk)[ecs->entities[entity].index] = (uint8_t)state;
+	}
+}
+
+static void run_tasks(ecs_t* ecs)
+{
+	for (int i = atomic_increment(&ecs->next_task); i < ecs->task_count; i = atomic_increment(&ecs->next_task))
+	{
+		ecs_task_t* task = &ecs->tasks[i];
+		if (task->all_runs)
+		{
+			for (; ecs_query_chunk_is_valid(ecs, &task->query); ecs_query_chunk_next(ecs, &task->query))
+			{
+				task->system->function(ecs, &task->query, task->system->user);
+			}
+		}
+		else
+		{
+			task->system->function(ecs, &task->query, task->system->user);
+		}
+	}
+}
+
+static void run_tasks_job(void* user)
+{
+	run_tasks(user);
 }
@@ -7,6 +7,7 @@
 #include <stdint.h>
 
 typedef struct heap_t heap_t;
+typedef struct job_system_t job_system_t;
 
 // Handle to an entity component system interface.
 typedef struct ecs_t ecs_t;
@@ -18,13 +19,45 @@ typedef struct ecs_entity_ref_t
 	int sequence;
 } ecs_entity_ref_t;
 
+// Chunk of entity storage. See ecs.c.
+typedef struct ecs_chunk_t ecs_chunk_t;
+
 // Working data for an active entity query.
+// Entities are stored in chunks grouped by component mask (archetype).
+// The query walks matching archetypes, their chunks, then entities within each chunk.
 typedef struct ecs_query_t
 {
 	uint64_t component_mask;
-	int entity;
+	int archetype;
+	int chunk_index;
+	ecs_chunk_t* chunk;
+	int index;
 } ecs_query_t;
 
+// Working data for an active chunk query.
+// Each step yields a run of count matching entities stored contiguously in one chunk.
+// Component arrays for the run are indexed [0, count).
+typedef struct ecs_query_chunk_t
+{
+	uint64_t component_mask;
+	int archetype;
+	int chunk_index;
+	ecs_chunk_t* chunk;
+	int start;
+	int count;
+} ecs_query_chunk_t;
+
+// Called by the system scheduler for a run of entities matching a system's components.
+typedef void (*ecs_system_function_t)(ecs_t* ecs, ecs_query_chunk_t* query, void* user);
+
+// Flags for ecs_system_register().
+typedef enum ecs_system_flags_t
+{
+	// Runs of this system may execute on several threads at once.
+	// Set only if the function touches nothing but the current run's components.
+	k_ecs_system_parallel = 1 << 0,
+} ecs_system_flags_t;
+
 // Create an entity component system.
 ecs_t* ecs_create(heap_t* heap);
 
@@ -41,9 +74,11 @@ int ecs_register_component_type(ecs_t* ecs, const char* name, size_t size_per_co
 size_t ecs_get_component_type_size(ecs_t* ecs, int component_type);
 
 // Spawn an entity with the masked components and return a reference to it.
+// Storage grows as needed; there is no fixed entity limit.
 ecs_entity_ref_t ecs_entity_add(ecs_t* ecs, uint64_t component_mask);
 
 // Destroy an entity.
+// Safe to call from concurrently running systems.
 // If allow_pending_add is true, can destroy an entity that is not fully spawned.
 void ecs_entity_remove(ecs_t* ecs, ecs_entity_ref_t ref, bool allow_pending_add);
 
@@ -52,6 +87,7 @@ void ecs_entity_remove(ecs_t* ecs, ecs_entity_ref_t ref, bool allow_pending_add)
 bool ecs_is_entity_ref_valid(ecs_t* ecs, ecs_entity_ref_t ref, bool allow_pending_add);
 
 // Get the memory for a component on an entity.
+// The pointer is valid until the next ecs_update, which may move entities when others are removed.
 // NULL is returned if the entity is not valid or the component_type is not present on the entity.
 // If allow_pending_add is true, will return component data for not fully spawned entities.
 void* ecs_entity_get_component(ecs_t* ecs, ecs_entity_ref_t ref, int component_type, bool allow_pending_add);
@@ -70,3 +106,36 @@ void* ecs_query_get_component(ecs_t* ecs, ecs_query_t* query, int component_type
 
 // Get a entity reference for the current query location.
 ecs_entity_ref_t ecs_query_get_entity(ecs_t* ecs, ecs_query_t* query);
+
+// Creates a new chunk query by component type mask.
+ecs_query_chunk_t ecs_query_chunk_create(ecs_t* ecs, uint64_t mask);
+
+// Determines if the chunk query points at a valid run of entities.
+bool ecs_query_chunk_is_valid(ecs_t* ecs, ecs_query_chunk_t* query);
+
+// Advances the chunk query to the next run of matching entities, if any.
+void ecs_query_chunk_next(ecs_t* ecs, ecs_query_chunk_t* query);
+
+// Get the array of component data for the current run.
+// The array holds query->count components, one per entity in the run.
+void* ecs_query_chunk_get_components(ecs_t* ecs, ecs_query_chunk_t* query, int component_type);
+
+// Get an entity reference for an entity in the current run.
+// Index is in the range [0, query->count).
+ecs_entity_ref_t ecs_query_chunk_get_entity(ecs_t* ecs, ecs_query_chunk_t* query, int index);
+
+// Register a system with the scheduler.
+// Read and write masks declare which component types the system accesses.
+// The system runs over every entity that has all components in either mask.
+// Systems that conflict (one writes what the other reads or writes) run in registration order.
+// Returns the system index, or -1 if out of systems.
+int ecs_system_register(ecs_t* ecs, const char* name, uint64_t read_mask, uint64_t write_mask, uint32_t flags, ecs_system_function_t function, void* user);
+
+// Set the job system whose workers run systems alongside the calling thread.
+// NULL runs all systems on the calling thread.
+void ecs_system_set_job_system(ecs_t* ecs, job_system_t* jobs);
+
+// Run all registered systems once.
+// Non-conflicting systems, and runs of parallel systems, execute concurrently as jobs.
+// Systems must not add entities. Returns when all systems are complete.
+void ecs_system_run_all(ecs_t* ecs);
@@ -0,0 +1,310 @@
+#include "bench.h"
+
+#include "debug.h"
+#include "ecs.h"
+#include "heap.h"
+#include "job.h"
+#include "thread.h"
+#include "timer.h"
+#include "transform.h"
+
+#include <string.h>
+
+typedef struct bench_model_t
+{
+	void* mesh;
+	void* shader;
+} bench_model_t;
+
+typedef struct bench_name_t
+{
+	char name[32];
+} bench_name_t;
+
+enum
+{
+	k_bench_transform,
+	k_bench_model,
+	k_bench_enemy,
+	k_bench_player,
+	k_bench_name,
+	k_bench_type_count,
+
+	k_bench_min_visits = 4 * 1000 * 1000,
+};
+
+static const size_t k_bench_type_sizes[k_bench_type_count] =
+{
+	sizeof(transform_t),
+	sizeof(bench_model_t),
+	sizeof(int),
+	sizeof(int),
+	sizeof(bench_name_t),
+};
+
+// Replica of the original ECS layout: one entity-capacity sized array per component
+// type, with queries scanning the component mask of every entity slot.
+typedef struct flat_ecs_t
+{
+	int entity_count;
+	uint64_t* component_masks;
+	int* entity_states;
+	char* components[k_bench_type_count];
+} flat_ecs_t;
+
+static uint64_t bench_entity_mask(int i)
+{
+	// A game-like mix: mostly enemies, a few players, some scenery without a model.
+	uint64_t mask = (1ULL << k_bench_transform) | (1ULL << k_bench_name);
+	if (i % 4 != 3)
+	{
+		mask |= (1ULL << k_bench_model);
+	}
+	mask |= (i % 16 == 0) ? (1ULL << k_bench_player) : (1ULL << k_bench_enemy);
+	return mask;
+}
+
+static double bench_ns_per_entity(uint64_t ticks, int visits)
+{
+	double seconds = (double)ticks / (double)timer_get_ticks_per_second();
+	return seconds * 1e9 / (double)visits;
+}
+
+// Per-entity query path of the flat layout, as it was in ecs.c.
+// Kept out of line so both layouts pay the same call overhead.
+static __declspec(noinline) int flat_query_next(flat_ecs_t* flat, uint64_t mask, int entity)
+{
+	for (int i = entity + 1; i < flat->entity_count; ++i)
+	{
+		if ((flat->component_masks[i] & mask) == mask && flat->entity_states[i])
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+static __declspec(noinline) void* flat_query_get_component(flat_ecs_t* flat, int entity, int component_type)
+{
+	return &flat->components[component_type][k_bench_type_sizes[component_type] * entity];
+}
+
+static void flat_run(heap_t* heap, int entity_count, uint64_t query_mask, int passes)
+{
+	flat_ecs_t flat = { .entity_count = entity_count };
+	flat.component_masks = heap_alloc(heap, sizeof(uint64_t) * entity_count, 8);
+	flat.entity_states = heap_alloc(heap, sizeof(int) * entity_count, 8);
+	for (int t = 0; t < k_bench_type_count; ++t)
+	{
+		flat.components[t] = heap_alloc(heap, k_bench_type_sizes[t] * entity_count, 8);
+		memset(flat.components[t], 0, k_bench_type_sizes[t] * entity_count);
+	}
+	for (int i = 0; i < entity_count; ++i)
+	{
+		flat.component_masks[i] = bench_entity_mask(i);
+		flat.entity_states[i] = 1;
+		transform_identity(flat_query_get_component(&flat, i, k_bench_transform));
+	}
+
+	int visits = 0;
+	uint64_t start = timer_get_ticks();
+	for (int p = 0; p < passes; ++p)
+	{
+		for (int entity = flat_query_next(&flat, query_mask, -1);
+			entity >= 0;
+			entity = flat_query_next(&flat, query_mask, entity))
+		{
+			transform_t* transform = flat_query_get_component(&flat, entity, k_bench_transform);
+			transform->translation.x += 0.016f;
+			++visits;
+		}
+	}
+	uint64_t ticks = timer_get_ticks() - start;
+
+	debug_print(k_print_info, "  flat:    %8d entities, %6.2f ns/matched entity\n", entity_count, bench_ns_per_entity(ticks, visits));
+
+	for (int t = 0; t < k_bench_type_count; ++t)
+	{
+		heap_free(heap, flat.components[t]);
+	}
+	heap_free(heap, flat.entity_states);
+	heap_free(heap, flat.component_masks);
+}
+
+static void ecs_create_bench_entities(ecs_t* ecs, int entity_count)
+{
+	for (int t = 0; t < k_bench_type_count; ++t)
+	{
+		ecs_register_component_type(ecs, "bench", k_bench_type_sizes[t], 8);
+	}
+	for (int i = 0; i < entity_count; ++i)
+	{
+		ecs_entity_ref_t ref = ecs_entity_add(ecs, bench_entity_mask(i));
+		transform_identity(ecs_entity_get_component(ecs, ref, k_bench_transform, true));
+	}
+	ecs_update(ecs);
+}
+
+static void chunk_run(heap_t* heap, int entity_count, uint64_t query_mask, int passes)
+{
+	ecs_t* ecs = ecs_create(heap);
+	ecs_create_bench_entities(ecs, entity_count);
+
+	int visits = 0;
+	uint64_t start = timer_get_ticks();
+	for (int p = 0; p < passes; ++p)
+	{
+		for (ecs_query_t query = ecs_query_create(ecs, query_mask);
+			ecs_query_is_valid(ecs, &query);
+			ecs_query_next(ecs, &query))
+		{
+			transform_t* transform = ecs_query_get_component(ecs, &query, k_bench_transform);
+			transform->translation.x += 0.016f;
+			++visits;
+		}
+	}
+	uint64_t ticks = timer_get_ticks() - start;
+
+	debug_print(k_print_info, "  chunked: %8d entities, %6.2f ns/matched entity\n", entity_count, bench_ns_per_entity(ticks, visits));
+
+	ecs_destroy(ecs);
+}
+
+void ecs_bench_run(heap_t* heap)
+{
+	// Enemies match most entities; players match few, where skipping whole archetypes pays off.
+	const struct { const char* name; uint64_t mask; } k_queries[] =
+	{
+		{ "transform+enemy", (1ULL << k_bench_transform) | (1ULL << k_bench_enemy) },
+		{ "transform+player", (1ULL << k_bench_transform) | (1ULL << k_bench_player) },
+	};
+	const int k_entity_counts[] = { 1000, 100 * 1000, 1000 * 1000 };
+	for (int q = 0; q < _countof(k_queries); ++q)
+	{
+		debug_print(k_print_info, " query %s\n", k_queries[q].name);
+		for (int i = 0; i < _countof(k_entity_counts); ++i)
+		{
+			int passes = __max(1, k_bench_min_visits / k_entity_counts[i]);
+			flat_run(heap, k_entity_counts[i], k_queries[q].mask, passes);
+			chunk_run(heap, k_entity_counts[i], k_queries[q].mask, passes);
+		}
+	}
+}
+
+void ecs_query_bench_run(heap_t* heap)
+{
+	const int k_entity_counts[] = { 1000, 100 * 1000, 1000 * 1000 };
+	uint64_t query_mask = (1ULL << k_bench_transform) | (1ULL << k_bench_enemy);
+
+	for (int c = 0; c < _countof(k_entity_counts); ++c)
+	{
+		ecs_t* ecs = ecs_create(heap);
+		ecs_create_bench_entities(ecs, k_entity_counts[c]);
+		int passes = __max(1, k_bench_min_visits / k_entity_counts[c]);
+
+		int visits = 0;
+		uint64_t start = timer_get_ticks();
+		for (int p = 0; p < passes; ++p)
+		{
+			for (ecs_query_t query = ecs_query_create(ecs, query_mask);
+				ecs_query_is_valid(ecs, &query);
+				ecs_query_next(ecs, &query))
+			{
+				transform_t* transform = ecs_query_get_component(ecs, &query, k_bench_transform);
+				transform->translation.x += 0.016f;
+				++visits;
+			}
+		}
+		uint64_t entity_ticks = timer_get_ticks() - start;
+		int entity_visits = visits;
+
+		visits = 0;
+		start = timer_get_ticks();
+		for (int p = 0; p < passes; ++p)
+		{
+			for (ecs_query_chunk_t query = ecs_query_chunk_create(ecs, query_mask);
+				ecs_query_chunk_is_valid(ecs, &query);
+				ecs_query_chunk_next(ecs, &query))
+			{
+				transform_t* transforms = ecs_query_chunk_get_components(ecs, &query, k_bench_transform);
+				for (int i = 0; i < query.count; ++i)
+				{
+					transforms[i].translation.x += 0.016f;
+				}
+				visits += query.count;
+			}
+		}
+		uint64_t chunk_ticks = timer_get_ticks() - start;
+
+		debug_print(k_print_info, "  %8d entities: per-entity %6.2f ns/entity, chunk %6.2f ns/entity\n",
+			k_entity_counts[c],
+			bench_ns_per_entity(entity_ticks, entity_visits),
+			bench_ns_per_entity(chunk_ticks, visits));
+
+		ecs_destroy(ecs);
+	}
+}
+
+static void bench_system_move(ecs_t* ecs, ecs_query_chunk_t* query, void* user)
+{
+	transform_t* move = user;
+	transform_t* transforms = ecs_query_chunk_get_components(ecs, query, k_bench_transform);
+	for (int i = 0; i < query->count; ++i)
+	{
+		transform_multiply(&transforms[i], move);
+	}
+}
+
+static void bench_system_count_models(ecs_t* ecs, ecs_query_chunk_t* query, void* user)
+{
+	bench_model_t* models = ecs_query_chunk_get_components(ecs, query, k_bench_model);
+	for (int i = 0; i < query->count; ++i)
+	{
+		models[i].mesh = (char*)models[i].mesh + 1;
+	}
+}
+
+void ecs_systems_bench_run(heap_t* heap)
+{
+	const int k_entity_count = 1000 * 1000;
+	const int k_frames = 16;
+
+	transform_t move;
+	transform_identity(&move);
+	move.translation.x = 0.016f;
+
+	int max_workers = thread_get_core_count();
+	uint64_t serial_ticks = 0;
+	for (int workers = 0; workers < max_workers; ++workers)
+	{
+		ecs_t* ecs = ecs_create(heap);
+		ecs_create_bench_entities(ecs, k_entity_count);
+
+		// Two movers that conflict on transform, and an independent model system that can overlap them.
+		uint64_t transform_mask = 1ULL << k_bench_transform;
+		ecs_system_register(ecs, "move_enemies", 1ULL << k_bench_enemy, transform_mask, k_ecs_system_parallel, bench_system_move, &move);
+		ecs_system_register(ecs, "move_players", 1ULL << k_bench_player, transform_mask, k_ecs_system_parallel, bench_system_move, &move);
+		ecs_system_register(ecs, "count_models", 0, 1ULL << k_bench_model, k_ecs_system_parallel, bench_system_count_models, NULL);
+		job_system_t* jobs = job_system_create(heap, workers);
+		ecs_system_set_job_system(ecs, jobs);
+
+		uint64_t start = timer_get_ticks();
+		for (int f = 0; f < k_frames; ++f)
+		{
+			ecs_system_run_all(ecs);
+		}
+		uint64_t ticks = (timer_get_ticks() - start) / k_frames;
+		if (workers == 0)
+		{
+			serial_ticks = ticks;
+		}
+
+		debug_print(k_print_info, "  %2d workers: %7.3f ms/frame, %4.2fx\n",
+			workers,
+			(double)ticks * 1000.0 / (double)timer_get_ticks_per_second(),
+			(double)serial_ticks / (double)ticks);
+
+		ecs_destroy(ecs);
+		job_system_destroy(jobs);
+	}
+}
@@ -2,8 +2,10 @@
 #include "final_game.h"
 
 //Home made imports
+#include "cull.h"
 #include "debug.h"
 #include "ecs.h"
+#include "frame_allocator.h"
 #include "fs.h"
 #include "gpu.h"
 #include "heap.h"
@@ -26,6 +28,12 @@
 #include "lua/lua.h"
 #include "lua/lualib.h"
 
+enum
+{
+	//Scratch memory each thread takes at a time for per-frame arrays
+	k_frame_page_size = 64 * 1024,
+};
+
 typedef struct transform_component_t
 {
 	transform_t transform;
@@ -41,6 +49,8 @@ typedef struct model_component_t
 {
 	gpu_mesh_info_t* mesh_info;
 	gpu_shader_info_t* shader_info;
+	//Model space bounds of the mesh, tested against each camera before drawing
+	cull_sphere_t bounds;
 } model_component_t;
 
 typedef struct player_component_t
@@ -110,6 +120,9 @@ typedef struct final_game_t
 
 	timer_object_t* timer;
 
+	//Scratch memory released at the start of each update
+	frame_allocator_t* frame_allocator;
+
 	ecs_t* ecs;
 	int transform_type;
 	int camera_type;
@@ -121,6 +134,11 @@ typedef struct final_game_t
 	ecs_entity_ref_t camera_ent;
 	ecs_entity_ref_t enemy_ent;
 
+	//Per-frame values shared with the systems while they run
+	transform_t player_move;
+	transform_t enemy_move;
+	transform_component_t* player_transform;
+
 	//Meshes for Player Cube
 	gpu_mesh_info_t cube_mesh;
 	
@@ -148,18 +166,20 @@ static void spawn_player(final_game_t* game, int index);
 static void spawn_enemy(final_game_t* game, int index, int region);
 static void spawnEnemies(final_game_t* game, int start);
 static void spawn_camera(final_game_t* game);
-static void update_players(final_game_t* game);
-static void update_enemies(final_game_t* game, int dir);
-static void check_collision(final_game_t* game);
-static void draw_models(final_game_t* game);
+static void update_moves(final_game_t* game, int dir);
+static void update_players(ecs_t* ecs, ecs_query_chunk_t* query, void* user);
+static void update_enemies(ecs_t* ecs, ecs_query_chunk_t* query, void* user);
+static void check_collision(ecs_t* ecs, ecs_query_chunk_t* query, void* user);
+static void draw_models(ecs_t* ecs, ecs_query_chunk_t* query, void* user);
 
 //Static functions to run to extract Lua data that the C program will use for entities
 static void playerConfigs(final_game_t* game);
 static void enemyConfigs(final_game_t* game);
 static void cameraConfigs(final_game_t* game);
+static void* lua_heap_alloc(void* user, void* ptr, size_t osize, size_t nsize);
 
 //Makes the final frogger game
-final_game_t* final_game_create(heap_t* heap, fs_t* fs, wm_window_t* window, render_t* render, int argc, const char** argv)
+final_game_t* final_game_create(heap_t* heap, fs_t* fs, job_system_t* jobs, wm_window_t* window, render_t* render, int argc, const char** argv)
 {
 	final_game_t* game = heap_alloc(heap, sizeof(final_game_t), 8);
 	game->heap = heap;
@@ -167,6 +187,7 @@ final_game_t* final_game_create(heap_t* heap, fs_t* fs, wm_window_t* window, ren
 	game->window = window;
 	game->render = render;
 	game->timer = timer_object_create(heap, NULL);
+	game->frame_allocator = frame_allocator_create(heap, k_frame_page_size, 0);
 	
 	game->ecs = ecs_create(heap);
 	game->transform_type = ecs_register_component_type(game->ecs, "transform", sizeof(transform_component_t), _Alignof(transform_component_t));
@@ -176,6 +197,14 @@ final_game_t* final_game_create(heap_t* heap, fs_t* fs, wm_window_t* window, ren
 	game->enemy_type = ecs_register_component_type(game->ecs, "enemy", sizeof(enemy_component_t), _Alignof(enemy_component_t));
 	game->name_type = ecs_register_component_type(game->ecs, "name", sizeof(name_component_t), _Alignof(name_component_t));
 
+	//Systems run in this order wherever they touch the same components
+	uint64_t transform_mask = 1ULL << game->transform_type;
+	ecs_system_register(game->ecs, "update_players", 1ULL << game->player_type, transform_mask, k_ecs_system_parallel, update_players, game);
+	ecs_system_register(game->ecs, "update_enemies", 1ULL << game->enemy_type, transform_mask, k_ecs_system_parallel, update_enemies, game);
+	ecs_system_register(game->ecs, "check_collision", 1ULL << game->enemy_type, transform_mask, 0, check_collision, game);
+	ecs_system_register(game->ecs, "draw_models", transform_mask | (1ULL << game->model_type), 0, 0, draw_models, game);
+	ecs_system_set_job_system(game->ecs, jobs);
+
 	//Loads resources for game
 	load_resources(game);
 
@@ -199,7 +228,7 @@ static void playerConfigs(final_game_t* game)
 {
 	//Create New Lua State
 	lua_State* L;
-	L = luaL_newstate();
+	L = lua_newstate(lua_heap_alloc, game);
 	luaL_openlibs(L);
 	luaL_dofile(L, "luaGamePlayerComps.lua");
 
@@ -264,7 +293,7 @@ static void enemyConfigs(final_game_t* game)
 {
 	//Create New Lua State
 	lua_State* L;
-	L = luaL_newstate();
+	L = lua_newstate(lua_heap_alloc, game);
 	luaL_openlibs(L);
 	luaL_dofile(L, "luaGameEnemyComps.lua");
 
@@ -321,7 +350,7 @@ static void cameraConfigs(final_game_t* game)
 {
 	//Create New Lua State
 	lua_State* L;
-	L = luaL_newstate();
+	L = lua_newstate(lua_heap_alloc, game);
 	luaL_openlibs(L);
 	luaL_dofile(L, "luaGameCameraComps.lua");
 
@@ -396,6 +425,32 @@ static void cameraConfigs(final_game_t* game)
 	//Closes Lua Object
 	lua_close(L);
 }
+
+//Lua allocates from the game's heap so its memory is counted under the lua tag
+static void* lua_heap_alloc(void* user, void* ptr, size_t osize, size_t nsize)
+{
+	final_game_t* game = user;
+	if (nsize == 0)
+	{
+		heap_free(game->heap, ptr);
+		return NULL;
+	}
+
+	//Without a block to resize, osize is a type code rather than a size
+	void* address = heap_alloc_tagged(game->heap, nsize, 16, k_heap_tag_lua);
+	if (!address)
+	{
+		//Lua expects shrinking to succeed, and the old block is big enough
+		return ptr && nsize <= osize ? ptr : NULL;
+	}
+	if (ptr)
+	{
+		memcpy(address, ptr, __min(osize, nsize));
+		heap_free(game->heap, ptr);
+	}
+	return address;
+}
+
 ////////////////////////////////////////////
 
 //Cleans up after frogger game is done
@@ -404,6 +459,15 @@ void final_game_destroy(final_game_t* game)
 	//net_destroy(game->net);
 	ecs_destroy(game->ecs);
 	timer_object_destroy(game->timer);
+
+	//Report the most scratch memory a frame used, to help size the pages
+	frame_allocator_stats_t frame_stats;
+	frame_allocator_get_stats(game->frame_allocator, &frame_stats);
+	debug_print(k_print_info, "Frame allocator: peak %llu bytes in a frame, %d pages (%llu bytes) on %d threads, %d large allocations\n",
+		(unsigned long long)frame_stats.peak_frame_bytes, frame_stats.page_count, (unsigned long long)frame_stats.page_bytes,
+		frame_stats.thread_count, frame_stats.large_count);
+	frame_allocator_destroy(game->frame_allocator);
+
 	unload_resources(game);
 	heap_free(game->heap, game);
 }
@@ -412,19 +476,28 @@ void final_game_destroy(final_game_t* game)
 void final_game_update(final_game_t* game)
 {
 	timer_object_update(game->timer);
+	//Last frame's scratch memory is done with once the new frame starts
+	frame_allocator_reset(game->frame_allocator);
 	ecs_update(game->ecs);
 	//net_update(game->net);
-	update_players(game);
-	update_enemies(game, 0);
-	check_collision(game);
-	draw_models(game);
+	update_moves(game, 0);
+	ecs_system_run_all(game->ecs);
+
+	//Spawns the next batch once every enemy has left the screen
+	uint64_t k_enemy_query_mask = (1ULL << game->transform_type) | (1ULL << game->enemy_type);
+	ecs_query_t query = ecs_query_create(game->ecs, k_enemy_query_mask);
+	if (!(ecs_query_is_valid(game->ecs, &query)))
+	{
+		spawnEnemies(game, 1);
+	}
+
 	render_push_done(game->render);
 }
 
 //Resources necessary for game
 static void load_resources(final_game_t* game)
 {
-	game->vertex_shader_work = fs_read(game->fs, "shaders/triangle.vert.spv", game->heap, false, false);
+	game->vertex_shader_work = fs_read(game->fs, "shaders/triangle_instanced.vert.spv", game->heap, false, false);
 	game->fragment_shader_work = fs_read(game->fs, "shaders/triangle.frag.spv", game->heap, false, false);
 	game->cube_shader = (gpu_shader_info_t)
 	{
@@ -432,7 +505,11 @@ static void load_resources(final_game_t* game)
 		.vertex_shader_size = fs_work_get_size(game->vertex_shader_work),
 		.fragment_shader_data = fs_work_get_buffer(game->fragment_shader_work),
 		.fragment_shader_size = fs_work_get_size(game->fragment_shader_work),
+		// The camera's projection and view matrices, pushed once per camera by draw_models.
 		.uniform_buffer_count = 1,
+		.view_data_size = sizeof(mat4f_t) * 2,
+		// The top three rows of each model matrix.
+		.instance_data_size = sizeof(float) * 12,
 	};
 
 	static vec3f_t cube_verts_player[] =
@@ -555,6 +632,7 @@ static void player_net_configure(ecs_t* ecs, ecs_entity_ref_t entity, int type,
 	model_component_t* model_comp = ecs_entity_get_component(ecs, entity, game->model_type, true);
 	model_comp->mesh_info = &game->cube_mesh;
 	model_comp->shader_info = &game->cube_shader;
+	cull_sphere_from_mesh(&model_comp->bounds, model_comp->mesh_info);
 }
 
 //Spawns the next batch of enemies
@@ -620,6 +698,7 @@ static void spawn_player(final_game_t* game, int index)
 	{
 		model_comp->mesh_info = &game->cube_mesh;
 		model_comp->shader_info = &game->cube_shader;
+		cull_sphere_from_mesh(&model_comp->bounds, model_comp->mesh_info);
 	}
 }
 
@@ -644,7 +723,7 @@ static void spawn_enemy(final_game_t* game, int index, int region)
 	strcpy_s(name_comp->name, sizeof(name_comp->name), game->enemyConfigs.name);
 
 	//Enemy Component
-	enemy_component_t* enemy_comp = ecs_entity_get_component(game->ecs, game->enemy_ent, game->player_type, true);
+	enemy_component_t* enemy_comp = ecs_entity_get_component(game->ecs, game->enemy_ent, game->enemy_type, true);
 	enemy_comp->index = index;
 
 	//Enemy Model Component
@@ -664,6 +743,7 @@ static void spawn_enemy(final_game_t* game, int index, int region)
 		model_comp->mesh_info = &game->cube_mesh_C;
 	}
 	model_comp->shader_info = &game->cube_shader;
+	cull_sphere_from_mesh(&model_comp->bounds, model_comp->mesh_info);
 }
 
 //Spawns a camera object
@@ -690,154 +770,164 @@ static void spawn_camera(final_game_t* game)
 	mat4f_make_lookat(&camera_comp->view, &eye_pos, &forward, &up);
 }
 
-//Gathers player input to update player models
-static void update_players(final_game_t* game)
+//Computes this frame's player and enemy movement before the systems run
+static void update_moves(final_game_t* game, int dir)
 {
 	float dt = (float)timer_object_get_delta_ms(game->timer) * 0.001f;
 
 	uint32_t key_mask = wm_get_key_mask(game->window);
 
-	uint64_t k_query_mask = (1ULL << game->transform_type) | (1ULL << game->player_type);
+	//Responsible for player movement
+	transform_identity(&game->player_move);
+	if (key_mask & k_key_up)
+	{
+		game->player_move.translation = vec3f_add(game->player_move.translation, vec3f_scale(vec3f_up(), -dt*2));
+	}
+	if (key_mask & k_key_down)
+	{
+		game->player_move.translation = vec3f_add(game->player_move.translation, vec3f_scale(vec3f_up(), dt * 2));
+	}
 
-	for (ecs_query_t query = ecs_query_create(game->ecs, k_query_mask);
-		ecs_query_is_valid(game->ecs, &query);
-		ecs_query_next(game->ecs, &query))
+	//Responsible for whether enemies move left or right
+	transform_identity(&game->enemy_move);
+	if (dir == 0)
 	{
-		transform_component_t* transform_comp = ecs_query_get_component(game->ecs, &query, game->transform_type);
-		player_component_t* player_comp = ecs_query_get_component(game->ecs, &query, game->player_type);
+		game->enemy_move.translation = vec3f_add(game->enemy_move.translation, vec3f_scale(vec3f_right(), -dt * 3.2f));
+	}
+	if (dir == 1)
+	{
+		game->enemy_move.translation = vec3f_add(game->enemy_move.translation, vec3f_scale(vec3f_right(), dt * 3.2f));
+	}
+
+	game->player_transform = ecs_entity_get_component(game->ecs, game->player_ent, game->transform_type, false);
+}
+
+//Gathers player input to update player models
+static void update_players(ecs_t* ecs, ecs_query_chunk_t* query, void* user)
+{
+	final_game_t* game = user;
+	transform_component_t* transform_comps = ecs_query_chunk_get_components(ecs, query, game->transform_type);
 
+	for (int i = 0; i < query->count; ++i)
+	{
 		//Keeps the player bounded
-		if (transform_comp->transform.translation.z <= -6.0f)
+		if (transform_comps[i].transform.translation.z <= -6.0f)
 		{
-			transform_comp->transform.translation.z = 6.0f;
+			transform_comps[i].transform.translation.z = 6.0f;
 		}
-		if (transform_comp->transform.translation.z > 6.0f)
+		if (transform_comps[i].transform.translation.z > 6.0f)
 		{
-			transform_comp->transform.translation.z = 6.0f;
+			transform_comps[i].transform.translation.z = 6.0f;
 		}
 
-		//Responsible for player movement
-		transform_t move;
-		transform_identity(&move);
-		if (key_mask & k_key_up)
-		{
-			move.translation = vec3f_add(move.translation, vec3f_scale(vec3f_up(), -dt*2));
-		}
-		if (key_mask & k_key_down)
-		{
-			move.translation = vec3f_add(move.translation, vec3f_scale(vec3f_up(), dt * 2));
-		}
-		transform_multiply(&transform_comp->transform, &move);
+		transform_multiply(&transform_comps[i].transform, &game->player_move);
 	}
-
 }
 
 //Updates all enemy objects
-static void update_enemies(final_game_t* game, int dir)
+static void update_enemies(ecs_t* ecs, ecs_query_chunk_t* query, void* user)
 {
-	float dt = (float)timer_object_get_delta_ms(game->timer) * 0.001f;
-
-	uint32_t key_mask = wm_get_key_mask(game->window);
-
-	uint64_t k_query_mask = (1ULL << game->transform_type) | (1ULL << game->enemy_type);
+	final_game_t* game = user;
+	transform_component_t* transform_comps = ecs_query_chunk_get_components(ecs, query, game->transform_type);
 
-	for (ecs_query_t query = ecs_query_create(game->ecs, k_query_mask);
-		ecs_query_is_valid(game->ecs, &query);
-		ecs_query_next(game->ecs, &query))
+	for (int i = 0; i < query->count; ++i)
 	{
-		transform_component_t* transform_comp = ecs_query_get_component(game->ecs, &query, game->transform_type);
-		enemy_component_t* enemy_comp = ecs_query_get_component(game->ecs, &query, game->enemy_type);
-
 		//Removes Enemies that are off screen
-		if (transform_comp->transform.translation.y < -13.0f)
+		if (transform_comps[i].transform.translation.y < -13.0f)
 		{
-			ecs_entity_remove(game->ecs, ecs_query_get_entity(game->ecs, &query), false);
+			ecs_entity_remove(ecs, ecs_query_chunk_get_entity(ecs, query, i), false);
 		}
 
-		transform_t move;
-		transform_identity(&move);
-		
-		//Responsible for whether enemies move left or right
-		if (dir == 0)
-		{
-			move.translation = vec3f_add(move.translation, vec3f_scale(vec3f_right(), -dt * 3.2f));
-		}
-		if (dir == 1)
-		{
-			move.translation = vec3f_add(move.translation, vec3f_scale(vec3f_right(), dt * 3.2f));
-		}
-
-		transform_multiply(&transform_comp->transform, &move);
-	}
-
-	ecs_query_t query = ecs_query_create(game->ecs, k_query_mask);
-	if (!(ecs_query_is_valid(game->ecs, &query))) 
-	{
-		spawnEnemies(game,1);
+		transform_multiply(&transform_comps[i].transform, &game->enemy_move);
 	}
 }
 
 //Checks to see if player has collided with an enemy object
-static void check_collision(final_game_t* game) 
+static void check_collision(ecs_t* ecs, ecs_query_chunk_t* query, void* user)
 {
-	uint64_t k_query_mask_enemy = (1ULL << game->transform_type) | (1ULL << game->enemy_type);
-
-	uint64_t k_query_mask_player = (1ULL << game->transform_type) | (1ULL << game->player_type);
-
-	ecs_query_t queryP = ecs_query_create(game->ecs, k_query_mask_player);
+	final_game_t* game = user;
+	transform_component_t* transform_comp_player = game->player_transform;
+	if (!transform_comp_player)
+	{
+		return;
+	}
 
-	transform_component_t* transform_comp_player = ecs_query_get_component(game->ecs, &queryP, game->transform_type);
+	transform_component_t* transform_comps = ecs_query_chunk_get_components(ecs, query, game->transform_type);
 
-	for (ecs_query_t query = ecs_query_create(game->ecs, k_query_mask_enemy);
-		ecs_query_is_valid(game->ecs, &query);
-		ecs_query_next(game->ecs, &query))
+	for (int i = 0; i < query->count; ++i)
 	{
-		transform_component_t* transform_comp = ecs_query_get_component(game->ecs, &query, game->transform_type);
-		enemy_component_t* enemy_comp = ecs_query_get_component(game->ecs, &query, game->enemy_type);
-
-		float dist = vec3f_dist2(transform_comp->transform.translation, transform_comp_player->transform.translation);
+		float dist = vec3f_dist2(transform_comps[i].transform.translation, transform_comp_player->transform.translation);
 
 		if (dist <= 0.5f)
 		{
-			//ecs_entity_remove(game->ecs, ecs_query_get_entity(game->ecs, &query), false);
+			//ecs_entity_remove(ecs, ecs_query_chunk_get_entity(ecs, query, i), false);
 			transform_comp_player->transform.translation.z = 6.0f;
 		}
-
 	}
-
 }
 
 //Draws every model
-static void draw_models(final_game_t* game)
+static void draw_models(ecs_t* ecs, ecs_query_chunk_t* query, void* user)
 {
+	final_game_t* game = user;
+	transform_component_t* transform_comps = ecs_query_chunk_get_components(ecs, query, game->transform_type);
+	model_component_t* model_comps = ecs_query_chunk_get_components(ecs, query, game->model_type);
+
+	//World space bounds, one array per component so the frustum test reads four models at a time.
+	//They only live until the models are pushed, so they come from the frame allocator.
+	float* bounds_x = frame_allocator_alloc(game->frame_allocator, query->count * sizeof(float), 16);
+	float* bounds_y = frame_allocator_alloc(game->frame_allocator, query->count * sizeof(float), 16);
+	float* bounds_z = frame_allocator_alloc(game->frame_allocator, query->count * sizeof(float), 16);
+	float* bounds_radius = frame_allocator_alloc(game->frame_allocator, query->count * sizeof(float), 16);
+	uint8_t* visible = frame_allocator_alloc(game->frame_allocator, query->count, 16);
+	for (int i = 0; i < query->count; ++i)
+	{
+		cull_sphere_t bounds;
+		cull_sphere_transform(&bounds, &model_comps[i].bounds, &transform_comps[i].transform);
+		bounds_x[i] = bounds.center.x;
+		bounds_y[i] = bounds.center.y;
+		bounds_z[i] = bounds.center.z;
+		bounds_radius[i] = bounds.radius;
+	}
+
 	uint64_t k_camera_query_mask = (1ULL << game->camera_type);
-	for (ecs_query_t camera_query = ecs_query_create(game->ecs, k_camera_query_mask);
-		ecs_query_is_valid(game->ecs, &camera_query);
-		ecs_query_next(game->ecs, &camera_query))
+	for (ecs_query_t camera_query = ecs_query_create(ecs, k_camera_query_mask);
+		ecs_query_is_valid(ecs, &camera_query);
+		ecs_query_next(ecs, &camera_query))
 	{
-		camera_component_t* camera_comp = ecs_query_get_component(game->ecs, &camera_query, game->camera_type);
+		camera_component_t* camera_comp = ecs_query_get_component(ecs, &camera_query, game->camera_type);
 
-		uint64_t k_model_query_mask = (1ULL << game->transform_type) | (1ULL << game->model_type);
-		for (ecs_query_t query = ecs_query_create(game->ecs, k_model_query_mask);
-			ecs_query_is_valid(game->ecs, &query);
-			ecs_query_next(game->ecs, &query))
+		//Camera matrices go to the GPU once per camera; each model only carries its own transform
+		struct
 		{
-			transform_component_t* transform_comp = ecs_query_get_component(game->ecs, &query, game->transform_type);
-			model_component_t* model_comp = ecs_query_get_component(game->ecs, &query, game->model_type);
-			ecs_entity_ref_t entity_ref = ecs_query_get_entity(game->ecs, &query);
-
-			struct
+			mat4f_t projection;
+			mat4f_t view;
+		} view_data;
+		view_data.projection = camera_comp->projection;
+		view_data.view = camera_comp->view;
+		gpu_uniform_buffer_info_t view_info = { .data = &view_data, sizeof(view_data) };
+		render_push_view(game->render, &view_info);
+
+		//Only models whose bounds touch the camera's frustum are sent to the render thread
+		mat4f_t view_projection;
+		mat4f_mul(&view_projection, &camera_comp->view, &camera_comp->projection);
+		cull_frustum_t frustum;
+		cull_frustum_from_matrix(&frustum, &view_projection);
+		cull_spheres(&frustum, bounds_x, bounds_y, bounds_z, bounds_radius, query->count, visible);
+
+		for (int i = 0; i < query->count; ++i)
+		{
+			if (!visible[i])
 			{
-				mat4f_t projection;
-				mat4f_t model;
-				mat4f_t view;
-			} uniform_data;
-			uniform_data.projection = camera_comp->projection;
-			uniform_data.view = camera_comp->view;
-			transform_to_matrix(&transform_comp->transform, &uniform_data.model);
-			gpu_uniform_buffer_info_t uniform_info = { .data = &uniform_data, sizeof(uniform_data) };
-
-			render_push_model(game->render, &entity_ref, model_comp->mesh_info, model_comp->shader_info, &uniform_info);
+				continue;
+			}
+			ecs_entity_ref_t entity_ref = ecs_query_chunk_get_entity(ecs, query, i);
+
+			float model_rows[3][4];
+			transform_to_affine_rows(&transform_comps[i].transform, model_rows);
+			gpu_uniform_buffer_info_t uniform_info = { .data = model_rows, sizeof(model_rows) };
+
+			render_push_model(game->render, &entity_ref, model_comps[i].mesh_info, model_comps[i].shader_info, &uniform_info);
 		}
 	}
 }
@@ -0,0 +1,294 @@
+#include "frame_allocator.h"
+
+#include "debug.h"
+#include "heap.h"
+#include "mutex.h"
+#include "thread.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum
+{
+	// Page data starts this far into each page, so it is cache line aligned.
+	k_frame_page_header_size = 64,
+};
+
+typedef struct frame_page_t
+{
+	struct frame_page_t* next;
+	// Usable bytes after the header.
+	size_t size;
+	// Holds a single allocation larger than a page; goes back to the heap instead of being reused.
+	bool large;
+} frame_page_t;
+
+// One thread's pages. Only that thread touches it, except in reset, stats, and destroy.
+typedef struct frame_thread_t
+{
+	// Page being bumped through, and the next free byte in it.
+	frame_page_t* page;
+	size_t offset;
+
+	// Pages filled in each frame still in flight, indexed by frame number modulo frame count.
+	frame_page_t** used;
+	// Pages ready to reuse.
+	frame_page_t* free;
+
+	uint64_t frame_bytes;
+	int page_count;
+	uint64_t page_bytes;
+	int large_count;
+} frame_thread_t;
+
+typedef struct frame_allocator_t
+{
+	heap_t* heap;
+	mutex_t* mutex;
+	size_t page_size;
+	int frame_count;
+	int frame;
+	// Each thread's frame_thread_t.
+	thread_registry_t threads;
+	// Shared under the lock by threads past the registry's limit.
+	frame_thread_t shared_thread;
+	uint64_t frame_bytes;
+	uint64_t peak_frame_bytes;
+} frame_allocator_t;
+
+// The thread state this thread used last, and the allocator it belongs to.
+static THREAD_LOCAL thread_registry_slot_t s_thread;
+
+static frame_thread_t* get_thread(frame_allocator_t* allocator);
+static void* create_thread(void* user);
+static void* alloc_from_thread(frame_allocator_t* allocator, frame_thread_t* thread, size_t size, size_t alignment);
+static frame_page_t* take_page(frame_allocator_t* allocator, frame_thread_t* thread, size_t size, bool large);
+static void release_pages(frame_allocator_t* allocator, frame_thread_t* thread, frame_page_t* page);
+static void free_pages(frame_allocator_t* allocator, frame_page_t* page);
+static void init_thread(frame_allocator_t* allocator, frame_thread_t* thread);
+static void destroy_thread(frame_allocator_t* allocator, frame_thread_t* thread);
+
+frame_allocator_t* frame_allocator_create(heap_t* heap, size_t page_size, int frame_delay)
+{
+	if (frame_delay < 0)
+	{
+		debug_print(k_print_error, "Frame allocator delay must not be negative: %d\n", frame_delay);
+		return NULL;
+	}
+
+	frame_allocator_t* allocator = heap_alloc(heap, sizeof(frame_allocator_t), 8);
+	memset(allocator, 0, sizeof(*allocator));
+	allocator->heap = heap;
+	allocator->mutex = mutex_create();
+	allocator->page_size = page_size;
+	allocator->frame_count = frame_delay + 1;
+	thread_registry_init(&allocator->threads);
+	init_thread(allocator, &allocator->shared_thread);
+	return allocator;
+}
+
+void frame_allocator_destroy(frame_allocator_t* allocator)
+{
+	for (int i = 0; i < allocator->threads.count; ++i)
+	{
+		destroy_thread(allocator, allocator->threads.states[i]);
+		heap_free(allocator->heap, allocator->threads.states[i]);
+	}
+	destroy_thread(allocator, &allocator->shared_thread);
+	mutex_destroy(allocator->mutex);
+	heap_free(allocator->heap, allocator);
+}
+
+void* frame_allocator_alloc(frame_allocator_t* allocator, size_t size, size_t alignment)
+{
+	frame_thread_t* thread = get_thread(allocator);
+	if (thread != &allocator->shared_thread)
+	{
+		return alloc_from_thread(allocator, thread, size, alignment);
+	}
+
+	mutex_lock(allocator->mutex);
+	void* address = alloc_from_thread(allocator, thread, size, alignment);
+	mutex_unlock(allocator->mutex);
+	return address;
+}
+
+void frame_allocator_reset(frame_allocator_t* allocator)
+{
+	mutex_lock(allocator->mutex);
+
+	// Pages in the slot the new frame takes over were filled frame_delay + 1 frames ago.
+	allocator->frame++;
+	int slot = allocator->frame % allocator->frame_count;
+
+	uint64_t frame_bytes = 0;
+	for (int i = 0; i <= allocator->threads.count; ++i)
+	{
+		frame_thread_t* thread = i < allocator->threads.count ? allocator->threads.states[i] : &allocator->shared_thread;
+		frame_bytes += thread->frame_bytes;
+		thread->frame_bytes = 0;
+		// The rest of the current page belongs to the last frame's slot, so the next allocation starts a page.
+		thread->page = NULL;
+		thread->offset = 0;
+		release_pages(allocator, thread, thread->used[slot]);
+		thread->used[slot] = NULL;
+	}
+	allocator->frame_bytes = frame_bytes;
+	allocator->peak_frame_bytes = __max(allocator->peak_frame_bytes, frame_bytes);
+
+	mutex_unlock(allocator->mutex);
+}
+
+void frame_allocator_get_stats(frame_allocator_t* allocator, frame_allocator_stats_t* stats)
+{
+	mutex_lock(allocator->mutex);
+	memset(stats, 0, sizeof(*stats));
+	stats->frame_bytes = allocator->frame_bytes;
+	stats->peak_frame_bytes = allocator->peak_frame_bytes;
+	stats->thread_count = allocator->threads.count;
+	for (int i = 0; i <= allocator->threads.count; ++i)
+	{
+		frame_thread_t* thread = i < allocator->threads.count ? allocator->threads.states[i] : &allocator->shared_thread;
+		stats->page_count += thread->page_count;
+		stats->page_bytes += thread->page_bytes;
+		stats->large_count += thread->large_count;
+	}
+	mutex_unlock(allocator->mutex);
+}
+
+static frame_thread_t* get_thread(frame_allocator_t* allocator)
+{
+	frame_thread_t* thread = thread_registry_get(&allocator->threads, &s_thread, allocator->mutex, create_thread, allocator);
+	return thread ? thread : &allocator->shared_thread;
+}
+
+// Called on a thread's first allocation, with the allocator's lock held.
+static void* create_thread(void* user)
+{
+	frame_allocator_t* allocator = user;
+	frame_thread_t* thread = heap_alloc(allocator->heap, sizeof(frame_thread_t), 8);
+	init_thread(allocator, thread);
+	return thread;
+}
+
+static void* alloc_from_thread(frame_allocator_t* allocator, frame_thread_t* thread, size_t size, size_t alignment)
+{
+	alignment = __max(alignment, 1);
+	thread->frame_bytes += size;
+
+	// Too big to share a page: give it one of its own.
+	if (size + alignment > allocator->page_size)
+	{
+		frame_page_t* page = take_page(allocator, thread, size + alignment, true);
+		if (!page)
+		{
+			return NULL;
+		}
+		uintptr_t data = (uintptr_t)page + k_frame_page_header_size;
+		return (void*)((data + alignment - 1) & ~(uintptr_t)(alignment - 1));
+	}
+
+	for (int attempt = 0; attempt < 2; ++attempt)
+	{
+		if (thread->page)
+		{
+			uintptr_t data = (uintptr_t)thread->page + k_frame_page_header_size;
+			uintptr_t address = (data + thread->offset + alignment - 1) & ~(uintptr_t)(alignment - 1);
+			if (address + size <= data + thread->page->size)
+			{
+				thread->offset = address + size - data;
+				return (void*)address;
+			}
+		}
+
+		thread->page = take_page(allocator, thread, allocator->page_size, false);
+		thread->offset = 0;
+		if (!thread->page)
+		{
+			return NULL;
+		}
+	}
+	return NULL;
+}
+
+// Take a page for the current frame: a reused one if the thread has one, else a new one from the heap.
+static frame_page_t* take_page(frame_allocator_t* allocator, frame_thread_t* thread, size_t size, bool large)
+{
+	frame_page_t* page = NULL;
+	if (!large && thread->free)
+	{
+		page = thread->free;
+		thread->free = page->next;
+	}
+	else
+	{
+		page = heap_alloc(allocator->heap, k_frame_page_header_size + size, k_frame_page_header_size);
+		if (!page)
+		{
+			return NULL;
+		}
+		page->size = size;
+		page->large = large;
+		if (large)
+		{
+			thread->large_count++;
+		}
+		else
+		{
+			thread->page_count++;
+			thread->page_bytes += size;
+		}
+	}
+
+	int slot = allocator->frame % allocator->frame_count;
+	page->next = thread->used[slot];
+	thread->used[slot] = page;
+	return page;
+}
+
+// Pages go back on the thread's free list; large pages go back to the heap.
+static void release_pages(frame_allocator_t* allocator, frame_thread_t* thread, frame_page_t* page)
+{
+	while (page)
+	{
+		frame_page_t* next = page->next;
+		if (page->large)
+		{
+			heap_free(allocator->heap, page);
+		}
+		else
+		{
+			page->next = thread->free;
+			thread->free = page;
+		}
+		page = next;
+	}
+}
+
+static void free_pages(frame_allocator_t* allocator, frame_page_t* page)
+{
+	while (page)
+	{
+		frame_page_t* next = page->next;
+		heap_free(allocator->heap, page);
+		page = next;
+	}
+}
+
+static void init_thread(frame_allocator_t* allocator, frame_thread_t* thread)
+{
+	memset(thread, 0, sizeof(*thread));
+	thread->used = heap_alloc(allocator->heap, allocator->frame_count * sizeof(frame_page_t*), 8);
+	memset(thread->used, 0, allocator->frame_count * sizeof(frame_page_t*));
+}
+
+static void destroy_thread(frame_allocator_t* allocator, frame_thread_t* thread)
+{
+	for (int i = 0; i < allocator->frame_count; ++i)
+	{
+		free_pages(allocator, thread->used[i]);
+	}
+	free_pages(allocator, thread->free);
+	heap_free(allocator->heap, thread->used);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// Frame Allocator
+// Bump allocation for data that only lives for a frame: scratch arrays, query results, copies.
+// Each thread bumps through its own pages, so allocation takes no lock and there is nothing to free.
+// frame_allocator_reset() marks a frame boundary. Memory allocated in a frame stays valid through
+// frame_delay more resets, so data handed to the render thread can outlive the frame that wrote it.
+// Threads take pages from the heap when their own run out; pages are kept and reused after that.
+
+// Handle to a frame allocator.
+typedef struct frame_allocator_t frame_allocator_t;
+
+typedef struct heap_t heap_t;
+
+typedef struct frame_allocator_stats_t
+{
+	// Bytes allocated in the last completed frame, and the most allocated in any one frame.
+	uint64_t frame_bytes;
+	uint64_t peak_frame_bytes;
+	// Pages taken from the heap so far, and their total size.
+	int page_count;
+	uint64_t page_bytes;
+	// Allocations too large for a page, each given a page of its own and returned to the heap on reuse.
+	int large_count;
+	int thread_count;
+} frame_allocator_stats_t;
+
+// Create a frame allocator.
+// Page size is how much each thread takes from the heap at a time.
+// Frame delay is how many extra resets memory survives; zero releases it at the next reset.
+// Returns NULL if frame delay is negative.
+frame_allocator_t* frame_allocator_create(heap_t* heap, size_t page_size, int frame_delay);
+
+// Destroy a frame allocator and return all of its pages to the heap.
+void frame_allocator_destroy(frame_allocator_t* allocator);
+
+// Allocate memory that stays valid until frame_delay + 1 calls to frame_allocator_reset().
+// Safe to call from any thread.
+void* frame_allocator_alloc(frame_allocator_t* allocator, size_t size, size_t alignment);
+
+// Mark a frame boundary, reclaiming memory allocated frame_delay + 1 frames ago.
+// No other thread may be allocating from the allocator during the call.
+void frame_allocator_reset(frame_allocator_t* allocator);
+
+// Get usage counters, including the peak bytes allocated in one frame.
+void frame_allocator_get_stats(frame_allocator_t* allocator, frame_allocator_stats_t* stats);
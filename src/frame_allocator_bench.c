@@ -0,0 +1,105 @@
+#include "bench.h"
+
+#include "debug.h"
+#include "frame_allocator.h"
+#include "heap.h"
+#include "job.h"
+#include "timer.h"
+
+#include <string.h>
+
+enum
+{
+	k_bench_frames = 256,
+	k_bench_jobs_per_frame = 32,
+	k_bench_allocs_per_job = 256,
+	k_bench_worker_count = 3,
+	k_bench_page_size = 64 * 1024,
+	k_bench_grow_increment = 4 * 1024 * 1024,
+};
+
+typedef struct bench_frame_job_t
+{
+	heap_t* heap;
+	frame_allocator_t* allocator;
+	uint32_t seed;
+} bench_frame_job_t;
+
+// Allocate scratch blocks of 16 to 256 bytes and touch each, as a system building per-frame arrays would.
+// Heap blocks are freed by the job; frame allocator blocks are left for the reset.
+static void bench_frame_job(void* data)
+{
+	bench_frame_job_t* job = data;
+	void* blocks[k_bench_allocs_per_job];
+	uint32_t seed = job->seed;
+	for (int i = 0; i < k_bench_allocs_per_job; ++i)
+	{
+		seed = seed * 1664525 + 1013904223;
+		size_t size = 16 + ((seed >> 16) % 16) * 16;
+		blocks[i] = job->allocator ? frame_allocator_alloc(job->allocator, size, 16) : heap_alloc(job->heap, size, 16);
+		memset(blocks[i], i, size);
+	}
+	if (!job->allocator)
+	{
+		for (int i = 0; i < k_bench_allocs_per_job; ++i)
+		{
+			heap_free(job->heap, blocks[i]);
+		}
+	}
+}
+
+// Returns ns per allocation, averaged over every frame.
+static double bench_frame_run(job_system_t* jobs, bool use_allocator, int frame_delay, frame_allocator_stats_t* stats)
+{
+	heap_t* heap = heap_create(k_bench_grow_increment);
+	frame_allocator_t* allocator = use_allocator ? frame_allocator_create(heap, k_bench_page_size, frame_delay) : NULL;
+
+	bench_frame_job_t frame_jobs[k_bench_jobs_per_frame];
+	uint64_t start = timer_get_ticks();
+	for (int frame = 0; frame < k_bench_frames; ++frame)
+	{
+		job_counter_t counter = { 0 };
+		for (int i = 0; i < k_bench_jobs_per_frame; ++i)
+		{
+			frame_jobs[i] = (bench_frame_job_t) { .heap = heap, .allocator = allocator, .seed = frame * k_bench_jobs_per_frame + i };
+			job_submit(jobs, bench_frame_job, &frame_jobs[i], &counter);
+		}
+		job_wait(jobs, &counter);
+		if (allocator)
+		{
+			frame_allocator_reset(allocator);
+		}
+	}
+	uint64_t ticks = timer_get_ticks() - start;
+
+	memset(stats, 0, sizeof(*stats));
+	if (allocator)
+	{
+		frame_allocator_get_stats(allocator, stats);
+		frame_allocator_destroy(allocator);
+	}
+	heap_destroy(heap);
+
+	double allocs = (double)k_bench_frames * k_bench_jobs_per_frame * k_bench_allocs_per_job;
+	return (double)ticks * 1e9 / (double)timer_get_ticks_per_second() / allocs;
+}
+
+void frame_allocator_bench_run(heap_t* heap)
+{
+	job_system_t* jobs = job_system_create(heap, k_bench_worker_count);
+
+	frame_allocator_stats_t stats;
+	double heap_ns = bench_frame_run(jobs, false, 0, &stats);
+	debug_print(k_print_info, "  heap alloc/free:        %6.1f ns/alloc\n", heap_ns);
+
+	const int k_delays[] = { 0, 2 };
+	for (int i = 0; i < _countof(k_delays); ++i)
+	{
+		double frame_ns = bench_frame_run(jobs, true, k_delays[i], &stats);
+		debug_print(k_print_info, "  frame allocator, delay %d: %6.1f ns/alloc (%4.1fx); peak %llu bytes/frame, %d pages (%llu bytes) on %d threads\n",
+			k_delays[i], frame_ns, heap_ns / frame_ns,
+			(unsigned long long)stats.peak_frame_bytes, stats.page_count, (unsigned long long)stats.page_bytes, stats.thread_count);
+	}
+
+	job_system_destroy(jobs);
+}
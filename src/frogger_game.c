@@ -356,7 +356,7 @@ static void spawn_enemy(frogger_game_t* game, int index, int zone, int letter)
 	name_component_t* name_comp = ecs_entity_get_component(game->ecs, game->enemy_ent, game->name_type, true);
 	strcpy_s(name_comp->name, sizeof(name_comp->name), "enemy");
 
-	enemy_component_t* enemy_comp = ecs_entity_get_component(game->ecs, game->enemy_ent, game->player_type, true);
+	enemy_component_t* enemy_comp = ecs_entity_get_component(game->ecs, game->enemy_ent, game->enemy_type, true);
 	enemy_comp->index = index;
 
 	model_component_t* model_comp = ecs_entity_get_component(game->ecs, game->enemy_ent, game->model_type, true);
@@ -1,20 +1,25 @@
 #include "fs.h"
 
-#include "event.h"
 #include "heap.h"
-#include "queue.h"
-#include "thread.h"
+#include "job.h"
+#include "object_pool.h"
 
 #include <string.h>
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
+enum
+{
+	k_fs_work_pool_chunk_count = 16,
+};
+
 typedef struct fs_t
 {
 	heap_t* heap;
-	queue_t* file_queue;
-	thread_t* file_thread;
+	job_system_t* jobs;
+	// Work items, each carrying its path inline.
+	object_pool_t* work_pool;
 } fs_t;
 
 typedef enum fs_work_op_t
@@ -25,6 +30,7 @@ typedef enum fs_work_op_t
 
 typedef struct fs_work_t
 {
+	fs_t* fs;
 	heap_t* heap;
 	fs_work_op_t op;
 	char path[1024];
@@ -32,54 +38,57 @@ typedef struct fs_work_t
 	bool use_compression;
 	void* buffer;
 	size_t size;
-	event_t* done;
+	job_system_t* jobs;
+	job_counter_t done;
 	int result;
 } fs_work_t;
 
-static int file_thread_func(void* user);
+static void file_job_func(void* user);
 
-fs_t* fs_create(heap_t* heap, int queue_capacity)
+fs_t* fs_create(heap_t* heap, job_system_t* jobs)
 {
-	fs_t* fs = heap_alloc(heap, sizeof(fs_t), 8);
+	fs_t* fs = heap_alloc_tagged(heap, sizeof(fs_t), 8, k_heap_tag_fs);
 	fs->heap = heap;
-	fs->file_queue = queue_create(heap, queue_capacity);
-	fs->file_thread = thread_create(file_thread_func, fs);
+	fs->jobs = jobs;
+	fs->work_pool = object_pool_create(heap, sizeof(fs_work_t), 8, k_fs_work_pool_chunk_count);
 	return fs;
 }
 
 void fs_destroy(fs_t* fs)
 {
-	queue_push(fs->file_queue, NULL);
-	thread_destroy(fs->file_thread);
-	queue_destroy(fs->file_queue);
+	object_pool_destroy(fs->work_pool);
 	heap_free(fs->heap, fs);
 }
 
 fs_work_t* fs_read(fs_t* fs, const char* path, heap_t* heap, bool null_terminate, bool use_compression)
 {
-	fs_work_t* work = heap_alloc(fs->heap, sizeof(fs_work_t), 8);
+	fs_work_t* work = object_pool_alloc(fs->work_pool);
+	work->fs = fs;
 	work->heap = heap;
 	work->op = k_fs_work_op_read;
 	strcpy_s(work->path, sizeof(work->path), path);
 	work->buffer = NULL;
 	work->size = 0;
-	work->done = event_create();
+	work->jobs = fs->jobs;
+	work->done = (job_counter_t) { 0 };
 	work->result = 0;
 	work->null_terminate = null_terminate;
 	work->use_compression = use_compression;
-	queue_push(fs->file_queue, work);
+	job_submit(fs->jobs, file_job_func, work, &work->done);
 	return work;
 }
 
 fs_work_t* fs_write(fs_t* fs, const char* path, const void* buffer, size_t size, bool use_compression)
 {
-	fs_work_t* work = heap_alloc(fs->heap, sizeof(fs_work_t), 8);
+	fs_work_t* work = object_pool_alloc(fs->work_pool);
+	work->fs = fs;
 	work->heap = fs->heap;
 	work->op = k_fs_work_op_write;
 	strcpy_s(work->path, sizeof(work->path), path);
 	work->buffer = (void*)buffer;
 	work->size = size;
-	work->done = event_create();
+	work->jobs = fs->jobs;
+	work->done = (job_counter_t) { 0 };
 	work->result = 0;
 	work->null_terminate = false;
 	work->use_compression = use_compression;
@@ -90,7 +99,7 @@ fs_work_t* fs_write(fs_t* fs, const char* path, const void* buffer, size_t size,
 	}
 	else
 	{
-		queue_push(fs->file_queue, work);
+		job_submit(fs->jobs, file_job_func, work, &work->done);
 	}
 
 	return work;
@@ -98,14 +107,14 @@ fs_work_t* fs_write(fs_t* fs, const char* path, const void* buffer, size_t size,
 
 bool fs_work_is_done(fs_work_t* work)
 {
-	return work ? event_is_raised(work->done) : true;
+	return work ? job_counter_is_done(&work->done) : true;
 }
 
 void fs_work_wait(fs_work_t* work)
 {
 	if (work)
 	{
-		event_wait(work->done);
+		job_wait(work->jobs, &work->done);
 	}
 }
 
@@ -131,9 +140,8 @@ void fs_work_destroy(fs_work_t* work)
 {
 	if (work)
 	{
-		event_wait(work->done);
-		event_destroy(work->done);
-		heap_free(work->heap, work);
+		job_wait(work->jobs, &work->done);
+		object_pool_free(work->fs->work_pool, work);
 	}
 }
 
@@ -143,7 +151,6 @@ static void file_read(fs_work_t* work)
 	if (MultiByteToWideChar(CP_UTF8, 0, work->path, -1, wide_path, sizeof(wide_path)) <= 0)
 	{
 		work->result = -1;
-		event_signal(work->done);
 		return;
 	}
 
@@ -152,7 +159,6 @@ static void file_read(fs_work_t* work)
 	if (handle == INVALID_HANDLE_VALUE)
 	{
 		work->result = GetLastError();
-		event_signal(work->done);
 		return;
 	}
 
@@ -160,18 +166,16 @@ static void file_read(fs_work_t* work)
 	{
 		work->result = GetLastError();
 		CloseHandle(handle);
-		event_signal(work->done);
 		return;
 	}
 
-	work->buffer = heap_alloc(work->heap, work->null_terminate ? work->size + 1 : work->size, 8);
+	work->buffer = heap_alloc_tagged(work->heap, work->null_terminate ? work->size + 1 : work->size, 8, k_heap_tag_fs);
 
 	DWORD bytes_read = 0;
 	if (!ReadFile(handle, work->buffer, (DWORD)work->size, &bytes_read, NULL))
 	{
 		work->result = GetLastError();
 		CloseHandle(handle);
-		event_signal(work->done);
 		return;
 	}
 
@@ -187,10 +191,6 @@ static void file_read(fs_work_t* work)
 	{
 		// HOMEWORK 2: Queue file read work on decompression queue!
 	}
-	else
-	{
-		event_signal(work->done);
-	}
 }
 
 static void file_write(fs_work_t* work)
@@ -199,7 +199,6 @@ static void file_write(fs_work_t* work)
 	if (MultiByteToWideChar(CP_UTF8, 0, work->path, -1, wide_path, sizeof(wide_path)) <= 0)
 	{
 		work->result = -1;
-		event_signal(work->done);
 		return;
 	}
 
@@ -208,7 +207,6 @@ static void file_write(fs_work_t* work)
 	if (handle == INVALID_HANDLE_VALUE)
 	{
 		work->result = GetLastError();
-		event_signal(work->done);
 		return;
 	}
 
@@ -217,37 +215,24 @@ static void file_write(fs_work_t* work)
 	{
 		work->result = GetLastError();
 		CloseHandle(handle);
-		event_signal(work->done);
 		return;
 	}
 
 	work->size = bytes_written;
 
 	CloseHandle(handle);
-
-	event_signal(work->done);
 }
 
-static int file_thread_func(void* user)
+static void file_job_func(void* user)
 {
-	fs_t* fs = user;
-	while (true)
+	fs_work_t* work = user;
+	switch (work->op)
 	{
-		fs_work_t* work = queue_pop(fs->file_queue);
-		if (work == NULL)
-		{
-			break;
-		}
-		
-		switch (work->op)
-		{
-		case k_fs_work_op_read:
-			file_read(work);
-			break;
-		case k_fs_work_op_write:
-			file_write(work);
-			break;
-		}
+	case k_fs_work_op_read:
+		file_read(work);
+		break;
+	case k_fs_work_op_write:
+		file_write(work);
+		break;
 	}
-	return 0;
 }
@@ -11,11 +11,12 @@ typedef struct fs_t fs_t;
 typedef struct fs_work_t fs_work_t;
 
 typedef struct heap_t heap_t;
+typedef struct job_system_t job_system_t;
 
 // Create a new file system.
-// Provided heap will be used to allocate space for queue and work buffers.
-// Provided queue size defines number of in-flight file operations.
-fs_t* fs_create(heap_t* heap, int queue_capacity);
+// Provided heap will be used to allocate space for work buffers.
+// File operations run as jobs on the provided job system.
+fs_t* fs_create(heap_t* heap, job_system_t* jobs);
 
 // Destroy a previously created file system.
 void fs_destroy(fs_t* fs);
@@ -36,6 +37,7 @@ fs_work_t* fs_write(fs_t* fs, const char* path, const void* buffer, size_t size,
 bool fs_work_is_done(fs_work_t* work);
 
 // Block for the file work to complete.
+// The calling thread runs other jobs while it waits.
 void fs_work_wait(fs_work_t* work);
 
 // Get the error code for the file work.
@@ -1,7 +1,16 @@
 #include "gpu.h"
 
+// Vulkan backend. Builds with GPU_NULL defined use gpu_null.c instead.
+#if !defined(GPU_NULL)
+
+#include "atomic.h"
 #include "debug.h"
+#include "fs.h"
+#include "gpu_allocator.h"
 #include "heap.h"
+#include "mutex.h"
+#include "timer.h"
+#include "trace.h"
 #include "wm.h"
 
 #define VK_USE_PLATFORM_WIN32_KHR
@@ -10,28 +19,97 @@
 #include <malloc.h>
 #include <string.h>
 
+enum
+{
+	// Vertex buffer binding for per-instance data; meshes use binding 0.
+	k_instance_binding = 1,
+	// Buffers are sub-allocated from device memory blocks of this size.
+	// Requests over half a block get a dedicated block of their own.
+	k_memory_block_size = 64 * 1024 * 1024,
+	// Mesh data passes through a host-visible ring of this size on its way to device-local memory.
+	// Larger meshes are copied through it in pieces.
+	k_staging_ring_size = 8 * 1024 * 1024,
+	k_staging_alignment = 16,
+	k_upload_initial_capacity = 64,
+	// Timed regions open at once in one command buffer; deeper regions are not timed.
+	k_trace_region_depth = 8,
+};
+
+static const char* k_pipeline_cache_path = "pipeline_cache.bin";
+
+// Leading fields of saved pipeline cache data, as laid out by VK_PIPELINE_CACHE_HEADER_VERSION_ONE.
+typedef struct pipeline_cache_header_t
+{
+	uint32_t header_size;
+	uint32_t header_version;
+	uint32_t vendor_id;
+	uint32_t device_id;
+	uint8_t uuid[VK_UUID_SIZE];
+} pipeline_cache_header_t;
+
+// One vkAllocateMemory allocation, carved up by a gpu_allocator_t.
+typedef struct gpu_memory_block_t
+{
+	VkDeviceMemory memory;
+	VkDeviceSize size;
+	// NULL for a dedicated block, which backs exactly one buffer.
+	gpu_allocator_t* allocator;
+	// Host-visible blocks are mapped once for their lifetime, since memory can't be mapped twice.
+	void* data;
+	struct gpu_memory_block_t* next;
+} gpu_memory_block_t;
+
+// A copy from the staging ring waiting to be recorded.
+typedef struct gpu_upload_t
+{
+	VkBuffer buffer;
+	VkBufferCopy region;
+} gpu_upload_t;
+
+// A range of a memory block backing one buffer.
+typedef struct gpu_memory_t
+{
+	gpu_memory_block_t* block;
+	gpu_allocation_t allocation;
+	// Mapped address of the range, if the block is host visible.
+	void* data;
+} gpu_memory_t;
+
 typedef struct gpu_cmd_buffer_t
 {
 	VkCommandBuffer buffer;
 	VkPipelineLayout pipeline_layout;
 	int index_count;
 	int vertex_count;
+	// Bind and draw counts recorded into this buffer, added to the totals in gpu_frame_end().
+	gpu_stats_t stats;
+	// Timed regions pushed and not yet popped, or -1 for regions that aren't being timed.
+	int trace_regions[k_trace_region_depth];
+	int trace_depth;
 } gpu_cmd_buffer_t;
 
 typedef struct gpu_descriptor_t
 {
 	VkDescriptorSet set;
+	int uniform_buffer_count;
 } gpu_descriptor_t;
 
+typedef struct gpu_instance_buffer_t
+{
+	VkBuffer buffer;
+	gpu_memory_t memory;
+	size_t size;
+} gpu_instance_buffer_t;
+
 typedef struct gpu_mesh_t
 {
 	VkBuffer index_buffer;
-	VkDeviceMemory index_memory;
+	gpu_memory_t index_memory;
 	int index_count;
 	VkIndexType index_type;
 
 	VkBuffer vertex_buffer;
-	VkDeviceMemory vertex_memory;
+	gpu_memory_t vertex_memory;
 	int vertex_count;
 } gpu_mesh_t;
 
@@ -46,12 +124,14 @@ typedef struct gpu_shader_t
 	VkShaderModule vertex_module;
 	VkShaderModule fragment_module;
 	VkDescriptorSetLayout descriptor_set_layout;
+	size_t instance_data_size;
 } gpu_shader_t;
 
 typedef struct gpu_uniform_buffer_t
 {
 	VkBuffer buffer;
-	VkDeviceMemory memory;
+	// Mapped for the life of the buffer; memory is host coherent.
+	gpu_memory_t memory;
 	VkDescriptorBufferInfo descriptor;
 } gpu_uniform_buffer_t;
 
@@ -62,16 +142,35 @@ typedef struct gpu_frame_t
 	VkFramebuffer frame_buffer;
 	VkFence fence;
 	gpu_cmd_buffer_t* cmd_buffer;
+	// Staging ring position after the copies recorded in this frame.
+	uint64_t staging_end;
+	// Secondary command buffers for gpu_frame_begin_parallel(), each with its own pool so threads don't share one.
+	// Created the first time a frame asks for that many.
+	VkCommandPool secondary_pools[k_gpu_max_parallel_cmd_buffers];
+	gpu_cmd_buffer_t* secondary_cmd_buffers[k_gpu_max_parallel_cmd_buffers];
+	int secondary_count;
+	// Begin and end timestamps for each timed region, read back the next time the frame's fence is waited on.
+	// NULL when not tracing.
+	VkQueryPool query_pool;
+	const char* trace_names[k_gpu_max_trace_regions];
+	int trace_region_count;
+	int render_pass_region;
 } gpu_frame_t;
 
 typedef struct gpu_t
 {
 	heap_t* heap;
 	VkInstance instance;
+	// With the validation layer, its messages go to debug_print() and errors are counted for gpu_destroy() to report.
+	VkDebugUtilsMessengerEXT debug_messenger;
+	int validation_error_count;
 	VkPhysicalDevice physical_device;
 	VkDevice logical_device;
 	VkPhysicalDeviceMemoryProperties memory_properties;
+	VkDeviceSize uniform_alignment;
+	gpu_memory_block_t* memory_blocks[VK_MAX_MEMORY_TYPES];
 	VkQueue queue;
+	uint32_t queue_family_index;
 	VkSurfaceKHR surface;
 	VkSwapchainKHR swap_chain;
 
@@ -84,6 +183,25 @@ typedef struct gpu_t
 	VkCommandPool cmd_pool;
 	VkDescriptorPool descriptor_pool;
 
+	// Saved through fs on destroy when there is one; warm if valid data for this device was loaded.
+	fs_t* fs;
+	VkPipelineCache pipeline_cache;
+	bool pipeline_cache_warm;
+
+	// Copies into device-local meshes are batched at the start of the next frame's command buffer.
+	// Ring positions only grow: data is written up to head, recorded in a frame up to submitted,
+	// and done being read by the GPU up to tail.
+	VkBuffer staging_buffer;
+	gpu_memory_t staging_memory;
+	uint64_t staging_head;
+	uint64_t staging_submitted;
+	uint64_t staging_tail;
+	gpu_upload_t* uploads;
+	int upload_count;
+	int upload_capacity;
+	// Records copies when the ring fills before a frame can take them.
+	VkCommandBuffer upload_cmd_buffer;
+
 	VkSemaphore present_complete_sema;
 	VkSemaphore render_complete_sema;
 
@@ -99,17 +217,51 @@ typedef struct gpu_t
 	gpu_frame_t* frames;
 	uint32_t frame_count;
 	uint32_t frame_index;
+
+	// GPU timestamps are converted to timer_get_ticks() time from one point where both clocks were read.
+	trace_t* trace;
+	uint64_t timestamp_mask;
+	double ticks_per_timestamp;
+	uint64_t calibration_timestamp;
+	uint64_t calibration_ticks;
+
+	gpu_stats_t stats;
+	// Guards the object and pipeline counts in stats, since shaders and pipelines may be created on any thread.
+	mutex_t* stats_mutex;
 } gpu_t;
 
 static void create_mesh_layouts(gpu_t* gpu);
 static void destroy_mesh_layouts(gpu_t* gpu);
 static uint32_t get_memory_type_index(gpu_t* gpu, uint32_t bits, VkMemoryPropertyFlags properties);
-
-gpu_t* gpu_create(heap_t* heap, wm_window_t* window)
+static VkResult bind_buffer_memory(gpu_t* gpu, VkBuffer buffer, VkMemoryPropertyFlags properties, gpu_memory_t* memory);
+static void free_buffer_memory(gpu_t* gpu, gpu_memory_t* memory);
+static void destroy_memory_blocks(gpu_t* gpu);
+static VkResult create_pipeline_cache(gpu_t* gpu, const VkPhysicalDeviceProperties* properties);
+static void count_object_created(gpu_t* gpu);
+static void count_object_destroyed(gpu_t* gpu);
+static void save_pipeline_cache(gpu_t* gpu);
+static void queue_upload(gpu_t* gpu, VkBuffer buffer, const void* data, VkDeviceSize size);
+static void cancel_uploads(gpu_t* gpu, VkBuffer buffer);
+static void record_uploads(gpu_t* gpu, VkCommandBuffer cmd_buffer);
+static void flush_uploads(gpu_t* gpu);
+static bool begin_frame(gpu_t* gpu, gpu_frame_t* frame, VkSubpassContents contents);
+static void set_viewport_and_scissor(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer);
+static gpu_cmd_buffer_t* get_secondary_cmd_buffer(gpu_t* gpu, gpu_frame_t* frame, int index);
+static void add_cmd_buffer_stats(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer);
+static void calibrate_timestamps(gpu_t* gpu);
+static int begin_trace_region(gpu_t* gpu, gpu_frame_t* frame, gpu_cmd_buffer_t* cmd_buffer, const char* name);
+static void end_trace_region(gpu_t* gpu, gpu_frame_t* frame, gpu_cmd_buffer_t* cmd_buffer, int region);
+static VkBool32 VKAPI_PTR validation_callback(VkDebugUtilsMessageSeverityFlagBitsEXT severity, VkDebugUtilsMessageTypeFlagsEXT types,
+	const VkDebugUtilsMessengerCallbackDataEXT* data, void* user);
+static uint64_t timestamp_to_ticks(gpu_t* gpu, uint64_t timestamp);
+static void trace_frame_timestamps(gpu_t* gpu, gpu_frame_t* frame);
+
+gpu_t* gpu_create(heap_t* heap, wm_window_t* window, fs_t* fs, trace_t* trace)
 {
-	gpu_t* gpu = heap_alloc(heap, sizeof(gpu_t), 8);
+	gpu_t* gpu = heap_alloc_tagged(heap, sizeof(gpu_t), 8, k_heap_tag_render);
 	memset(gpu, 0, sizeof(*gpu));
 	gpu->heap = heap;
+	gpu->stats_mutex = mutex_create();
 
 	//////////////////////////////////////////////////////
 	// Create VkInstance
@@ -125,10 +277,12 @@ gpu_t* gpu_create(heap_t* heap, wm_window_t* window)
 		.apiVersion = VK_API_VERSION_1_2,
 	};
 
+	// The debug utils extension is last, and only enabled along with the validation layer.
 	const char* k_extensions[] =
 	{
 		VK_KHR_SURFACE_EXTENSION_NAME,
 		VK_KHR_WIN32_SURFACE_EXTENSION_NAME,
+		VK_EXT_DEBUG_UTILS_EXTENSION_NAME,
 	};
 
 	const char* k_layers[] =
@@ -140,7 +294,7 @@ gpu_t* gpu_create(heap_t* heap, wm_window_t* window)
 	{
 		.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
 		.pApplicationInfo = &app_info,
-		.enabledExtensionCount = _countof(k_extensions),
+		.enabledExtensionCount = use_validation ? _countof(k_extensions) : _countof(k_extensions) - 1,
 		.ppEnabledExtensionNames = k_extensions,
 		.enabledLayerCount = use_validation ? _countof(k_layers) : 0,
 		.ppEnabledLayerNames = k_layers,
@@ -154,6 +308,26 @@ gpu_t* gpu_create(heap_t* heap, wm_window_t* window)
 		goto fail;
 	}
 
+	if (use_validation)
+	{
+		VkDebugUtilsMessengerCreateInfoEXT messenger_info =
+		{
+			.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT,
+			.messageSeverity = VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT,
+			.messageType = VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT |
+				VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT,
+			.pfnUserCallback = validation_callback,
+			.pUserData = gpu,
+		};
+		PFN_vkCreateDebugUtilsMessengerEXT create_messenger =
+			(PFN_vkCreateDebugUtilsMessengerEXT)vkGetInstanceProcAddr(gpu->instance, "vkCreateDebugUtilsMessengerEXT");
+		result = create_messenger ? create_messenger(gpu->instance, &messenger_info, NULL, &gpu->debug_messenger) : VK_ERROR_EXTENSION_NOT_PRESENT;
+		if (result)
+		{
+			debug_print(k_print_warning, "Validation messages go to the layer's default output: vkCreateDebugUtilsMessengerEXT failed: %d\n", result);
+		}
+	}
+
 	//////////////////////////////////////////////////////
 	// Find our desired VkPhysicalDevice (GPU)
 	//////////////////////////////////////////////////////
@@ -240,7 +414,29 @@ gpu_t* gpu_create(heap_t* heap, wm_window_t* window)
 	}
 
 	vkGetPhysicalDeviceMemoryProperties(gpu->physical_device, &gpu->memory_properties);
+
+	VkPhysicalDeviceProperties device_properties;
+	vkGetPhysicalDeviceProperties(gpu->physical_device, &device_properties);
+	gpu->uniform_alignment = device_properties.limits.minUniformBufferOffsetAlignment;
+
+	gpu->fs = fs;
+	// Without valid timestamp bits on the queue, frames are recorded without timing.
+	if (trace && queue_families[queue_family_index].timestampValidBits)
+	{
+		uint32_t valid_bits = queue_families[queue_family_index].timestampValidBits;
+		gpu->trace = trace;
+		gpu->timestamp_mask = valid_bits < 64 ? (1ull << valid_bits) - 1 : UINT64_MAX;
+		gpu->ticks_per_timestamp = device_properties.limits.timestampPeriod * (double)timer_get_ticks_per_second() / 1e9;
+	}
+	result = create_pipeline_cache(gpu, &device_properties);
+	if (result)
+	{
+		function = "vkCreatePipelineCache";
+		goto fail;
+	}
+
 	vkGetDeviceQueue(gpu->logical_device, queue_family_index, 0, &gpu->queue);
+	gpu->queue_family_index = queue_family_index;
 
 	//////////////////////////////////////////////////////
 	// Create a Windows surface on which to render
@@ -304,7 +500,7 @@ gpu_t* gpu_create(heap_t* heap, wm_window_t* window)
 		goto fail;
 	}
 
-	gpu->frames = heap_alloc(heap, sizeof(gpu_frame_t) * gpu->frame_count, 8);
+	gpu->frames = heap_alloc_tagged(heap, sizeof(gpu_frame_t) * gpu->frame_count, 8, k_heap_tag_render);
 	memset(gpu->frames, 0, sizeof(gpu_frame_t) * gpu->frame_count);
 	VkImage* images = alloca(sizeof(VkImage) * gpu->frame_count);
 
@@ -546,7 +742,7 @@ gpu_t* gpu_create(heap_t* heap, wm_window_t* window)
 	VkDescriptorPoolSize descriptor_pool_sizes[1] =
 	{
 		{
-			.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+			.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
 			.descriptorCount = 512,
 		}
 	};
@@ -586,7 +782,7 @@ gpu_t* gpu_create(heap_t* heap, wm_window_t* window)
 	//////////////////////////////////////////////////////
 	for (uint32_t i = 0; i < gpu->frame_count; i++)
 	{
-		gpu->frames[i].cmd_buffer = heap_alloc(gpu->heap, sizeof(gpu_cmd_buffer_t), 8);
+		gpu->frames[i].cmd_buffer = heap_alloc_tagged(gpu->heap, sizeof(gpu_cmd_buffer_t), 8, k_heap_tag_render);
 		memset(gpu->frames[i].cmd_buffer, 0, sizeof(gpu_cmd_buffer_t));
 
 		VkCommandBufferAllocateInfo alloc_info =
@@ -614,10 +810,70 @@ gpu_t* gpu_create(heap_t* heap, wm_window_t* window)
 			function = "vkCreateFence";
 			goto fail;
 		}
+
+		if (gpu->trace)
+		{
+			VkQueryPoolCreateInfo query_pool_info =
+			{
+				.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+				.queryType = VK_QUERY_TYPE_TIMESTAMP,
+				.queryCount = k_gpu_max_trace_regions * 2,
+			};
+			result = vkCreateQueryPool(gpu->logical_device, &query_pool_info, NULL, &gpu->frames[i].query_pool);
+			if (result)
+			{
+				function = "vkCreateQueryPool";
+				goto fail;
+			}
+		}
+	}
+
+	//////////////////////////////////////////////////////
+	// Create the staging ring for mesh uploads
+	//////////////////////////////////////////////////////
+	VkCommandBufferAllocateInfo upload_alloc_info =
+	{
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+		.commandPool = gpu->cmd_pool,
+		.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+		.commandBufferCount = 1,
+	};
+	result = vkAllocateCommandBuffers(gpu->logical_device, &upload_alloc_info, &gpu->upload_cmd_buffer);
+	if (result)
+	{
+		function = "vkAllocateCommandBuffers";
+		goto fail;
+	}
+
+	VkBufferCreateInfo staging_buffer_info =
+	{
+		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+		.size = k_staging_ring_size,
+		.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+	};
+	result = vkCreateBuffer(gpu->logical_device, &staging_buffer_info, NULL, &gpu->staging_buffer);
+	if (result)
+	{
+		function = "vkCreateBuffer";
+		goto fail;
+	}
+	result = bind_buffer_memory(gpu, gpu->staging_buffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &gpu->staging_memory);
+	if (result)
+	{
+		function = "bind_buffer_memory";
+		goto fail;
 	}
 
+	gpu->upload_capacity = k_upload_initial_capacity;
+	gpu->uploads = heap_alloc_tagged(gpu->heap, sizeof(gpu_upload_t) * gpu->upload_capacity, 8, k_heap_tag_render);
+
 	create_mesh_layouts(gpu);
 
+	if (gpu->trace)
+	{
+		calibrate_timestamps(gpu);
+	}
+
 	return gpu;
 
 fail:
@@ -633,6 +889,11 @@ void gpu_destroy(gpu_t* gpu)
 		vkQueueWaitIdle(gpu->queue);
 	}
 
+	if (gpu && gpu->pipeline_cache)
+	{
+		save_pipeline_cache(gpu);
+		vkDestroyPipelineCache(gpu->logical_device, gpu->pipeline_cache, NULL);
+	}
 	if (gpu)
 	{
 		destroy_mesh_layouts(gpu);
@@ -657,6 +918,22 @@ void gpu_destroy(gpu_t* gpu)
 	{
 		vkFreeMemory(gpu->logical_device, gpu->depth_stencil_memory, NULL);
 	}
+	if (gpu && gpu->staging_buffer)
+	{
+		vkDestroyBuffer(gpu->logical_device, gpu->staging_buffer, NULL);
+	}
+	if (gpu && gpu->uploads)
+	{
+		heap_free(gpu->heap, gpu->uploads);
+	}
+	if (gpu && gpu->upload_cmd_buffer)
+	{
+		vkFreeCommandBuffers(gpu->logical_device, gpu->cmd_pool, 1, &gpu->upload_cmd_buffer);
+	}
+	if (gpu)
+	{
+		destroy_memory_blocks(gpu);
+	}
 	if (gpu && gpu->frames)
 	{
 		for (uint32_t i = 0; i < gpu->frame_count; i++)
@@ -665,11 +942,21 @@ void gpu_destroy(gpu_t* gpu)
 			{
 				vkDestroyFence(gpu->logical_device, gpu->frames[i].fence, NULL);
 			}
+			if (gpu->frames[i].query_pool)
+			{
+				vkDestroyQueryPool(gpu->logical_device, gpu->frames[i].query_pool, NULL);
+			}
 			if (gpu->frames[i].cmd_buffer)
 			{
 				vkFreeCommandBuffers(gpu->logical_device, gpu->cmd_pool, 1, &gpu->frames[i].cmd_buffer->buffer);
 				heap_free(gpu->heap, gpu->frames[i].cmd_buffer);
 			}
+			for (int j = 0; j < k_gpu_max_parallel_cmd_buffers && gpu->frames[i].secondary_cmd_buffers[j]; ++j)
+			{
+				// Destroying the pool frees its command buffers.
+				vkDestroyCommandPool(gpu->logical_device, gpu->frames[i].secondary_pools[j], NULL);
+				heap_free(gpu->heap, gpu->frames[i].secondary_cmd_buffers[j]);
+			}
 			if (gpu->frames[i].frame_buffer)
 			{
 				vkDestroyFramebuffer(gpu->logical_device, gpu->frames[i].frame_buffer, NULL);
@@ -705,12 +992,23 @@ void gpu_destroy(gpu_t* gpu)
 	{
 		vkDestroyDevice(gpu->logical_device, NULL);
 	}
+	if (gpu && gpu->debug_messenger)
+	{
+		debug_print(k_print_info, "Vulkan validation: %d errors\n", gpu->validation_error_count);
+		PFN_vkDestroyDebugUtilsMessengerEXT destroy_messenger =
+			(PFN_vkDestroyDebugUtilsMessengerEXT)vkGetInstanceProcAddr(gpu->instance, "vkDestroyDebugUtilsMessengerEXT");
+		if (destroy_messenger)
+		{
+			destroy_messenger(gpu->instance, gpu->debug_messenger, NULL);
+		}
+	}
 	if (gpu && gpu->instance)
 	{
 		vkDestroyInstance(gpu->instance, NULL);
 	}
 	if (gpu)
 	{
+		mutex_destroy(gpu->stats_mutex);
 		heap_free(gpu->heap, gpu);
 	}
 }
@@ -725,10 +1023,45 @@ void gpu_wait_until_idle(gpu_t* gpu)
 	vkQueueWaitIdle(gpu->queue);
 }
 
+void gpu_get_stats(gpu_t* gpu, gpu_stats_t* stats)
+{
+	mutex_lock(gpu->stats_mutex);
+	*stats = gpu->stats;
+	mutex_unlock(gpu->stats_mutex);
+}
+
+void gpu_get_memory_stats(gpu_t* gpu, gpu_memory_stats_t* stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	for (uint32_t i = 0; i < gpu->memory_properties.memoryTypeCount; ++i)
+	{
+		for (gpu_memory_block_t* block = gpu->memory_blocks[i]; block; block = block->next)
+		{
+			gpu_allocator_stats_t block_stats = { .size = block->size, .used_bytes = block->size, .allocation_count = 1 };
+			if (block->allocator)
+			{
+				gpu_allocator_get_stats(block->allocator, &block_stats);
+			}
+			++stats->block_count;
+			stats->block_bytes += block_stats.size;
+			stats->used_bytes += block_stats.used_bytes;
+			stats->allocation_count += block_stats.allocation_count;
+			stats->free_range_count += block_stats.free_range_count;
+			stats->largest_free_bytes = __max(stats->largest_free_bytes, block_stats.largest_free_bytes);
+		}
+	}
+}
+
+size_t gpu_get_uniform_alignment(gpu_t* gpu)
+{
+	return (size_t)gpu->uniform_alignment;
+}
+
 gpu_descriptor_t* gpu_descriptor_create(gpu_t* gpu, const gpu_descriptor_info_t* info)
 {
-	gpu_descriptor_t* descriptor = heap_alloc(gpu->heap, sizeof(gpu_descriptor_t), 8);
+	gpu_descriptor_t* descriptor = heap_alloc_tagged(gpu->heap, sizeof(gpu_descriptor_t), 8, k_heap_tag_render);
 	memset(descriptor, 0, sizeof(*descriptor));
+	descriptor->uniform_buffer_count = info->uniform_buffer_count;
 
 	VkDescriptorSetAllocateInfo alloc_info =
 	{
@@ -746,20 +1079,32 @@ gpu_descriptor_t* gpu_descriptor_create(gpu_t* gpu, const gpu_descriptor_info_t*
 	}
 
 	VkWriteDescriptorSet* write_sets = alloca(sizeof(VkWriteDescriptorSet) * info->uniform_buffer_count);
+	VkDescriptorBufferInfo* buffer_infos = alloca(sizeof(VkDescriptorBufferInfo) * info->uniform_buffer_count);
 	for (int i = 0; i < info->uniform_buffer_count; ++i)
 	{
+		buffer_infos[i] = info->uniform_buffers[i]->descriptor;
+		if (info->uniform_ranges)
+		{
+			buffer_infos[i].range = info->uniform_ranges[i];
+		}
+		else if (info->uniform_range)
+		{
+			buffer_infos[i].range = info->uniform_range;
+		}
+
 		write_sets[i] = (VkWriteDescriptorSet)
 		{
 			.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
 			.dstSet = descriptor->set,
 			.descriptorCount = 1,
-			.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-			.pBufferInfo = &info->uniform_buffers[i]->descriptor,
+			.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+			.pBufferInfo = &buffer_infos[i],
 			.dstBinding = i,
 		};
 	}
 	vkUpdateDescriptorSets(gpu->logical_device, info->uniform_buffer_count, write_sets, 0, NULL);
 
+	count_object_created(gpu);
 	return descriptor;
 }
 
@@ -772,12 +1117,64 @@ void gpu_descriptor_destroy(gpu_t* gpu, gpu_descriptor_t* descriptor)
 	if (descriptor)
 	{
 		heap_free(gpu->heap, descriptor);
+		count_object_destroyed(gpu);
+	}
+}
+
+gpu_instance_buffer_t* gpu_instance_buffer_create(gpu_t* gpu, size_t size)
+{
+	gpu_instance_buffer_t* instance_buffer = heap_alloc_tagged(gpu->heap, sizeof(gpu_instance_buffer_t), 8, k_heap_tag_render);
+	memset(instance_buffer, 0, sizeof(*instance_buffer));
+	instance_buffer->size = size;
+
+	VkBufferCreateInfo buffer_info =
+	{
+		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+		.size = size,
+		.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+	};
+	VkResult result = vkCreateBuffer(gpu->logical_device, &buffer_info, NULL, &instance_buffer->buffer);
+	if (result)
+	{
+		debug_print(k_print_error, "vkCreateBuffer failed: %d\n", result);
+		gpu_instance_buffer_destroy(gpu, instance_buffer);
+		return NULL;
+	}
+
+	result = bind_buffer_memory(gpu, instance_buffer->buffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &instance_buffer->memory);
+	if (result)
+	{
+		gpu_instance_buffer_destroy(gpu, instance_buffer);
+		return NULL;
+	}
+
+	count_object_created(gpu);
+	return instance_buffer;
+}
+
+void gpu_instance_buffer_update(gpu_t* gpu, gpu_instance_buffer_t* buffer, const void* data, size_t size)
+{
+	memcpy(buffer->memory.data, data, size);
+	gpu->stats.instance_bytes_uploaded += size;
+}
+
+void gpu_instance_buffer_destroy(gpu_t* gpu, gpu_instance_buffer_t* buffer)
+{
+	if (buffer && buffer->buffer)
+	{
+		vkDestroyBuffer(gpu->logical_device, buffer->buffer, NULL);
+	}
+	if (buffer)
+	{
+		free_buffer_memory(gpu, &buffer->memory);
+		heap_free(gpu->heap, buffer);
+		count_object_destroyed(gpu);
 	}
 }
 
 gpu_mesh_t* gpu_mesh_create(gpu_t* gpu, const gpu_mesh_info_t* info)
 {
-	gpu_mesh_t* mesh = heap_alloc(gpu->heap, sizeof(gpu_mesh_t), 8);
+	gpu_mesh_t* mesh = heap_alloc_tagged(gpu->heap, sizeof(gpu_mesh_t), 8, k_heap_tag_render);
 	memset(mesh, 0, sizeof(*mesh));
 
 	mesh->index_type = gpu->mesh_index_type[info->layout];
@@ -790,7 +1187,7 @@ gpu_mesh_t* gpu_mesh_create(gpu_t* gpu, const gpu_mesh_info_t* info)
 		{
 			.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
 			.size = info->vertex_data_size,
-			.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+			.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
 		};
 		VkResult result = vkCreateBuffer(gpu->logical_device, &vertex_buffer_info, NULL, &mesh->vertex_buffer);
 		if (result)
@@ -800,41 +1197,13 @@ gpu_mesh_t* gpu_mesh_create(gpu_t* gpu, const gpu_mesh_info_t* info)
 			return NULL;
 		}
 
-		VkMemoryRequirements mem_reqs;
-		vkGetBufferMemoryRequirements(gpu->logical_device, mesh->vertex_buffer, &mem_reqs);
-
-		VkMemoryAllocateInfo mem_alloc =
-		{
-			.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-			.allocationSize = mem_reqs.size,
-			.memoryTypeIndex = get_memory_type_index(gpu, mem_reqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT),
-		};
-		result = vkAllocateMemory(gpu->logical_device, &mem_alloc, NULL, &mesh->vertex_memory);
-		if (result)
-		{
-			debug_print(k_print_error, "vkAllocateMemory failed: %d\n", result);
-			gpu_mesh_destroy(gpu, mesh);
-			return NULL;
-		}
-
-		void* vertex_dest = NULL;
-		result = vkMapMemory(gpu->logical_device, mesh->vertex_memory, 0, mem_alloc.allocationSize, 0, &vertex_dest);
-		if (result)
-		{
-			debug_print(k_print_error, "vkMapMemory failed: %d\n", result);
-			gpu_mesh_destroy(gpu, mesh);
-			return NULL;
-		}
-		memcpy(vertex_dest, info->vertex_data, info->vertex_data_size);
-		vkUnmapMemory(gpu->logical_device, mesh->vertex_memory);
-
-		result = vkBindBufferMemory(gpu->logical_device, mesh->vertex_buffer, mesh->vertex_memory, 0);
+		result = bind_buffer_memory(gpu, mesh->vertex_buffer, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &mesh->vertex_memory);
 		if (result)
 		{
-			debug_print(k_print_error, "vkBindBufferMemory failed: %d\n", result);
 			gpu_mesh_destroy(gpu, mesh);
 			return NULL;
 		}
+		queue_upload(gpu, mesh->vertex_buffer, info->vertex_data, info->vertex_data_size);
 	}
 
 	// Index data
@@ -843,7 +1212,7 @@ gpu_mesh_t* gpu_mesh_create(gpu_t* gpu, const gpu_mesh_info_t* info)
 		{
 			.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
 			.size = info->index_data_size,
-			.usage = VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+			.usage = VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
 		};
 		VkResult result = vkCreateBuffer(gpu->logical_device, &index_buffer_info, NULL, &mesh->index_buffer);
 		if (result)
@@ -853,43 +1222,17 @@ gpu_mesh_t* gpu_mesh_create(gpu_t* gpu, const gpu_mesh_info_t* info)
 			return NULL;
 		}
 
-		VkMemoryRequirements mem_reqs;
-		vkGetBufferMemoryRequirements(gpu->logical_device, mesh->index_buffer, &mem_reqs);
-
-		VkMemoryAllocateInfo mem_alloc =
-		{
-			.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-			.allocationSize = mem_reqs.size,
-			.memoryTypeIndex = get_memory_type_index(gpu, mem_reqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT),
-		};
-		result = vkAllocateMemory(gpu->logical_device, &mem_alloc, NULL, &mesh->index_memory);
-		if (result)
-		{
-			debug_print(k_print_error, "vkAllocateMemory failed: %d\n", result);
-			gpu_mesh_destroy(gpu, mesh);
-			return NULL;
-		}
-
-		void* index_dest = NULL;
-		result = vkMapMemory(gpu->logical_device, mesh->index_memory, 0, mem_alloc.allocationSize, 0, &index_dest);
-		if (result)
-		{
-			debug_print(k_print_error, "vkMapMemory failed: %d\n", result);
-			gpu_mesh_destroy(gpu, mesh);
-			return NULL;
-		}
-		memcpy(index_dest, info->index_data, info->index_data_size);
-		vkUnmapMemory(gpu->logical_device, mesh->index_memory);
-
-		result = vkBindBufferMemory(gpu->logical_device, mesh->index_buffer, mesh->index_memory, 0);
+		result = bind_buffer_memory(gpu, mesh->index_buffer, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &mesh->index_memory);
 		if (result)
 		{
-			debug_print(k_print_error, "vkBindBufferMemory failed: %d\n", result);
 			gpu_mesh_destroy(gpu, mesh);
 			return NULL;
 		}
+		queue_upload(gpu, mesh->index_buffer, info->index_data, info->index_data_size);
 	}
 
+	count_object_created(gpu);
+	gpu->stats.mesh_bytes_uploaded += info->vertex_data_size + info->index_data_size;
 	return mesh;
 }
 
@@ -897,29 +1240,26 @@ void gpu_mesh_destroy(gpu_t* gpu, gpu_mesh_t* mesh)
 {
 	if (mesh && mesh->index_buffer)
 	{
+		cancel_uploads(gpu, mesh->index_buffer);
 		vkDestroyBuffer(gpu->logical_device, mesh->index_buffer, NULL);
 	}
-	if (mesh && mesh->index_memory)
-	{
-		vkFreeMemory(gpu->logical_device, mesh->index_memory, NULL);
-	}
 	if (mesh && mesh->vertex_buffer)
 	{
+		cancel_uploads(gpu, mesh->vertex_buffer);
 		vkDestroyBuffer(gpu->logical_device, mesh->vertex_buffer, NULL);
 	}
-	if (mesh && mesh->vertex_memory)
-	{
-		vkFreeMemory(gpu->logical_device, mesh->vertex_memory, NULL);
-	}
 	if (mesh)
 	{
+		free_buffer_memory(gpu, &mesh->index_memory);
+		free_buffer_memory(gpu, &mesh->vertex_memory);
 		heap_free(gpu->heap, mesh);
+		count_object_destroyed(gpu);
 	}
 }
 
 gpu_pipeline_t* gpu_pipeline_create(gpu_t* gpu, const gpu_pipeline_info_t* info)
 {
-	gpu_pipeline_t* pipeline = heap_alloc(gpu->heap, sizeof(gpu_pipeline_t), 8);
+	gpu_pipeline_t* pipeline = heap_alloc_tagged(gpu->heap, sizeof(gpu_pipeline_t), 8, k_heap_tag_render);
 	memset(pipeline, 0, sizeof(*pipeline));
 
 	VkPipelineRasterizationStateCreateInfo rasterization_state_info =
@@ -1000,6 +1340,42 @@ gpu_pipeline_t* gpu_pipeline_create(gpu_t* gpu, const gpu_pipeline_info_t* info)
 		.pDynamicStates = dynamic_states,
 	};
 
+	// Instanced shaders add a per-instance binding of vec4 attributes after the mesh's vertex inputs.
+	VkPipelineVertexInputStateCreateInfo vertex_input_info = gpu->mesh_vertex_input_info[info->mesh_layout];
+	if (info->shader->instance_data_size)
+	{
+		uint32_t mesh_binding_count = vertex_input_info.vertexBindingDescriptionCount;
+		uint32_t mesh_attribute_count = vertex_input_info.vertexAttributeDescriptionCount;
+		uint32_t instance_attribute_count = (uint32_t)(info->shader->instance_data_size / 16);
+
+		VkVertexInputBindingDescription* bindings = alloca(sizeof(VkVertexInputBindingDescription) * (mesh_binding_count + 1));
+		memcpy(bindings, vertex_input_info.pVertexBindingDescriptions, sizeof(VkVertexInputBindingDescription) * mesh_binding_count);
+		bindings[mesh_binding_count] = (VkVertexInputBindingDescription)
+		{
+			.binding = k_instance_binding,
+			.stride = (uint32_t)info->shader->instance_data_size,
+			.inputRate = VK_VERTEX_INPUT_RATE_INSTANCE,
+		};
+
+		VkVertexInputAttributeDescription* attributes = alloca(sizeof(VkVertexInputAttributeDescription) * (mesh_attribute_count + instance_attribute_count));
+		memcpy(attributes, vertex_input_info.pVertexAttributeDescriptions, sizeof(VkVertexInputAttributeDescription) * mesh_attribute_count);
+		for (uint32_t i = 0; i < instance_attribute_count; ++i)
+		{
+			attributes[mesh_attribute_count + i] = (VkVertexInputAttributeDescription)
+			{
+				.binding = k_instance_binding,
+				.location = k_gpu_instance_attribute_location + i,
+				.format = VK_FORMAT_R32G32B32A32_SFLOAT,
+				.offset = i * 16,
+			};
+		}
+
+		vertex_input_info.vertexBindingDescriptionCount = mesh_binding_count + 1;
+		vertex_input_info.pVertexBindingDescriptions = bindings;
+		vertex_input_info.vertexAttributeDescriptionCount = mesh_attribute_count + instance_attribute_count;
+		vertex_input_info.pVertexAttributeDescriptions = attributes;
+	}
+
 	VkPipelineLayoutCreateInfo pipeline_layout_info =
 	{
 		.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
@@ -1021,7 +1397,7 @@ gpu_pipeline_t* gpu_pipeline_create(gpu_t* gpu, const gpu_pipeline_info_t* info)
 		.renderPass = gpu->render_pass,
 		.stageCount = _countof(shader_info),
 		.pStages = shader_info,
-		.pVertexInputState = &gpu->mesh_vertex_input_info[info->mesh_layout],
+		.pVertexInputState = &vertex_input_info,
 		.pInputAssemblyState = &gpu->mesh_input_assembly_info[info->mesh_layout],
 		.pRasterizationState = &rasterization_state_info,
 		.pColorBlendState = &color_blend_info,
@@ -1030,7 +1406,9 @@ gpu_pipeline_t* gpu_pipeline_create(gpu_t* gpu, const gpu_pipeline_info_t* info)
 		.pDepthStencilState = &depth_stencil_info,
 		.pDynamicState = &dynamic_info,
 	};
-	result = vkCreateGraphicsPipelines(gpu->logical_device, NULL, 1, &pipeline_info, NULL, &pipeline->pipe);
+	uint64_t start_ticks = timer_get_ticks();
+	result = vkCreateGraphicsPipelines(gpu->logical_device, gpu->pipeline_cache, 1, &pipeline_info, NULL, &pipeline->pipe);
+	uint64_t ticks = timer_get_ticks() - start_ticks;
 	if (result)
 	{
 		debug_print(k_print_error, "vkCreateGraphicsPipelines failed: %d\n", result);
@@ -1038,6 +1416,13 @@ gpu_pipeline_t* gpu_pipeline_create(gpu_t* gpu, const gpu_pipeline_info_t* info)
 		return NULL;
 	}
 
+	mutex_lock(gpu->stats_mutex);
+	++gpu->stats.pipeline_create_count;
+	gpu->stats.pipeline_create_ticks += ticks;
+	gpu->stats.pipeline_create_max_ticks = __max(gpu->stats.pipeline_create_max_ticks, ticks);
+	mutex_unlock(gpu->stats_mutex);
+
+	count_object_created(gpu);
 	return pipeline;
 }
 
@@ -1054,12 +1439,13 @@ void gpu_pipeline_destroy(gpu_t* gpu, gpu_pipeline_t* pipeline)
 	if (pipeline)
 	{
 		heap_free(gpu->heap, pipeline);
+		count_object_destroyed(gpu);
 	}
 }
 
 gpu_shader_t* gpu_shader_create(gpu_t* gpu, const gpu_shader_info_t* info)
 {
-	gpu_shader_t* shader = heap_alloc(gpu->heap, sizeof(gpu_shader_t), 8);
+	gpu_shader_t* shader = heap_alloc_tagged(gpu->heap, sizeof(gpu_shader_t), 8, k_heap_tag_render);
 	memset(shader, 0, sizeof(*shader));
 
 	VkShaderModuleCreateInfo vertex_module_info =
@@ -1068,6 +1454,8 @@ gpu_shader_t* gpu_shader_create(gpu_t* gpu, const gpu_shader_info_t* info)
 		.codeSize = info->vertex_shader_size,
 		.pCode = info->vertex_shader_data,
 	};
+	shader->instance_data_size = info->instance_data_size;
+
 	VkResult result = vkCreateShaderModule(gpu->logical_device, &vertex_module_info, NULL, &shader->vertex_module);
 	if (result)
 	{
@@ -1096,7 +1484,7 @@ gpu_shader_t* gpu_shader_create(gpu_t* gpu, const gpu_shader_info_t* info)
 		descriptor_set_layout_bindings[i] = (VkDescriptorSetLayoutBinding)
 		{
 			.binding = i,
-			.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+			.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
 			.descriptorCount = 1,
 			.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
 		};
@@ -1116,6 +1504,7 @@ gpu_shader_t* gpu_shader_create(gpu_t* gpu, const gpu_shader_info_t* info)
 		return NULL;
 	}
 
+	count_object_created(gpu);
 	return shader;
 }
 
@@ -1136,12 +1525,13 @@ void gpu_shader_destroy(gpu_t* gpu, gpu_shader_t* shader)
 	if (shader)
 	{
 		heap_free(gpu->heap, shader);
+		count_object_destroyed(gpu);
 	}
 }
 
 gpu_uniform_buffer_t* gpu_uniform_buffer_create(gpu_t* gpu, const gpu_uniform_buffer_info_t* info)
 {
-	gpu_uniform_buffer_t* uniform_buffer = heap_alloc(gpu->heap, sizeof(gpu_uniform_buffer_t), 8);
+	gpu_uniform_buffer_t* uniform_buffer = heap_alloc_tagged(gpu->heap, sizeof(gpu_uniform_buffer_t), 8, k_heap_tag_render);
 	memset(uniform_buffer, 0, sizeof(*uniform_buffer));
 
 	VkBufferCreateInfo buffer_info =
@@ -1158,27 +1548,9 @@ gpu_uniform_buffer_t* gpu_uniform_buffer_create(gpu_t* gpu, const gpu_uniform_bu
 		return NULL;
 	}
 
-	VkMemoryRequirements mem_reqs;
-	vkGetBufferMemoryRequirements(gpu->logical_device, uniform_buffer->buffer, &mem_reqs);
-
-	VkMemoryAllocateInfo mem_alloc =
-	{
-		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-		.allocationSize = mem_reqs.size,
-		.memoryTypeIndex = get_memory_type_index(gpu, mem_reqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT),
-	};
-	result = vkAllocateMemory(gpu->logical_device, &mem_alloc, NULL, &uniform_buffer->memory);
-	if (result)
-	{
-		debug_print(k_print_error, "vkAllocateMemory failed: %d\n", result);
-		gpu_uniform_buffer_destroy(gpu, uniform_buffer);
-		return NULL;
-	}
-
-	result = vkBindBufferMemory(gpu->logical_device, uniform_buffer->buffer, uniform_buffer->memory, 0);
+	result = bind_buffer_memory(gpu, uniform_buffer->buffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &uniform_buffer->memory);
 	if (result)
 	{
-		debug_print(k_print_error, "vkBindBufferMemory failed: %d\n", result);
 		gpu_uniform_buffer_destroy(gpu, uniform_buffer);
 		return NULL;
 	}
@@ -1186,20 +1558,25 @@ gpu_uniform_buffer_t* gpu_uniform_buffer_create(gpu_t* gpu, const gpu_uniform_bu
 	uniform_buffer->descriptor.buffer = uniform_buffer->buffer;
 	uniform_buffer->descriptor.range = info->size;
 
-	gpu_uniform_buffer_update(gpu, uniform_buffer, info->data, info->size);
+	if (info->data)
+	{
+		gpu_uniform_buffer_update(gpu, uniform_buffer, info->data, info->size);
+	}
 
+	count_object_created(gpu);
 	return uniform_buffer;
 }
 
 void gpu_uniform_buffer_update(gpu_t* gpu, gpu_uniform_buffer_t* buffer, const void* data, size_t size)
 {
-	void* dest = NULL;
-	VkResult result = vkMapMemory(gpu->logical_device, buffer->memory, 0, size, 0, &dest);
-	if (!result)
-	{
-		memcpy(dest, data, size);
-		vkUnmapMemory(gpu->logical_device, buffer->memory);
-	}
+	memcpy(buffer->memory.data, data, size);
+	++gpu->stats.uniform_update_count;
+	gpu->stats.uniform_bytes_uploaded += size;
+}
+
+void* gpu_uniform_buffer_get_data(gpu_t* gpu, gpu_uniform_buffer_t* buffer)
+{
+	return buffer->memory.data;
 }
 
 void gpu_uniform_buffer_destroy(gpu_t* gpu, gpu_uniform_buffer_t* buffer)
@@ -1208,73 +1585,95 @@ void gpu_uniform_buffer_destroy(gpu_t* gpu, gpu_uniform_buffer_t* buffer)
 	{
 		vkDestroyBuffer(gpu->logical_device, buffer->buffer, NULL);
 	}
-	if (buffer && buffer->memory)
-	{
-		vkFreeMemory(gpu->logical_device, buffer->memory, NULL);
-	}
 	if (buffer)
 	{
+		free_buffer_memory(gpu, &buffer->memory);
 		heap_free(gpu->heap, buffer);
+		count_object_destroyed(gpu);
 	}
 }
 
 gpu_cmd_buffer_t* gpu_frame_begin(gpu_t* gpu)
 {
 	gpu_frame_t* frame = &gpu->frames[gpu->frame_index];
-
-	VkCommandBufferBeginInfo begin_info =
-	{
-		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-	};
-	VkResult result = vkBeginCommandBuffer(frame->cmd_buffer->buffer, &begin_info);
-	if (result)
+	if (!begin_frame(gpu, frame, VK_SUBPASS_CONTENTS_INLINE))
 	{
-		debug_print(k_print_error, "vkBeginCommandBuffer failed: %d\n", result);
 		return NULL;
 	}
+	set_viewport_and_scissor(gpu, frame->cmd_buffer);
+	return frame->cmd_buffer;
+}
 
-	VkClearValue clear_values[2] =
+bool gpu_frame_begin_parallel(gpu_t* gpu, int count, gpu_cmd_buffer_t** cmd_buffers)
+{
+	gpu_frame_t* frame = &gpu->frames[gpu->frame_index];
+	if (!begin_frame(gpu, frame, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS))
 	{
-		{.color = {.float32 = { 0.0f, 0.0f, 0.2f, 1.0f } } },
-		{.depthStencil = {.depth = 1.0f, .stencil = 0 } },
-	};
-	VkRenderPassBeginInfo render_pass_begin_info =
+		return false;
+	}
+
+	VkCommandBufferInheritanceInfo inheritance_info =
 	{
-		.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
 		.renderPass = gpu->render_pass,
-		.renderArea.extent.width = gpu->frame_width,
-		.renderArea.extent.height = gpu->frame_height,
-		.clearValueCount = _countof(clear_values),
-		.pClearValues = clear_values,
+		.subpass = 0,
 		.framebuffer = frame->frame_buffer,
 	};
-	vkCmdBeginRenderPass(frame->cmd_buffer->buffer, &render_pass_begin_info, VK_SUBPASS_CONTENTS_INLINE);
-
-	VkViewport viewport =
+	VkCommandBufferBeginInfo begin_info =
 	{
-		.height = (float)gpu->frame_height,
-		.width = (float)gpu->frame_width,
-		.minDepth = 0.0f,
-		.maxDepth = 1.0f,
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+		.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT | VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+		.pInheritanceInfo = &inheritance_info,
 	};
-	vkCmdSetViewport(frame->cmd_buffer->buffer, 0, 1, &viewport);
-
-	VkRect2D scissor =
+	for (int i = 0; i < count; ++i)
 	{
-		.extent.width = gpu->frame_width,
-		.extent.height = gpu->frame_height,
-	};
-	vkCmdSetScissor(frame->cmd_buffer->buffer, 0, 1, &scissor);
-
-	return frame->cmd_buffer;
-}
-
-void gpu_frame_end(gpu_t* gpu)
+		gpu_cmd_buffer_t* cmd_buffer = get_secondary_cmd_buffer(gpu, frame, i);
+		VkResult result = vkResetCommandPool(gpu->logical_device, frame->secondary_pools[i], 0);
+		if (result)
+		{
+			debug_print(k_print_error, "vkResetCommandPool failed: %d\n", result);
+		}
+		result = vkBeginCommandBuffer(cmd_buffer->buffer, &begin_info);
+		if (result)
+		{
+			debug_print(k_print_error, "vkBeginCommandBuffer failed: %d\n", result);
+		}
+		// Dynamic state isn't inherited from the primary.
+		set_viewport_and_scissor(gpu, cmd_buffer);
+		cmd_buffer->trace_depth = 0;
+		cmd_buffers[i] = cmd_buffer;
+	}
+	frame->secondary_count = count;
+	return true;
+}
+
+void gpu_frame_end(gpu_t* gpu)
 {
 	gpu_frame_t* frame = &gpu->frames[gpu->frame_index];
 	gpu->frame_index = (gpu->frame_index + 1) % gpu->frame_count;
+	++gpu->stats.frame_count;
+
+	if (frame->secondary_count)
+	{
+		VkCommandBuffer* buffers = alloca(sizeof(VkCommandBuffer) * frame->secondary_count);
+		for (int i = 0; i < frame->secondary_count; ++i)
+		{
+			gpu_cmd_buffer_t* cmd_buffer = frame->secondary_cmd_buffers[i];
+			VkResult result = vkEndCommandBuffer(cmd_buffer->buffer);
+			if (result)
+			{
+				debug_print(k_print_error, "vkEndCommandBuffer failed: %d\n", result);
+			}
+			add_cmd_buffer_stats(gpu, cmd_buffer);
+			buffers[i] = cmd_buffer->buffer;
+		}
+		vkCmdExecuteCommands(frame->cmd_buffer->buffer, frame->secondary_count, buffers);
+		frame->secondary_count = 0;
+	}
+	add_cmd_buffer_stats(gpu, frame->cmd_buffer);
 
 	vkCmdEndRenderPass(frame->cmd_buffer->buffer);
+	end_trace_region(gpu, frame, frame->cmd_buffer, frame->render_pass_region);
 	VkResult result = vkEndCommandBuffer(frame->cmd_buffer->buffer);
 	if (result)
 	{
@@ -1288,11 +1687,6 @@ void gpu_frame_end(gpu_t* gpu)
 		debug_print(k_print_error, "vkAcquireNextImageKHR failed: %d\n", result);
 	}
 
-	result = vkWaitForFences(gpu->logical_device, 1, &frame->fence, VK_TRUE, UINT64_MAX);
-	if (result)
-	{
-		debug_print(k_print_error, "vkWaitForFences failed: %d\n", result);
-	}
 	result = vkResetFences(gpu->logical_device, 1, &frame->fence);
 	if (result)
 	{
@@ -1337,11 +1731,21 @@ void gpu_cmd_pipeline_bind(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer, gpu_pipelin
 {
 	vkCmdBindPipeline(cmd_buffer->buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->pipe);
 	cmd_buffer->pipeline_layout = pipeline->pipeline_layout;
+	++cmd_buffer->stats.pipeline_bind_count;
 }
 
 void gpu_cmd_descriptor_bind(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer, gpu_descriptor_t* descriptor)
 {
-	vkCmdBindDescriptorSets(cmd_buffer->buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, cmd_buffer->pipeline_layout, 0, 1, &descriptor->set, 0, NULL);
+	uint32_t* offsets = alloca(sizeof(uint32_t) * descriptor->uniform_buffer_count);
+	memset(offsets, 0, sizeof(uint32_t) * descriptor->uniform_buffer_count);
+	gpu_cmd_descriptor_bind_offsets(gpu, cmd_buffer, descriptor, offsets);
+}
+
+void gpu_cmd_descriptor_bind_offsets(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer, gpu_descriptor_t* descriptor, const uint32_t* offsets)
+{
+	vkCmdBindDescriptorSets(cmd_buffer->buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, cmd_buffer->pipeline_layout, 0, 1, &descriptor->set,
+		descriptor->uniform_buffer_count, offsets);
+	++cmd_buffer->stats.descriptor_bind_count;
 }
 
 void gpu_cmd_mesh_bind(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer, gpu_mesh_t* mesh)
@@ -1365,6 +1769,7 @@ void gpu_cmd_mesh_bind(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer, gpu_mesh_t* mes
 	{
 		cmd_buffer->index_count = 0;
 	}
+	++cmd_buffer->stats.mesh_bind_count;
 }
 
 void gpu_cmd_draw(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer)
@@ -1377,6 +1782,43 @@ void gpu_cmd_draw(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer)
 	{
 		vkCmdDraw(cmd_buffer->buffer, cmd_buffer->vertex_count, 1, 0, 0);
 	}
+	++cmd_buffer->stats.draw_count;
+	++cmd_buffer->stats.instance_count;
+}
+
+void gpu_cmd_draw_instanced(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer, gpu_instance_buffer_t* instances, size_t offset, int instance_count)
+{
+	VkDeviceSize instance_offset = offset;
+	vkCmdBindVertexBuffers(cmd_buffer->buffer, k_instance_binding, 1, &instances->buffer, &instance_offset);
+	if (cmd_buffer->index_count)
+	{
+		vkCmdDrawIndexed(cmd_buffer->buffer, cmd_buffer->index_count, instance_count, 0, 0, 0);
+	}
+	else if (cmd_buffer->vertex_count)
+	{
+		vkCmdDraw(cmd_buffer->buffer, cmd_buffer->vertex_count, instance_count, 0, 0);
+	}
+	++cmd_buffer->stats.draw_count;
+	cmd_buffer->stats.instance_count += instance_count;
+}
+
+void gpu_cmd_trace_push(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer, const char* name)
+{
+	int region = begin_trace_region(gpu, &gpu->frames[gpu->frame_index], cmd_buffer, name);
+	if (cmd_buffer->trace_depth < k_trace_region_depth)
+	{
+		cmd_buffer->trace_regions[cmd_buffer->trace_depth] = region;
+	}
+	++cmd_buffer->trace_depth;
+}
+
+void gpu_cmd_trace_pop(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer)
+{
+	--cmd_buffer->trace_depth;
+	if (cmd_buffer->trace_depth < k_trace_region_depth)
+	{
+		end_trace_region(gpu, &gpu->frames[gpu->frame_index], cmd_buffer, cmd_buffer->trace_regions[cmd_buffer->trace_depth]);
+	}
 }
 
 static void create_mesh_layouts(gpu_t* gpu)
@@ -1389,7 +1831,7 @@ static void create_mesh_layouts(gpu_t* gpu)
 			.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
 		};
 
-		VkVertexInputBindingDescription* vertex_binding = heap_alloc(gpu->heap, sizeof(VkVertexInputBindingDescription), 8);
+		VkVertexInputBindingDescription* vertex_binding = heap_alloc_tagged(gpu->heap, sizeof(VkVertexInputBindingDescription), 8, k_heap_tag_render);
 		*vertex_binding = (VkVertexInputBindingDescription)
 		{
 			.binding = 0,
@@ -1397,7 +1839,7 @@ static void create_mesh_layouts(gpu_t* gpu)
 			.inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
 		};
 
-		VkVertexInputAttributeDescription* vertex_attributes = heap_alloc(gpu->heap, sizeof(VkVertexInputAttributeDescription) * 1, 8);
+		VkVertexInputAttributeDescription* vertex_attributes = heap_alloc_tagged(gpu->heap, sizeof(VkVertexInputAttributeDescription) * 1, 8, k_heap_tag_render);
 		vertex_attributes[0] = (VkVertexInputAttributeDescription)
 		{
 			.binding = 0,
@@ -1428,7 +1870,7 @@ static void create_mesh_layouts(gpu_t* gpu)
 			.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
 		};
 
-		VkVertexInputBindingDescription* vertex_binding = heap_alloc(gpu->heap, sizeof(VkVertexInputBindingDescription), 8);
+		VkVertexInputBindingDescription* vertex_binding = heap_alloc_tagged(gpu->heap, sizeof(VkVertexInputBindingDescription), 8, k_heap_tag_render);
 		*vertex_binding = (VkVertexInputBindingDescription)
 		{
 			.binding = 0,
@@ -1436,7 +1878,7 @@ static void create_mesh_layouts(gpu_t* gpu)
 			.inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
 		};
 
-		VkVertexInputAttributeDescription* vertex_attributes = heap_alloc(gpu->heap, sizeof(VkVertexInputAttributeDescription) * 2, 8);
+		VkVertexInputAttributeDescription* vertex_attributes = heap_alloc_tagged(gpu->heap, sizeof(VkVertexInputAttributeDescription) * 2, 8, k_heap_tag_render);
 		vertex_attributes[0] = (VkVertexInputAttributeDescription)
 		{
 			.binding = 0,
@@ -1479,6 +1921,105 @@ static void destroy_mesh_layouts(gpu_t* gpu)
 	}
 }
 
+static void count_object_created(gpu_t* gpu)
+{
+	mutex_lock(gpu->stats_mutex);
+	++gpu->stats.object_create_count;
+	mutex_unlock(gpu->stats_mutex);
+}
+
+static void count_object_destroyed(gpu_t* gpu)
+{
+	mutex_lock(gpu->stats_mutex);
+	++gpu->stats.object_destroy_count;
+	mutex_unlock(gpu->stats_mutex);
+}
+
+// Seed the pipeline cache with data saved by an earlier run on the same device and driver.
+// The driver would reject mismatched data too, but checking the header first lets us say why.
+static VkResult create_pipeline_cache(gpu_t* gpu, const VkPhysicalDeviceProperties* properties)
+{
+	fs_work_t* work = gpu->fs ? fs_read(gpu->fs, k_pipeline_cache_path, gpu->heap, false, false) : NULL;
+	void* data = NULL;
+	size_t size = 0;
+	if (work && fs_work_get_result(work) == 0)
+	{
+		data = fs_work_get_buffer(work);
+		size = fs_work_get_size(work);
+
+		pipeline_cache_header_t header;
+		if (size < sizeof(header))
+		{
+			size = 0;
+		}
+		else
+		{
+			memcpy(&header, data, sizeof(header));
+			if (header.header_version != VK_PIPELINE_CACHE_HEADER_VERSION_ONE ||
+				header.vendor_id != properties->vendorID ||
+				header.device_id != properties->deviceID ||
+				memcmp(header.uuid, properties->pipelineCacheUUID, VK_UUID_SIZE) != 0)
+			{
+				debug_print(k_print_info, "Ignoring %s: saved for a different device or driver\n", k_pipeline_cache_path);
+				size = 0;
+			}
+		}
+	}
+
+	VkPipelineCacheCreateInfo cache_info =
+	{
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+		.initialDataSize = size,
+		.pInitialData = size ? data : NULL,
+	};
+	VkResult result = vkCreatePipelineCache(gpu->logical_device, &cache_info, NULL, &gpu->pipeline_cache);
+	gpu->pipeline_cache_warm = size > 0;
+
+	if (data)
+	{
+		heap_free(gpu->heap, data);
+	}
+	fs_work_destroy(work);
+	return result;
+}
+
+static void save_pipeline_cache(gpu_t* gpu)
+{
+	// Pipelines compile on job workers, so the total is CPU time; the slowest one is the longest a draw waited.
+	double create_ms = (double)gpu->stats.pipeline_create_ticks * 1000.0 / (double)timer_get_ticks_per_second();
+	double max_ms = (double)gpu->stats.pipeline_create_max_ticks * 1000.0 / (double)timer_get_ticks_per_second();
+	debug_print(k_print_info, "Created %llu pipelines in %.2f ms, slowest %.2f ms, with a %s pipeline cache\n",
+		(unsigned long long)gpu->stats.pipeline_create_count, create_ms, max_ms, gpu->pipeline_cache_warm ? "warm" : "cold");
+
+	if (!gpu->fs)
+	{
+		return;
+	}
+
+	size_t size = 0;
+	VkResult result = vkGetPipelineCacheData(gpu->logical_device, gpu->pipeline_cache, &size, NULL);
+	if (result || !size)
+	{
+		return;
+	}
+	void* data = heap_alloc_tagged(gpu->heap, size, 8, k_heap_tag_render);
+	result = vkGetPipelineCacheData(gpu->logical_device, gpu->pipeline_cache, &size, data);
+	if (!result)
+	{
+		fs_work_t* work = fs_write(gpu->fs, k_pipeline_cache_path, data, size, false);
+		if (fs_work_get_result(work))
+		{
+			debug_print(k_print_warning, "Unable to save %s\n", k_pipeline_cache_path);
+		}
+		fs_work_destroy(work);
+	}
+	else
+	{
+		debug_print(k_print_error, "vkGetPipelineCacheData failed: %d\n", result);
+	}
+	heap_free(gpu->heap, data);
+}
+
 static uint32_t get_memory_type_index(gpu_t* gpu, uint32_t bits, VkMemoryPropertyFlags properties)
 {
 	for (uint32_t i = 0; i < gpu->memory_properties.memoryTypeCount; ++i)
@@ -1494,3 +2035,536 @@ static uint32_t get_memory_type_index(gpu_t* gpu, uint32_t bits, VkMemoryPropert
 	debug_print(k_print_error, "Unable to find memory of type: %x\n", bits);
 	return 0;
 }
+
+static gpu_memory_block_t* create_memory_block(gpu_t* gpu, uint32_t type_index, VkDeviceSize size, bool dedicated)
+{
+	VkMemoryAllocateInfo mem_alloc =
+	{
+		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+		.allocationSize = size,
+		.memoryTypeIndex = type_index,
+	};
+	VkDeviceMemory memory;
+	VkResult result = vkAllocateMemory(gpu->logical_device, &mem_alloc, NULL, &memory);
+	if (result)
+	{
+		debug_print(k_print_error, "vkAllocateMemory failed: %d\n", result);
+		return NULL;
+	}
+
+	void* data = NULL;
+	if (gpu->memory_properties.memoryTypes[type_index].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+	{
+		result = vkMapMemory(gpu->logical_device, memory, 0, VK_WHOLE_SIZE, 0, &data);
+		if (result)
+		{
+			debug_print(k_print_error, "vkMapMemory failed: %d\n", result);
+			vkFreeMemory(gpu->logical_device, memory, NULL);
+			return NULL;
+		}
+	}
+
+	gpu_memory_block_t* block = heap_alloc_tagged(gpu->heap, sizeof(gpu_memory_block_t), 8, k_heap_tag_render);
+	block->memory = memory;
+	block->size = size;
+	block->allocator = dedicated ? NULL : gpu_allocator_create(gpu->heap, size);
+	block->data = data;
+	block->next = gpu->memory_blocks[type_index];
+	gpu->memory_blocks[type_index] = block;
+	return block;
+}
+
+static void destroy_memory_block(gpu_t* gpu, gpu_memory_block_t* block)
+{
+	if (block->data)
+	{
+		vkUnmapMemory(gpu->logical_device, block->memory);
+	}
+	vkFreeMemory(gpu->logical_device, block->memory, NULL);
+	if (block->allocator)
+	{
+		gpu_allocator_destroy(block->allocator);
+	}
+	heap_free(gpu->heap, block);
+}
+
+static void destroy_memory_blocks(gpu_t* gpu)
+{
+	for (int i = 0; i < _countof(gpu->memory_blocks); ++i)
+	{
+		gpu_memory_block_t* block = gpu->memory_blocks[i];
+		while (block)
+		{
+			gpu_memory_block_t* next = block->next;
+			destroy_memory_block(gpu, block);
+			block = next;
+		}
+		gpu->memory_blocks[i] = NULL;
+	}
+}
+
+static void* reserve_staging(gpu_t* gpu, VkDeviceSize size, VkDeviceSize* offset)
+{
+	size = (size + k_staging_alignment - 1) & ~(VkDeviceSize)(k_staging_alignment - 1);
+
+	// Allocations don't wrap; skip the end of the ring if this one won't fit there.
+	VkDeviceSize position = gpu->staging_head % k_staging_ring_size;
+	VkDeviceSize padding = (position + size > k_staging_ring_size) ? k_staging_ring_size - position : 0;
+	if (gpu->staging_head + padding + size - gpu->staging_tail > k_staging_ring_size)
+	{
+		flush_uploads(gpu);
+		padding = 0;
+	}
+
+	gpu->staging_head += padding;
+	*offset = gpu->staging_head % k_staging_ring_size;
+	gpu->staging_head += size;
+	return (char*)gpu->staging_memory.data + *offset;
+}
+
+static void queue_upload(gpu_t* gpu, VkBuffer buffer, const void* data, VkDeviceSize size)
+{
+	for (VkDeviceSize copied = 0; copied < size;)
+	{
+		VkDeviceSize chunk_size = __min(size - copied, k_staging_ring_size / 2);
+		VkDeviceSize offset;
+		void* dest = reserve_staging(gpu, chunk_size, &offset);
+		memcpy(dest, (const char*)data + copied, chunk_size);
+
+		if (gpu->upload_count == gpu->upload_capacity)
+		{
+			int capacity = gpu->upload_capacity * 2;
+			gpu_upload_t* uploads = heap_alloc_tagged(gpu->heap, sizeof(gpu_upload_t) * capacity, 8, k_heap_tag_render);
+			memcpy(uploads, gpu->uploads, sizeof(gpu_upload_t) * gpu->upload_count);
+			heap_free(gpu->heap, gpu->uploads);
+			gpu->uploads = uploads;
+			gpu->upload_capacity = capacity;
+		}
+		gpu->uploads[gpu->upload_count++] = (gpu_upload_t)
+		{
+			.buffer = buffer,
+			.region = { .srcOffset = offset, .dstOffset = copied, .size = chunk_size },
+		};
+		copied += chunk_size;
+	}
+}
+
+// Drop copies into a buffer destroyed before they were recorded.
+static void cancel_uploads(gpu_t* gpu, VkBuffer buffer)
+{
+	int count = 0;
+	for (int i = 0; i < gpu->upload_count; ++i)
+	{
+		if (gpu->uploads[i].buffer != buffer)
+		{
+			gpu->uploads[count++] = gpu->uploads[i];
+		}
+	}
+	gpu->upload_count = count;
+}
+
+static void record_uploads(gpu_t* gpu, VkCommandBuffer cmd_buffer)
+{
+	if (!gpu->upload_count)
+	{
+		return;
+	}
+
+	for (int i = 0; i < gpu->upload_count; ++i)
+	{
+		vkCmdCopyBuffer(cmd_buffer, gpu->staging_buffer, gpu->uploads[i].buffer, 1, &gpu->uploads[i].region);
+	}
+
+	// One barrier covers every copy in the batch.
+	VkMemoryBarrier barrier =
+	{
+		.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT,
+	};
+	vkCmdPipelineBarrier(cmd_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 1, &barrier, 0, NULL, 0, NULL);
+
+	gpu->stats.upload_copy_count += gpu->upload_count;
+	++gpu->stats.upload_batch_count;
+	gpu->upload_count = 0;
+	gpu->staging_submitted = gpu->staging_head;
+}
+
+// Submit pending copies on their own and wait for all GPU work, leaving the staging ring empty.
+// Only needed when the ring fills between frames.
+static void flush_uploads(gpu_t* gpu)
+{
+	vkQueueWaitIdle(gpu->queue);
+
+	if (gpu->upload_count)
+	{
+		VkCommandBufferBeginInfo begin_info =
+		{
+			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+			.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+		};
+		VkResult result = vkBeginCommandBuffer(gpu->upload_cmd_buffer, &begin_info);
+		if (result)
+		{
+			debug_print(k_print_error, "vkBeginCommandBuffer failed: %d\n", result);
+		}
+		record_uploads(gpu, gpu->upload_cmd_buffer);
+		result = vkEndCommandBuffer(gpu->upload_cmd_buffer);
+		if (result)
+		{
+			debug_print(k_print_error, "vkEndCommandBuffer failed: %d\n", result);
+		}
+
+		VkSubmitInfo submit_info =
+		{
+			.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+			.pCommandBuffers = &gpu->upload_cmd_buffer,
+			.commandBufferCount = 1,
+		};
+		result = vkQueueSubmit(gpu->queue, 1, &submit_info, VK_NULL_HANDLE);
+		if (result)
+		{
+			debug_print(k_print_error, "vkQueueSubmit failed: %d\n", result);
+		}
+		vkQueueWaitIdle(gpu->queue);
+	}
+
+	gpu->staging_head = 0;
+	gpu->staging_submitted = 0;
+	gpu->staging_tail = 0;
+	for (uint32_t i = 0; i < gpu->frame_count; ++i)
+	{
+		gpu->frames[i].staging_end = 0;
+	}
+}
+
+static VkResult bind_buffer_memory(gpu_t* gpu, VkBuffer buffer, VkMemoryPropertyFlags properties, gpu_memory_t* memory)
+{
+	VkMemoryRequirements mem_reqs;
+	vkGetBufferMemoryRequirements(gpu->logical_device, buffer, &mem_reqs);
+	uint32_t type_index = get_memory_type_index(gpu, mem_reqs.memoryTypeBits, properties);
+
+	// First fit across the shared blocks of this memory type, then a new block.
+	gpu_memory_block_t* block = NULL;
+	bool dedicated = mem_reqs.size > k_memory_block_size / 2;
+	if (!dedicated)
+	{
+		for (block = gpu->memory_blocks[type_index]; block; block = block->next)
+		{
+			if (block->allocator && gpu_allocator_alloc(block->allocator, mem_reqs.size, mem_reqs.alignment, &memory->allocation))
+			{
+				break;
+			}
+		}
+	}
+	if (!block)
+	{
+		block = create_memory_block(gpu, type_index, dedicated ? mem_reqs.size : k_memory_block_size, dedicated);
+		if (!block)
+		{
+			return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+		}
+		if (dedicated)
+		{
+			memory->allocation = (gpu_allocation_t) { .offset = 0, .size = mem_reqs.size };
+		}
+		else
+		{
+			gpu_allocator_alloc(block->allocator, mem_reqs.size, mem_reqs.alignment, &memory->allocation);
+		}
+	}
+	memory->block = block;
+	memory->data = block->data ? (char*)block->data + memory->allocation.offset : NULL;
+
+	VkResult result = vkBindBufferMemory(gpu->logical_device, buffer, block->memory, memory->allocation.offset);
+	if (result)
+	{
+		debug_print(k_print_error, "vkBindBufferMemory failed: %d\n", result);
+		free_buffer_memory(gpu, memory);
+	}
+	return result;
+}
+
+static void free_buffer_memory(gpu_t* gpu, gpu_memory_t* memory)
+{
+	gpu_memory_block_t* block = memory->block;
+	if (!block)
+	{
+		return;
+	}
+	memory->block = NULL;
+	memory->data = NULL;
+
+	// Shared blocks are kept for reuse until gpu_destroy(); dedicated ones go with their buffer.
+	if (block->allocator)
+	{
+		gpu_allocator_free(block->allocator, &memory->allocation);
+	}
+	else
+	{
+		for (int i = 0; i < _countof(gpu->memory_blocks); ++i)
+		{
+			for (gpu_memory_block_t** link = &gpu->memory_blocks[i]; *link; link = &(*link)->next)
+			{
+				if (*link == block)
+				{
+					*link = block->next;
+					destroy_memory_block(gpu, block);
+					return;
+				}
+			}
+		}
+	}
+}
+
+
+// Wait for the GPU to finish with this frame's command buffers, then begin the primary and the render pass.
+static bool begin_frame(gpu_t* gpu, gpu_frame_t* frame, VkSubpassContents contents)
+{
+	VkResult result = vkWaitForFences(gpu->logical_device, 1, &frame->fence, VK_TRUE, UINT64_MAX);
+	if (result)
+	{
+		debug_print(k_print_error, "vkWaitForFences failed: %d\n", result);
+	}
+	// The GPU is done with the copies from this frame's last trip through the swapchain.
+	gpu->staging_tail = frame->staging_end;
+	trace_frame_timestamps(gpu, frame);
+
+	VkCommandBufferBeginInfo begin_info =
+	{
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+	};
+	result = vkBeginCommandBuffer(frame->cmd_buffer->buffer, &begin_info);
+	if (result)
+	{
+		debug_print(k_print_error, "vkBeginCommandBuffer failed: %d\n", result);
+		return false;
+	}
+	frame->cmd_buffer->trace_depth = 0;
+	if (frame->query_pool)
+	{
+		vkCmdResetQueryPool(frame->cmd_buffer->buffer, frame->query_pool, 0, k_gpu_max_trace_regions * 2);
+	}
+
+	// Copies have to land outside the render pass.
+	record_uploads(gpu, frame->cmd_buffer->buffer);
+	frame->staging_end = gpu->staging_submitted;
+
+	VkClearValue clear_values[2] =
+	{
+		{.color = {.float32 = { 0.0f, 0.0f, 0.2f, 1.0f } } },
+		{.depthStencil = {.depth = 1.0f, .stencil = 0 } },
+	};
+	VkRenderPassBeginInfo render_pass_begin_info =
+	{
+		.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+		.renderPass = gpu->render_pass,
+		.renderArea.extent.width = gpu->frame_width,
+		.renderArea.extent.height = gpu->frame_height,
+		.clearValueCount = _countof(clear_values),
+		.pClearValues = clear_values,
+		.framebuffer = frame->frame_buffer,
+	};
+	frame->render_pass_region = begin_trace_region(gpu, frame, frame->cmd_buffer, "render pass");
+	vkCmdBeginRenderPass(frame->cmd_buffer->buffer, &render_pass_begin_info, contents);
+	return true;
+}
+
+static void set_viewport_and_scissor(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer)
+{
+	VkViewport viewport =
+	{
+		.height = (float)gpu->frame_height,
+		.width = (float)gpu->frame_width,
+		.minDepth = 0.0f,
+		.maxDepth = 1.0f,
+	};
+	vkCmdSetViewport(cmd_buffer->buffer, 0, 1, &viewport);
+
+	VkRect2D scissor =
+	{
+		.extent.width = gpu->frame_width,
+		.extent.height = gpu->frame_height,
+	};
+	vkCmdSetScissor(cmd_buffer->buffer, 0, 1, &scissor);
+}
+
+static gpu_cmd_buffer_t* get_secondary_cmd_buffer(gpu_t* gpu, gpu_frame_t* frame, int index)
+{
+	if (frame->secondary_cmd_buffers[index])
+	{
+		return frame->secondary_cmd_buffers[index];
+	}
+
+	// Transient: the whole pool is reset each frame rather than individual buffers.
+	VkCommandPoolCreateInfo pool_info =
+	{
+		.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+		.queueFamilyIndex = gpu->queue_family_index,
+		.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+	};
+	VkResult result = vkCreateCommandPool(gpu->logical_device, &pool_info, NULL, &frame->secondary_pools[index]);
+	if (result)
+	{
+		debug_print(k_print_error, "vkCreateCommandPool failed: %d\n", result);
+	}
+
+	gpu_cmd_buffer_t* cmd_buffer = heap_alloc_tagged(gpu->heap, sizeof(gpu_cmd_buffer_t), 8, k_heap_tag_render);
+	memset(cmd_buffer, 0, sizeof(gpu_cmd_buffer_t));
+	VkCommandBufferAllocateInfo alloc_info =
+	{
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+		.commandPool = frame->secondary_pools[index],
+		.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+		.commandBufferCount = 1,
+	};
+	result = vkAllocateCommandBuffers(gpu->logical_device, &alloc_info, &cmd_buffer->buffer);
+	if (result)
+	{
+		debug_print(k_print_error, "vkAllocateCommandBuffers failed: %d\n", result);
+	}
+	frame->secondary_cmd_buffers[index] = cmd_buffer;
+	return cmd_buffer;
+}
+
+static void add_cmd_buffer_stats(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer)
+{
+	gpu->stats.draw_count += cmd_buffer->stats.draw_count;
+	gpu->stats.instance_count += cmd_buffer->stats.instance_count;
+	gpu->stats.pipeline_bind_count += cmd_buffer->stats.pipeline_bind_count;
+	gpu->stats.mesh_bind_count += cmd_buffer->stats.mesh_bind_count;
+	gpu->stats.descriptor_bind_count += cmd_buffer->stats.descriptor_bind_count;
+	memset(&cmd_buffer->stats, 0, sizeof(cmd_buffer->stats));
+}
+
+// Write a timestamp on an otherwise idle queue, and take the CPU time it was written at to be
+// halfway between submit and idle. Off by at most half the round trip.
+static void calibrate_timestamps(gpu_t* gpu)
+{
+	VkQueryPool query_pool = gpu->frames[0].query_pool;
+	VkCommandBufferBeginInfo begin_info =
+	{
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+		.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+	};
+	VkResult result = vkBeginCommandBuffer(gpu->upload_cmd_buffer, &begin_info);
+	if (result)
+	{
+		debug_print(k_print_error, "vkBeginCommandBuffer failed: %d\n", result);
+	}
+	vkCmdResetQueryPool(gpu->upload_cmd_buffer, query_pool, 0, 1);
+	vkCmdWriteTimestamp(gpu->upload_cmd_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_pool, 0);
+	result = vkEndCommandBuffer(gpu->upload_cmd_buffer);
+	if (result)
+	{
+		debug_print(k_print_error, "vkEndCommandBuffer failed: %d\n", result);
+	}
+
+	VkSubmitInfo submit_info =
+	{
+		.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+		.pCommandBuffers = &gpu->upload_cmd_buffer,
+		.commandBufferCount = 1,
+	};
+	uint64_t submit_ticks = timer_get_ticks();
+	result = vkQueueSubmit(gpu->queue, 1, &submit_info, VK_NULL_HANDLE);
+	if (result)
+	{
+		debug_print(k_print_error, "vkQueueSubmit failed: %d\n", result);
+	}
+	vkQueueWaitIdle(gpu->queue);
+	uint64_t idle_ticks = timer_get_ticks();
+
+	uint64_t timestamp = 0;
+	result = vkGetQueryPoolResults(gpu->logical_device, query_pool, 0, 1, sizeof(timestamp), &timestamp, sizeof(timestamp),
+		VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+	if (result)
+	{
+		debug_print(k_print_error, "vkGetQueryPoolResults failed: %d\n", result);
+	}
+	gpu->calibration_timestamp = timestamp;
+	gpu->calibration_ticks = submit_ticks + (idle_ticks - submit_ticks) / 2;
+}
+
+// Write the begin timestamp of a region and return its index, or -1 if it isn't being timed.
+// Region indices are handed out atomically, since parallel command buffers are recorded on several threads.
+// May be called on any thread that makes Vulkan calls, including recording workers.
+static VkBool32 VKAPI_PTR validation_callback(VkDebugUtilsMessageSeverityFlagBitsEXT severity, VkDebugUtilsMessageTypeFlagsEXT types,
+	const VkDebugUtilsMessengerCallbackDataEXT* data, void* user)
+{
+	gpu_t* gpu = user;
+	if (severity & VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT)
+	{
+		atomic_increment(&gpu->validation_error_count);
+		debug_print(k_print_error, "Vulkan validation: %s\n", data->pMessage);
+	}
+	else
+	{
+		debug_print(k_print_warning, "Vulkan validation: %s\n", data->pMessage);
+	}
+	return VK_FALSE;
+}
+
+static int begin_trace_region(gpu_t* gpu, gpu_frame_t* frame, gpu_cmd_buffer_t* cmd_buffer, const char* name)
+{
+	if (!frame->query_pool)
+	{
+		return -1;
+	}
+	int region = atomic_increment(&frame->trace_region_count);
+	if (region >= k_gpu_max_trace_regions)
+	{
+		return -1;
+	}
+	frame->trace_names[region] = name;
+	vkCmdWriteTimestamp(cmd_buffer->buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frame->query_pool, region * 2);
+	return region;
+}
+
+static void end_trace_region(gpu_t* gpu, gpu_frame_t* frame, gpu_cmd_buffer_t* cmd_buffer, int region)
+{
+	if (region >= 0)
+	{
+		vkCmdWriteTimestamp(cmd_buffer->buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frame->query_pool, region * 2 + 1);
+	}
+}
+
+static uint64_t timestamp_to_ticks(gpu_t* gpu, uint64_t timestamp)
+{
+	// Masking the difference keeps it right across one wrap of counters narrower than 64 bits.
+	uint64_t elapsed = (timestamp - gpu->calibration_timestamp) & gpu->timestamp_mask;
+	return gpu->calibration_ticks + (uint64_t)((double)elapsed * gpu->ticks_per_timestamp);
+}
+
+// Add the regions timed in a frame the GPU has finished to the trace, then clear them for reuse.
+static void trace_frame_timestamps(gpu_t* gpu, gpu_frame_t* frame)
+{
+	int region_count = __min(frame->trace_region_count, k_gpu_max_trace_regions);
+	frame->trace_region_count = 0;
+	if (!region_count)
+	{
+		return;
+	}
+
+	// Each query gives its timestamp then whether it was written; a region left open has no end.
+	uint64_t* results = alloca(sizeof(uint64_t) * 4 * region_count);
+	VkResult result = vkGetQueryPoolResults(gpu->logical_device, frame->query_pool, 0, region_count * 2,
+		sizeof(uint64_t) * 4 * region_count, results, sizeof(uint64_t) * 2,
+		VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+	if (result != VK_SUCCESS && result != VK_NOT_READY)
+	{
+		debug_print(k_print_error, "vkGetQueryPoolResults failed: %d\n", result);
+		return;
+	}
+	for (int i = 0; i < region_count; ++i)
+	{
+		const uint64_t* begin = &results[i * 4];
+		const uint64_t* end = &results[i * 4 + 2];
+		if (begin[1] && end[1])
+		{
+			trace_duration_add(gpu->trace, "GPU", frame->trace_names[i], timestamp_to_ticks(gpu, begin[0]), timestamp_to_ticks(gpu, end[0]));
+		}
+	}
+}
+
+#endif
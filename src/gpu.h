@@ -1,23 +1,44 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef struct gpu_t gpu_t;
 typedef struct gpu_cmd_buffer_t gpu_cmd_buffer_t;
 typedef struct gpu_descriptor_t gpu_descriptor_t;
+typedef struct gpu_instance_buffer_t gpu_instance_buffer_t;
 typedef struct gpu_mesh_t gpu_mesh_t;
 typedef struct gpu_pipeline_t gpu_pipeline_t;
 typedef struct gpu_shader_t gpu_shader_t;
 typedef struct gpu_uniform_buffer_t gpu_uniform_buffer_t;
 
+typedef struct fs_t fs_t;
 typedef struct heap_t heap_t;
+typedef struct trace_t trace_t;
 typedef struct wm_window_t wm_window_t;
 
+enum
+{
+	// Instanced vertex shaders read per-instance data as vec4 attributes from this location on.
+	k_gpu_instance_attribute_location = 2,
+	// Vulkan guarantees 16 vertex attributes; mesh layouts use the locations below the instance data.
+	k_gpu_instance_data_max_size = (16 - k_gpu_instance_attribute_location) * 16,
+	// Most command buffers gpu_frame_begin_parallel() hands out in one frame.
+	k_gpu_max_parallel_cmd_buffers = 16,
+	// Most regions timed in one frame, counting the render pass; later regions are not timed.
+	k_gpu_max_trace_regions = 32,
+};
+
 typedef struct gpu_descriptor_info_t
 {
 	gpu_shader_t* shader;
 	gpu_uniform_buffer_t** uniform_buffers;
 	int uniform_buffer_count;
+	// Bytes of each uniform buffer the shader sees, starting at the offset given when bound.
+	// Zero for whole buffers.
+	size_t uniform_range;
+	// Per-buffer ranges, in place of uniform_range when the bindings differ in size. May be NULL.
+	const size_t* uniform_ranges;
 } gpu_descriptor_info_t;
 
 typedef enum gpu_mesh_layout_t
@@ -50,16 +71,63 @@ typedef struct gpu_shader_info_t
 	void* fragment_shader_data;
 	size_t fragment_shader_size;
 	int uniform_buffer_count;
+	// Bytes of per-instance data for instanced draws: a multiple of 16, at most k_gpu_instance_data_max_size.
+	// Zero for shaders that are not drawn instanced.
+	size_t instance_data_size;
+	// Bytes of per-view data, such as camera matrices, read from uniform binding 0 and shared by every draw in the view.
+	// Per-draw uniforms then start at binding 1. Zero for shaders that take everything per draw.
+	size_t view_data_size;
 } gpu_shader_info_t;
 
 typedef struct gpu_uniform_buffer_info_t
 {
+	// Initial contents; may be NULL.
 	void* data;
 	size_t size;
 } gpu_uniform_buffer_info_t;
 
+// Running totals of work requested through this interface since gpu_create().
+typedef struct gpu_stats_t
+{
+	uint64_t frame_count;
+	uint64_t draw_count;
+	uint64_t instance_count;
+	uint64_t pipeline_bind_count;
+	uint64_t mesh_bind_count;
+	uint64_t descriptor_bind_count;
+	uint64_t uniform_update_count;
+	uint64_t uniform_bytes_uploaded;
+	uint64_t mesh_bytes_uploaded;
+	uint64_t instance_bytes_uploaded;
+	// Copies from the staging ring into device-local meshes, and the batches they were recorded in.
+	uint64_t upload_copy_count;
+	uint64_t upload_batch_count;
+	// Pipelines created, and time spent creating them in timer ticks, summed over threads and for the slowest one.
+	uint64_t pipeline_create_count;
+	uint64_t pipeline_create_ticks;
+	uint64_t pipeline_create_max_ticks;
+	// Descriptors, instance buffers, meshes, pipelines, shaders, and uniform buffers.
+	uint64_t object_create_count;
+	uint64_t object_destroy_count;
+} gpu_stats_t;
+
+// Device memory held by this interface. Buffers are sub-allocated from a few large blocks.
+typedef struct gpu_memory_stats_t
+{
+	int block_count;
+	uint64_t block_bytes;
+	uint64_t used_bytes;
+	int allocation_count;
+	// Free space is split across this many ranges; more ranges for the same free bytes means more fragmentation.
+	int free_range_count;
+	uint64_t largest_free_bytes;
+} gpu_memory_stats_t;
+
 // Create an instance of Vulkan on the provided window.
-gpu_t* gpu_create(heap_t* heap, wm_window_t* window);
+// If fs is not NULL, the pipeline cache is loaded through it here and saved back in gpu_destroy().
+// If trace is not NULL, the GPU time of each frame's render pass, and of regions marked with gpu_cmd_trace_push(),
+// is added to it on a "GPU" track. Times are read back a few frames later, once the GPU has finished the frame.
+gpu_t* gpu_create(heap_t* heap, wm_window_t* window, fs_t* fs, trace_t* trace);
 
 // Destroy the previously created Vulkan.
 void gpu_destroy(gpu_t* gpu);
@@ -70,12 +138,32 @@ int gpu_get_frame_count(gpu_t* gpu);
 // Wait for the GPU to be done all queued work.
 void gpu_wait_until_idle(gpu_t* gpu);
 
+// Get the alignment required of uniform buffer offsets passed to gpu_cmd_descriptor_bind_offsets().
+size_t gpu_get_uniform_alignment(gpu_t* gpu);
+
+// Copy out the running totals of calls and uploads.
+// Only the thread that owns the GPU should call this.
+void gpu_get_stats(gpu_t* gpu, gpu_stats_t* stats);
+
+// Get current device memory usage and fragmentation.
+// Only the thread that owns the GPU should call this.
+void gpu_get_memory_stats(gpu_t* gpu, gpu_memory_stats_t* stats);
+
 // Binds uniform buffers (and textures if we had them) to a given shader layout.
 gpu_descriptor_t* gpu_descriptor_create(gpu_t* gpu, const gpu_descriptor_info_t* info);
 
 // Destroys a descriptor.
 void gpu_descriptor_destroy(gpu_t* gpu, gpu_descriptor_t* descriptor);
 
+// Create a buffer of per-instance data for instanced draws.
+gpu_instance_buffer_t* gpu_instance_buffer_create(gpu_t* gpu, size_t size);
+
+// Write per-instance data to the start of an instance buffer.
+void gpu_instance_buffer_update(gpu_t* gpu, gpu_instance_buffer_t* buffer, const void* data, size_t size);
+
+// Destroy an instance buffer.
+void gpu_instance_buffer_destroy(gpu_t* gpu, gpu_instance_buffer_t* buffer);
+
 // Create a drawable piece of geometry with vertex and index data.
 gpu_mesh_t* gpu_mesh_create(gpu_t* gpu, const gpu_mesh_info_t* info);
 
@@ -83,12 +171,14 @@ gpu_mesh_t* gpu_mesh_create(gpu_t* gpu, const gpu_mesh_info_t* info);
 void gpu_mesh_destroy(gpu_t* gpu, gpu_mesh_t* mesh);
 
 // Setup an object that binds a shader to a mesh layout for rendering.
+// Unlike most of this interface, safe to call from any thread, so slow compiles can run off the render thread.
 gpu_pipeline_t* gpu_pipeline_create(gpu_t* gpu, const gpu_pipeline_info_t* info);
 
 // Destroy a pipeline.
 void gpu_pipeline_destroy(gpu_t* gpu, gpu_pipeline_t* pipeline);
 
 // Create a shader object with vertex and fragment shader programs.
+// Safe to call from any thread, like gpu_pipeline_create().
 gpu_shader_t* gpu_shader_create(gpu_t* gpu, const gpu_shader_info_t* info);
 
 // Destroy a shader.
@@ -101,6 +191,10 @@ gpu_uniform_buffer_t* gpu_uniform_buffer_create(gpu_t* gpu, const gpu_uniform_bu
 // Modify an existing uniform buffer.
 void gpu_uniform_buffer_update(gpu_t* gpu, gpu_uniform_buffer_t* buffer, const void* data, size_t size);
 
+// Get a pointer through which the CPU can write the buffer directly.
+// The buffer stays mapped until destroyed; the caller must not overwrite data a frame in flight still reads.
+void* gpu_uniform_buffer_get_data(gpu_t* gpu, gpu_uniform_buffer_t* buffer);
+
 // Destroy a uniform buffer.
 void gpu_uniform_buffer_destroy(gpu_t* gpu, gpu_uniform_buffer_t* buffer);
 
@@ -108,9 +202,18 @@ void gpu_uniform_buffer_destroy(gpu_t* gpu, gpu_uniform_buffer_t* buffer);
 // Returns a command buffer for all rendering in that frame.
 gpu_cmd_buffer_t* gpu_frame_begin(gpu_t* gpu);
 
+// Start a new frame whose rendering is recorded into count command buffers, at most k_gpu_max_parallel_cmd_buffers.
+// Each buffer may be recorded on a different thread; gpu_frame_end() executes them in index order.
+// Every buffer starts with no pipeline, mesh, or descriptor bound.
+// Returns false if the frame could not be started.
+bool gpu_frame_begin_parallel(gpu_t* gpu, int count, gpu_cmd_buffer_t** cmd_buffers);
+
 // Finish rendering frame.
+// Recording into every command buffer from this frame must be done.
 void gpu_frame_end(gpu_t* gpu);
 
+// The gpu_cmd functions may be called on any thread, as long as each command buffer is used by one thread at a time.
+
 // Set the current pipeline for this command buffer.
 void gpu_cmd_pipeline_bind(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer, gpu_pipeline_t* pipeline);
 
@@ -118,7 +221,24 @@ void gpu_cmd_pipeline_bind(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer, gpu_pipelin
 void gpu_cmd_mesh_bind(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer, gpu_mesh_t* mesh);
 
 // Set the current descriptor for this command buffer.
+// Uniform buffers are read from offset zero.
 void gpu_cmd_descriptor_bind(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer, gpu_descriptor_t* descriptor);
 
+// Set the current descriptor, reading each uniform buffer from the matching offset.
+// Offsets must be multiples of gpu_get_uniform_alignment().
+void gpu_cmd_descriptor_bind_offsets(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer, gpu_descriptor_t* descriptor, const uint32_t* offsets);
+
 // Draw given current pipeline, mesh, and descriptor.
 void gpu_cmd_draw(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer);
+
+// Draw instance_count copies of the current mesh with the current pipeline.
+// Per-instance data is read from the buffer starting at offset, one shader instance_data_size apart.
+void gpu_cmd_draw_instanced(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer, gpu_instance_buffer_t* instances, size_t offset, int instance_count);
+
+// Begin timing a named region of GPU work for the trace passed to gpu_create().
+// Regions may nest, and are popped in the command buffer they were pushed in.
+// The name is kept until the frame is read back, so it should be a string literal.
+void gpu_cmd_trace_push(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer, const char* name);
+
+// End the region most recently pushed in this command buffer.
+void gpu_cmd_trace_pop(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer);
@@ -0,0 +1,348 @@
+#include "gpu_allocator.h"
+
+#include "heap.h"
+
+#include <string.h>
+
+#include <intrin.h>
+
+// Size classes follow tlsf/tlsf.c: the first level is the power of two,
+// the second splits each power of two into 32 linear steps.
+// Sizes below k_small_size share first level zero.
+enum
+{
+	k_sl_count_log2 = 5,
+	k_sl_count = 1 << k_sl_count_log2,
+	k_granularity_log2 = 4,
+	k_granularity = 1 << k_granularity_log2,
+	k_fl_shift = k_sl_count_log2 + k_granularity_log2,
+	k_small_size = 1 << k_fl_shift,
+	k_fl_count = 64 - k_fl_shift + 1,
+	k_initial_range_capacity = 64,
+	k_no_range = -1,
+};
+
+// A contiguous span of the block, either allocated or free.
+// Physical links order ranges by offset; free links chain ranges in the same size class.
+// Unused records are chained through next_free.
+typedef struct range_t
+{
+	uint64_t offset;
+	uint64_t size;
+	int prev_physical;
+	int next_physical;
+	int prev_free;
+	int next_free;
+	bool is_free;
+} range_t;
+
+typedef struct gpu_allocator_t
+{
+	heap_t* heap;
+	uint64_t size;
+
+	range_t* ranges;
+	int range_capacity;
+	int first_unused_range;
+
+	uint64_t fl_bitmap;
+	uint32_t sl_bitmaps[k_fl_count];
+	int free_heads[k_fl_count][k_sl_count];
+
+	uint64_t used_bytes;
+	int allocation_count;
+	int free_range_count;
+} gpu_allocator_t;
+
+static int find_last_set(uint64_t value)
+{
+	unsigned long index;
+	_BitScanReverse64(&index, value);
+	return (int)index;
+}
+
+static int find_first_set(uint64_t value)
+{
+	unsigned long index;
+	_BitScanForward64(&index, value);
+	return (int)index;
+}
+
+static void mapping_insert(uint64_t size, int* fl, int* sl)
+{
+	if (size < k_small_size)
+	{
+		*fl = 0;
+		*sl = (int)(size >> k_granularity_log2);
+	}
+	else
+	{
+		int last = find_last_set(size);
+		*sl = (int)(size >> (last - k_sl_count_log2)) ^ (1 << k_sl_count_log2);
+		*fl = last - (k_fl_shift - 1);
+	}
+}
+
+// Round up to the next size class, so any range found there is large enough.
+static void mapping_search(uint64_t size, int* fl, int* sl)
+{
+	if (size >= k_small_size)
+	{
+		size += (1ull << (find_last_set(size) - k_sl_count_log2)) - 1;
+	}
+	mapping_insert(size, fl, sl);
+}
+
+static int range_new(gpu_allocator_t* allocator)
+{
+	if (allocator->first_unused_range == k_no_range)
+	{
+		int capacity = allocator->range_capacity * 2;
+		range_t* ranges = heap_alloc_tagged(allocator->heap, sizeof(range_t) * capacity, 8, k_heap_tag_render);
+		memcpy(ranges, allocator->ranges, sizeof(range_t) * allocator->range_capacity);
+		heap_free(allocator->heap, allocator->ranges);
+		for (int i = allocator->range_capacity; i < capacity; ++i)
+		{
+			ranges[i].next_free = (i + 1 < capacity) ? i + 1 : k_no_range;
+		}
+		allocator->first_unused_range = allocator->range_capacity;
+		allocator->ranges = ranges;
+		allocator->range_capacity = capacity;
+	}
+
+	int index = allocator->first_unused_range;
+	allocator->first_unused_range = allocator->ranges[index].next_free;
+	return index;
+}
+
+static void range_release(gpu_allocator_t* allocator, int index)
+{
+	allocator->ranges[index].next_free = allocator->first_unused_range;
+	allocator->first_unused_range = index;
+}
+
+static void insert_free_range(gpu_allocator_t* allocator, int index)
+{
+	range_t* range = &allocator->ranges[index];
+	int fl, sl;
+	mapping_insert(range->size, &fl, &sl);
+
+	int head = allocator->free_heads[fl][sl];
+	range->is_free = true;
+	range->prev_free = k_no_range;
+	range->next_free = head;
+	if (head != k_no_range)
+	{
+		allocator->ranges[head].prev_free = index;
+	}
+	allocator->free_heads[fl][sl] = index;
+	allocator->fl_bitmap |= 1ull << fl;
+	allocator->sl_bitmaps[fl] |= 1u << sl;
+	++allocator->free_range_count;
+}
+
+static void remove_free_range(gpu_allocator_t* allocator, int index)
+{
+	range_t* range = &allocator->ranges[index];
+	int fl, sl;
+	mapping_insert(range->size, &fl, &sl);
+
+	if (range->prev_free != k_no_range)
+	{
+		allocator->ranges[range->prev_free].next_free = range->next_free;
+	}
+	else
+	{
+		allocator->free_heads[fl][sl] = range->next_free;
+		if (range->next_free == k_no_range)
+		{
+			allocator->sl_bitmaps[fl] &= ~(1u << sl);
+			if (!allocator->sl_bitmaps[fl])
+			{
+				allocator->fl_bitmap &= ~(1ull << fl);
+			}
+		}
+	}
+	if (range->next_free != k_no_range)
+	{
+		allocator->ranges[range->next_free].prev_free = range->prev_free;
+	}
+	range->is_free = false;
+	--allocator->free_range_count;
+}
+
+static int find_free_range(gpu_allocator_t* allocator, int fl, int sl)
+{
+	uint32_t sl_map = allocator->sl_bitmaps[fl] & (~0u << sl);
+	if (!sl_map)
+	{
+		uint64_t fl_map = (fl + 1 < 64) ? allocator->fl_bitmap & (~0ull << (fl + 1)) : 0;
+		if (!fl_map)
+		{
+			return k_no_range;
+		}
+		fl = find_first_set(fl_map);
+		sl_map = allocator->sl_bitmaps[fl];
+	}
+	return allocator->free_heads[fl][find_first_set(sl_map)];
+}
+
+// Split the tail of a range off into a new free range, starting size bytes in.
+static void split_range(gpu_allocator_t* allocator, int index, uint64_t size)
+{
+	int tail = range_new(allocator);
+	range_t* range = &allocator->ranges[index];
+	allocator->ranges[tail] = (range_t)
+	{
+		.offset = range->offset + size,
+		.size = range->size - size,
+		.prev_physical = index,
+		.next_physical = range->next_physical,
+	};
+	if (range->next_physical != k_no_range)
+	{
+		allocator->ranges[range->next_physical].prev_physical = tail;
+	}
+	range->next_physical = tail;
+	range->size = size;
+	insert_free_range(allocator, tail);
+}
+
+// Fold a range into the one physically before it and release its record.
+static void merge_with_previous(gpu_allocator_t* allocator, int index)
+{
+	range_t* range = &allocator->ranges[index];
+	range_t* previous = &allocator->ranges[range->prev_physical];
+	previous->size += range->size;
+	previous->next_physical = range->next_physical;
+	if (range->next_physical != k_no_range)
+	{
+		allocator->ranges[range->next_physical].prev_physical = range->prev_physical;
+	}
+	range_release(allocator, index);
+}
+
+gpu_allocator_t* gpu_allocator_create(heap_t* heap, uint64_t size)
+{
+	gpu_allocator_t* allocator = heap_alloc_tagged(heap, sizeof(gpu_allocator_t), 8, k_heap_tag_render);
+	memset(allocator, 0, sizeof(*allocator));
+	allocator->heap = heap;
+	allocator->size = size & ~(uint64_t)(k_granularity - 1);
+	memset(allocator->free_heads, 0xff, sizeof(allocator->free_heads));
+
+	allocator->range_capacity = k_initial_range_capacity;
+	allocator->ranges = heap_alloc_tagged(heap, sizeof(range_t) * allocator->range_capacity, 8, k_heap_tag_render);
+	for (int i = 0; i < allocator->range_capacity; ++i)
+	{
+		allocator->ranges[i].next_free = (i + 1 < allocator->range_capacity) ? i + 1 : k_no_range;
+	}
+	allocator->first_unused_range = 0;
+
+	int index = range_new(allocator);
+	allocator->ranges[index] = (range_t)
+	{
+		.offset = 0,
+		.size = allocator->size,
+		.prev_physical = k_no_range,
+		.next_physical = k_no_range,
+	};
+	insert_free_range(allocator, index);
+	return allocator;
+}
+
+void gpu_allocator_destroy(gpu_allocator_t* allocator)
+{
+	heap_free(allocator->heap, allocator->ranges);
+	heap_free(allocator->heap, allocator);
+}
+
+bool gpu_allocator_alloc(gpu_allocator_t* allocator, uint64_t size, uint64_t alignment, gpu_allocation_t* allocation)
+{
+	size = (__max(size, 1) + k_granularity - 1) & ~(uint64_t)(k_granularity - 1);
+	alignment = __max(alignment, k_granularity);
+
+	// Free ranges start on the granularity, so this much extra always covers the alignment gap.
+	uint64_t search_size = size + alignment - k_granularity;
+	if (search_size > allocator->size)
+	{
+		return false;
+	}
+	int fl, sl;
+	mapping_search(search_size, &fl, &sl);
+	if (fl >= k_fl_count)
+	{
+		return false;
+	}
+	int index = find_free_range(allocator, fl, sl);
+	if (index == k_no_range)
+	{
+		return false;
+	}
+	remove_free_range(allocator, index);
+
+	// Leave any alignment gap behind as its own free range.
+	uint64_t gap = ((allocator->ranges[index].offset + alignment - 1) & ~(alignment - 1)) - allocator->ranges[index].offset;
+	if (gap)
+	{
+		split_range(allocator, index, gap);
+		int aligned = allocator->ranges[index].next_physical;
+		remove_free_range(allocator, aligned);
+		insert_free_range(allocator, index);
+		index = aligned;
+	}
+	if (allocator->ranges[index].size - size >= k_granularity)
+	{
+		split_range(allocator, index, size);
+	}
+
+	range_t* range = &allocator->ranges[index];
+	allocator->used_bytes += range->size;
+	++allocator->allocation_count;
+
+	allocation->offset = range->offset;
+	allocation->size = range->size;
+	allocation->range = index;
+	return true;
+}
+
+void gpu_allocator_free(gpu_allocator_t* allocator, const gpu_allocation_t* allocation)
+{
+	int index = allocation->range;
+	allocator->used_bytes -= allocator->ranges[index].size;
+	--allocator->allocation_count;
+
+	int next = allocator->ranges[index].next_physical;
+	if (next != k_no_range && allocator->ranges[next].is_free)
+	{
+		remove_free_range(allocator, next);
+		merge_with_previous(allocator, next);
+	}
+	int previous = allocator->ranges[index].prev_physical;
+	if (previous != k_no_range && allocator->ranges[previous].is_free)
+	{
+		remove_free_range(allocator, previous);
+		merge_with_previous(allocator, index);
+		index = previous;
+	}
+	insert_free_range(allocator, index);
+}
+
+void gpu_allocator_get_stats(gpu_allocator_t* allocator, gpu_allocator_stats_t* stats)
+{
+	stats->size = allocator->size;
+	stats->used_bytes = allocator->used_bytes;
+	stats->allocation_count = allocator->allocation_count;
+	stats->free_range_count = allocator->free_range_count;
+
+	// The largest free range is in the highest non-empty size class.
+	stats->largest_free_bytes = 0;
+	if (allocator->fl_bitmap)
+	{
+		int fl = find_last_set(allocator->fl_bitmap);
+		int sl = find_last_set(allocator->sl_bitmaps[fl]);
+		for (int index = allocator->free_heads[fl][sl]; index != k_no_range; index = allocator->ranges[index].next_free)
+		{
+			stats->largest_free_bytes = __max(stats->largest_free_bytes, allocator->ranges[index].size);
+		}
+	}
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// GPU Memory Allocator
+// Two-level segregated fit (TLSF) allocator over offsets into one block of GPU memory.
+// Unlike tlsf/tlsf.c, range records live in CPU memory, since device memory can't hold headers.
+// Allocation and free are constant time; adjacent free ranges are merged on free.
+
+// Handle to an allocator.
+typedef struct gpu_allocator_t gpu_allocator_t;
+
+typedef struct heap_t heap_t;
+
+// A range handed out by gpu_allocator_alloc().
+typedef struct gpu_allocation_t
+{
+	uint64_t offset;
+	uint64_t size;
+	int range;
+} gpu_allocation_t;
+
+typedef struct gpu_allocator_stats_t
+{
+	uint64_t size;
+	uint64_t used_bytes;
+	// The largest allocation that could succeed, before alignment.
+	uint64_t largest_free_bytes;
+	int allocation_count;
+	int free_range_count;
+} gpu_allocator_stats_t;
+
+// Create an allocator managing offsets [0, size).
+gpu_allocator_t* gpu_allocator_create(heap_t* heap, uint64_t size);
+
+// Destroy an allocator. Outstanding allocations are forgotten.
+void gpu_allocator_destroy(gpu_allocator_t* allocator);
+
+// Allocate a range of at least size bytes at an offset that is a multiple of alignment.
+// Alignment must be a power of two.
+// Returns false if no free range is large enough.
+bool gpu_allocator_alloc(gpu_allocator_t* allocator, uint64_t size, uint64_t alignment, gpu_allocation_t* allocation);
+
+// Return a range to the allocator.
+void gpu_allocator_free(gpu_allocator_t* allocator, const gpu_allocation_t* allocation);
+
+// Get usage and fragmentation statistics.
+void gpu_allocator_get_stats(gpu_allocator_t* allocator, gpu_allocator_stats_t* stats);
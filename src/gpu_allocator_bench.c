@@ -0,0 +1,94 @@
+#include "bench.h"
+
+#include "debug.h"
+#include "gpu_allocator.h"
+#include "heap.h"
+#include "timer.h"
+
+#include <stdint.h>
+#include <string.h>
+
+enum
+{
+	k_bench_block_size = 64 * 1024 * 1024,
+	k_bench_max_allocations = 16 * 1024,
+	k_bench_churn_ops = 1024 * 1024,
+};
+
+// Live allocation counts to churn at; the block is roughly 1/8, 1/2, and 7/8 full at each.
+static const int k_live_counts[] = { 512, 2 * 1024, 3584 };
+
+static uint32_t bench_random(uint32_t* state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+// Buffer-like sizes from 256 bytes to 64k, aligned as vertex, index, and uniform buffers are.
+static void bench_random_request(uint32_t* state, uint64_t* size, uint64_t* alignment)
+{
+	*size = 256ull << (bench_random(state) % 9);
+	*size += bench_random(state) % *size;
+	*alignment = 16ull << (bench_random(state) % 5);
+}
+
+void gpu_allocator_bench_run(heap_t* heap)
+{
+	gpu_allocation_t* allocations = heap_alloc(heap, sizeof(gpu_allocation_t) * k_bench_max_allocations, 8);
+
+	for (int c = 0; c < _countof(k_live_counts); ++c)
+	{
+		int live_count = k_live_counts[c];
+		gpu_allocator_t* allocator = gpu_allocator_create(heap, k_bench_block_size);
+		uint32_t state = 0x9e3779b9;
+		memset(allocations, 0, sizeof(gpu_allocation_t) * live_count);
+
+		for (int i = 0; i < live_count; ++i)
+		{
+			uint64_t size, alignment;
+			bench_random_request(&state, &size, &alignment);
+			gpu_allocator_alloc(allocator, size, alignment, &allocations[i]);
+		}
+
+		// Replace a random live allocation with a new request, so frees land all over the block.
+		int failed_count = 0;
+		uint64_t start_ticks = timer_get_ticks();
+		for (int i = 0; i < k_bench_churn_ops; ++i)
+		{
+			int index = bench_random(&state) % live_count;
+			if (allocations[index].size)
+			{
+				gpu_allocator_free(allocator, &allocations[index]);
+			}
+			uint64_t size, alignment;
+			bench_random_request(&state, &size, &alignment);
+			if (!gpu_allocator_alloc(allocator, size, alignment, &allocations[index]))
+			{
+				allocations[index].size = 0;
+				++failed_count;
+			}
+		}
+		uint64_t ticks = timer_get_ticks() - start_ticks;
+
+		gpu_allocator_stats_t stats;
+		gpu_allocator_get_stats(allocator, &stats);
+		uint64_t free_bytes = stats.size - stats.used_bytes;
+
+		// One op is an alloc/free pair.
+		double ns_per_op = (double)ticks * 1e9 / (double)timer_get_ticks_per_second() / k_bench_churn_ops;
+		debug_print(k_print_info, "  %5d live: %6.1f ns/op, %5.1f%% used, %5d free ranges, largest free %5.1f%% of free, %d failed\n",
+			live_count, ns_per_op,
+			100.0 * stats.used_bytes / stats.size,
+			stats.free_range_count,
+			free_bytes ? 100.0 * stats.largest_free_bytes / free_bytes : 100.0,
+			failed_count);
+
+		gpu_allocator_destroy(allocator);
+	}
+
+	heap_free(heap, allocations);
+}
@@ -0,0 +1,463 @@
+#include "gpu.h"
+
+// Null backend. Implements gpu.h without a device or window, so the
+// render thread's CPU cost can be measured on headless machines.
+// Records the same call counts and upload sizes as gpu.c.
+// Builds with GPU_NULL defined use this in place of gpu.c.
+#if defined(GPU_NULL)
+
+#include "gpu_allocator.h"
+#include "heap.h"
+#include "mutex.h"
+
+#include <string.h>
+
+enum
+{
+	k_null_frame_count = 3,
+	// The largest minUniformBufferOffsetAlignment Vulkan allows, so offsets are laid out as on real devices.
+	k_null_uniform_alignment = 256,
+	// Buffer alignment and block sizing as gpu.c sub-allocates them.
+	k_null_buffer_alignment = 16,
+	k_null_memory_block_size = 64 * 1024 * 1024,
+	// Mesh uploads are split into copies of at most this size, as gpu.c's staging ring does.
+	k_null_upload_max_size = 4 * 1024 * 1024,
+};
+
+// Stands in for a block of device memory; only the range bookkeeping is real.
+typedef struct null_memory_block_t
+{
+	size_t size;
+	// NULL for a dedicated block, which backs exactly one buffer.
+	gpu_allocator_t* allocator;
+	struct null_memory_block_t* next;
+} null_memory_block_t;
+
+typedef struct null_memory_t
+{
+	null_memory_block_t* block;
+	gpu_allocation_t allocation;
+} null_memory_t;
+
+typedef struct gpu_cmd_buffer_t
+{
+	gpu_pipeline_t* pipeline;
+	gpu_mesh_t* mesh;
+	gpu_descriptor_t* descriptor;
+	gpu_stats_t stats;
+} gpu_cmd_buffer_t;
+
+typedef struct gpu_descriptor_t
+{
+	gpu_shader_t* shader;
+} gpu_descriptor_t;
+
+typedef struct gpu_instance_buffer_t
+{
+	void* data;
+	size_t size;
+	null_memory_t memory;
+} gpu_instance_buffer_t;
+
+typedef struct gpu_mesh_t
+{
+	gpu_mesh_layout_t layout;
+	size_t vertex_data_size;
+	size_t index_data_size;
+	null_memory_t vertex_memory;
+	null_memory_t index_memory;
+} gpu_mesh_t;
+
+typedef struct gpu_pipeline_t
+{
+	gpu_shader_t* shader;
+	gpu_mesh_layout_t mesh_layout;
+} gpu_pipeline_t;
+
+typedef struct gpu_shader_t
+{
+	int uniform_buffer_count;
+	size_t instance_data_size;
+} gpu_shader_t;
+
+typedef struct gpu_uniform_buffer_t
+{
+	void* data;
+	size_t size;
+	null_memory_t memory;
+} gpu_uniform_buffer_t;
+
+typedef struct gpu_t
+{
+	heap_t* heap;
+	gpu_cmd_buffer_t cmd_buffer;
+	gpu_cmd_buffer_t parallel_cmd_buffers[k_gpu_max_parallel_cmd_buffers];
+	int parallel_count;
+	int frame_index;
+	gpu_stats_t stats;
+	// Guards the object and pipeline counts in stats, since shaders and pipelines may be created on any thread.
+	mutex_t* stats_mutex;
+	null_memory_block_t* memory_blocks;
+	// Mesh copies waiting for the next frame.
+	int upload_count;
+} gpu_t;
+
+static void add_cmd_buffer_stats(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer);
+static void alloc_memory(gpu_t* gpu, size_t size, size_t alignment, null_memory_t* memory);
+static void count_object_created(gpu_t* gpu);
+static void count_object_destroyed(gpu_t* gpu);
+static void free_memory(gpu_t* gpu, null_memory_t* memory);
+
+gpu_t* gpu_create(heap_t* heap, wm_window_t* window, fs_t* fs, trace_t* trace)
+{
+	gpu_t* gpu = heap_alloc_tagged(heap, sizeof(gpu_t), 8, k_heap_tag_render);
+	memset(gpu, 0, sizeof(*gpu));
+	gpu->heap = heap;
+	gpu->stats_mutex = mutex_create();
+	return gpu;
+}
+
+void gpu_destroy(gpu_t* gpu)
+{
+	while (gpu->memory_blocks)
+	{
+		null_memory_block_t* next = gpu->memory_blocks->next;
+		if (gpu->memory_blocks->allocator)
+		{
+			gpu_allocator_destroy(gpu->memory_blocks->allocator);
+		}
+		heap_free(gpu->heap, gpu->memory_blocks);
+		gpu->memory_blocks = next;
+	}
+	mutex_destroy(gpu->stats_mutex);
+	heap_free(gpu->heap, gpu);
+}
+
+int gpu_get_frame_count(gpu_t* gpu)
+{
+	return k_null_frame_count;
+}
+
+void gpu_wait_until_idle(gpu_t* gpu)
+{
+}
+
+size_t gpu_get_uniform_alignment(gpu_t* gpu)
+{
+	return k_null_uniform_alignment;
+}
+
+void gpu_get_stats(gpu_t* gpu, gpu_stats_t* stats)
+{
+	mutex_lock(gpu->stats_mutex);
+	*stats = gpu->stats;
+	mutex_unlock(gpu->stats_mutex);
+}
+
+void gpu_get_memory_stats(gpu_t* gpu, gpu_memory_stats_t* stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	for (null_memory_block_t* block = gpu->memory_blocks; block; block = block->next)
+	{
+		gpu_allocator_stats_t block_stats = { .size = block->size, .used_bytes = block->size, .allocation_count = 1 };
+		if (block->allocator)
+		{
+			gpu_allocator_get_stats(block->allocator, &block_stats);
+		}
+		++stats->block_count;
+		stats->block_bytes += block_stats.size;
+		stats->used_bytes += block_stats.used_bytes;
+		stats->allocation_count += block_stats.allocation_count;
+		stats->free_range_count += block_stats.free_range_count;
+		stats->largest_free_bytes = __max(stats->largest_free_bytes, block_stats.largest_free_bytes);
+	}
+}
+
+gpu_descriptor_t* gpu_descriptor_create(gpu_t* gpu, const gpu_descriptor_info_t* info)
+{
+	gpu_descriptor_t* descriptor = heap_alloc_tagged(gpu->heap, sizeof(gpu_descriptor_t), 8, k_heap_tag_render);
+	descriptor->shader = info->shader;
+	count_object_created(gpu);
+	return descriptor;
+}
+
+void gpu_descriptor_destroy(gpu_t* gpu, gpu_descriptor_t* descriptor)
+{
+	heap_free(gpu->heap, descriptor);
+	count_object_destroyed(gpu);
+}
+
+gpu_instance_buffer_t* gpu_instance_buffer_create(gpu_t* gpu, size_t size)
+{
+	gpu_instance_buffer_t* buffer = heap_alloc_tagged(gpu->heap, sizeof(gpu_instance_buffer_t), 8, k_heap_tag_render);
+	buffer->data = heap_alloc_tagged(gpu->heap, size, 16, k_heap_tag_render);
+	buffer->size = size;
+	alloc_memory(gpu, size, k_null_buffer_alignment, &buffer->memory);
+	count_object_created(gpu);
+	return buffer;
+}
+
+void gpu_instance_buffer_update(gpu_t* gpu, gpu_instance_buffer_t* buffer, const void* data, size_t size)
+{
+	memcpy(buffer->data, data, size < buffer->size ? size : buffer->size);
+	gpu->stats.instance_bytes_uploaded += size;
+}
+
+void gpu_instance_buffer_destroy(gpu_t* gpu, gpu_instance_buffer_t* buffer)
+{
+	free_memory(gpu, &buffer->memory);
+	heap_free(gpu->heap, buffer->data);
+	heap_free(gpu->heap, buffer);
+	count_object_destroyed(gpu);
+}
+
+gpu_mesh_t* gpu_mesh_create(gpu_t* gpu, const gpu_mesh_info_t* info)
+{
+	gpu_mesh_t* mesh = heap_alloc_tagged(gpu->heap, sizeof(gpu_mesh_t), 8, k_heap_tag_render);
+	mesh->layout = info->layout;
+	mesh->vertex_data_size = info->vertex_data_size;
+	mesh->index_data_size = info->index_data_size;
+	alloc_memory(gpu, info->vertex_data_size, k_null_buffer_alignment, &mesh->vertex_memory);
+	alloc_memory(gpu, info->index_data_size, k_null_buffer_alignment, &mesh->index_memory);
+	gpu->upload_count += (int)((info->vertex_data_size + k_null_upload_max_size - 1) / k_null_upload_max_size);
+	gpu->upload_count += (int)((info->index_data_size + k_null_upload_max_size - 1) / k_null_upload_max_size);
+	count_object_created(gpu);
+	gpu->stats.mesh_bytes_uploaded += info->vertex_data_size + info->index_data_size;
+	return mesh;
+}
+
+void gpu_mesh_destroy(gpu_t* gpu, gpu_mesh_t* mesh)
+{
+	free_memory(gpu, &mesh->index_memory);
+	free_memory(gpu, &mesh->vertex_memory);
+	heap_free(gpu->heap, mesh);
+	count_object_destroyed(gpu);
+}
+
+gpu_pipeline_t* gpu_pipeline_create(gpu_t* gpu, const gpu_pipeline_info_t* info)
+{
+	gpu_pipeline_t* pipeline = heap_alloc_tagged(gpu->heap, sizeof(gpu_pipeline_t), 8, k_heap_tag_render);
+	pipeline->shader = info->shader;
+	pipeline->mesh_layout = info->mesh_layout;
+	mutex_lock(gpu->stats_mutex);
+	++gpu->stats.pipeline_create_count;
+	mutex_unlock(gpu->stats_mutex);
+	count_object_created(gpu);
+	return pipeline;
+}
+
+void gpu_pipeline_destroy(gpu_t* gpu, gpu_pipeline_t* pipeline)
+{
+	heap_free(gpu->heap, pipeline);
+	count_object_destroyed(gpu);
+}
+
+gpu_shader_t* gpu_shader_create(gpu_t* gpu, const gpu_shader_info_t* info)
+{
+	gpu_shader_t* shader = heap_alloc_tagged(gpu->heap, sizeof(gpu_shader_t), 8, k_heap_tag_render);
+	shader->uniform_buffer_count = info->uniform_buffer_count;
+	shader->instance_data_size = info->instance_data_size;
+	count_object_created(gpu);
+	return shader;
+}
+
+void gpu_shader_destroy(gpu_t* gpu, gpu_shader_t* shader)
+{
+	heap_free(gpu->heap, shader);
+	count_object_destroyed(gpu);
+}
+
+gpu_uniform_buffer_t* gpu_uniform_buffer_create(gpu_t* gpu, const gpu_uniform_buffer_info_t* info)
+{
+	// Keep a CPU copy so updates cost what a mapped write would.
+	gpu_uniform_buffer_t* buffer = heap_alloc_tagged(gpu->heap, sizeof(gpu_uniform_buffer_t), 8, k_heap_tag_render);
+	buffer->data = heap_alloc_tagged(gpu->heap, info->size, 16, k_heap_tag_render);
+	buffer->size = info->size;
+	alloc_memory(gpu, info->size, k_null_uniform_alignment, &buffer->memory);
+	if (info->data)
+	{
+		gpu_uniform_buffer_update(gpu, buffer, info->data, info->size);
+	}
+	count_object_created(gpu);
+	return buffer;
+}
+
+void gpu_uniform_buffer_update(gpu_t* gpu, gpu_uniform_buffer_t* buffer, const void* data, size_t size)
+{
+	memcpy(buffer->data, data, size < buffer->size ? size : buffer->size);
+	++gpu->stats.uniform_update_count;
+	gpu->stats.uniform_bytes_uploaded += size;
+}
+
+void* gpu_uniform_buffer_get_data(gpu_t* gpu, gpu_uniform_buffer_t* buffer)
+{
+	return buffer->data;
+}
+
+void gpu_uniform_buffer_destroy(gpu_t* gpu, gpu_uniform_buffer_t* buffer)
+{
+	free_memory(gpu, &buffer->memory);
+	heap_free(gpu->heap, buffer->data);
+	heap_free(gpu->heap, buffer);
+	count_object_destroyed(gpu);
+}
+
+gpu_cmd_buffer_t* gpu_frame_begin(gpu_t* gpu)
+{
+	if (gpu->upload_count)
+	{
+		gpu->stats.upload_copy_count += gpu->upload_count;
+		++gpu->stats.upload_batch_count;
+		gpu->upload_count = 0;
+	}
+	memset(&gpu->cmd_buffer, 0, sizeof(gpu->cmd_buffer));
+	return &gpu->cmd_buffer;
+}
+
+bool gpu_frame_begin_parallel(gpu_t* gpu, int count, gpu_cmd_buffer_t** cmd_buffers)
+{
+	gpu_frame_begin(gpu);
+	for (int i = 0; i < count; ++i)
+	{
+		memset(&gpu->parallel_cmd_buffers[i], 0, sizeof(gpu->parallel_cmd_buffers[i]));
+		cmd_buffers[i] = &gpu->parallel_cmd_buffers[i];
+	}
+	gpu->parallel_count = count;
+	return true;
+}
+
+void gpu_frame_end(gpu_t* gpu)
+{
+	for (int i = 0; i < gpu->parallel_count; ++i)
+	{
+		add_cmd_buffer_stats(gpu, &gpu->parallel_cmd_buffers[i]);
+	}
+	gpu->parallel_count = 0;
+	add_cmd_buffer_stats(gpu, &gpu->cmd_buffer);
+
+	gpu->frame_index = (gpu->frame_index + 1) % k_null_frame_count;
+	++gpu->stats.frame_count;
+}
+
+void gpu_cmd_pipeline_bind(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer, gpu_pipeline_t* pipeline)
+{
+	cmd_buffer->pipeline = pipeline;
+	++cmd_buffer->stats.pipeline_bind_count;
+}
+
+void gpu_cmd_mesh_bind(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer, gpu_mesh_t* mesh)
+{
+	cmd_buffer->mesh = mesh;
+	++cmd_buffer->stats.mesh_bind_count;
+}
+
+void gpu_cmd_descriptor_bind(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer, gpu_descriptor_t* descriptor)
+{
+	cmd_buffer->descriptor = descriptor;
+	++cmd_buffer->stats.descriptor_bind_count;
+}
+
+void gpu_cmd_descriptor_bind_offsets(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer, gpu_descriptor_t* descriptor, const uint32_t* offsets)
+{
+	gpu_cmd_descriptor_bind(gpu, cmd_buffer, descriptor);
+}
+
+void gpu_cmd_draw(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer)
+{
+	++cmd_buffer->stats.draw_count;
+	++cmd_buffer->stats.instance_count;
+}
+
+void gpu_cmd_draw_instanced(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer, gpu_instance_buffer_t* instances, size_t offset, int instance_count)
+{
+	++cmd_buffer->stats.draw_count;
+	cmd_buffer->stats.instance_count += instance_count;
+}
+
+void gpu_cmd_trace_push(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer, const char* name)
+{
+}
+
+void gpu_cmd_trace_pop(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer)
+{
+}
+
+static void count_object_created(gpu_t* gpu)
+{
+	mutex_lock(gpu->stats_mutex);
+	++gpu->stats.object_create_count;
+	mutex_unlock(gpu->stats_mutex);
+}
+
+static void count_object_destroyed(gpu_t* gpu)
+{
+	mutex_lock(gpu->stats_mutex);
+	++gpu->stats.object_destroy_count;
+	mutex_unlock(gpu->stats_mutex);
+}
+
+static void alloc_memory(gpu_t* gpu, size_t size, size_t alignment, null_memory_t* memory)
+{
+	null_memory_block_t* block = NULL;
+	bool dedicated = size > k_null_memory_block_size / 2;
+	if (!dedicated)
+	{
+		for (block = gpu->memory_blocks; block; block = block->next)
+		{
+			if (block->allocator && gpu_allocator_alloc(block->allocator, size, alignment, &memory->allocation))
+			{
+				break;
+			}
+		}
+	}
+	if (!block)
+	{
+		block = heap_alloc_tagged(gpu->heap, sizeof(null_memory_block_t), 8, k_heap_tag_render);
+		block->size = dedicated ? size : k_null_memory_block_size;
+		block->allocator = dedicated ? NULL : gpu_allocator_create(gpu->heap, block->size);
+		block->next = gpu->memory_blocks;
+		gpu->memory_blocks = block;
+		if (dedicated)
+		{
+			memory->allocation = (gpu_allocation_t) { .offset = 0, .size = size };
+		}
+		else
+		{
+			gpu_allocator_alloc(block->allocator, size, alignment, &memory->allocation);
+		}
+	}
+	memory->block = block;
+}
+
+static void free_memory(gpu_t* gpu, null_memory_t* memory)
+{
+	null_memory_block_t* block = memory->block;
+	if (block->allocator)
+	{
+		gpu_allocator_free(block->allocator, &memory->allocation);
+	}
+	else
+	{
+		for (null_memory_block_t** link = &gpu->memory_blocks; *link; link = &(*link)->next)
+		{
+			if (*link == block)
+			{
+				*link = block->next;
+				break;
+			}
+		}
+		heap_free(gpu->heap, block);
+	}
+}
+
+static void add_cmd_buffer_stats(gpu_t* gpu, gpu_cmd_buffer_t* cmd_buffer)
+{
+	gpu->stats.draw_count += cmd_buffer->stats.draw_count;
+	gpu->stats.instance_count += cmd_buffer->stats.instance_count;
+	gpu->stats.pipeline_bind_count += cmd_buffer->stats.pipeline_bind_count;
+	gpu->stats.mesh_bind_count += cmd_buffer->stats.mesh_bind_count;
+	gpu->stats.descriptor_bind_count += cmd_buffer->stats.descriptor_bind_count;
+	memset(&cmd_buffer->stats, 0, sizeof(cmd_buffer->stats));
+}
+
+#endif
@@ -1,18 +1,61 @@
 #include "heap.h"
 
+#include "atomic.h"
 #include "debug.h"
 #include "mutex.h"
+#include "thread.h"
 #include "tlsf/tlsf.h"
+#include "trace.h"
 
 #include <stdlib.h>
 
 #include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
-#define MAX_POOL 10
+#include <intrin.h>
+#define HEAP_RETURN_ADDRESS() _ReturnAddress()
+#define HEAP_STACK_ADDRESS() _AddressOfReturnAddress()
+
+enum
+{
+	// Every allocation is preceded by a heap_header_t, and is aligned to at least this.
+	k_heap_header_size = 16,
+	// Size classes step by 16 bytes up to 128 bytes, then by a quarter of each power of two up to 2KB.
+	k_heap_linear_class_count = 8,
+	k_heap_size_class_count = 24,
+	k_heap_max_cached_size = 2048,
+	// Free blocks a thread keeps per size class. Misses refill, and overflows release, half of it at a time.
+	k_heap_magazine_capacity = 32,
+	// Blocks freed for another thread's cache are handed over this many at a time.
+	k_heap_remote_batch = 16,
+	k_heap_cache_line = 64,
+
+	// Frames kept per allocation stack with k_heap_flag_track_leaks, starting at heap_alloc()'s caller.
+	k_heap_stack_depth = 8,
+	// Frames captured, leaving room for the heap's own frames above the caller.
+	k_heap_stack_capture = k_heap_stack_depth + 8,
+	// Distinct stacks the table holds. A power of two.
+	k_heap_stack_capacity = 16 * 1024,
+	// Call sites each thread remembers the last stack for. A power of two.
+	k_heap_site_count = 256,
+	// A remembered site captures its stack again after this many allocations, to follow the paths that reach it.
+	// The gap doubles each time the stack comes back the same, and drops back when it changes.
+	k_heap_site_min_refresh = 16,
+	k_heap_site_max_refresh = 4096,
+};
+
+static const uint32_t k_size_classes[k_heap_size_class_count] =
+{
+	16, 32, 48, 64, 80, 96, 112, 128,
+	160, 192, 224, 256,
+	320, 384, 448, 512,
+	640, 768, 896, 1024,
+	1280, 1536, 1792, 2048,
+};
 
 typedef struct arena_t
 {
@@ -20,26 +63,172 @@ typedef struct arena_t
 	struct arena_t* next;
 } arena_t;
 
+typedef struct heap_cache_t heap_cache_t;
+
+// Sits just before every address heap_alloc() returns.
+// Blocks allocated with more padding than the header also start with a copy of it, so leaked blocks can be reported.
+typedef struct heap_header_t
+{
+	// Cache the block belongs to while free, or NULL for blocks that go straight back to TLSF.
+	heap_cache_t* cache;
+	// Stack table entry of the allocating call with k_heap_flag_track_leaks, or zero.
+	uint32_t stack_id;
+	// Index into k_size_classes, for cached blocks.
+	uint8_t size_class;
+	// heap_tag_t the block is counted against while allocated.
+	uint8_t tag;
+	// Log2 of the bytes from the start of the TLSF block to the returned address.
+	uint8_t offset_shift;
+} heap_header_t;
+
+// An allocation stack, with k_heap_flag_track_leaks. Its index in the table plus one is its stack id.
+typedef struct heap_stack_t
+{
+	// Zero while the entry is empty. Set last, so a reader that sees it sees the frames.
+	int hash;
+	int depth;
+	void* frames[k_heap_stack_depth];
+} heap_stack_t;
+
+// The stack last captured at a call site, reached with the stack at a given depth.
+// Different paths to one call site rarely reach it at the same depth, so they rarely share an entry.
+typedef struct heap_site_t
+{
+	void* caller;
+	void* stack_address;
+	uint32_t stack_id;
+	// Allocations left before the next capture, and the gap the last capture set.
+	uint32_t countdown;
+	uint32_t refresh;
+} heap_site_t;
+
+// Leaked blocks allocated by one stack, gathered for the report in heap_destroy().
+typedef struct heap_leak_t
+{
+	int64_t bytes;
+	int count;
+	int tag;
+} heap_leak_t;
+
+typedef struct heap_leak_report_t
+{
+	// Indexed by stack id when tracking; otherwise each leak is reported as it is found.
+	heap_leak_t* leaks;
+	int64_t bytes;
+	int count;
+} heap_leak_report_t;
+
+// Usage of one tag, counted by whichever thread allocates or frees.
+// A thread's counters go negative when it frees more than it allocates; only the sum over threads means anything.
+typedef struct heap_counters_t
+{
+	int64_t live_bytes;
+	int64_t live_count;
+	int64_t alloc_count;
+} heap_counters_t;
+
+// Free blocks of one size class, used as a stack.
+typedef struct heap_magazine_t
+{
+	int count;
+	heap_header_t* blocks[k_heap_magazine_capacity];
+} heap_magazine_t;
+
+// One thread's free blocks.
+typedef struct heap_cache_t
+{
+	// Blocks other threads freed back to this cache, linked through their first bytes.
+	// Other threads push batches lock-free; the owner takes the whole list at once on a miss.
+	void* remote_frees;
+	// Kept off the line other threads write to.
+	char remote_padding[k_heap_cache_line - sizeof(void*)];
+
+	// This thread's frees of blocks owned by another cache, gathered for one owner at a time.
+	heap_cache_t* batch_owner;
+	heap_header_t* batch_head;
+	heap_header_t* batch_tail;
+	int batch_count;
+
+	heap_magazine_t magazines[k_heap_size_class_count];
+
+	// Only the owning thread writes these; sum_counters() reads them without stopping it.
+	heap_counters_t counters[k_heap_tag_count];
+
+	// With k_heap_flag_track_leaks, call sites this thread allocated from, indexed by a hash of the caller.
+	heap_site_t sites[k_heap_site_count];
+} heap_cache_t;
+
 typedef struct heap_t
 {
 	tlsf_t tlsf;
 	size_t grow_increment;
 	arena_t* arena;
 	mutex_t* mutex;
+	uint32_t flags;
+	// Each thread's heap_cache_t. Threads past the limit allocate under the lock.
+	thread_registry_t caches;
+
+	// Allocations that don't go through a thread cache, and frees by threads without one. Written under the lock.
+	heap_counters_t counters[k_heap_tag_count];
+
+	// Arena and TLSF usage, and sampled peaks, kept under the lock.
+	int arena_count;
+	uint64_t arena_bytes;
+	uint64_t used_bytes;
+	uint64_t peak_used_bytes;
+	// Per tag, then the total.
+	int64_t peak_live_bytes[k_heap_tag_count + 1];
+	int64_t traced_alloc_count;
+
+	// Allocation stacks with k_heap_flag_track_leaks, as an open addressed hash table. Looked up without the lock.
+	heap_stack_t* stacks;
 } heap_t;
 
-//Function that prints the call stack of lost memory
-static void default_walker_p(void* ptr, size_t size, int used, void* user)
+static const char* const k_heap_tag_names[k_heap_tag_count] =
 {
-	(void)user;
+	"none",
+	"render",
+	"net",
+	"fs",
+	"ecs",
+	"lua",
+	"trace",
+};
 
-	if (used == 1) 
-	{
-		debug_backtrace_print(ptr, size, used, user);
-	}
-}
+// The cache this thread used last, and the heap it belongs to.
+static THREAD_LOCAL thread_registry_slot_t s_thread;
+
+static void* alloc(heap_t* heap, size_t size, size_t alignment, heap_tag_t tag, void* caller, void* stack_address);
+static void* alloc_locked(heap_t* heap, size_t size, size_t alignment);
+static void free_locked(heap_t* heap, void* block);
+static void count(heap_counters_t* counters, int tag, int64_t bytes, int64_t blocks);
+static void sum_counters(heap_t* heap, heap_stats_t* stats);
+static void walk_free_blocks(void* ptr, size_t size, int used, void* user);
+static heap_cache_t* get_thread_cache(heap_t* heap);
+static void* create_cache(void* user);
+static int find_last_set(uint64_t value);
+static int get_size_class(size_t size);
+static void* get_block(heap_header_t* header);
+static heap_header_t** get_next(heap_header_t* header);
+static void refill_magazine(heap_t* heap, heap_cache_t* cache, int size_class);
+static void push_magazine(heap_t* heap, heap_cache_t* cache, heap_header_t* header);
+static void take_remote_frees(heap_t* heap, heap_cache_t* cache);
+static void free_remote(heap_cache_t* cache, heap_header_t* header);
+static void flush_remote_batch(heap_cache_t* cache);
+static void push_remote(heap_cache_t* owner, heap_header_t* head, heap_header_t* tail);
+static void release_cache(heap_t* heap, heap_cache_t* cache);
+static uint32_t get_stack_id(heap_t* heap, heap_cache_t* cache, void* caller, void* stack_address);
+static uint32_t capture_stack(heap_t* heap, void* caller);
+static uint32_t find_or_add_stack(heap_t* heap, void** frames, int depth);
+static void report_leaks(heap_t* heap);
+static void walk_leaks(void* ptr, size_t size, int used, void* user);
 
 heap_t* heap_create(size_t grow_increment)
+{
+	return heap_create_flags(grow_increment, 0);
+}
+
+heap_t* heap_create_flags(size_t grow_increment, uint32_t flags)
 {
 	heap_t* heap = VirtualAlloc(NULL, sizeof(heap_t) + tlsf_size(),
 		MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
@@ -55,14 +244,211 @@ heap_t* heap_create(size_t grow_increment)
 	heap->grow_increment = grow_increment;
 	heap->tlsf = tlsf_create(heap + 1);
 	heap->arena = NULL;
+	heap->flags = flags;
+	thread_registry_init(&heap->caches);
+
+	// Kept outside the arenas, so the stacks don't count as heap usage and outlive the blocks they describe.
+	heap->stacks = NULL;
+	if (flags & k_heap_flag_track_leaks)
+	{
+		heap->stacks = VirtualAlloc(NULL, sizeof(heap_stack_t) * k_heap_stack_capacity,
+			MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	}
 
 	return heap;
 }
 
 void* heap_alloc(heap_t* heap, size_t size, size_t alignment)
 {
+	return alloc(heap, size, alignment, k_heap_tag_none, HEAP_RETURN_ADDRESS(), HEAP_STACK_ADDRESS());
+}
+
+void* heap_alloc_tagged(heap_t* heap, size_t size, size_t alignment, heap_tag_t tag)
+{
+	return alloc(heap, size, alignment, tag, HEAP_RETURN_ADDRESS(), HEAP_STACK_ADDRESS());
+}
+
+void heap_free(heap_t* heap, void* address)
+{
+	if (!address)
+	{
+		return;
+	}
+
+	heap_header_t* header = (heap_header_t*)address - 1;
+	if (header->cache)
+	{
+		heap_cache_t* cache = get_thread_cache(heap);
+		if (cache)
+		{
+			count(cache->counters, header->tag, -(int64_t)k_size_classes[header->size_class], -1);
+		}
+		else
+		{
+			mutex_lock(heap->mutex);
+			count(heap->counters, header->tag, -(int64_t)k_size_classes[header->size_class], -1);
+			mutex_unlock(heap->mutex);
+		}
+		if (cache == header->cache)
+		{
+			push_magazine(heap, cache, header);
+		}
+		else
+		{
+			free_remote(cache, header);
+		}
+		return;
+	}
+
+	void* block = get_block(header);
+	mutex_lock(heap->mutex);
+	count(heap->counters, header->tag, -(int64_t)(tlsf_block_size(block) - ((size_t)1 << header->offset_shift)), -1);
+	free_locked(heap, block);
+	mutex_unlock(heap->mutex);
+}
+
+void heap_destroy(heap_t* heap)
+{
+	// Cached blocks are allocated as far as TLSF knows. Hand every batch to its owner,
+	// then release each cache, so the walk below only reports real leaks.
+	for (int i = 0; i < heap->caches.count; ++i)
+	{
+		flush_remote_batch(heap->caches.states[i]);
+	}
+	for (int i = 0; i < heap->caches.count; ++i)
+	{
+		release_cache(heap, heap->caches.states[i]);
+	}
+
+	tlsf_destroy(heap->tlsf);
+
+	report_leaks(heap);
+
+	arena_t* arena = heap->arena;
+	while (arena)
+	{
+		arena_t* next = arena->next;
+		VirtualFree(arena, 0, MEM_RELEASE);
+		arena = next;
+	}
+	if (heap->stacks)
+	{
+		VirtualFree(heap->stacks, 0, MEM_RELEASE);
+	}
+
+	mutex_destroy(heap->mutex);
+
+	VirtualFree(heap, 0, MEM_RELEASE);
+}
+
+void heap_get_stats(heap_t* heap, heap_stats_t* stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	mutex_lock(heap->mutex);
+	sum_counters(heap, stats);
+	stats->arena_count = heap->arena_count;
+	stats->arena_bytes = heap->arena_bytes;
+	stats->used_bytes = heap->used_bytes;
+	stats->peak_used_bytes = heap->peak_used_bytes;
+	for (arena_t* arena = heap->arena; arena; arena = arena->next)
+	{
+		tlsf_walk_pool(arena->pool, walk_free_blocks, stats);
+	}
+	mutex_unlock(heap->mutex);
+
+	stats->fragmentation = stats->free_bytes ? 1.0f - (float)stats->largest_free_bytes / (float)stats->free_bytes : 0.0f;
+}
+
+void heap_trace_counters(heap_t* heap, trace_t* trace)
+{
+	heap_stats_t stats = { 0 };
+	mutex_lock(heap->mutex);
+	sum_counters(heap, &stats);
+	int64_t used[] = { (int64_t)heap->arena_bytes, (int64_t)heap->used_bytes };
+	int64_t allocs = stats.total.alloc_count - heap->traced_alloc_count;
+	heap->traced_alloc_count = stats.total.alloc_count;
+	mutex_unlock(heap->mutex);
+
+	int64_t live_bytes[k_heap_tag_count];
+	for (int i = 0; i < k_heap_tag_count; ++i)
+	{
+		live_bytes[i] = stats.tags[i].live_bytes;
+	}
+	trace_counter(trace, "heap live bytes", k_heap_tag_count, k_heap_tag_names, live_bytes);
+
+	const char* const k_used_series[] = { "arenas", "used" };
+	trace_counter(trace, "heap arena bytes", _countof(k_used_series), k_used_series, used);
+
+	const char* const k_alloc_series[] = { "allocs" };
+	trace_counter(trace, "heap allocs", 1, k_alloc_series, &allocs);
+}
+
+const char* heap_tag_get_name(heap_tag_t tag)
+{
+	return tag >= 0 && tag < k_heap_tag_count ? k_heap_tag_names[tag] : "unknown";
+}
+
+// Allocate for heap_alloc() or heap_alloc_tagged().
+// Caller is the address they return to, and stack address is a location in their stack frame.
+static void* alloc(heap_t* heap, size_t size, size_t alignment, heap_tag_t tag, void* caller, void* stack_address)
+{
+	heap_cache_t* cache = NULL;
+	if (size <= k_heap_max_cached_size && alignment <= k_heap_header_size && !(heap->flags & k_heap_flag_no_thread_cache))
+	{
+		cache = get_thread_cache(heap);
+	}
+
+	if (cache)
+	{
+		int size_class = get_size_class(size);
+		heap_magazine_t* magazine = &cache->magazines[size_class];
+		if (magazine->count == 0)
+		{
+			refill_magazine(heap, cache, size_class);
+			if (magazine->count == 0)
+			{
+				return NULL;
+			}
+		}
+		heap_header_t* header = magazine->blocks[--magazine->count];
+		header->stack_id = heap->stacks ? get_stack_id(heap, cache, caller, stack_address) : 0;
+		header->tag = (uint8_t)tag;
+		count(cache->counters, tag, k_size_classes[size_class], 1);
+		return header + 1;
+	}
+
+	// Large and over-aligned allocations, and every allocation on a thread without a cache, come straight from TLSF.
+	// The header goes in the padding that keeps the returned address aligned.
+	alignment = __max(alignment, k_heap_header_size);
+	uint32_t stack_id = heap->stacks ? get_stack_id(heap, NULL, caller, stack_address) : 0;
 	mutex_lock(heap->mutex);
+	char* block = alloc_locked(heap, size + alignment, alignment);
+	if (block)
+	{
+		count(heap->counters, tag, tlsf_block_size(block) - alignment, 1);
+	}
+	mutex_unlock(heap->mutex);
+	if (!block)
+	{
+		return NULL;
+	}
 
+	heap_header_t* header = (heap_header_t*)(block + alignment) - 1;
+	header->cache = NULL;
+	header->stack_id = stack_id;
+	header->size_class = 0;
+	header->tag = (uint8_t)tag;
+	header->offset_shift = (uint8_t)find_last_set(alignment);
+	if (alignment > k_heap_header_size)
+	{
+		*(heap_header_t*)block = *header;
+	}
+	return header + 1;
+}
+
+// Allocate from TLSF, adding an arena if it is full. The caller holds the heap's lock.
+static void* alloc_locked(heap_t* heap, size_t size, size_t alignment)
+{
 	void* address = tlsf_memalign(heap->tlsf, alignment, size);
 	if (!address)
 	{
@@ -84,40 +470,439 @@ void* heap_alloc(heap_t* heap, size_t size, size_t alignment)
 
 		arena->next = heap->arena;
 		heap->arena = arena;
+		heap->arena_count++;
+		heap->arena_bytes += arena_size;
 
 		address = tlsf_memalign(heap->tlsf, alignment, size);
 	}
+	if (address)
+	{
+		heap->used_bytes += tlsf_block_size(address);
+		heap->peak_used_bytes = __max(heap->peak_used_bytes, heap->used_bytes);
+	}
+	return address;
+}
 
-//<<<<<<< HEAD
-//=======
-	mutex_unlock(heap->mutex);
+// Return a block to TLSF. The caller holds the heap's lock.
+static void free_locked(heap_t* heap, void* block)
+{
+	heap->used_bytes -= tlsf_block_size(block);
+	tlsf_free(heap->tlsf, block);
+}
 
-//>>>>>>> d16ca9eb862c4f05fe40079290d10f1bdd8d09ac
-	return address;
+// Count an allocation or free. Only a cache's owning thread writes its counters, and only under the lock for the heap's.
+// Readers may see a count mid-update, but each field is read whole, so no locked adds are needed.
+static void count(heap_counters_t* counters, int tag, int64_t bytes, int64_t blocks)
+{
+	// Only the owning thread writes these, but heap_get_stats reads them from any thread,
+	// so each one is updated with a whole-word load and store rather than a plain +=.
+	heap_counters_t* counter = &counters[tag];
+	atomic_store64_relaxed(&counter->live_bytes, atomic_load64_relaxed(&counter->live_bytes) + bytes);
+	atomic_store64_relaxed(&counter->live_count, atomic_load64_relaxed(&counter->live_count) + blocks);
+	if (blocks > 0)
+	{
+		atomic_store64_relaxed(&counter->alloc_count, atomic_load64_relaxed(&counter->alloc_count) + blocks);
+	}
 }
 
-void heap_free(heap_t* heap, void* address)
+// Add up every thread's counters, and raise the sampled peaks. The caller holds the heap's lock.
+static void sum_counters(heap_t* heap, heap_stats_t* stats)
+{
+	for (int i = -1; i < heap->caches.count; ++i)
+	{
+		heap_counters_t* counters = i < 0 ? heap->counters : ((heap_cache_t*)heap->caches.states[i])->counters;
+		for (int tag = 0; tag < k_heap_tag_count; ++tag)
+		{
+			stats->tags[tag].live_bytes += atomic_load64_relaxed(&counters[tag].live_bytes);
+			stats->tags[tag].live_count += atomic_load64_relaxed(&counters[tag].live_count);
+			stats->tags[tag].alloc_count += atomic_load64_relaxed(&counters[tag].alloc_count);
+		}
+	}
+
+	for (int tag = 0; tag < k_heap_tag_count; ++tag)
+	{
+		stats->total.live_bytes += stats->tags[tag].live_bytes;
+		stats->total.live_count += stats->tags[tag].live_count;
+		stats->total.alloc_count += stats->tags[tag].alloc_count;
+	}
+
+	for (int tag = 0; tag <= k_heap_tag_count; ++tag)
+	{
+		heap_tag_stats_t* tag_stats = tag < k_heap_tag_count ? &stats->tags[tag] : &stats->total;
+		heap->peak_live_bytes[tag] = __max(heap->peak_live_bytes[tag], tag_stats->live_bytes);
+		tag_stats->peak_bytes = heap->peak_live_bytes[tag];
+	}
+}
+
+static void walk_free_blocks(void* ptr, size_t size, int used, void* user)
+{
+	(void)ptr;
+	heap_stats_t* stats = user;
+	if (!used)
+	{
+		stats->free_bytes += size;
+		stats->largest_free_bytes = __max(stats->largest_free_bytes, size);
+	}
+}
+
+static heap_cache_t* get_thread_cache(heap_t* heap)
+{
+	return thread_registry_get(&heap->caches, &s_thread, heap->mutex, create_cache, heap);
+}
+
+// Called on a thread's first use of a heap, with the heap's lock held.
+static void* create_cache(void* user)
+{
+	heap_t* heap = user;
+	heap_cache_t* cache = alloc_locked(heap, sizeof(heap_cache_t), k_heap_cache_line);
+	if (cache)
+	{
+		memset(cache, 0, sizeof(*cache));
+	}
+	return cache;
+}
+
+static int find_last_set(uint64_t value)
+{
+	unsigned long index;
+	_BitScanReverse64(&index, value);
+	return (int)index;
+}
+
+static int get_size_class(size_t size)
+{
+	if (size <= k_size_classes[k_heap_linear_class_count - 1])
+	{
+		return size ? (int)((size - 1) / k_size_classes[0]) : 0;
+	}
+	// Four classes per power of two: 129 to 256 bytes step by 32, 257 to 512 by 64, and so on.
+	int power = find_last_set(size - 1);
+	int first_power = find_last_set(k_size_classes[k_heap_linear_class_count - 1]);
+	return k_heap_linear_class_count + (power - first_power) * 4 + (int)((size - 1 - ((size_t)1 << power)) >> (power - 2));
+}
+
+static void* get_block(heap_header_t* header)
+{
+	return (char*)(header + 1) - ((size_t)1 << header->offset_shift);
+}
+
+// Free blocks are linked through the memory just after their header.
+static heap_header_t** get_next(heap_header_t* header)
 {
+	return (heap_header_t**)(header + 1);
+}
+
+static void refill_magazine(heap_t* heap, heap_cache_t* cache, int size_class)
+{
+	// Blocks other threads have freed back to this cache come first.
+	take_remote_frees(heap, cache);
+
+	heap_magazine_t* magazine = &cache->magazines[size_class];
+	if (magazine->count > 0)
+	{
+		return;
+	}
+
+	// Then half a magazine from TLSF under one lock.
+	size_t block_size = k_heap_header_size + k_size_classes[size_class];
 	mutex_lock(heap->mutex);
-	tlsf_free(heap->tlsf, address);
+	while (magazine->count < k_heap_magazine_capacity / 2)
+	{
+		heap_header_t* header = alloc_locked(heap, block_size, k_heap_header_size);
+		if (!header)
+		{
+			break;
+		}
+		header->cache = cache;
+		header->offset_shift = (uint8_t)find_last_set(k_heap_header_size);
+		header->size_class = (uint8_t)size_class;
+		magazine->blocks[magazine->count++] = header;
+	}
 	mutex_unlock(heap->mutex);
 }
 
-void heap_destroy(heap_t* heap)
+static void push_magazine(heap_t* heap, heap_cache_t* cache, heap_header_t* header)
 {
-	tlsf_destroy(heap->tlsf);
+	heap_magazine_t* magazine = &cache->magazines[header->size_class];
+	if (magazine->count == k_heap_magazine_capacity)
+	{
+		// Full: return the older half to TLSF under one lock.
+		mutex_lock(heap->mutex);
+		for (int i = 0; i < k_heap_magazine_capacity / 2; ++i)
+		{
+			free_locked(heap, get_block(magazine->blocks[i]));
+		}
+		mutex_unlock(heap->mutex);
+		memmove(magazine->blocks, magazine->blocks + k_heap_magazine_capacity / 2, sizeof(heap_header_t*) * (k_heap_magazine_capacity / 2));
+		magazine->count -= k_heap_magazine_capacity / 2;
+	}
+	magazine->blocks[magazine->count++] = header;
+}
 
-	arena_t* arena = heap->arena;
-	while (arena)
+static void take_remote_frees(heap_t* heap, heap_cache_t* cache)
+{
+	heap_header_t* header = atomic_exchange_ptr(&cache->remote_frees, NULL);
+
+	// Blocks that don't fit in their magazine go back to TLSF together.
+	heap_header_t* overflow = NULL;
+	while (header)
 	{
-		tlsf_walk_pool(arena->pool, default_walker_p, NULL);
-		arena_t* next = arena->next;
-		
-		VirtualFree(arena, 0, MEM_RELEASE);
-		arena = next;
+		heap_header_t* next = *get_next(header);
+		heap_magazine_t* magazine = &cache->magazines[header->size_class];
+		if (magazine->count < k_heap_magazine_capacity)
+		{
+			magazine->blocks[magazine->count++] = header;
+		}
+		else
+		{
+			*get_next(header) = overflow;
+			overflow = header;
+		}
+		header = next;
 	}
 
-	mutex_destroy(heap->mutex);
+	if (overflow)
+	{
+		mutex_lock(heap->mutex);
+		while (overflow)
+		{
+			heap_header_t* next = *get_next(overflow);
+			free_locked(heap, get_block(overflow));
+			overflow = next;
+		}
+		mutex_unlock(heap->mutex);
+	}
+}
 
-	VirtualFree(heap, 0, MEM_RELEASE);
+static void free_remote(heap_cache_t* cache, heap_header_t* header)
+{
+	// Without a cache to batch in, hand the block over on its own.
+	if (!cache)
+	{
+		push_remote(header->cache, header, header);
+		return;
+	}
+
+	if (cache->batch_owner != header->cache)
+	{
+		flush_remote_batch(cache);
+		cache->batch_owner = header->cache;
+		cache->batch_tail = header;
+	}
+	*get_next(header) = cache->batch_head;
+	cache->batch_head = header;
+	if (++cache->batch_count == k_heap_remote_batch)
+	{
+		flush_remote_batch(cache);
+	}
+}
+
+static void flush_remote_batch(heap_cache_t* cache)
+{
+	if (cache->batch_count)
+	{
+		push_remote(cache->batch_owner, cache->batch_head, cache->batch_tail);
+	}
+	cache->batch_owner = NULL;
+	cache->batch_head = NULL;
+	cache->batch_tail = NULL;
+	cache->batch_count = 0;
+}
+
+// Push a chain of blocks onto their owner's remote list with one compare and exchange.
+// The owner only ever takes the whole list, so a block can't be popped and pushed back underneath us.
+static void push_remote(heap_cache_t* owner, heap_header_t* head, heap_header_t* tail)
+{
+	void* expected = NULL;
+	for (;;)
+	{
+		*get_next(tail) = expected;
+		void* previous = atomic_compare_and_exchange_ptr(&owner->remote_frees, expected, head);
+		if (previous == expected)
+		{
+			break;
+		}
+		expected = previous;
+	}
+}
+
+// Return everything a cache holds to TLSF, then the cache itself. Only while destroying the heap.
+static void release_cache(heap_t* heap, heap_cache_t* cache)
+{
+	for (heap_header_t* header = cache->remote_frees; header;)
+	{
+		heap_header_t* next = *get_next(header);
+		tlsf_free(heap->tlsf, get_block(header));
+		header = next;
+	}
+	for (int i = 0; i < k_heap_size_class_count; ++i)
+	{
+		heap_magazine_t* magazine = &cache->magazines[i];
+		for (int j = 0; j < magazine->count; ++j)
+		{
+			tlsf_free(heap->tlsf, get_block(magazine->blocks[j]));
+		}
+	}
+	tlsf_free(heap->tlsf, cache);
+}
+
+// Get the stack id for an allocation from caller. A thread with a cache reuses the stack it last captured at the
+// same call site and stack depth, so a hot call site with one path to it rarely pays for a capture.
+// The caller's frame is always exact; the frames above it are from the latest capture at that site and depth.
+static uint32_t get_stack_id(heap_t* heap, heap_cache_t* cache, void* caller, void* stack_address)
+{
+	if (!cache)
+	{
+		return capture_stack(heap, caller);
+	}
+
+	uintptr_t key = (uintptr_t)caller ^ ((uintptr_t)stack_address >> 4);
+	heap_site_t* site = &cache->sites[(key ^ (key >> 12)) & (k_heap_site_count - 1)];
+	if (site->caller != caller || site->stack_address != stack_address)
+	{
+		site->caller = caller;
+		site->stack_address = stack_address;
+		site->stack_id = 0;
+		site->countdown = 0;
+		site->refresh = k_heap_site_min_refresh;
+	}
+	if (site->countdown-- == 0)
+	{
+		uint32_t stack_id = capture_stack(heap, caller);
+		site->refresh = stack_id == site->stack_id ? __min(site->refresh * 2, k_heap_site_max_refresh) : k_heap_site_min_refresh;
+		site->countdown = site->refresh - 1;
+		site->stack_id = stack_id;
+	}
+	return site->stack_id;
+}
+
+// Capture the calling stack from caller outward, and return its stack id.
+static uint32_t capture_stack(heap_t* heap, void* caller)
+{
+	void* frames[k_heap_stack_capture];
+	int count = debug_backtrace(frames, k_heap_stack_capture, 0);
+
+	// Drop the heap's own frames. How many there are depends on inlining, so look for the caller.
+	int first = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		if (frames[i] == caller)
+		{
+			first = i;
+			break;
+		}
+	}
+	return find_or_add_stack(heap, frames + first, __min(count - first, k_heap_stack_depth));
+}
+
+// Returns zero if the table is full.
+static uint32_t find_or_add_stack(heap_t* heap, void** frames, int depth)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (int i = 0; i < depth; ++i)
+	{
+		hash = (hash ^ (uintptr_t)frames[i]) * 1099511628211ULL;
+	}
+	int stack_hash = (int)((uint32_t)(hash ^ (hash >> 32)) | 1);
+
+	uint32_t index = (uint32_t)stack_hash & (k_heap_stack_capacity - 1);
+	for (int probe = 0; probe < k_heap_stack_capacity; ++probe)
+	{
+		heap_stack_t* stack = &heap->stacks[index];
+		int entry_hash = atomic_load(&stack->hash);
+		if (entry_hash == 0)
+		{
+			// Add it under the lock, unless another thread filled the entry first.
+			mutex_lock(heap->mutex);
+			if (stack->hash == 0)
+			{
+				stack->depth = depth;
+				memcpy(stack->frames, frames, sizeof(void*) * depth);
+				atomic_store(&stack->hash, stack_hash);
+				mutex_unlock(heap->mutex);
+				return index + 1;
+			}
+			mutex_unlock(heap->mutex);
+			entry_hash = atomic_load(&stack->hash);
+		}
+
+		if (entry_hash == stack_hash && stack->depth == depth && memcmp(stack->frames, frames, sizeof(void*) * depth) == 0)
+		{
+			return index + 1;
+		}
+		index = (index + 1) & (k_heap_stack_capacity - 1);
+	}
+	return 0;
+}
+
+// Report blocks still allocated. With k_heap_flag_track_leaks, leaks are grouped by stack and each stack is
+// symbolized once; otherwise each block is reported on its own, with no stack.
+static void report_leaks(heap_t* heap)
+{
+	heap_leak_report_t report = { 0 };
+	if (heap->stacks)
+	{
+		report.leaks = VirtualAlloc(NULL, sizeof(heap_leak_t) * (k_heap_stack_capacity + 1),
+			MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	}
+
+	for (arena_t* arena = heap->arena; arena; arena = arena->next)
+	{
+		tlsf_walk_pool(arena->pool, walk_leaks, &report);
+	}
+
+	if (report.leaks)
+	{
+		for (int i = 0; i <= k_heap_stack_capacity; ++i)
+		{
+			heap_leak_t* leak = &report.leaks[i];
+			if (!leak->count)
+			{
+				continue;
+			}
+			debug_print(k_print_error, "Memory leak of %d blocks, %lld bytes (%s), allocated at:\n",
+				leak->count, (long long)leak->bytes, heap_tag_get_name(leak->tag));
+			if (i > 0)
+			{
+				debug_backtrace_print(heap->stacks[i - 1].frames, heap->stacks[i - 1].depth);
+			}
+			else
+			{
+				debug_print(k_print_error, "  (stack table full)\n");
+			}
+		}
+		VirtualFree(report.leaks, 0, MEM_RELEASE);
+	}
+
+	if (report.count)
+	{
+		debug_print(k_print_error, "%d blocks, %lld bytes leaked.%s\n", report.count, (long long)report.bytes,
+			heap->stacks ? "" : " Create the heap with k_heap_flag_track_leaks to see where they were allocated.");
+	}
+}
+
+static void walk_leaks(void* ptr, size_t size, int used, void* user)
+{
+	if (!used)
+	{
+		return;
+	}
+
+	// Every allocated block starts with its header, or a copy of it.
+	heap_leak_report_t* report = user;
+	heap_header_t* header = ptr;
+	int64_t bytes = (int64_t)(size - ((size_t)1 << header->offset_shift));
+	report->bytes += bytes;
+	report->count++;
+	if (report->leaks)
+	{
+		heap_leak_t* leak = &report->leaks[header->stack_id];
+		leak->bytes += bytes;
+		leak->count++;
+		leak->tag = header->tag;
+	}
+	else
+	{
+		debug_print(k_print_error, "Memory leak of %lld bytes (%s)\n", (long long)bytes, heap_tag_get_name(header->tag));
+	}
 }
@@ -1,25 +1,109 @@
 #pragma once
 
+#include <stdint.h>
 #include <stdlib.h>
 
 // Heap Memory Manager
-// 
+//
 // Main object, heap_t, represents a dynamic memory heap.
 // Once created, memory can be allocated and free from the heap.
+//
+// Small allocations (up to 2KB, aligned to 16 bytes or less) are served from per-thread caches
+// without taking the heap's lock. A block freed on another thread goes back to the cache of the
+// thread that allocated it, handed over in batches. The shared TLSF heap is only locked on a cache
+// miss, when a cache overflows, and for larger or over-aligned allocations.
 
 // Handle to a heap.
 typedef struct heap_t heap_t;
 
+typedef struct trace_t trace_t;
+
+// Options for heap_create_flags().
+typedef enum heap_flags_t
+{
+	// Serve every allocation from the shared TLSF heap under its lock, with no thread caches.
+	k_heap_flag_no_thread_cache = 1 << 0,
+	// Record where each allocation was made, so heap_destroy() can say where leaked blocks came from.
+	// Each allocation keeps a 32-bit id into a table of distinct stacks, which are only symbolized for the report.
+	// Call sites reuse the last stack captured at the same stack depth, capturing again periodically, so deeper
+	// frames may rarely be from another path through the same call site.
+	k_heap_flag_track_leaks = 1 << 1,
+} heap_flags_t;
+
+// Subsystem an allocation is counted against in heap_stats_t.
+typedef enum heap_tag_t
+{
+	k_heap_tag_none,
+	k_heap_tag_render,
+	k_heap_tag_net,
+	k_heap_tag_fs,
+	k_heap_tag_ecs,
+	k_heap_tag_lua,
+	k_heap_tag_trace,
+
+	k_heap_tag_count,
+} heap_tag_t;
+
+// Usage by one tag.
+typedef struct heap_tag_stats_t
+{
+	// Bytes and blocks allocated and not yet freed, counting each block's full usable size.
+	int64_t live_bytes;
+	int64_t live_count;
+	// Highest live bytes seen by heap_get_stats() or heap_trace_counters().
+	int64_t peak_bytes;
+	// Allocations made since the heap was created. The difference between two calls gives a rate.
+	int64_t alloc_count;
+} heap_tag_stats_t;
+
+typedef struct heap_stats_t
+{
+	heap_tag_stats_t tags[k_heap_tag_count];
+	// All tags together.
+	heap_tag_stats_t total;
+
+	// Memory the heap has taken from the OS, in grow_increment or larger arenas.
+	int arena_count;
+	uint64_t arena_bytes;
+	// Bytes in blocks taken from the arenas, including free blocks held in thread caches, and the most there have been.
+	uint64_t used_bytes;
+	uint64_t peak_used_bytes;
+	// Bytes in free blocks in the arenas, and the largest of them.
+	uint64_t free_bytes;
+	uint64_t largest_free_bytes;
+	// Share of free memory outside the largest free block: 0 when free memory is one block, near 1 when it is scattered.
+	float fragmentation;
+} heap_stats_t;
+
 // Creates a new memory heap.
 // The grow increment is the default size with which the heap grows.
 // Should be a multiple of OS page size.
 heap_t* heap_create(size_t grow_increment);
 
+// Creates a new memory heap with heap_flags_t options.
+heap_t* heap_create_flags(size_t grow_increment, uint32_t flags);
+
 // Destroy a previously created heap.
+// Blocks still allocated are reported as leaks, grouped by allocation stack with k_heap_flag_track_leaks.
 void heap_destroy(heap_t* heap);
 
 // Allocate memory from a heap.
+// The allocation is counted against k_heap_tag_none.
 void* heap_alloc(heap_t* heap, size_t size, size_t alignment);
 
+// Allocate memory from a heap, counted against a tag.
+void* heap_alloc_tagged(heap_t* heap, size_t size, size_t alignment, heap_tag_t tag);
+
 // Free memory previously allocated from a heap.
 void heap_free(heap_t* heap, void* address);
+
+// Get usage counters for each tag and for the heap's arenas.
+// Walks every block in the heap under its lock to find free space; not meant to be called every frame.
+void heap_get_stats(heap_t* heap, heap_stats_t* stats);
+
+// Add live bytes per tag, used bytes, and allocations since the last call as counter events to a trace.
+// Cheap enough to call once a frame, though render samples it less often. The trace drops them while it isn't capturing.
+void heap_trace_counters(heap_t* heap, trace_t* trace);
+
+// Get the name of a tag, as used for trace counters.
+const char* heap_tag_get_name(heap_tag_t tag);
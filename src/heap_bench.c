@@ -0,0 +1,155 @@
+#include "bench.h"
+
+#include "atomic.h"
+#include "debug.h"
+#include "heap.h"
+#include "queue.h"
+#include "thread.h"
+#include "timer.h"
+
+#include <stdint.h>
+
+enum
+{
+	// Alloc/free pairs per run, split between the threads.
+	k_bench_ops = 2 * 1024 * 1024,
+	k_bench_live_blocks = 256,
+	k_bench_max_threads = 16,
+	k_bench_handoff_capacity = 1024,
+	k_bench_grow_increment = 2 * 1024 * 1024,
+};
+
+static const int k_thread_counts[] = { 1, 2, 4, 8, 16 };
+
+typedef struct bench_heap_thread_t
+{
+	heap_t* heap;
+	// For the handoff pattern: blocks go out on one queue and are freed from the other.
+	queue_t* handoff_out;
+	queue_t* handoff_in;
+	int* start;
+	int ops;
+	uint32_t seed;
+} bench_heap_thread_t;
+
+static uint32_t bench_random(uint32_t* state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+static int bench_heap_thread(void* data)
+{
+	bench_heap_thread_t* thread = data;
+	while (!atomic_load(thread->start))
+	{
+		atomic_wait(thread->start, 0);
+	}
+
+	// Packet, command, and work item sized blocks.
+	void* live[k_bench_live_blocks] = { 0 };
+	uint32_t state = thread->seed;
+	for (int i = 0; i < thread->ops; ++i)
+	{
+		size_t size = 16 + bench_random(&state) % 1024;
+		void* block = heap_alloc(thread->heap, size, 8);
+		if (thread->handoff_out)
+		{
+			// Freed by the next thread, while this thread frees what the previous one passed along.
+			if (!queue_try_push(thread->handoff_out, block))
+			{
+				heap_free(thread->heap, block);
+			}
+			heap_free(thread->heap, queue_try_pop(thread->handoff_in));
+		}
+		else
+		{
+			int slot = bench_random(&state) % k_bench_live_blocks;
+			heap_free(thread->heap, live[slot]);
+			live[slot] = block;
+		}
+	}
+
+	for (int i = 0; i < k_bench_live_blocks; ++i)
+	{
+		heap_free(thread->heap, live[i]);
+	}
+	return 0;
+}
+
+// Returns millions of alloc/free pairs per second.
+static double bench_heap_run(heap_t* heap, int thread_count, bool handoff, uint32_t flags)
+{
+	heap_t* test_heap = heap_create_flags(k_bench_grow_increment, flags);
+
+	int start = 0;
+	bench_heap_thread_t threads[k_bench_max_threads];
+	queue_t* queues[k_bench_max_threads];
+	thread_t* handles[k_bench_max_threads];
+	for (int i = 0; i < thread_count; ++i)
+	{
+		queues[i] = handoff ? queue_create(heap, k_bench_handoff_capacity) : NULL;
+	}
+	for (int i = 0; i < thread_count; ++i)
+	{
+		threads[i] = (bench_heap_thread_t)
+		{
+			.heap = test_heap,
+			.handoff_out = queues[i],
+			.handoff_in = queues[(i + thread_count - 1) % thread_count],
+			.start = &start,
+			.ops = k_bench_ops / thread_count,
+			.seed = 0x9e3779b9 + i,
+		};
+		handles[i] = thread_create(bench_heap_thread, &threads[i]);
+	}
+
+	uint64_t start_ticks = timer_get_ticks();
+	atomic_store(&start, 1);
+	atomic_wake_all(&start);
+	for (int i = 0; i < thread_count; ++i)
+	{
+		thread_destroy(handles[i]);
+	}
+	uint64_t ticks = timer_get_ticks() - start_ticks;
+
+	for (int i = 0; i < thread_count; ++i)
+	{
+		if (queues[i])
+		{
+			for (void* block = queue_try_pop(queues[i]); block; block = queue_try_pop(queues[i]))
+			{
+				heap_free(test_heap, block);
+			}
+			queue_destroy(queues[i]);
+		}
+	}
+	heap_destroy(test_heap);
+
+	double seconds = (double)ticks / (double)timer_get_ticks_per_second();
+	return (double)(k_bench_ops / thread_count * thread_count) / seconds / 1e6;
+}
+
+void heap_bench_run(heap_t* heap)
+{
+	int core_count = thread_get_core_count();
+	for (int pattern = 0; pattern < 2; ++pattern)
+	{
+		bool handoff = pattern == 1;
+		for (int i = 0; i < _countof(k_thread_counts); ++i)
+		{
+			int thread_count = k_thread_counts[i];
+			double locked_rate = bench_heap_run(heap, thread_count, handoff, k_heap_flag_no_thread_cache);
+			double cached_rate = bench_heap_run(heap, thread_count, handoff, 0);
+			double tracked_rate = bench_heap_run(heap, thread_count, handoff, k_heap_flag_track_leaks);
+			debug_print(k_print_info, "  %-7s %2d threads: %6.2f M ops/sec locked, %6.2f M ops/sec thread cached (%5.2fx), %6.2f M ops/sec tracking leaks (%4.2fx overhead)%s\n",
+				handoff ? "handoff" : "local", thread_count,
+				locked_rate, cached_rate, cached_rate / locked_rate, tracked_rate, cached_rate / tracked_rate,
+				thread_count > core_count ? "; more threads than cores" : "");
+		}
+	}
+}
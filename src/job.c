@@ -0,0 +1,348 @@
+#include "job.h"
+
+#include "atomic.h"
+#include "heap.h"
+#include "mutex.h"
+#include "semaphore.h"
+#include "thread.h"
+
+#include <string.h>
+
+enum
+{
+	k_deque_capacity = 4096,
+	k_shared_capacity = 4096,
+	k_idle_spin_count = 64,
+	k_cache_line_size = 64,
+};
+
+typedef struct job_t
+{
+	job_function_t function;
+	void* data;
+	job_counter_t* counter;
+} job_t;
+
+// Chase-Lev deque. The owning worker pushes and pops at the bottom;
+// any other thread may steal from the top. Indices grow without bound
+// and are masked into the ring; the difference between them is the size.
+typedef struct job_deque_t
+{
+	int top;
+	char top_padding[k_cache_line_size - sizeof(int)];
+	int bottom;
+	char bottom_padding[k_cache_line_size - sizeof(int)];
+	job_t jobs[k_deque_capacity];
+} job_deque_t;
+
+typedef struct job_worker_t
+{
+	job_deque_t deque;
+	job_system_t* system;
+	thread_t* thread;
+	int index;
+	uint32_t steal_seed;
+} job_worker_t;
+
+typedef struct job_system_t
+{
+	heap_t* heap;
+
+	job_worker_t* workers;
+	int worker_count;
+
+	// Jobs from threads that are not workers.
+	mutex_t* shared_mutex;
+	job_t shared_jobs[k_shared_capacity];
+	int shared_head;
+	int shared_count;
+
+	semaphore_t* wake;
+	int sleeping_count;
+	int quit;
+} job_system_t;
+
+static THREAD_LOCAL job_worker_t* s_current_worker;
+
+static int worker_thread_func(void* user);
+
+static int deque_size(int bottom, int top)
+{
+	return (int)((unsigned)bottom - (unsigned)top);
+}
+
+job_system_t* job_system_create(heap_t* heap, int worker_count)
+{
+	job_system_t* jobs = heap_alloc(heap, sizeof(job_system_t), k_cache_line_size);
+	memset(jobs, 0, sizeof(*jobs));
+	jobs->heap = heap;
+	jobs->shared_mutex = mutex_create();
+	jobs->wake = semaphore_create(0, worker_count > 0 ? worker_count : 1);
+
+	jobs->worker_count = worker_count;
+	if (worker_count > 0)
+	{
+		jobs->workers = heap_alloc(heap, sizeof(job_worker_t) * worker_count, k_cache_line_size);
+		memset(jobs->workers, 0, sizeof(job_worker_t) * worker_count);
+		for (int i = 0; i < worker_count; ++i)
+		{
+			jobs->workers[i].system = jobs;
+			jobs->workers[i].index = i;
+			jobs->workers[i].steal_seed = 2654435761u * (i + 1);
+		}
+		for (int i = 0; i < worker_count; ++i)
+		{
+			jobs->workers[i].thread = thread_create(worker_thread_func, &jobs->workers[i]);
+		}
+	}
+	return jobs;
+}
+
+void job_system_destroy(job_system_t* jobs)
+{
+	atomic_store(&jobs->quit, 1);
+	for (int i = 0; i < jobs->worker_count; ++i)
+	{
+		semaphore_release(jobs->wake);
+	}
+	for (int i = 0; i < jobs->worker_count; ++i)
+	{
+		thread_destroy(jobs->workers[i].thread);
+	}
+	if (jobs->workers)
+	{
+		heap_free(jobs->heap, jobs->workers);
+	}
+	semaphore_destroy(jobs->wake);
+	mutex_destroy(jobs->shared_mutex);
+	heap_free(jobs->heap, jobs);
+}
+
+int job_system_get_worker_count(job_system_t* jobs)
+{
+	return jobs->worker_count;
+}
+
+static void job_run(job_t* job)
+{
+	job->function(job->data);
+	if (job->counter)
+	{
+		atomic_decrement(&job->counter->value);
+	}
+}
+
+static bool deque_push(job_deque_t* deque, job_t* job)
+{
+	int bottom = deque->bottom;
+	int top = atomic_load(&deque->top);
+	if (deque_size(bottom, top) >= k_deque_capacity)
+	{
+		return false;
+	}
+	deque->jobs[bottom & (k_deque_capacity - 1)] = *job;
+	atomic_store(&deque->bottom, bottom + 1);
+	return true;
+}
+
+static bool deque_pop(job_deque_t* deque, job_t* job)
+{
+	int bottom = deque->bottom - 1;
+	// Full barrier: the new bottom must be visible before top is read.
+	atomic_exchange(&deque->bottom, bottom);
+	int top = atomic_load(&deque->top);
+
+	int size = deque_size(bottom, top);
+	if (size < 0)
+	{
+		atomic_store(&deque->bottom, top);
+		return false;
+	}
+
+	*job = deque->jobs[bottom & (k_deque_capacity - 1)];
+	if (size > 0)
+	{
+		return true;
+	}
+
+	// Last job: race any thieves for it.
+	bool won = atomic_compare_and_exchange(&deque->top, top, top + 1) == top;
+	atomic_store(&deque->bottom, top + 1);
+	return won;
+}
+
+static bool deque_steal(job_deque_t* deque, job_t* job)
+{
+	int top = atomic_load(&deque->top);
+	int bottom = atomic_load(&deque->bottom);
+	if (deque_size(bottom, top) <= 0)
+	{
+		return false;
+	}
+
+	// The copy may be torn if the owner wraps around; the exchange fails in that case.
+	*job = deque->jobs[top & (k_deque_capacity - 1)];
+	return atomic_compare_and_exchange(&deque->top, top, top + 1) == top;
+}
+
+static bool shared_pop(job_system_t* jobs, job_t* job)
+{
+	if (atomic_load(&jobs->shared_count) == 0)
+	{
+		return false;
+	}
+
+	bool found = false;
+	mutex_lock(jobs->shared_mutex);
+	if (jobs->shared_count > 0)
+	{
+		*job = jobs->shared_jobs[jobs->shared_head];
+		jobs->shared_head = (jobs->shared_head + 1) % k_shared_capacity;
+		atomic_store(&jobs->shared_count, jobs->shared_count - 1);
+		found = true;
+	}
+	mutex_unlock(jobs->shared_mutex);
+	return found;
+}
+
+static bool shared_push(job_system_t* jobs, job_t* job)
+{
+	bool pushed = false;
+	mutex_lock(jobs->shared_mutex);
+	if (jobs->shared_count < k_shared_capacity)
+	{
+		jobs->shared_jobs[(jobs->shared_head + jobs->shared_count) % k_shared_capacity] = *job;
+		atomic_store(&jobs->shared_count, jobs->shared_count + 1);
+		pushed = true;
+	}
+	mutex_unlock(jobs->shared_mutex);
+	return pushed;
+}
+
+static bool find_job(job_system_t* jobs, job_worker_t* self, job_t* job)
+{
+	if (self && deque_pop(&self->deque, job))
+	{
+		return true;
+	}
+	if (shared_pop(jobs, job))
+	{
+		return true;
+	}
+	if (jobs->worker_count == 0)
+	{
+		return false;
+	}
+
+	// Start at a random victim so thieves spread out.
+	uint32_t start = 0;
+	if (self)
+	{
+		self->steal_seed ^= self->steal_seed << 13;
+		self->steal_seed ^= self->steal_seed >> 17;
+		self->steal_seed ^= self->steal_seed << 5;
+		start = self->steal_seed;
+	}
+	for (int i = 0; i < jobs->worker_count; ++i)
+	{
+		job_worker_t* victim = &jobs->workers[(start + i) % jobs->worker_count];
+		if (victim != self && deque_steal(&victim->deque, job))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+void job_submit(job_system_t* jobs, job_function_t function, void* data, job_counter_t* counter)
+{
+	job_t job = { .function = function, .data = data, .counter = counter };
+	if (counter)
+	{
+		atomic_increment(&counter->value);
+	}
+
+	job_worker_t* self = s_current_worker;
+	bool queued = (self && self->system == jobs) ?
+		deque_push(&self->deque, &job) :
+		shared_push(jobs, &job);
+	if (!queued)
+	{
+		job_run(&job);
+		return;
+	}
+
+	// Locked read: a full barrier, so the push is visible before the sleeper count is read.
+	if (atomic_compare_and_exchange(&jobs->sleeping_count, 0, 0) > 0)
+	{
+		semaphore_release(jobs->wake);
+	}
+}
+
+bool job_counter_is_done(job_counter_t* counter)
+{
+	return atomic_load(&counter->value) == 0;
+}
+
+void job_wait(job_system_t* jobs, job_counter_t* counter)
+{
+	job_worker_t* self = s_current_worker;
+	if (self && self->system != jobs)
+	{
+		self = NULL;
+	}
+
+	while (atomic_load(&counter->value) > 0)
+	{
+		job_t job;
+		if (find_job(jobs, self, &job))
+		{
+			job_run(&job);
+		}
+		else
+		{
+			thread_sleep(0);
+		}
+	}
+}
+
+static int worker_thread_func(void* user)
+{
+	job_worker_t* self = user;
+	job_system_t* jobs = self->system;
+	s_current_worker = self;
+
+	int idle_count = 0;
+	while (!atomic_load(&jobs->quit))
+	{
+		job_t job;
+		if (find_job(jobs, self, &job))
+		{
+			job_run(&job);
+			idle_count = 0;
+			continue;
+		}
+
+		if (++idle_count < k_idle_spin_count)
+		{
+			continue;
+		}
+
+		// Announce sleep before the last look, so a submit that misses
+		// the look is guaranteed to see the sleeper and wake it.
+		atomic_increment(&jobs->sleeping_count);
+		if (find_job(jobs, self, &job))
+		{
+			atomic_decrement(&jobs->sleeping_count);
+			job_run(&job);
+			idle_count = 0;
+			continue;
+		}
+		semaphore_acquire(jobs->wake);
+		atomic_decrement(&jobs->sleeping_count);
+		idle_count = 0;
+	}
+
+	s_current_worker = NULL;
+	return 0;
+}
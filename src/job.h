@@ -0,0 +1,48 @@
+#pragma once
+
+// Job System
+// A pool of worker threads that run small units of work.
+// Each worker owns a work-stealing deque; idle workers steal from the others.
+// Threads that wait on jobs help run them instead of blocking.
+
+#include <stdbool.h>
+
+// Handle to a job system.
+typedef struct job_system_t job_system_t;
+
+typedef struct heap_t heap_t;
+
+// Counts jobs that have been submitted but not yet completed.
+// Zero-initialize before use; may be shared by any number of jobs.
+typedef struct job_counter_t
+{
+	int value;
+} job_counter_t;
+
+// Function run by a job.
+typedef void (*job_function_t)(void* data);
+
+// Create a job system with the specified number of worker threads.
+// With zero workers, jobs run only on threads that call job_wait().
+job_system_t* job_system_create(heap_t* heap, int worker_count);
+
+// Destroy a job system.
+// All submitted jobs must be complete.
+void job_system_destroy(job_system_t* jobs);
+
+// Get the number of worker threads in the job system.
+int job_system_get_worker_count(job_system_t* jobs);
+
+// Submit a job to run function with data.
+// If counter is not NULL, it is raised by one now and lowered when the job completes.
+// Safe to call from any thread, including from inside a running job.
+// Jobs submitted by a worker go on its own deque; others go on a shared queue.
+// If the destination is full, the job runs immediately on the calling thread.
+void job_submit(job_system_t* jobs, job_function_t function, void* data, job_counter_t* counter);
+
+// Determines if all jobs tracked by a counter are complete.
+bool job_counter_is_done(job_counter_t* counter);
+
+// Wait for all jobs tracked by a counter to complete.
+// The calling thread runs other jobs while it waits.
+void job_wait(job_system_t* jobs, job_counter_t* counter);
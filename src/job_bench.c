@@ -0,0 +1,87 @@
+#include "bench.h"
+
+#include "debug.h"
+#include "heap.h"
+#include "job.h"
+#include "thread.h"
+#include "timer.h"
+
+enum
+{
+	k_bench_root_count = 64,
+	k_bench_leaf_count = 1024,
+	k_bench_leaf_work = 64,
+	k_bench_passes = 8,
+};
+
+typedef struct bench_root_t
+{
+	job_system_t* jobs;
+	uint32_t results[k_bench_leaf_count];
+} bench_root_t;
+
+static void bench_leaf_job(void* data)
+{
+	// A few dozen cycles of dependent integer work, standing in for a small task.
+	uint32_t* result = data;
+	uint32_t x = (uint32_t)(uintptr_t)data;
+	for (int i = 0; i < k_bench_leaf_work; ++i)
+	{
+		x = x * 1664525u + 1013904223u;
+	}
+	*result = x;
+}
+
+static void bench_root_job(void* data)
+{
+	// Leaves go on this worker's deque; idle workers steal them.
+	bench_root_t* root = data;
+	job_counter_t counter = { 0 };
+	for (int i = 0; i < k_bench_leaf_count; ++i)
+	{
+		job_submit(root->jobs, bench_leaf_job, &root->results[i], &counter);
+	}
+	job_wait(root->jobs, &counter);
+}
+
+void job_bench_run(heap_t* heap)
+{
+	bench_root_t* roots = heap_alloc(heap, sizeof(bench_root_t) * k_bench_root_count, 64);
+	int job_count = k_bench_passes * k_bench_root_count * (k_bench_leaf_count + 1);
+
+	int core_count = thread_get_core_count();
+	double single_rate = 0.0;
+	for (int cores = 1; cores <= core_count; ++cores)
+	{
+		// The calling thread helps in job_wait, so it counts as a core.
+		job_system_t* jobs = job_system_create(heap, cores - 1);
+		for (int i = 0; i < k_bench_root_count; ++i)
+		{
+			roots[i].jobs = jobs;
+		}
+
+		uint64_t start = timer_get_ticks();
+		for (int p = 0; p < k_bench_passes; ++p)
+		{
+			job_counter_t counter = { 0 };
+			for (int i = 0; i < k_bench_root_count; ++i)
+			{
+				job_submit(jobs, bench_root_job, &roots[i], &counter);
+			}
+			job_wait(jobs, &counter);
+		}
+		uint64_t ticks = timer_get_ticks() - start;
+
+		double seconds = (double)ticks / (double)timer_get_ticks_per_second();
+		double rate = (double)job_count / seconds;
+		if (cores == 1)
+		{
+			single_rate = rate;
+		}
+		debug_print(k_print_info, "  %2d cores: %8.2f M jobs/sec, %4.2fx\n", cores, rate / 1e6, rate / single_rate);
+
+		job_system_destroy(jobs);
+	}
+
+	heap_free(heap, roots);
+}
@@ -1,12 +1,17 @@
+#include "bench.h"
 #include "debug.h"
 #include "fs.h"
 #include "heap.h"
+#include "job.h"
 #include "render.h"
 #include "final_game.h"
+#include "thread.h"
 #include "timer.h"
+#include "trace.h"
 #include "wm.h"
 
 #include <stdio.h>
+#include <string.h>
 
 int main(int argc, const char* argv[])
 {
@@ -15,12 +20,39 @@ int main(int argc, const char* argv[])
 
 	timer_startup();
 		
-	heap_t* heap = heap_create(2 * 1024 * 1024);
-	fs_t* fs = fs_create(heap, 8);
+	// Debug builds record where each allocation was made, so leaks at shutdown come with their stacks.
+	uint32_t heap_flags = 0;
+#if defined(_DEBUG)
+	heap_flags |= k_heap_flag_track_leaks;
+#endif
+	heap_t* heap = heap_create_flags(2 * 1024 * 1024, heap_flags);
+
+	// Usage: ga2022 bench <name|all>
+	if (argc >= 3 && strcmp(argv[1], "bench") == 0)
+	{
+		bool found = bench_run(heap, argv[2]);
+		heap_destroy(heap);
+		return found ? 0 : 1;
+	}
+
+	// Leave a core for the main thread, which helps run jobs while it waits.
+	int worker_count = thread_get_core_count() - 1;
+	job_system_t* jobs = job_system_create(heap, worker_count > 0 ? worker_count : 1);
+
+	// Usage: ga2022 trace <path>
+	// Records GPU time per frame and per command buffer, plus heap counters, to a Chrome trace file written at exit.
+	trace_t* trace = NULL;
+	if (argc >= 3 && strcmp(argv[1], "trace") == 0)
+	{
+		trace = trace_create(heap, 1024);
+		trace_capture_start(trace, argv[2]);
+	}
+
+	fs_t* fs = fs_create(heap, jobs);
 	wm_window_t* window = wm_create(heap);
-	render_t* render = render_create(heap, window);
+	render_t* render = render_create(heap, window, fs, jobs, trace, 2);
 
-	final_game_t* game = final_game_create(heap, fs, window, render, argc, argv);
+	final_game_t* game = final_game_create(heap, fs, jobs, window, render, argc, argv);
 
 //<<<<<<< HEAD
 //=======
@@ -35,8 +67,16 @@ int main(int argc, const char* argv[])
 
 	final_game_destroy(game);
 
+	// Stopped after render, so the render thread is no longer adding to it.
+	if (trace)
+	{
+		trace_capture_stop(trace);
+		trace_destroy(trace);
+	}
+
 	wm_destroy(window);
 	fs_destroy(fs);
+	job_system_destroy(jobs);
 	heap_destroy(heap);
 
 	return 0;
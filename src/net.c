@@ -2,7 +2,9 @@
 
 #include "debug.h"
 #include "heap.h"
+#include "job.h"
 #include "mutex.h"
+#include "object_pool.h"
 #include "queue.h"
 #include "thread.h"
 #include "timer.h"
@@ -22,6 +24,7 @@ enum
 	k_max_entity_types = 32,
 	k_max_snapshots = 256,
 	k_max_entities = 32,
+	k_packet_pool_chunk_count = 32,
 };
 
 typedef struct entity_type_t
@@ -48,8 +51,11 @@ typedef struct snapshot_t
 	char data[k_net_mtu];
 } snapshot_t;
 
+typedef struct connection_t connection_t;
+
 typedef struct packet_t
 {
+	connection_t* connection;
 	int size;
 	char data[k_net_mtu];
 } packet_t;
@@ -75,9 +81,8 @@ typedef struct connection_t
 	int incoming_sequence;
 	int ack_sequence;
 
-	thread_t* send_thread;
+	job_counter_t send_jobs;
 
-	queue_t* send_queue;
 	queue_t* recv_queue;
 
 	uint32_t last_recv_ms;
@@ -89,6 +94,10 @@ typedef struct net_t
 {
 	heap_t* heap;
 	ecs_t* ecs;
+	job_system_t* jobs;
+
+	// Every packet sent and received, allocated on one thread and freed on another.
+	object_pool_t* packet_pool;
 
 	int sequence;
 
@@ -111,12 +120,14 @@ static void snapshot_entities(net_t* net);
 static void packet_send(connection_t* connection);
 static void packet_recv(connection_t* connection);
 
-net_t* net_create(heap_t* heap, ecs_t* ecs)
+net_t* net_create(heap_t* heap, ecs_t* ecs, job_system_t* jobs)
 {
-	net_t* net = heap_alloc(heap, sizeof(net_t), 8);
+	net_t* net = heap_alloc_tagged(heap, sizeof(net_t), 8, k_heap_tag_net);
 	memset(net, 0, sizeof(net_t));
 	net->heap = heap;
 	net->ecs = ecs;
+	net->jobs = jobs;
+	net->packet_pool = object_pool_create(heap, sizeof(packet_t), 8, k_packet_pool_chunk_count);
 
 	WSADATA data;
 	WSAStartup(MAKEWORD(2, 2), &data);
@@ -146,6 +157,7 @@ void net_destroy(net_t* net)
 	thread_destroy(net->recv_thread);
 	WSACleanup();
 	mutex_destroy(net->connections_mutex);
+	object_pool_destroy(net->packet_pool);
 	heap_free(net->heap, net);
 }
 
@@ -179,9 +191,7 @@ void net_disconnect_all(net_t* net)
 		connection_t* c = &net->connections[i];
 		if (c->address.port)
 		{
-			queue_push(c->send_queue, NULL);
-			thread_destroy(c->send_thread);
-			queue_destroy(c->send_queue);
+			job_wait(net->jobs, &c->send_jobs);
 			queue_destroy(c->recv_queue);
 		}
 	}
@@ -269,9 +279,10 @@ bool net_string_to_address(const char* str, net_address_t* address)
 	return false;
 }
 
-static int send_thread_func(void* user)
+static void send_job_func(void* user)
 {
-	connection_t* connection = user;
+	packet_t* packet = user;
+	connection_t* connection = packet->connection;
 
 	struct sockaddr_in address = { 0 };
 	address.sin_family = AF_INET;
@@ -281,27 +292,11 @@ static int send_thread_func(void* user)
 	address.sin_addr.S_un.S_un_b.s_b3 = connection->address.ip[2];
 	address.sin_addr.S_un.S_un_b.s_b4 = connection->address.ip[3];
 
-	while (true)
-	{
-		packet_t* packet = queue_pop(connection->send_queue);
-		if (!packet)
-		{
-			break;
-		}
-
-		int bytes = sendto(connection->net->sock,
-			packet->data, packet->size, 0,
-			(struct sockaddr*)&address, sizeof(address));
-
-		heap_free(connection->net->heap, packet);
+	sendto(connection->net->sock,
+		packet->data, packet->size, 0,
+		(struct sockaddr*)&address, sizeof(address));
 
-		if (bytes <= 0)
-		{
-			break;
-		}
-	}
-
-	return 0;
+	object_pool_free(connection->net->packet_pool, packet);
 }
 
 static connection_t* find_or_create_connection(net_t* net, const net_address_t* address)
@@ -331,9 +326,8 @@ static connection_t* find_or_create_connection(net_t* net, const net_address_t*
 				c->incoming_sequence = -1;
 				c->ack_sequence = -1;
 				c->last_recv_ms = timer_ticks_to_ms(timer_get_ticks());
-				c->send_queue = queue_create(net->heap, 3);
+				c->send_jobs = (job_counter_t) { 0 };
 				c->recv_queue = queue_create(net->heap, 3);
-				c->send_thread = thread_create(send_thread_func, c);
 
 				result = c;
 				break;
@@ -352,7 +346,7 @@ static int recv_thread_func(void* user)
 
 	while (true)
 	{
-		packet_t* packet = heap_alloc(net->heap, sizeof(packet_t), 8);
+		packet_t* packet = object_pool_alloc(net->packet_pool);
 
 		struct sockaddr_in address;
 		int address_len = sizeof(address);
@@ -361,7 +355,7 @@ static int recv_thread_func(void* user)
 			(struct sockaddr*)&address, &address_len);
 		if (bytes <= 0)
 		{
-			heap_free(net->heap, packet);
+			object_pool_free(net->packet_pool, packet);
 			break;
 		}
 
@@ -378,12 +372,15 @@ static int recv_thread_func(void* user)
 		if (!connection)
 		{
 			debug_print(k_print_info, "Too many connections!\n");
-			heap_free(net->heap, packet);
+			object_pool_free(net->packet_pool, packet);
 			continue;
 		}
 		connection->last_recv_ms = timer_ticks_to_ms(timer_get_ticks());
 
-		queue_try_push(connection->recv_queue, packet);
+		if (!queue_try_push(connection->recv_queue, packet))
+		{
+			object_pool_free(net->packet_pool, packet);
+		}
 	}
 
 	return 0;
@@ -401,9 +398,7 @@ static void timeout_old_connections(net_t* net)
 		{
 			debug_print(k_print_info, "Disconnecting old connection.\n");
 
-			queue_push(c->send_queue, NULL);
-			thread_destroy(c->send_thread);
-			queue_destroy(c->send_queue);
+			job_wait(net->jobs, &c->send_jobs);
 			queue_destroy(c->recv_queue);
 			memset(c, 0, sizeof(*c));
 		}
@@ -507,7 +502,8 @@ static void packet_send(connection_t* connection)
 {
 	net_t* net = connection->net;
 
-	packet_t* packet = heap_alloc(net->heap, sizeof(packet_t), 8);
+	packet_t* packet = object_pool_alloc(net->packet_pool);
+	packet->connection = connection;
 
 	packet_header_t header =
 	{
@@ -519,7 +515,7 @@ static void packet_send(connection_t* connection)
 	packet->size = sizeof(header);
 	packet->size += (int)packet_add_entities(connection, &packet->data[packet->size], sizeof(packet->data) - packet->size);
 
-	queue_push(connection->send_queue, packet);
+	job_submit(net->jobs, send_job_func, packet, &connection->send_jobs);
 }
 
 static void packet_read_entities(connection_t* connection, char* packet, size_t packet_size)
@@ -610,6 +606,7 @@ static void packet_recv(connection_t* connection)
 		memcpy(&header, packet->data, sizeof(header));
 		if (header.sequence <= connection->incoming_sequence)
 		{
+			object_pool_free(net->packet_pool, packet);
 			continue;
 		}
 
@@ -618,6 +615,6 @@ static void packet_recv(connection_t* connection)
 
 		packet_read_entities(connection, &packet->data[sizeof(header)], packet->size - sizeof(header));
 
-		heap_free(net->heap, packet);
+		object_pool_free(net->packet_pool, packet);
 	}
 }
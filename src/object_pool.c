@@ -0,0 +1,167 @@
+#include "object_pool.h"
+
+#include "atomic.h"
+#include "heap.h"
+#include "mutex.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum
+{
+	// x64 addresses fit in the low 48 bits of the free list head, leaving the high 16 for a count.
+	k_object_pool_address_bits = 48,
+	k_object_pool_cache_line = 64,
+};
+
+// A free slot's first bytes link it to the next.
+typedef struct object_pool_slot_t
+{
+	struct object_pool_slot_t* next;
+} object_pool_slot_t;
+
+typedef struct object_pool_chunk_t
+{
+	struct object_pool_chunk_t* next;
+} object_pool_chunk_t;
+
+typedef struct object_pool_t
+{
+	// First free slot, with a count of pops in the high bits.
+	// The count changes on every pop, so a slot popped and pushed back between another thread's read
+	// and its compare and exchange isn't mistaken for an unchanged list (the ABA problem).
+	void* free_head;
+	// Kept off the line every alloc and free writes to.
+	char free_head_padding[k_object_pool_cache_line - sizeof(void*)];
+
+	heap_t* heap;
+	mutex_t* grow_mutex;
+	object_pool_chunk_t* chunks;
+	size_t slot_size;
+	size_t alignment;
+	size_t chunk_header_size;
+	int slots_per_chunk;
+} object_pool_t;
+
+static void* make_head(object_pool_slot_t* slot, uintptr_t count);
+static object_pool_slot_t* get_head_slot(void* head);
+static uintptr_t get_head_count(void* head);
+static void push_slots(object_pool_t* pool, object_pool_slot_t* first, object_pool_slot_t* last);
+static bool grow(object_pool_t* pool);
+
+object_pool_t* object_pool_create(heap_t* heap, size_t slot_size, size_t alignment, int slots_per_chunk)
+{
+	object_pool_t* pool = heap_alloc(heap, sizeof(object_pool_t), k_object_pool_cache_line);
+	pool->free_head = NULL;
+	pool->heap = heap;
+	pool->grow_mutex = mutex_create();
+	pool->chunks = NULL;
+	pool->alignment = __max(alignment, _Alignof(object_pool_slot_t));
+	pool->slot_size = (__max(slot_size, sizeof(object_pool_slot_t)) + pool->alignment - 1) & ~(pool->alignment - 1);
+	pool->chunk_header_size = (sizeof(object_pool_chunk_t) + pool->alignment - 1) & ~(pool->alignment - 1);
+	pool->slots_per_chunk = __max(slots_per_chunk, 1);
+	return pool;
+}
+
+void object_pool_destroy(object_pool_t* pool)
+{
+	object_pool_chunk_t* chunk = pool->chunks;
+	while (chunk)
+	{
+		object_pool_chunk_t* next = chunk->next;
+		heap_free(pool->heap, chunk);
+		chunk = next;
+	}
+	mutex_destroy(pool->grow_mutex);
+	heap_free(pool->heap, pool);
+}
+
+void* object_pool_alloc(object_pool_t* pool)
+{
+	for (;;)
+	{
+		void* head = atomic_load_ptr(&pool->free_head);
+		object_pool_slot_t* slot = get_head_slot(head);
+		if (!slot)
+		{
+			if (!grow(pool))
+			{
+				return NULL;
+			}
+			continue;
+		}
+
+		// If another thread takes the slot first, next may be stale, but the count will have moved on and the exchange fails.
+		void* next = make_head(slot->next, get_head_count(head) + 1);
+		if (atomic_compare_and_exchange_ptr(&pool->free_head, head, next) == head)
+		{
+			return slot;
+		}
+	}
+}
+
+void object_pool_free(object_pool_t* pool, void* address)
+{
+	if (address)
+	{
+		push_slots(pool, address, address);
+	}
+}
+
+static void* make_head(object_pool_slot_t* slot, uintptr_t count)
+{
+	return (void*)((uintptr_t)slot | (count << k_object_pool_address_bits));
+}
+
+static object_pool_slot_t* get_head_slot(void* head)
+{
+	return (object_pool_slot_t*)((uintptr_t)head & (((uintptr_t)1 << k_object_pool_address_bits) - 1));
+}
+
+static uintptr_t get_head_count(void* head)
+{
+	return (uintptr_t)head >> k_object_pool_address_bits;
+}
+
+// Push a chain of linked slots, first to last, with one compare and exchange.
+static void push_slots(object_pool_t* pool, object_pool_slot_t* first, object_pool_slot_t* last)
+{
+	for (;;)
+	{
+		void* head = atomic_load_ptr(&pool->free_head);
+		last->next = get_head_slot(head);
+		if (atomic_compare_and_exchange_ptr(&pool->free_head, head, make_head(first, get_head_count(head))) == head)
+		{
+			break;
+		}
+	}
+}
+
+// Add a chunk of slots to the free list. Returns false if the heap is out of memory.
+static bool grow(object_pool_t* pool)
+{
+	mutex_lock(pool->grow_mutex);
+
+	// Another thread may have grown the pool, or freed slots, while this one waited.
+	bool has_free = get_head_slot(atomic_load_ptr(&pool->free_head)) != NULL;
+	if (!has_free)
+	{
+		object_pool_chunk_t* chunk = heap_alloc(pool->heap, pool->chunk_header_size + pool->slot_size * pool->slots_per_chunk, pool->alignment);
+		if (chunk)
+		{
+			chunk->next = pool->chunks;
+			pool->chunks = chunk;
+
+			char* slots = (char*)chunk + pool->chunk_header_size;
+			for (int i = 0; i < pool->slots_per_chunk - 1; ++i)
+			{
+				((object_pool_slot_t*)(slots + i * pool->slot_size))->next = (object_pool_slot_t*)(slots + (i + 1) * pool->slot_size);
+			}
+			push_slots(pool, (object_pool_slot_t*)slots, (object_pool_slot_t*)(slots + (pool->slots_per_chunk - 1) * pool->slot_size));
+			has_free = true;
+		}
+	}
+
+	mutex_unlock(pool->grow_mutex);
+	return has_free;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdlib.h>
+
+// Object Pool
+// Hands out fixed-size slots carved from chunks allocated on a heap, for structs allocated and freed often.
+// Free slots form an intrusive lock-free list, so any thread can allocate and free without a lock.
+// Only growing the pool by another chunk takes one. Chunks are kept until the pool is destroyed.
+
+// Handle to a pool.
+typedef struct object_pool_t object_pool_t;
+
+typedef struct heap_t heap_t;
+
+// Create a pool of slots of at least slot_size bytes, each aligned to alignment.
+// The pool grows by slots_per_chunk slots at a time.
+object_pool_t* object_pool_create(heap_t* heap, size_t slot_size, size_t alignment, int slots_per_chunk);
+
+// Destroy a pool and every chunk it allocated. Outstanding slots are freed with it.
+void object_pool_destroy(object_pool_t* pool);
+
+// Allocate a slot. Returns NULL only if the heap is out of memory.
+void* object_pool_alloc(object_pool_t* pool);
+
+// Return a slot to the pool it was allocated from.
+void object_pool_free(object_pool_t* pool, void* address);
@@ -0,0 +1,123 @@
+#include "bench.h"
+
+#include "debug.h"
+#include "heap.h"
+#include "object_pool.h"
+#include "thread.h"
+#include "timer.h"
+
+enum
+{
+	k_bench_batch = 64,
+	k_bench_rounds = 16 * 1024,
+	k_bench_max_threads = 4,
+	k_bench_pool_chunk_count = 64,
+	k_bench_grow_increment = 2 * 1024 * 1024,
+};
+
+// Sized like the structs converted to pools.
+static const struct
+{
+	const char* name;
+	size_t size;
+} k_bench_objects[] =
+{
+	{ "event_t", 68 },
+	{ "packet_t", 1040 },
+	{ "fs_work_t", 1088 },
+};
+
+typedef struct bench_pool_thread_t
+{
+	heap_t* heap;
+	object_pool_t* pool;
+	size_t size;
+} bench_pool_thread_t;
+
+// Allocate a batch, then free it, as a frame's worth of packets or events would be.
+static int bench_pool_thread(void* data)
+{
+	bench_pool_thread_t* thread = data;
+	void* blocks[k_bench_batch];
+	for (int round = 0; round < k_bench_rounds; ++round)
+	{
+		if (thread->pool)
+		{
+			for (int i = 0; i < k_bench_batch; ++i)
+			{
+				blocks[i] = object_pool_alloc(thread->pool);
+			}
+			for (int i = 0; i < k_bench_batch; ++i)
+			{
+				object_pool_free(thread->pool, blocks[i]);
+			}
+		}
+		else
+		{
+			for (int i = 0; i < k_bench_batch; ++i)
+			{
+				blocks[i] = heap_alloc(thread->heap, thread->size, 8);
+			}
+			for (int i = 0; i < k_bench_batch; ++i)
+			{
+				heap_free(thread->heap, blocks[i]);
+			}
+		}
+	}
+	return 0;
+}
+
+// Returns ns per call, alloc or free, as seen by each thread.
+static double bench_pool_run(size_t size, uint32_t heap_flags, bool use_pool, int thread_count)
+{
+	heap_t* heap = heap_create_flags(k_bench_grow_increment, heap_flags);
+	object_pool_t* pool = use_pool ? object_pool_create(heap, size, 8, k_bench_pool_chunk_count) : NULL;
+
+	bench_pool_thread_t threads[k_bench_max_threads];
+	thread_t* handles[k_bench_max_threads];
+	uint64_t start = timer_get_ticks();
+	for (int i = 0; i < thread_count; ++i)
+	{
+		threads[i] = (bench_pool_thread_t) { .heap = heap, .pool = pool, .size = size };
+		handles[i] = thread_count > 1 ? thread_create(bench_pool_thread, &threads[i]) : NULL;
+	}
+	if (thread_count == 1)
+	{
+		bench_pool_thread(&threads[0]);
+	}
+	for (int i = 0; i < thread_count && handles[i]; ++i)
+	{
+		thread_destroy(handles[i]);
+	}
+	uint64_t ticks = timer_get_ticks() - start;
+
+	if (pool)
+	{
+		object_pool_destroy(pool);
+	}
+	heap_destroy(heap);
+
+	double calls = (double)k_bench_rounds * k_bench_batch * 2;
+	return (double)ticks * 1e9 / (double)timer_get_ticks_per_second() / calls;
+}
+
+void object_pool_bench_run(heap_t* heap)
+{
+	const int k_thread_counts[] = { 1, k_bench_max_threads };
+	int core_count = thread_get_core_count();
+	for (int i = 0; i < _countof(k_bench_objects); ++i)
+	{
+		for (int t = 0; t < _countof(k_thread_counts); ++t)
+		{
+			int thread_count = k_thread_counts[t];
+			size_t size = k_bench_objects[i].size;
+			double locked_ns = bench_pool_run(size, k_heap_flag_no_thread_cache, false, thread_count);
+			double cached_ns = bench_pool_run(size, 0, false, thread_count);
+			double pool_ns = bench_pool_run(size, 0, true, thread_count);
+			debug_print(k_print_info, "  %-9s %4d bytes, %d threads: %6.1f ns/call heap locked, %6.1f ns/call heap thread cached, %6.1f ns/call pool%s\n",
+				k_bench_objects[i].name, (int)size, thread_count,
+				locked_ns, cached_ns, pool_ns,
+				thread_count > core_count ? "; more threads than cores" : "");
+		}
+	}
+}
@@ -1,76 +1,273 @@
+#include "queue.h"
+
 #include "atomic.h"
 #include "heap.h"
 #include "semaphore.h"
 
+#include <string.h>
+
+enum
+{
+	k_cache_line_size = 64,
+	k_spin_count = 128,
+};
+
+typedef struct queue_cell_t
+{
+	int sequence;
+	void* item;
+} queue_cell_t;
+
 typedef struct queue_t
 {
 	heap_t* heap;
+	queue_type_t type;
+	int capacity;
+
+	// k_queue_semaphore
 	semaphore_t* used_items;
 	semaphore_t* free_items;
 	void** items;
-	int capacity;
-	int head_index;
+
+	// k_queue_lock_free
+	queue_cell_t* cells;
+	int mask;
+
+	// Producers and consumers each get their own cache lines.
+	char tail_padding[k_cache_line_size];
 	int tail_index;
+	int push_waiters;
+	int pop_epoch;
+	char head_padding[k_cache_line_size - 3 * sizeof(int)];
+	int head_index;
+	int pop_waiters;
+	int push_epoch;
+	char end_padding[k_cache_line_size - 3 * sizeof(int)];
 } queue_t;
 
 queue_t* queue_create(heap_t* heap, int capacity)
 {
-	queue_t* queue = heap_alloc(heap, sizeof(queue_t), 8);
-	queue->items = heap_alloc(heap, sizeof(void*) * capacity, 8);
-	queue->used_items = semaphore_create(0, capacity);
-	queue->free_items = semaphore_create(capacity, capacity);
+	return queue_create_type(heap, capacity, k_queue_lock_free);
+}
+
+queue_t* queue_create_type(heap_t* heap, int capacity, queue_type_t type)
+{
+	queue_t* queue = heap_alloc(heap, sizeof(queue_t), k_cache_line_size);
+	memset(queue, 0, sizeof(*queue));
 	queue->heap = heap;
-	queue->capacity = capacity;
-	queue->head_index = 0;
-	queue->tail_index = 0;
+	queue->type = type;
+
+	if (type == k_queue_semaphore)
+	{
+		queue->items = heap_alloc(heap, sizeof(void*) * capacity, 8);
+		queue->used_items = semaphore_create(0, capacity);
+		queue->free_items = semaphore_create(capacity, capacity);
+		queue->capacity = capacity;
+	}
+	else
+	{
+		int rounded = 1;
+		while (rounded < capacity)
+		{
+			rounded *= 2;
+		}
+		queue->cells = heap_alloc(heap, sizeof(queue_cell_t) * rounded, k_cache_line_size);
+		for (int i = 0; i < rounded; ++i)
+		{
+			queue->cells[i].sequence = i;
+			queue->cells[i].item = NULL;
+		}
+		queue->capacity = rounded;
+		queue->mask = rounded - 1;
+	}
 	return queue;
 }
 
 void queue_destroy(queue_t* queue)
 {
-	semaphore_destroy(queue->used_items);
-	semaphore_destroy(queue->free_items);
-	heap_free(queue->heap, queue->items);
+	if (queue->type == k_queue_semaphore)
+	{
+		semaphore_destroy(queue->used_items);
+		semaphore_destroy(queue->free_items);
+		heap_free(queue->heap, queue->items);
+	}
+	else
+	{
+		heap_free(queue->heap, queue->cells);
+	}
 	heap_free(queue->heap, queue);
 }
 
-void queue_push(queue_t* queue, void* item)
+static bool lock_free_try_push(queue_t* queue, void* item)
 {
-	semaphore_acquire(queue->free_items);
-	int index = atomic_increment(&queue->tail_index) % queue->capacity;
-	queue->items[index] = item;
-	semaphore_release(queue->used_items);
+	int pos = atomic_load(&queue->tail_index);
+	while (true)
+	{
+		queue_cell_t* cell = &queue->cells[pos & queue->mask];
+		int diff = (int)((unsigned)atomic_load(&cell->sequence) - (unsigned)pos);
+		if (diff == 0)
+		{
+			int prev = atomic_compare_and_exchange(&queue->tail_index, pos, pos + 1);
+			if (prev == pos)
+			{
+				cell->item = item;
+				atomic_store(&cell->sequence, pos + 1);
+				break;
+			}
+			pos = prev;
+		}
+		else if (diff < 0)
+		{
+			return false;
+		}
+		else
+		{
+			pos = atomic_load(&queue->tail_index);
+		}
+	}
+
+	// Locked read: a full barrier, so the item is visible before the waiter count is read.
+	if (atomic_compare_and_exchange(&queue->pop_waiters, 0, 0) > 0)
+	{
+		atomic_increment(&queue->push_epoch);
+		atomic_wake_one(&queue->push_epoch);
+	}
+	return true;
 }
 
-void* queue_pop(queue_t* queue)
+static bool lock_free_try_pop(queue_t* queue, void** item)
 {
-	semaphore_acquire(queue->used_items);
-	int index = atomic_increment(&queue->head_index) % queue->capacity;
-	void* item = queue->items[index];
-	semaphore_release(queue->free_items);
-	return item;
+	int pos = atomic_load(&queue->head_index);
+	while (true)
+	{
+		queue_cell_t* cell = &queue->cells[pos & queue->mask];
+		int diff = (int)((unsigned)atomic_load(&cell->sequence) - (unsigned)(pos + 1));
+		if (diff == 0)
+		{
+			int prev = atomic_compare_and_exchange(&queue->head_index, pos, pos + 1);
+			if (prev == pos)
+			{
+				*item = cell->item;
+				atomic_store(&cell->sequence, pos + queue->mask + 1);
+				break;
+			}
+			pos = prev;
+		}
+		else if (diff < 0)
+		{
+			return false;
+		}
+		else
+		{
+			pos = atomic_load(&queue->head_index);
+		}
+	}
+
+	if (atomic_compare_and_exchange(&queue->push_waiters, 0, 0) > 0)
+	{
+		atomic_increment(&queue->pop_epoch);
+		atomic_wake_one(&queue->pop_epoch);
+	}
+	return true;
 }
 
-bool queue_try_push(queue_t* queue, void* item)
+void queue_push(queue_t* queue, void* item)
 {
-	if (semaphore_try_acquire(queue->free_items))
+	if (queue->type == k_queue_semaphore)
 	{
+		semaphore_acquire(queue->free_items);
 		int index = atomic_increment(&queue->tail_index) % queue->capacity;
 		queue->items[index] = item;
 		semaphore_release(queue->used_items);
-		return true;
+		return;
+	}
+
+	for (int i = 0; i < k_spin_count; ++i)
+	{
+		if (lock_free_try_push(queue, item))
+		{
+			return;
+		}
+	}
+	while (true)
+	{
+		// Register before the last try, so a pop that misses it sees the waiter.
+		atomic_increment(&queue->push_waiters);
+		int epoch = atomic_load(&queue->pop_epoch);
+		if (lock_free_try_push(queue, item))
+		{
+			atomic_decrement(&queue->push_waiters);
+			return;
+		}
+		atomic_wait(&queue->pop_epoch, epoch);
+		atomic_decrement(&queue->push_waiters);
 	}
-	return false;
 }
 
-void* queue_try_pop(queue_t* queue)
+void* queue_pop(queue_t* queue)
 {
-	if (semaphore_try_acquire(queue->used_items))
+	if (queue->type == k_queue_semaphore)
 	{
+		semaphore_acquire(queue->used_items);
 		int index = atomic_increment(&queue->head_index) % queue->capacity;
 		void* item = queue->items[index];
 		semaphore_release(queue->free_items);
 		return item;
 	}
-	return NULL;
+
+	void* item = NULL;
+	for (int i = 0; i < k_spin_count; ++i)
+	{
+		if (lock_free_try_pop(queue, &item))
+		{
+			return item;
+		}
+	}
+	while (true)
+	{
+		atomic_increment(&queue->pop_waiters);
+		int epoch = atomic_load(&queue->push_epoch);
+		if (lock_free_try_pop(queue, &item))
+		{
+			atomic_decrement(&queue->pop_waiters);
+			return item;
+		}
+		atomic_wait(&queue->push_epoch, epoch);
+		atomic_decrement(&queue->pop_waiters);
+	}
+}
+
+bool queue_try_push(queue_t* queue, void* item)
+{
+	if (queue->type == k_queue_semaphore)
+	{
+		if (semaphore_try_acquire(queue->free_items))
+		{
+			int index = atomic_increment(&queue->tail_index) % queue->capacity;
+			queue->items[index] = item;
+			semaphore_release(queue->used_items);
+			return true;
+		}
+		return false;
+	}
+	return lock_free_try_push(queue, item);
+}
+
+void* queue_try_pop(queue_t* queue)
+{
+	if (queue->type == k_queue_semaphore)
+	{
+		if (semaphore_try_acquire(queue->used_items))
+		{
+			int index = atomic_increment(&queue->head_index) % queue->capacity;
+			void* item = queue->items[index];
+			semaphore_release(queue->free_items);
+			return item;
+		}
+		return NULL;
+	}
+
+	void* item = NULL;
+	lock_free_try_pop(queue, &item);
+	return item;
 }
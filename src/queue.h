@@ -9,9 +9,25 @@ typedef struct queue_t queue_t;
 
 typedef struct heap_t heap_t;
 
-// Create a queue with the defined capacity.
+// Queue implementations.
+typedef enum queue_type_t
+{
+	// Bounded lock-free ring with a sequence number per slot.
+	// Blocking calls spin briefly, then park on a futex.
+	// Capacity is rounded up to a power of two.
+	k_queue_lock_free,
+
+	// Ring guarded by a pair of kernel semaphores.
+	// Every call makes two semaphore calls.
+	k_queue_semaphore,
+} queue_type_t;
+
+// Create a lock-free queue with the defined capacity.
 queue_t* queue_create(heap_t* heap, int capacity);
 
+// Create a queue with the defined capacity and implementation.
+queue_t* queue_create_type(heap_t* heap, int capacity, queue_type_t type);
+
 // Destroy a previously created queue.
 void queue_destroy(queue_t* queue);
 
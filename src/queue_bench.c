@@ -0,0 +1,96 @@
+#include "bench.h"
+
+#include "atomic.h"
+#include "debug.h"
+#include "heap.h"
+#include "queue.h"
+#include "thread.h"
+#include "timer.h"
+
+#include <stdint.h>
+
+enum
+{
+	k_bench_queue_capacity = 1024,
+	k_bench_item_count = 256 * 1024,
+	k_bench_max_threads = 16,
+};
+
+typedef struct bench_queue_thread_t
+{
+	queue_t* queue;
+	int* start;
+	int count;
+} bench_queue_thread_t;
+
+static void bench_wait_for_start(int* start)
+{
+	while (!atomic_load(start))
+	{
+		thread_sleep(0);
+	}
+}
+
+static int bench_producer_func(void* user)
+{
+	bench_queue_thread_t* data = user;
+	bench_wait_for_start(data->start);
+	for (int i = 0; i < data->count; ++i)
+	{
+		queue_push(data->queue, (void*)(uintptr_t)(i + 1));
+	}
+	return 0;
+}
+
+static int bench_consumer_func(void* user)
+{
+	bench_queue_thread_t* data = user;
+	bench_wait_for_start(data->start);
+	for (int i = 0; i < data->count; ++i)
+	{
+		queue_pop(data->queue);
+	}
+	return 0;
+}
+
+static double bench_queue_ops_per_second(heap_t* heap, queue_type_t type, int thread_pairs)
+{
+	queue_t* queue = queue_create_type(heap, k_bench_queue_capacity, type);
+	int start = 0;
+	int per_thread = k_bench_item_count / thread_pairs;
+
+	bench_queue_thread_t data = { .queue = queue, .start = &start, .count = per_thread };
+	thread_t* producers[k_bench_max_threads];
+	thread_t* consumers[k_bench_max_threads];
+	for (int i = 0; i < thread_pairs; ++i)
+	{
+		producers[i] = thread_create(bench_producer_func, &data);
+		consumers[i] = thread_create(bench_consumer_func, &data);
+	}
+
+	uint64_t start_ticks = timer_get_ticks();
+	atomic_store(&start, 1);
+	for (int i = 0; i < thread_pairs; ++i)
+	{
+		thread_destroy(producers[i]);
+		thread_destroy(consumers[i]);
+	}
+	uint64_t ticks = timer_get_ticks() - start_ticks;
+
+	queue_destroy(queue);
+
+	// One op is a push or a pop.
+	double seconds = (double)ticks / (double)timer_get_ticks_per_second();
+	return 2.0 * per_thread * thread_pairs / seconds;
+}
+
+void queue_bench_run(heap_t* heap)
+{
+	for (int pairs = 1; pairs <= k_bench_max_threads; pairs *= 2)
+	{
+		double semaphore_rate = bench_queue_ops_per_second(heap, k_queue_semaphore, pairs);
+		double lock_free_rate = bench_queue_ops_per_second(heap, k_queue_lock_free, pairs);
+		debug_print(k_print_info, "  %2d producers/%2d consumers: semaphore %7.2f M ops/sec, lock-free %7.2f M ops/sec, %5.2fx\n",
+			pairs, pairs, semaphore_rate / 1e6, lock_free_rate / 1e6, lock_free_rate / semaphore_rate);
+	}
+}
@@ -1,24 +1,54 @@
 #include "render.h"
 
+#include "atomic.h"
+#include "debug.h"
 #include "ecs.h"
 #include "gpu.h"
 #include "heap.h"
-#include "queue.h"
+#include "job.h"
+#include "spsc_queue.h"
 #include "thread.h"
+#include "timer.h"
 #include "wm.h"
 
-#include <assert.h>
 #include <string.h>
 
 enum
 {
-	k_render_max_drawables = 512,
+	k_render_cache_initial_capacity = 64,
+	k_render_queue_capacity = 64 * 1024,
+	k_render_publish_batch = 64,
+	k_render_arena_size = 1024 * 1024,
+	k_render_command_alignment = 16,
+	k_render_draw_initial_capacity = 1024,
+	k_render_instance_buffer_initial_size = 64 * 1024,
+	k_render_uniform_ring_initial_size = 256 * 1024,
+	// Fewer draws than this per command buffer and a recording job isn't worth its overhead.
+	k_render_min_draws_per_job = 1024,
+	// Distinct views one frame can hold; the sort key has a byte for the view.
+	k_render_max_views = 256,
+	// Heap counters go to the trace at most this often, so they don't crowd out per-frame events.
+	k_render_counter_interval_ms = 50,
+};
+
+// Draw sort keys, most significant first: pipeline id, mesh id, view, submission index.
+// Sorting groups draws by pipeline, then by mesh, then by view; the index keeps the sort stable
+// and locates the draw once sorted.
+enum
+{
+	k_sort_key_pipeline_shift = 48,
+	k_sort_key_mesh_shift = 32,
+	k_sort_key_view_shift = 24,
+	k_sort_key_id_mask = 0xffff,
+	k_sort_key_view_mask = 0xff,
+	k_sort_key_index_mask = 0xffffff,
 };
 
 typedef enum command_type_t
 {
 	k_command_frame_done,
 	k_command_model,
+	k_command_view,
 } command_type_t;
 
 typedef struct model_command_t
@@ -30,167 +60,564 @@ typedef struct model_command_t
 	gpu_uniform_buffer_info_t uniform_buffer;
 } model_command_t;
 
+typedef struct view_command_t
+{
+	command_type_t type;
+	gpu_uniform_buffer_info_t data;
+} view_command_t;
+
 typedef struct frame_done_command_t
 {
 	command_type_t type;
 } frame_done_command_t;
 
-typedef struct draw_instance_t
+// Linear allocator for one frame of commands.
+// Written by the game thread; reset in bulk once the render thread has consumed the frame.
+typedef struct command_arena_t
 {
-	ecs_entity_ref_t entity;
-	gpu_uniform_buffer_t** uniform_buffers;
-	gpu_descriptor_t** descriptors;
-	int frame_counter;
-} draw_instance_t;
+	char* base;
+	size_t size;
+	size_t used;
+	// Blocks filled earlier this frame, when the frame outgrew the arena.
+	void** overflow_blocks;
+	int overflow_count;
+	int overflow_capacity;
+	size_t overflow_size;
+} command_arena_t;
 
 typedef struct draw_mesh_t
 {
 	gpu_mesh_info_t* info;
 	gpu_mesh_t* mesh;
-	int frame_counter;
+	int id;
 } draw_mesh_t;
 
+// A shader and pipeline being created on the job system.
+// Heap allocated so it stays put while the shader cache grows.
+typedef struct shader_compile_t
+{
+	gpu_t* gpu;
+	gpu_shader_info_t* info;
+	gpu_mesh_layout_t mesh_layout;
+	gpu_shader_t* shader;
+	gpu_pipeline_t* pipeline;
+	job_counter_t counter;
+} shader_compile_t;
+
 typedef struct draw_shader_t
 {
 	gpu_shader_info_t* info;
+	// Both NULL until the compile, if any, has finished.
 	gpu_shader_t* shader;
 	gpu_pipeline_t* pipeline;
-	int frame_counter;
+	shader_compile_t* compile;
+	int id;
+	// Size of each model's uniform data, fixed by the first model drawn with the shader.
+	size_t uniform_size;
+	// Set once a model with the wrong uniform size has been reported, so the error isn't repeated every frame.
+	bool uniform_size_reported;
+	// Likewise for a model drawn without a view of the size the shader reads.
+	bool view_size_reported;
+	// One descriptor per GPU frame over that frame's uniform ring, bound with a per-draw offset.
+	// Recreated when the ring is, as tracked by the generation.
+	gpu_descriptor_t** descriptors;
+	int* descriptor_generations;
 } draw_shader_t;
 
+// A draw with its GPU objects resolved, waiting to be recorded in sorted order.
+// Data is the model's uniform data, or its instance data if the shader is instanced.
+// Runs of instanced draws sharing a pipeline and mesh are recorded as one instanced draw.
+typedef struct draw_item_t
+{
+	gpu_pipeline_t* pipeline;
+	gpu_mesh_t* mesh;
+	int shader_id;
+	// Index into the frame's views, or -1 if the shader reads no view data.
+	int view;
+	bool instanced;
+	const void* data;
+	size_t data_size;
+} draw_item_t;
+
+// A contiguous run of sorted draws, recorded into its own command buffer, possibly on a job.
+// The offsets are where the run's uniform and instance data start, worked out before recording.
+typedef struct record_range_t
+{
+	render_t* render;
+	gpu_cmd_buffer_t* cmdbuf;
+	const uint64_t* keys;
+	char* uniform_ring;
+	int frame_index;
+	int begin;
+	int end;
+	size_t uniform_offset;
+	size_t instance_offset;
+	// Written by recording.
+	int bind_count;
+	int instanced_draw_count;
+} record_range_t;
+
+// Per GPU frame buffers, written by the CPU while recording that frame.
+typedef struct frame_buffers_t
+{
+	gpu_instance_buffer_t* instances;
+	size_t instances_size;
+	// Persistently mapped; each draw's uniforms are written at the next aligned offset.
+	gpu_uniform_buffer_t* uniforms;
+	size_t uniforms_size;
+	int uniforms_generation;
+} frame_buffers_t;
+
+// Open-addressing hash map from a 64-bit key to an entry slot.
+// Slots are also kept on a list in order of last use, so eviction only
+// visits entries that have gone stale.
+typedef struct render_cache_t
+{
+	// Buckets hold a slot index, or -1 if empty. Linear probing.
+	int* buckets;
+	int bucket_mask;
+	int bucket_shift;
+	int count;
+
+	// Per-slot data, indexed by slot.
+	void* entries;
+	size_t entry_size;
+	uint64_t* keys;
+	int* frame_counters;
+	int* older;
+	int* newer;
+	int slot_count;
+	int slot_capacity;
+	int* free_slots;
+	int free_count;
+
+	int oldest;
+	int newest;
+} render_cache_t;
+
 typedef struct render_t
 {
 	heap_t* heap;
 	wm_window_t* window;
+	fs_t* fs;
+	job_system_t* jobs;
+	trace_t* trace;
 	thread_t* thread;
 	gpu_t* gpu;
-	queue_t* queue;
+	spsc_queue_t* queue;
+
+	// Game thread only.
+	command_arena_t* arenas;
+	int arena_count;
+	int frame_depth;
+	int frames_submitted;
+	int unpublished_count;
+	uint64_t model_bytes_pushed;
+	uint64_t stall_ticks;
+	uint64_t last_frame_stall_ticks;
+
+	// Written by the render thread, read by the game thread.
+	int frames_completed;
 
 	int frame_counter;
 	int gpu_frame_count;
 
-	int instance_count;
-	int mesh_count;
-	int shader_count;
-	draw_instance_t instances[k_render_max_drawables];
-	draw_mesh_t meshes[k_render_max_drawables];
-	draw_shader_t shaders[k_render_max_drawables];
+	// Render thread only: draws collected for the current frame.
+	draw_item_t* draws;
+	uint64_t* draw_keys;
+	uint64_t* draw_keys_scratch;
+	int draw_count;
+	int draw_capacity;
+	// Pipeline and mesh binds the frame would need if recorded in submission order.
+	int submission_bind_count;
+	// Instance data for the current frame, gathered in sorted order and uploaded
+	// to that frame's instance buffer in one update.
+	char* instance_data;
+	size_t instance_data_size;
+	size_t instance_data_capacity;
+	// Views pushed this frame, and where each sits at the front of the uniform ring.
+	// Models use the most recently pushed view.
+	gpu_uniform_buffer_info_t views[k_render_max_views];
+	size_t view_offsets[k_render_max_views];
+	int view_count;
+	int current_view;
+	size_t view_data_size;
+	// Uniform ring space the current frame needs, views included, with each draw's data aligned.
+	size_t uniform_data_size;
+	size_t uniform_alignment;
+	frame_buffers_t* frame_buffers;
+	record_range_t record_ranges[k_gpu_max_parallel_cmd_buffers];
+	render_stats_t stats;
+	// When heap counters were last added to the trace.
+	uint64_t counter_ticks;
+
+	render_cache_t meshes;
+	render_cache_t shaders;
 } render_t;
 
 static int render_thread_func(void* user);
+static void push_command(render_t* render, void* command);
+static void* arena_alloc(render_t* render, size_t size);
+static void arena_reset(render_t* render, command_arena_t* arena);
 static draw_shader_t* create_or_get_shader_for_model_command(render_t* render, model_command_t* command);
 static draw_mesh_t* create_or_get_mesh_for_model_command(render_t* render, model_command_t* command);
-static draw_instance_t* create_or_get_instance_for_model_command(render_t* render, model_command_t* command, gpu_shader_t* shader);
 static void destroy_stale_data(render_t* render);
+static void compile_shader_job(void* data);
+static void finish_shader_compile(render_t* render, draw_shader_t* shader);
+static void add_draw(render_t* render, draw_shader_t* shader, draw_mesh_t* mesh, model_command_t* command);
+static void add_view(render_t* render, view_command_t* command);
+static void record_draws(render_t* render, int frame_index);
+static int partition_draws(render_t* render, const uint64_t* keys, int frame_index);
+static void record_range_job(void* data);
+static void reserve_frame_buffers(render_t* render, frame_buffers_t* buffers);
+static gpu_descriptor_t* get_shader_descriptor(render_t* render, draw_shader_t* shader, int frame_index);
+static int get_shader_binding_count(draw_shader_t* shader);
+static uint64_t* radix_sort_keys(uint64_t* keys, uint64_t* scratch, int count);
+static size_t align_up(size_t size, size_t alignment);
+static void* grow_array(heap_t* heap, void* array, int count, int capacity, size_t element_size);
+static void cache_create(heap_t* heap, render_cache_t* cache, size_t entry_size);
+static void cache_destroy(heap_t* heap, render_cache_t* cache);
+static int cache_find(render_cache_t* cache, uint64_t key);
+static int cache_insert(heap_t* heap, render_cache_t* cache, uint64_t key);
+static void cache_touch(render_cache_t* cache, int slot, int frame_counter);
+static void cache_remove(render_cache_t* cache, int slot);
+static void* cache_get_entry(render_cache_t* cache, int slot);
 
-render_t* render_create(heap_t* heap, wm_window_t* window)
+render_t* render_create(heap_t* heap, wm_window_t* window, fs_t* fs, job_system_t* jobs, trace_t* trace, int frame_depth)
 {
-	render_t* render = heap_alloc(heap, sizeof(render_t), 8);
+	render_t* render = heap_alloc_tagged(heap, sizeof(render_t), 8, k_heap_tag_render);
 	render->heap = heap;
 	render->window = window;
-	render->queue = queue_create(heap, 3);
+	render->fs = fs;
+	render->jobs = jobs;
+	render->trace = trace;
+	render->queue = spsc_queue_create(heap, k_render_queue_capacity);
+	render->frame_depth = frame_depth;
+	render->frames_submitted = 0;
+	render->frames_completed = 0;
+	render->unpublished_count = 0;
+	render->model_bytes_pushed = 0;
+	render->stall_ticks = 0;
+	render->last_frame_stall_ticks = 0;
+
+	// Frames in flight on the render thread, plus the one the game is writing.
+	render->arena_count = frame_depth + 1;
+	render->arenas = heap_alloc_tagged(heap, sizeof(command_arena_t) * render->arena_count, 8, k_heap_tag_render);
+	for (int i = 0; i < render->arena_count; ++i)
+	{
+		render->arenas[i] = (command_arena_t) { 0 };
+		render->arenas[i].size = k_render_arena_size;
+		render->arenas[i].base = heap_alloc_tagged(heap, k_render_arena_size, k_render_command_alignment, k_heap_tag_render);
+	}
 	render->frame_counter = 0;
-	render->instance_count = 0;
-	render->mesh_count = 0;
-	render->shader_count = 0;
+	render->draws = NULL;
+	render->draw_keys = NULL;
+	render->draw_keys_scratch = NULL;
+	render->draw_count = 0;
+	render->draw_capacity = 0;
+	render->submission_bind_count = 0;
+	render->instance_data = NULL;
+	render->instance_data_size = 0;
+	render->instance_data_capacity = 0;
+	render->view_count = 0;
+	render->current_view = -1;
+	render->view_data_size = 0;
+	render->uniform_data_size = 0;
+	render->uniform_alignment = 0;
+	render->frame_buffers = NULL;
+	render->stats = (render_stats_t) { 0 };
+	render->counter_ticks = 0;
+	cache_create(heap, &render->meshes, sizeof(draw_mesh_t));
+	cache_create(heap, &render->shaders, sizeof(draw_shader_t));
 	render->thread = thread_create(render_thread_func, render);
 	return render;
 }
 
 void render_destroy(render_t* render)
 {
-	queue_push(render->queue, NULL);
+	spsc_queue_push(render->queue, NULL);
+	spsc_queue_publish(render->queue);
 	thread_destroy(render->thread);
-	queue_destroy(render->queue);
+	spsc_queue_destroy(render->queue);
+	for (int i = 0; i < render->arena_count; ++i)
+	{
+		arena_reset(render, &render->arenas[i]);
+		heap_free(render->heap, render->arenas[i].base);
+	}
+	heap_free(render->heap, render->arenas);
+	if (render->draws)
+	{
+		heap_free(render->heap, render->draws);
+		heap_free(render->heap, render->draw_keys);
+		heap_free(render->heap, render->draw_keys_scratch);
+	}
+	if (render->instance_data)
+	{
+		heap_free(render->heap, render->instance_data);
+	}
+	cache_destroy(render->heap, &render->meshes);
+	cache_destroy(render->heap, &render->shaders);
 	heap_free(render->heap, render);
 }
 
 void render_push_model(render_t* render, ecs_entity_ref_t* entity, gpu_mesh_info_t* mesh, gpu_shader_info_t* shader, gpu_uniform_buffer_info_t* uniform)
 {
-	model_command_t* command = heap_alloc(render->heap, sizeof(model_command_t), 8);
+	// Uniform data is packed directly after its command.
+	size_t command_size = (sizeof(model_command_t) + k_render_command_alignment - 1) & ~(size_t)(k_render_command_alignment - 1);
+	model_command_t* command = arena_alloc(render, command_size + uniform->size);
 	command->type = k_command_model;
 	command->entity = *entity;
 	command->mesh = mesh;
 	command->shader = shader;
 	command->uniform_buffer.size = uniform->size;
-	command->uniform_buffer.data = heap_alloc(render->heap, uniform->size, 8);
+	command->uniform_buffer.data = (char*)command + command_size;
 	memcpy(command->uniform_buffer.data, uniform->data, uniform->size);
-	queue_push(render->queue, command);
+	render->model_bytes_pushed += uniform->size;
+	push_command(render, command);
+
+	// Publish in batches so the render thread sees one tail update per batch.
+	if (++render->unpublished_count >= k_render_publish_batch)
+	{
+		spsc_queue_publish(render->queue);
+		render->unpublished_count = 0;
+	}
+}
+
+void render_push_view(render_t* render, gpu_uniform_buffer_info_t* view)
+{
+	size_t command_size = (sizeof(view_command_t) + k_render_command_alignment - 1) & ~(size_t)(k_render_command_alignment - 1);
+	view_command_t* command = arena_alloc(render, command_size + view->size);
+	command->type = k_command_view;
+	command->data.size = view->size;
+	command->data.data = (char*)command + command_size;
+	memcpy(command->data.data, view->data, view->size);
+	push_command(render, command);
 }
 
 void render_push_done(render_t* render)
 {
-	frame_done_command_t* command = heap_alloc(render->heap, sizeof(frame_done_command_t), 8);
+	frame_done_command_t* command = arena_alloc(render, sizeof(frame_done_command_t));
 	command->type = k_command_frame_done;
-	queue_push(render->queue, command);
+	push_command(render, command);
+	spsc_queue_publish(render->queue);
+	render->unpublished_count = 0;
+
+	// Block only if the render thread has fallen more than frame_depth frames behind.
+	++render->frames_submitted;
+	int completed = atomic_load(&render->frames_completed);
+	if (render->frames_submitted - completed > render->frame_depth)
+	{
+		uint64_t start = timer_get_ticks();
+		while (render->frames_submitted - completed > render->frame_depth)
+		{
+			atomic_wait(&render->frames_completed, completed);
+			completed = atomic_load(&render->frames_completed);
+		}
+		render->stall_ticks += timer_get_ticks() - start;
+	}
+
+	// The render thread is done with the frame that last used the next arena.
+	arena_reset(render, &render->arenas[render->frames_submitted % render->arena_count]);
+
+	render->last_frame_stall_ticks = render->stall_ticks;
+	render->stall_ticks = 0;
+}
+
+uint64_t render_get_push_stall_ticks(render_t* render)
+{
+	return render->last_frame_stall_ticks;
+}
+
+static void wait_for_submitted_frames(render_t* render)
+{
+	int completed = atomic_load(&render->frames_completed);
+	while (completed != render->frames_submitted)
+	{
+		atomic_wait(&render->frames_completed, completed);
+		completed = atomic_load(&render->frames_completed);
+	}
+}
+
+void render_get_stats(render_t* render, render_stats_t* stats)
+{
+	wait_for_submitted_frames(render);
+	*stats = render->stats;
+	stats->model_bytes_pushed = render->model_bytes_pushed;
+}
+
+void render_get_gpu_stats(render_t* render, gpu_stats_t* stats)
+{
+	wait_for_submitted_frames(render);
+
+	if (render->frames_submitted > 0)
+	{
+		gpu_get_stats(render->gpu, stats);
+	}
+	else
+	{
+		memset(stats, 0, sizeof(*stats));
+	}
+}
+
+static void* arena_alloc(render_t* render, size_t size)
+{
+	command_arena_t* arena = &render->arenas[render->frames_submitted % render->arena_count];
+	size = (size + k_render_command_alignment - 1) & ~(size_t)(k_render_command_alignment - 1);
+	if (arena->used + size > arena->size)
+	{
+		// Keep the full block alive until reset; start a new one at least twice as large.
+		if (arena->overflow_count == arena->overflow_capacity)
+		{
+			arena->overflow_capacity = arena->overflow_capacity ? arena->overflow_capacity * 2 : 4;
+			void** blocks = heap_alloc_tagged(render->heap, sizeof(void*) * arena->overflow_capacity, 8, k_heap_tag_render);
+			if (arena->overflow_blocks)
+			{
+				memcpy(blocks, arena->overflow_blocks, sizeof(void*) * arena->overflow_count);
+				heap_free(render->heap, arena->overflow_blocks);
+			}
+			arena->overflow_blocks = blocks;
+		}
+		arena->overflow_blocks[arena->overflow_count++] = arena->base;
+		arena->overflow_size += arena->size;
+
+		arena->size = __max(arena->size * 2, size);
+		arena->base = heap_alloc_tagged(render->heap, arena->size, k_render_command_alignment, k_heap_tag_render);
+		arena->used = 0;
+	}
+	void* address = arena->base + arena->used;
+	arena->used += size;
+	return address;
+}
+
+static void arena_reset(render_t* render, command_arena_t* arena)
+{
+	// A frame that overflowed gets one block big enough for all of it, so the next one won't.
+	if (arena->overflow_count)
+	{
+		for (int i = 0; i < arena->overflow_count; ++i)
+		{
+			heap_free(render->heap, arena->overflow_blocks[i]);
+		}
+		heap_free(render->heap, arena->overflow_blocks);
+		heap_free(render->heap, arena->base);
+
+		arena->size += arena->overflow_size;
+		arena->base = heap_alloc_tagged(render->heap, arena->size, k_render_command_alignment, k_heap_tag_render);
+		arena->overflow_blocks = NULL;
+		arena->overflow_count = 0;
+		arena->overflow_capacity = 0;
+		arena->overflow_size = 0;
+	}
+	arena->used = 0;
+}
+
+static void push_command(render_t* render, void* command)
+{
+	if (!spsc_queue_try_push(render->queue, command))
+	{
+		uint64_t start = timer_get_ticks();
+		spsc_queue_push(render->queue, command);
+		render->stall_ticks += timer_get_ticks() - start;
+	}
 }
 
 static int render_thread_func(void* user)
 {
 	render_t* render = user;
 
-	render->gpu = gpu_create(render->heap, render->window);
+	render->gpu = gpu_create(render->heap, render->window, render->fs, render->trace);
 	render->gpu_frame_count = gpu_get_frame_count(render->gpu);
 
-	gpu_cmd_buffer_t* cmdbuf = NULL;
-	gpu_pipeline_t* last_pipeline = NULL;
-	gpu_mesh_t* last_mesh = NULL;
+	render->uniform_alignment = gpu_get_uniform_alignment(render->gpu);
+
+	render->frame_buffers = heap_alloc_tagged(render->heap, sizeof(frame_buffers_t) * render->gpu_frame_count, 8, k_heap_tag_render);
+	for (int i = 0; i < render->gpu_frame_count; ++i)
+	{
+		render->frame_buffers[i] = (frame_buffers_t) { 0 };
+	}
+
 	int frame_index = 0;
 
 	while (true)
 	{
-		command_type_t* type = queue_pop(render->queue);
+		command_type_t* type = spsc_queue_pop(render->queue);
 		if (!type)
 		{
 			break;
 		}
 
-		if (!cmdbuf)
-		{
-			cmdbuf = gpu_frame_begin(render->gpu);
-		}
-
 		if (*type == k_command_frame_done)
 		{
-			gpu_frame_end(render->gpu);
-			cmdbuf = NULL;
-			last_pipeline = NULL;
-			last_mesh = NULL;
+			record_draws(render, frame_index);
 
 			destroy_stale_data(render);
+			if (render->trace && (render->frame_counter == 0 ||
+				timer_ticks_to_ms(timer_get_ticks() - render->counter_ticks) >= k_render_counter_interval_ms))
+			{
+				heap_trace_counters(render->heap, render->trace);
+				render->counter_ticks = timer_get_ticks();
+			}
 			++render->frame_counter;
 			frame_index = render->frame_counter % render->gpu_frame_count;
+
+			atomic_increment(&render->frames_completed);
+			atomic_wake_one(&render->frames_completed);
+		}
+		else if (*type == k_command_view)
+		{
+			add_view(render, (view_command_t*)type);
 		}
 		else if (*type == k_command_model)
 		{
 			model_command_t* command = (model_command_t*)type;
 			draw_shader_t* shader = create_or_get_shader_for_model_command(render, command);
 			draw_mesh_t* mesh = create_or_get_mesh_for_model_command(render, command);
-			draw_instance_t* instance = create_or_get_instance_for_model_command(render, command, shader->shader);
-
-			heap_free(render->heap, command->uniform_buffer.data);
-
-			if (last_pipeline != shader->pipeline)
+			size_t expected_size = shader->info->instance_data_size ? shader->info->instance_data_size : shader->uniform_size;
+			if (!shader->pipeline)
+			{
+				++render->stats.draws_skipped;
+			}
+			else if (shader->info->view_data_size &&
+				(render->current_view < 0 || render->views[render->current_view].size != shader->info->view_data_size))
+			{
+				if (!shader->view_size_reported)
+				{
+					debug_print(k_print_error, "Model's shader reads %zu bytes of view data, but no view of that size was pushed\n",
+						shader->info->view_data_size);
+					shader->view_size_reported = true;
+				}
+			}
+			else if (command->uniform_buffer.size == expected_size)
 			{
-				gpu_cmd_pipeline_bind(render->gpu, cmdbuf, shader->pipeline);
-				last_pipeline = shader->pipeline;
+				add_draw(render, shader, mesh, command);
 			}
-			if (last_mesh != mesh->mesh)
+			else if (!shader->uniform_size_reported)
 			{
-				gpu_cmd_mesh_bind(render->gpu, cmdbuf, mesh->mesh);
-				last_mesh = mesh->mesh;
+				debug_print(k_print_error, "Model uniform size %zu does not match the %zu bytes its shader expects\n",
+					command->uniform_buffer.size, expected_size);
+				shader->uniform_size_reported = true;
 			}
-			gpu_cmd_descriptor_bind(render->gpu, cmdbuf, instance->descriptors[frame_index]);
-			gpu_cmd_draw(render->gpu, cmdbuf);
 		}
-
-		heap_free(render->heap, type);
 	}
 
 	gpu_wait_until_idle(render->gpu);
 	render->frame_counter += render->gpu_frame_count + 1;
 	destroy_stale_data(render);
 
+	for (int i = 0; i < render->gpu_frame_count; ++i)
+	{
+		frame_buffers_t* buffers = &render->frame_buffers[i];
+		if (buffers->instances)
+		{
+			gpu_instance_buffer_destroy(render->gpu, buffers->instances);
+		}
+		if (buffers->uniforms)
+		{
+			gpu_uniform_buffer_destroy(render->gpu, buffers->uniforms);
+		}
+	}
+	heap_free(render->heap, render->frame_buffers);
+
 	gpu_destroy(render->gpu);
 	render->gpu = NULL;
 
@@ -199,138 +626,778 @@ static int render_thread_func(void* user)
 
 static draw_shader_t* create_or_get_shader_for_model_command(render_t* render, model_command_t* command)
 {
-	draw_shader_t* shader = NULL;
-	for (int i = 0; i < render->shader_count; ++i)
-	{
-		if (render->shaders[i].info == command->shader)
-		{
-			shader = &render->shaders[i];
-			break;
-		}
-	}
-	if (!shader)
+	uint64_t key = (uint64_t)(uintptr_t)command->shader;
+	int slot = cache_find(&render->shaders, key);
+	if (slot < 0)
 	{
-		assert(render->shader_count < _countof(render->shaders));
-		shader = &render->shaders[render->shader_count++];
-		shader->info = command->shader;
+		slot = cache_insert(render->heap, &render->shaders, key);
 	}
-	if (!shader->shader)
+	draw_shader_t* shader = cache_get_entry(&render->shaders, slot);
+	shader->info = command->shader;
+	shader->id = slot;
+	if (!shader->descriptors)
 	{
-		shader->shader = gpu_shader_create(render->gpu, shader->info);
+		shader->uniform_size = command->uniform_buffer.size;
+		shader->descriptors = heap_alloc_tagged(render->heap, sizeof(gpu_descriptor_t*) * render->gpu_frame_count, 8, k_heap_tag_render);
+		shader->descriptor_generations = heap_alloc_tagged(render->heap, sizeof(int) * render->gpu_frame_count, 8, k_heap_tag_render);
+		for (int i = 0; i < render->gpu_frame_count; ++i)
+		{
+			shader->descriptors[i] = NULL;
+			shader->descriptor_generations[i] = 0;
+		}
 	}
-	if (!shader->pipeline)
+	if (!shader->pipeline && !shader->compile)
 	{
-		gpu_pipeline_info_t pipeline_info =
+		shader->compile = heap_alloc_tagged(render->heap, sizeof(shader_compile_t), 8, k_heap_tag_render);
+		*shader->compile = (shader_compile_t)
 		{
-			.shader = shader->shader,
+			.gpu = render->gpu,
+			.info = shader->info,
 			.mesh_layout = command->mesh->layout,
+			.shader = shader->shader,
 		};
-		shader->pipeline = gpu_pipeline_create(render->gpu, &pipeline_info);
+		if (render->jobs)
+		{
+			job_submit(render->jobs, compile_shader_job, shader->compile, &shader->compile->counter);
+		}
+		else
+		{
+			compile_shader_job(shader->compile);
+		}
+	}
+	if (shader->compile && job_counter_is_done(&shader->compile->counter))
+	{
+		finish_shader_compile(render, shader);
 	}
-	shader->frame_counter = render->frame_counter;
+	cache_touch(&render->shaders, slot, render->frame_counter);
 	return shader;
 }
 
-static draw_mesh_t* create_or_get_mesh_for_model_command(render_t* render, model_command_t* command)
+static void compile_shader_job(void* data)
 {
-	draw_mesh_t* mesh = NULL;
-	for (int i = 0; i < render->mesh_count; ++i)
+	shader_compile_t* compile = data;
+	if (!compile->shader)
 	{
-		if (render->meshes[i].info == command->mesh)
-		{
-			mesh = &render->meshes[i];
-			break;
-		}
+		compile->shader = gpu_shader_create(compile->gpu, compile->info);
 	}
-	if (!mesh)
+	gpu_pipeline_info_t pipeline_info =
 	{
-		assert(render->mesh_count < _countof(render->meshes));
-		mesh = &render->meshes[render->mesh_count++];
-		mesh->info = command->mesh;
+		.shader = compile->shader,
+		.mesh_layout = compile->mesh_layout,
+	};
+	compile->pipeline = gpu_pipeline_create(compile->gpu, &pipeline_info);
+}
+
+// Take the results of a finished compile.
+// If the pipeline failed, the next model using the shader retries it.
+static void finish_shader_compile(render_t* render, draw_shader_t* shader)
+{
+	shader->shader = shader->compile->shader;
+	shader->pipeline = shader->compile->pipeline;
+	heap_free(render->heap, shader->compile);
+	shader->compile = NULL;
+}
+
+static draw_mesh_t* create_or_get_mesh_for_model_command(render_t* render, model_command_t* command)
+{
+	uint64_t key = (uint64_t)(uintptr_t)command->mesh;
+	int slot = cache_find(&render->meshes, key);
+	if (slot < 0)
+	{
+		slot = cache_insert(render->heap, &render->meshes, key);
 	}
+	draw_mesh_t* mesh = cache_get_entry(&render->meshes, slot);
+	mesh->info = command->mesh;
+	mesh->id = slot;
 	if (!mesh->mesh)
 	{
 		mesh->mesh = gpu_mesh_create(render->gpu, command->mesh);
 	}
-	mesh->frame_counter = render->frame_counter;
+	cache_touch(&render->meshes, slot, render->frame_counter);
 	return mesh;
 }
 
-static draw_instance_t* create_or_get_instance_for_model_command(render_t* render, model_command_t* command, gpu_shader_t* shader)
+static void add_draw(render_t* render, draw_shader_t* shader, draw_mesh_t* mesh, model_command_t* command)
+{
+	if (render->draw_count > k_sort_key_index_mask)
+	{
+		debug_print(k_print_error, "More than %d draws in a frame; dropping the rest\n", k_sort_key_index_mask + 1);
+		return;
+	}
+	if (render->draw_count == render->draw_capacity)
+	{
+		int capacity = render->draw_capacity ? render->draw_capacity * 2 : k_render_draw_initial_capacity;
+		render->draws = grow_array(render->heap, render->draws, render->draw_count, capacity, sizeof(draw_item_t));
+		render->draw_keys = grow_array(render->heap, render->draw_keys, render->draw_count, capacity, sizeof(uint64_t));
+		render->draw_keys_scratch = grow_array(render->heap, render->draw_keys_scratch, 0, capacity, sizeof(uint64_t));
+		render->draw_capacity = capacity;
+	}
+
+	// Track the binds submission order would need, so the saving from sorting can be reported.
+	draw_item_t* previous = render->draw_count ? &render->draws[render->draw_count - 1] : NULL;
+	if (!previous || previous->pipeline != shader->pipeline)
+	{
+		++render->submission_bind_count;
+	}
+	if (!previous || previous->mesh != mesh->mesh)
+	{
+		++render->submission_bind_count;
+	}
+
+	int index = render->draw_count++;
+	draw_item_t* draw = &render->draws[index];
+	*draw = (draw_item_t)
+	{
+		.pipeline = shader->pipeline,
+		.mesh = mesh->mesh,
+		.shader_id = shader->id,
+		.view = shader->info->view_data_size ? render->current_view : -1,
+		.instanced = shader->info->instance_data_size != 0,
+		.data = command->uniform_buffer.data,
+		.data_size = command->uniform_buffer.size,
+	};
+	if (draw->instanced)
+	{
+		render->instance_data_size += draw->data_size;
+	}
+	else
+	{
+		render->uniform_data_size += align_up(draw->data_size, render->uniform_alignment);
+	}
+	render->draw_keys[index] =
+		((uint64_t)(shader->id & k_sort_key_id_mask) << k_sort_key_pipeline_shift) |
+		((uint64_t)(mesh->id & k_sort_key_id_mask) << k_sort_key_mesh_shift) |
+		((uint64_t)(__max(draw->view, 0) & k_sort_key_view_mask) << k_sort_key_view_shift) |
+		(uint64_t)index;
+}
+
+// Make a view current for the models pushed after it.
+// Pushing the current view's data again, as a game drawing in chunks does, reuses it.
+static void add_view(render_t* render, view_command_t* command)
 {
-	draw_instance_t* instance = NULL;
-	for (int i = 0; i < render->instance_count; ++i)
+	if (render->current_view >= 0)
 	{
-		if (memcmp(&render->instances[i].entity, &command->entity, sizeof(ecs_entity_ref_t)) == 0)
+		gpu_uniform_buffer_info_t* current = &render->views[render->current_view];
+		if (current->size == command->data.size && memcmp(current->data, command->data.data, current->size) == 0)
 		{
-			instance = &render->instances[i];
-			break;
+			return;
 		}
 	}
-	if (!instance)
+	if (render->view_count == k_render_max_views)
 	{
-		assert(render->instance_count < _countof(render->instances));
-		instance = &render->instances[render->instance_count++];
+		debug_print(k_print_error, "More than %d views in a frame; later models use the last one\n", k_render_max_views);
+		return;
+	}
 
-		instance->entity = command->entity;
-		instance->uniform_buffers = heap_alloc(render->heap, sizeof(gpu_uniform_buffer_t*) * render->gpu_frame_count, 8);
-		instance->descriptors = heap_alloc(render->heap, sizeof(gpu_descriptor_t*) * render->gpu_frame_count, 8);
-		for (int i = 0; i < render->gpu_frame_count; ++i)
+	int index = render->view_count++;
+	render->views[index] = command->data;
+	render->view_offsets[index] = render->view_data_size;
+	size_t size = align_up(command->data.size, render->uniform_alignment);
+	render->view_data_size += size;
+	render->uniform_data_size += size;
+	render->current_view = index;
+}
+
+// Record the frame's draws in sorted order.
+// With a job system and enough draws, the draws are split across command buffers recorded in parallel.
+static void record_draws(render_t* render, int frame_index)
+{
+	uint64_t start_ticks = timer_get_ticks();
+
+	const uint64_t* keys = radix_sort_keys(render->draw_keys, render->draw_keys_scratch, render->draw_count);
+	frame_buffers_t* buffers = &render->frame_buffers[frame_index];
+	reserve_frame_buffers(render, buffers);
+	int range_count = partition_draws(render, keys, frame_index);
+
+	gpu_cmd_buffer_t* cmdbufs[k_gpu_max_parallel_cmd_buffers];
+	bool begun;
+	if (range_count == 1)
+	{
+		cmdbufs[0] = gpu_frame_begin(render->gpu);
+		begun = cmdbufs[0] != NULL;
+	}
+	else
+	{
+		begun = gpu_frame_begin_parallel(render->gpu, range_count, cmdbufs);
+	}
+
+	if (begun)
+	{
+		// The frame has begun, so the GPU is done reading this frame's uniform ring.
+		// Views go at the front, written once for every draw that reads them.
+		char* uniform_ring = buffers->uniforms ? gpu_uniform_buffer_get_data(render->gpu, buffers->uniforms) : NULL;
+		for (int i = 0; i < render->view_count; ++i)
+		{
+			memcpy(uniform_ring + render->view_offsets[i], render->views[i].data, render->views[i].size);
+		}
+		for (int i = 0; i < range_count; ++i)
+		{
+			render->record_ranges[i].cmdbuf = cmdbufs[i];
+			render->record_ranges[i].uniform_ring = uniform_ring;
+		}
+
+		// The render thread records the first range itself while workers take the rest.
+		job_counter_t counter = { 0 };
+		for (int i = 1; i < range_count; ++i)
+		{
+			job_submit(render->jobs, record_range_job, &render->record_ranges[i], &counter);
+		}
+		record_range_job(&render->record_ranges[0]);
+		if (range_count > 1)
+		{
+			job_wait(render->jobs, &counter);
+		}
+
+		int bind_count = 0;
+		for (int i = 0; i < range_count; ++i)
+		{
+			bind_count += render->record_ranges[i].bind_count;
+			render->stats.instanced_draw_count += render->record_ranges[i].instanced_draw_count;
+		}
+		if (render->instance_data_size)
 		{
-			instance->uniform_buffers[i] = gpu_uniform_buffer_create(render->gpu, &command->uniform_buffer);
+			gpu_instance_buffer_update(render->gpu, buffers->instances, render->instance_data, render->instance_data_size);
+		}
+
+		render->stats.binds_saved += render->submission_bind_count - bind_count;
+		render->stats.uniform_bytes_written += render->uniform_data_size;
+		render->stats.view_bytes_written += render->view_data_size;
+		render->stats.cmd_buffer_count += range_count;
+	}
+	gpu_frame_end(render->gpu);
+
+	++render->stats.frame_count;
+	render->stats.draw_count += render->draw_count;
+	render->stats.record_ticks += timer_get_ticks() - start_ticks;
+
+	render->draw_count = 0;
+	render->submission_bind_count = 0;
+	render->instance_data_size = 0;
+	render->view_count = 0;
+	render->current_view = -1;
+	render->view_data_size = 0;
+	render->uniform_data_size = 0;
+}
+
+// Split the sorted draws into ranges of about the same number of draws, one per command buffer,
+// and work out where each range's uniform and instance data start.
+// Runs of instanced draws are never split, so each is still recorded as one draw.
+// Also creates the descriptors the draws use, which recording jobs only read.
+// Returns the number of ranges.
+static int partition_draws(render_t* render, const uint64_t* keys, int frame_index)
+{
+	int range_count = 1;
+	if (render->jobs)
+	{
+		range_count = __min(job_system_get_worker_count(render->jobs) + 1, k_gpu_max_parallel_cmd_buffers);
+		range_count = __max(__min(range_count, render->draw_count / k_render_min_draws_per_job), 1);
+	}
+	int target_size = (render->draw_count + range_count - 1) / __max(range_count, 1);
 
-			gpu_descriptor_info_t descriptor_info =
+	// Per-draw uniforms follow the views in the ring.
+	size_t uniform_offset = render->view_data_size;
+	size_t instance_offset = 0;
+	record_range_t* range = &render->record_ranges[0];
+	*range = (record_range_t) { .render = render, .keys = keys, .frame_index = frame_index, .uniform_offset = uniform_offset };
+	int count = 1;
+	int last_shader_id = -1;
+	for (int i = 0; i < render->draw_count;)
+	{
+		draw_item_t* draw = &render->draws[keys[i] & k_sort_key_index_mask];
+		if (draw->shader_id != last_shader_id)
+		{
+			draw_shader_t* shader = cache_get_entry(&render->shaders, draw->shader_id);
+			if (get_shader_binding_count(shader))
+			{
+				get_shader_descriptor(render, shader, frame_index);
+			}
+			last_shader_id = draw->shader_id;
+		}
+
+		if (draw->instanced)
+		{
+			for (; i < render->draw_count; ++i)
 			{
-				.shader = shader,
-				.uniform_buffers = &instance->uniform_buffers[i],
-				.uniform_buffer_count = 1,
+				draw_item_t* instance = &render->draws[keys[i] & k_sort_key_index_mask];
+				if (instance->pipeline != draw->pipeline || instance->mesh != draw->mesh || instance->view != draw->view)
+				{
+					break;
+				}
+				instance_offset += instance->data_size;
+			}
+		}
+		else
+		{
+			uniform_offset += align_up(draw->data_size, render->uniform_alignment);
+			++i;
+		}
+
+		if (i - range->begin >= target_size && i < render->draw_count && count < range_count)
+		{
+			range->end = i;
+			range = &render->record_ranges[count++];
+			*range = (record_range_t)
+			{
+				.render = render,
+				.keys = keys,
+				.frame_index = frame_index,
+				.begin = i,
+				.uniform_offset = uniform_offset,
+				.instance_offset = instance_offset,
 			};
-			instance->descriptors[i] = gpu_descriptor_create(render->gpu, &descriptor_info);
 		}
 	}
+	range->end = render->draw_count;
+	return count;
+}
+
+// Record a range of sorted draws. Runs on the render thread or a worker; the range owns its
+// command buffer and the parts of the uniform ring and instance data it writes.
+static void record_range_job(void* data)
+{
+	record_range_t* range = data;
+	render_t* render = range->render;
+	frame_buffers_t* buffers = &render->frame_buffers[range->frame_index];
+
+	gpu_pipeline_t* last_pipeline = NULL;
+	gpu_mesh_t* last_mesh = NULL;
+	size_t instance_offset = range->instance_offset;
+	size_t uniform_offset = range->uniform_offset;
+	gpu_cmd_trace_push(render->gpu, range->cmdbuf, "draws");
+	for (int i = range->begin; i < range->end;)
+	{
+		draw_item_t* draw = &render->draws[range->keys[i] & k_sort_key_index_mask];
+		if (last_pipeline != draw->pipeline)
+		{
+			gpu_cmd_pipeline_bind(render->gpu, range->cmdbuf, draw->pipeline);
+			last_pipeline = draw->pipeline;
+			++range->bind_count;
+		}
+		if (last_mesh != draw->mesh)
+		{
+			gpu_cmd_mesh_bind(render->gpu, range->cmdbuf, draw->mesh);
+			last_mesh = draw->mesh;
+			++range->bind_count;
+		}
+
+		// The view, if any, is binding 0; per-draw uniforms follow it.
+		draw_shader_t* shader = cache_get_entry(&render->shaders, draw->shader_id);
+		uint32_t offsets[2];
+		int offset_count = 0;
+		if (draw->view >= 0)
+		{
+			offsets[offset_count++] = (uint32_t)render->view_offsets[draw->view];
+		}
+
+		if (!draw->instanced)
+		{
+			// Uniforms go straight into the mapped ring; the draw selects them with a dynamic offset.
+			memcpy(range->uniform_ring + uniform_offset, draw->data, draw->data_size);
+			offsets[offset_count++] = (uint32_t)uniform_offset;
+			gpu_cmd_descriptor_bind_offsets(render->gpu, range->cmdbuf, shader->descriptors[range->frame_index], offsets);
+			gpu_cmd_draw(render->gpu, range->cmdbuf);
+			uniform_offset += align_up(draw->data_size, render->uniform_alignment);
+			++i;
+			continue;
+		}
+
+		if (offset_count)
+		{
+			gpu_cmd_descriptor_bind_offsets(render->gpu, range->cmdbuf, shader->descriptors[range->frame_index], offsets);
+		}
+
+		// Sorting made draws that share this pipeline, mesh, and view adjacent; gather them into one instanced draw.
+		size_t first_offset = instance_offset;
+		int instance_count = 0;
+		for (; i < range->end; ++i, ++instance_count)
+		{
+			draw_item_t* instance = &render->draws[range->keys[i] & k_sort_key_index_mask];
+			if (instance->pipeline != draw->pipeline || instance->mesh != draw->mesh || instance->view != draw->view)
+			{
+				break;
+			}
+			memcpy(render->instance_data + instance_offset, instance->data, instance->data_size);
+			instance_offset += instance->data_size;
+		}
+		gpu_cmd_draw_instanced(render->gpu, range->cmdbuf, buffers->instances, first_offset, instance_count);
+		++range->instanced_draw_count;
+	}
+	gpu_cmd_trace_pop(render->gpu, range->cmdbuf);
+}
 
-	int frame_index = render->frame_counter % render->gpu_frame_count;
-	gpu_uniform_buffer_update(render->gpu, instance->uniform_buffers[frame_index], command->uniform_buffer.data, command->uniform_buffer.size);
+// Make sure a frame's buffers, and the CPU space instance data is gathered in, can hold the current frame.
+// Growing a buffer the GPU may still be reading waits for the GPU; it is rare once sizes settle.
+static void reserve_frame_buffers(render_t* render, frame_buffers_t* buffers)
+{
+	size_t instance_size = render->instance_data_size;
+	if (instance_size > render->instance_data_capacity)
+	{
+		size_t capacity = __max(render->instance_data_capacity * 2, instance_size);
+		if (render->instance_data)
+		{
+			heap_free(render->heap, render->instance_data);
+		}
+		render->instance_data = heap_alloc_tagged(render->heap, capacity, 16, k_heap_tag_render);
+		render->instance_data_capacity = capacity;
+	}
 
-	instance->frame_counter = render->frame_counter;
+	if (instance_size > buffers->instances_size)
+	{
+		size_t size = __max(buffers->instances_size * 2, __max(instance_size, k_render_instance_buffer_initial_size));
+		if (buffers->instances)
+		{
+			gpu_wait_until_idle(render->gpu);
+			gpu_instance_buffer_destroy(render->gpu, buffers->instances);
+		}
+		buffers->instances = gpu_instance_buffer_create(render->gpu, size);
+		buffers->instances_size = size;
+	}
 
-	return instance;
+	if (render->uniform_data_size > buffers->uniforms_size)
+	{
+		size_t size = __max(buffers->uniforms_size * 2, __max(render->uniform_data_size, k_render_uniform_ring_initial_size));
+		if (buffers->uniforms)
+		{
+			gpu_wait_until_idle(render->gpu);
+			gpu_uniform_buffer_destroy(render->gpu, buffers->uniforms);
+		}
+		// Every shader descriptor over the old ring is recreated on next use.
+		gpu_uniform_buffer_info_t info = { .size = size };
+		buffers->uniforms = gpu_uniform_buffer_create(render->gpu, &info);
+		buffers->uniforms_size = size;
+		++buffers->uniforms_generation;
+	}
+}
+
+static gpu_descriptor_t* get_shader_descriptor(render_t* render, draw_shader_t* shader, int frame_index)
+{
+	frame_buffers_t* buffers = &render->frame_buffers[frame_index];
+	if (shader->descriptor_generations[frame_index] != buffers->uniforms_generation)
+	{
+		if (shader->descriptors[frame_index])
+		{
+			gpu_descriptor_destroy(render->gpu, shader->descriptors[frame_index]);
+		}
+
+		// Each binding covers one view's or one draw's uniforms in the ring; the offsets pick which.
+		gpu_uniform_buffer_t* uniform_buffers[2] = { buffers->uniforms, buffers->uniforms };
+		size_t uniform_ranges[2];
+		int binding = 0;
+		if (shader->info->view_data_size)
+		{
+			uniform_ranges[binding++] = shader->info->view_data_size;
+		}
+		if (!shader->info->instance_data_size)
+		{
+			uniform_ranges[binding++] = shader->uniform_size;
+		}
+		gpu_descriptor_info_t descriptor_info =
+		{
+			.shader = shader->shader,
+			.uniform_buffers = uniform_buffers,
+			.uniform_buffer_count = binding,
+			.uniform_ranges = uniform_ranges,
+		};
+		shader->descriptors[frame_index] = gpu_descriptor_create(render->gpu, &descriptor_info);
+		shader->descriptor_generations[frame_index] = buffers->uniforms_generation;
+	}
+	return shader->descriptors[frame_index];
+}
+
+// Uniform bindings the shader reads: the view, if it has one, and per-draw uniforms unless it is instanced.
+static int get_shader_binding_count(draw_shader_t* shader)
+{
+	return (shader->info->view_data_size ? 1 : 0) + (shader->info->instance_data_size ? 0 : 1);
+}
+
+// LSD radix sort on 8-bit digits. Returns whichever of the two buffers holds the result.
+// Keys are generated in index order, so the stable passes over the index bytes are skipped,
+// as are passes where every key has the same digit.
+static uint64_t* radix_sort_keys(uint64_t* keys, uint64_t* scratch, int count)
+{
+	enum { k_first_digit = k_sort_key_view_shift / 8, k_digit_count = 8 };
+
+	int histograms[k_digit_count][256];
+	memset(histograms, 0, sizeof(histograms));
+	for (int i = 0; i < count; ++i)
+	{
+		for (int d = k_first_digit; d < k_digit_count; ++d)
+		{
+			++histograms[d][(keys[i] >> (d * 8)) & 0xff];
+		}
+	}
+
+	for (int d = k_first_digit; d < k_digit_count; ++d)
+	{
+		int* histogram = histograms[d];
+		if (count == 0 || histogram[(keys[0] >> (d * 8)) & 0xff] == count)
+		{
+			continue;
+		}
+
+		int offset = 0;
+		for (int b = 0; b < 256; ++b)
+		{
+			int bucket_count = histogram[b];
+			histogram[b] = offset;
+			offset += bucket_count;
+		}
+		for (int i = 0; i < count; ++i)
+		{
+			scratch[histogram[(keys[i] >> (d * 8)) & 0xff]++] = keys[i];
+		}
+
+		uint64_t* temp = keys;
+		keys = scratch;
+		scratch = temp;
+	}
+	return keys;
+}
+
+static bool cache_is_stale(render_t* render, render_cache_t* cache, int slot)
+{
+	return slot >= 0 && cache->frame_counters[slot] + render->gpu_frame_count <= render->frame_counter;
 }
 
 static void destroy_stale_data(render_t* render)
 {
-	for (int i = render->instance_count - 1; i >= 0; --i)
+	// Each cache is ordered by last use, so stop at the first entry still in use.
+	while (cache_is_stale(render, &render->meshes, render->meshes.oldest))
+	{
+		int slot = render->meshes.oldest;
+		draw_mesh_t* mesh = cache_get_entry(&render->meshes, slot);
+		gpu_mesh_destroy(render->gpu, mesh->mesh);
+		cache_remove(&render->meshes, slot);
+	}
+	while (cache_is_stale(render, &render->shaders, render->shaders.oldest))
 	{
-		if (render->instances[i].frame_counter + render->gpu_frame_count <= render->frame_counter)
+		int slot = render->shaders.oldest;
+		draw_shader_t* shader = cache_get_entry(&render->shaders, slot);
+		for (int f = 0; f < render->gpu_frame_count; ++f)
 		{
-			for (int f = 0; f < render->gpu_frame_count; ++f)
+			if (shader->descriptors[f])
 			{
-				gpu_descriptor_destroy(render->gpu, render->instances[i].descriptors[f]);
-				gpu_uniform_buffer_destroy(render->gpu, render->instances[i].uniform_buffers[f]);
+				gpu_descriptor_destroy(render->gpu, shader->descriptors[f]);
 			}
-			heap_free(render->heap, render->instances[i].descriptors);
-			heap_free(render->heap, render->instances[i].uniform_buffers);
-			render->instances[i] = render->instances[render->instance_count - 1];
-			render->instance_count--;
 		}
+		heap_free(render->heap, shader->descriptors);
+		heap_free(render->heap, shader->descriptor_generations);
+		if (shader->compile)
+		{
+			if (render->jobs)
+			{
+				job_wait(render->jobs, &shader->compile->counter);
+			}
+			finish_shader_compile(render, shader);
+		}
+		if (shader->pipeline)
+		{
+			gpu_pipeline_destroy(render->gpu, shader->pipeline);
+		}
+		if (shader->shader)
+		{
+			gpu_shader_destroy(render->gpu, shader->shader);
+		}
+		cache_remove(&render->shaders, slot);
 	}
-	for (int i = render->mesh_count - 1; i >= 0; --i)
+}
+
+static size_t align_up(size_t size, size_t alignment)
+{
+	return (size + alignment - 1) & ~(alignment - 1);
+}
+
+static void* grow_array(heap_t* heap, void* array, int count, int capacity, size_t element_size)
+{
+	void* new_array = heap_alloc_tagged(heap, element_size * capacity, 8, k_heap_tag_render);
+	if (array)
 	{
-		if (render->meshes[i].frame_counter + render->gpu_frame_count <= render->frame_counter)
+		memcpy(new_array, array, element_size * count);
+		heap_free(heap, array);
+	}
+	return new_array;
+}
+
+static int cache_bucket_for_key(render_cache_t* cache, uint64_t key)
+{
+	// Fibonacci hashing: the multiply mixes pointer and index bits into the top bits.
+	return (int)((key * 0x9E3779B97F4A7C15ull) >> cache->bucket_shift);
+}
+
+static void cache_create_buckets(heap_t* heap, render_cache_t* cache, int bucket_count)
+{
+	int shift = 64;
+	for (int n = bucket_count; n > 1; n /= 2)
+	{
+		--shift;
+	}
+	cache->buckets = heap_alloc_tagged(heap, sizeof(int) * bucket_count, 8, k_heap_tag_render);
+	memset(cache->buckets, 0xff, sizeof(int) * bucket_count);
+	cache->bucket_mask = bucket_count - 1;
+	cache->bucket_shift = shift;
+}
+
+static void cache_create(heap_t* heap, render_cache_t* cache, size_t entry_size)
+{
+	memset(cache, 0, sizeof(*cache));
+	cache->entry_size = entry_size;
+	cache->oldest = -1;
+	cache->newest = -1;
+	cache_create_buckets(heap, cache, k_render_cache_initial_capacity * 2);
+}
+
+static void cache_destroy(heap_t* heap, render_cache_t* cache)
+{
+	heap_free(heap, cache->buckets);
+	if (cache->slot_capacity)
+	{
+		heap_free(heap, cache->entries);
+		heap_free(heap, cache->keys);
+		heap_free(heap, cache->frame_counters);
+		heap_free(heap, cache->older);
+		heap_free(heap, cache->newer);
+		heap_free(heap, cache->free_slots);
+	}
+}
+
+static int cache_find(render_cache_t* cache, uint64_t key)
+{
+	for (int bucket = cache_bucket_for_key(cache, key);; bucket = (bucket + 1) & cache->bucket_mask)
+	{
+		int slot = cache->buckets[bucket];
+		if (slot < 0 || cache->keys[slot] == key)
 		{
-			gpu_mesh_destroy(render->gpu, render->meshes[i].mesh);
-			render->meshes[i] = render->meshes[render->mesh_count - 1];
-			render->mesh_count--;
+			return slot;
 		}
 	}
-	for (int i = render->shader_count - 1; i >= 0; --i)
+}
+
+static void cache_insert_bucket(render_cache_t* cache, int slot)
+{
+	int bucket = cache_bucket_for_key(cache, cache->keys[slot]);
+	while (cache->buckets[bucket] >= 0)
 	{
-		if (render->shaders[i].frame_counter + render->gpu_frame_count <= render->frame_counter)
+		bucket = (bucket + 1) & cache->bucket_mask;
+	}
+	cache->buckets[bucket] = slot;
+}
+
+static int cache_insert(heap_t* heap, render_cache_t* cache, uint64_t key)
+{
+	// Keep the load factor at or below one half.
+	if ((cache->count + 1) * 2 > cache->bucket_mask + 1)
+	{
+		heap_free(heap, cache->buckets);
+		cache_create_buckets(heap, cache, (cache->bucket_mask + 1) * 2);
+		for (int slot = cache->oldest; slot >= 0; slot = cache->newer[slot])
+		{
+			cache_insert_bucket(cache, slot);
+		}
+	}
+
+	int slot;
+	if (cache->free_count)
+	{
+		slot = cache->free_slots[--cache->free_count];
+	}
+	else
+	{
+		if (cache->slot_count == cache->slot_capacity)
+		{
+			int capacity = cache->slot_capacity ? cache->slot_capacity * 2 : k_render_cache_initial_capacity;
+			cache->entries = grow_array(heap, cache->entries, cache->slot_count, capacity, cache->entry_size);
+			cache->keys = grow_array(heap, cache->keys, cache->slot_count, capacity, sizeof(uint64_t));
+			cache->frame_counters = grow_array(heap, cache->frame_counters, cache->slot_count, capacity, sizeof(int));
+			cache->older = grow_array(heap, cache->older, cache->slot_count, capacity, sizeof(int));
+			cache->newer = grow_array(heap, cache->newer, cache->slot_count, capacity, sizeof(int));
+			cache->free_slots = grow_array(heap, cache->free_slots, 0, capacity, sizeof(int));
+			cache->slot_capacity = capacity;
+		}
+		slot = cache->slot_count++;
+	}
+
+	memset(cache_get_entry(cache, slot), 0, cache->entry_size);
+	cache->keys[slot] = key;
+	cache->frame_counters[slot] = 0;
+	cache_insert_bucket(cache, slot);
+	cache->count++;
+
+	// New slots start newest; cache_touch sets the frame.
+	cache->older[slot] = cache->newest;
+	cache->newer[slot] = -1;
+	if (cache->newest >= 0)
+	{
+		cache->newer[cache->newest] = slot;
+	}
+	else
+	{
+		cache->oldest = slot;
+	}
+	cache->newest = slot;
+	return slot;
+}
+
+static void cache_unlink(render_cache_t* cache, int slot)
+{
+	if (cache->older[slot] >= 0)
+	{
+		cache->newer[cache->older[slot]] = cache->newer[slot];
+	}
+	else
+	{
+		cache->oldest = cache->newer[slot];
+	}
+	if (cache->newer[slot] >= 0)
+	{
+		cache->older[cache->newer[slot]] = cache->older[slot];
+	}
+	else
+	{
+		cache->newest = cache->older[slot];
+	}
+}
+
+static void cache_touch(render_cache_t* cache, int slot, int frame_counter)
+{
+	cache->frame_counters[slot] = frame_counter;
+	if (cache->newest != slot)
+	{
+		cache_unlink(cache, slot);
+		cache->older[slot] = cache->newest;
+		cache->newer[slot] = -1;
+		cache->newer[cache->newest] = slot;
+		cache->newest = slot;
+	}
+}
+
+static void cache_remove(render_cache_t* cache, int slot)
+{
+	int bucket = cache_bucket_for_key(cache, cache->keys[slot]);
+	while (cache->buckets[bucket] != slot)
+	{
+		bucket = (bucket + 1) & cache->bucket_mask;
+	}
+
+	// Backward-shift deletion: pull later entries of the probe run into the hole.
+	int hole = bucket;
+	for (int next = (hole + 1) & cache->bucket_mask; cache->buckets[next] >= 0; next = (next + 1) & cache->bucket_mask)
+	{
+		int home = cache_bucket_for_key(cache, cache->keys[cache->buckets[next]]);
+		bool movable = (next > hole) ? (home <= hole || home > next) : (home <= hole && home > next);
+		if (movable)
 		{
-			gpu_pipeline_destroy(render->gpu, render->shaders[i].pipeline);
-			gpu_shader_destroy(render->gpu, render->shaders[i].shader);
-			render->shaders[i] = render->shaders[render->shader_count - 1];
-			render->shader_count--;
+			cache->buckets[hole] = cache->buckets[next];
+			hole = next;
 		}
 	}
+	cache->buckets[hole] = -1;
+	cache->count--;
+
+	cache_unlink(cache, slot);
+	cache->free_slots[cache->free_count++] = slot;
+}
+
+static void* cache_get_entry(render_cache_t* cache, int slot)
+{
+	return (char*)cache->entries + cache->entry_size * slot;
 }
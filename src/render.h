@@ -1,24 +1,81 @@
 #pragma once
 
+#include <stdint.h>
+
 // High-level graphics rendering interface.
 
 typedef struct render_t render_t;
 
 typedef struct ecs_entity_ref_t ecs_entity_ref_t;
+typedef struct fs_t fs_t;
 typedef struct gpu_mesh_info_t gpu_mesh_info_t;
 typedef struct gpu_shader_info_t gpu_shader_info_t;
+typedef struct gpu_stats_t gpu_stats_t;
 typedef struct gpu_uniform_buffer_info_t gpu_uniform_buffer_info_t;
 typedef struct heap_t heap_t;
+typedef struct job_system_t job_system_t;
+typedef struct trace_t trace_t;
 typedef struct wm_window_t wm_window_t;
 
+// Running totals kept by the render thread.
+typedef struct render_stats_t
+{
+	uint64_t frame_count;
+	uint64_t draw_count;
+	// Instanced draws recorded; each replaces a run of draws that share a pipeline and mesh.
+	uint64_t instanced_draw_count;
+	// Pipeline and mesh binds that recording in submission order would have needed,
+	// minus those needed after sorting draws by pipeline and mesh.
+	uint64_t binds_saved;
+	// Uniform data written to the per-frame uniform rings, including alignment padding and views.
+	uint64_t uniform_bytes_written;
+	// The part of uniform_bytes_written that is view data, written once per view rather than per draw.
+	uint64_t view_bytes_written;
+	// Uniform and instance data copied in by render_push_model(), counted on the game thread.
+	uint64_t model_bytes_pushed;
+	// Models not drawn because their shader's pipeline was still compiling.
+	uint64_t draws_skipped;
+	// Command buffers draws were recorded into; more than one a frame when recording is split across jobs.
+	uint64_t cmd_buffer_count;
+	// Time spent sorting and recording draws, including waiting on recording jobs, in timer ticks.
+	uint64_t record_ticks;
+} render_stats_t;
+
 // Create a render system.
-render_t* render_create(heap_t* heap, wm_window_t* window);
+// The game thread may run up to frame_depth frames ahead of the render thread
+// before render_push_done() blocks.
+// The file system, if not NULL, persists the GPU pipeline cache across runs.
+// The job system, if not NULL, compiles shaders and pipelines in the background; models using
+// a shader are skipped until it is ready. Without one, compiles block the render thread.
+// Large frames are also recorded into several command buffers on the job system.
+// The trace, if not NULL, gets GPU time for each frame and each command buffer's draws.
+render_t* render_create(heap_t* heap, wm_window_t* window, fs_t* fs, job_system_t* jobs, trace_t* trace, int frame_depth);
 
 // Destroy a render system.
 void render_destroy(render_t* render);
 
 // Push a model onto a queue of items to be rendered.
+// All models drawn with a shader must push uniforms of the same size.
+// If the shader has instance data, the uniform is that data and must be instance_data_size bytes;
+// models sharing its mesh and shader are then drawn together in one instanced draw.
 void render_push_model(render_t* render, ecs_entity_ref_t* entity, gpu_mesh_info_t* mesh, gpu_shader_info_t* shader, gpu_uniform_buffer_info_t* uniform);
 
+// Push per-view data, such as camera matrices, for the models pushed after it in the same frame.
+// Shaders with view_data_size read it from binding 0, so each model need only push its own transform.
+// The data is written to the GPU once per view; pushing the same data again is cheap.
+void render_push_view(render_t* render, gpu_uniform_buffer_info_t* view);
+
 // Push an end-of-frame marker on a queue of items to be rendered.
+// Publishes the frame to the render thread.
 void render_push_done(render_t* render);
+
+// Get the time the game thread spent blocked in render_push_*() during the last frame, in ticks.
+uint64_t render_get_push_stall_ticks(render_t* render);
+
+// Get the totals kept by the render thread.
+// Call from the game thread between frames; waits for all submitted frames to complete.
+void render_get_stats(render_t* render, render_stats_t* stats);
+
+// Get the GPU call and upload totals recorded by the render thread.
+// Call from the game thread between frames; waits for all submitted frames to complete.
+void render_get_gpu_stats(render_t* render, gpu_stats_t* stats);
@@ -0,0 +1,259 @@
+#include "bench.h"
+
+#include "debug.h"
+#include "ecs.h"
+#include "gpu.h"
+#include "heap.h"
+#include "job.h"
+#include "render.h"
+#include "thread.h"
+#include "timer.h"
+
+#include <string.h>
+
+enum
+{
+	k_bench_mesh_count = 8,
+	k_bench_shader_count = 2,
+	k_bench_warmup_frames = 4,
+	k_bench_frames = 30,
+	k_bench_frame_depth = 2,
+};
+
+// A synthetic scene: a set of entities, each drawn with one of a few meshes and shaders.
+typedef struct bench_scene_t
+{
+	const char* name;
+	int entity_count;
+	int mesh_count;
+	int shader_count;
+	// Entities with an index below churn_count respawn every frame.
+	int churn_count;
+	bool instanced;
+	// Push camera data once as a view, leaving each model a 48 byte transform instead of three matrices.
+	bool view;
+} bench_scene_t;
+
+typedef struct bench_assets_t
+{
+	gpu_mesh_info_t meshes[k_bench_mesh_count];
+	gpu_shader_info_t shaders[k_bench_shader_count];
+	gpu_shader_info_t instanced_shaders[k_bench_shader_count];
+	gpu_shader_info_t view_shaders[k_bench_shader_count];
+	gpu_shader_info_t view_instanced_shaders[k_bench_shader_count];
+	float uniform_data[48];
+	float view_data[32];
+	float model_data[12];
+} bench_assets_t;
+
+typedef struct bench_result_t
+{
+	double frame_ms;
+	double submit_ms;
+	double record_ms;
+	render_stats_t render_stats;
+	gpu_stats_t stats;
+} bench_result_t;
+
+static void bench_assets_init(bench_assets_t* assets)
+{
+	memset(assets, 0, sizeof(*assets));
+	for (int i = 0; i < k_bench_mesh_count; ++i)
+	{
+		assets->meshes[i].layout = k_gpu_mesh_layout_tri_p444_c444_i2;
+		assets->meshes[i].vertex_data_size = 8 * 24;
+		assets->meshes[i].index_data_size = 36 * 2;
+	}
+	for (int i = 0; i < k_bench_shader_count; ++i)
+	{
+		assets->shaders[i].uniform_buffer_count = 1;
+		assets->instanced_shaders[i].instance_data_size = sizeof(assets->uniform_data);
+		assets->view_shaders[i].uniform_buffer_count = 2;
+		assets->view_shaders[i].view_data_size = sizeof(assets->view_data);
+		assets->view_instanced_shaders[i].uniform_buffer_count = 1;
+		assets->view_instanced_shaders[i].view_data_size = sizeof(assets->view_data);
+		assets->view_instanced_shaders[i].instance_data_size = sizeof(assets->model_data);
+	}
+}
+
+static void bench_scene_push_frame(render_t* render, bench_assets_t* assets, const bench_scene_t* scene, int frame)
+{
+	gpu_uniform_buffer_info_t uniform = { .data = assets->uniform_data, .size = sizeof(assets->uniform_data) };
+	gpu_shader_info_t* shaders = scene->instanced ? assets->instanced_shaders : assets->shaders;
+	if (scene->view)
+	{
+		gpu_uniform_buffer_info_t view = { .data = assets->view_data, .size = sizeof(assets->view_data) };
+		render_push_view(render, &view);
+		uniform = (gpu_uniform_buffer_info_t) { .data = assets->model_data, .size = sizeof(assets->model_data) };
+		shaders = scene->instanced ? assets->view_instanced_shaders : assets->view_shaders;
+	}
+	for (int i = 0; i < scene->entity_count; ++i)
+	{
+		ecs_entity_ref_t entity = { .entity = i, .sequence = i < scene->churn_count ? frame : 0 };
+		render_push_model(render, &entity,
+			&assets->meshes[i % scene->mesh_count],
+			&shaders[i % scene->shader_count],
+			&uniform);
+	}
+	render_push_done(render);
+}
+
+static void bench_stats_subtract(gpu_stats_t* stats, const gpu_stats_t* base)
+{
+	uint64_t* values = (uint64_t*)stats;
+	const uint64_t* base_values = (const uint64_t*)base;
+	for (int i = 0; i < sizeof(gpu_stats_t) / sizeof(uint64_t); ++i)
+	{
+		values[i] -= base_values[i];
+	}
+}
+
+// Run the scene and measure the steady state, after the warmup frames have created its resources.
+// With a job system, shaders compile and large frames record on its workers.
+static void bench_scene_run(heap_t* heap, job_system_t* jobs, bench_assets_t* assets, const bench_scene_t* scene, bench_result_t* result)
+{
+	render_t* render = render_create(heap, NULL, NULL, jobs, NULL, k_bench_frame_depth);
+
+	int frame = 0;
+	for (; frame < k_bench_warmup_frames; ++frame)
+	{
+		bench_scene_push_frame(render, assets, scene, frame);
+	}
+	render_stats_t render_base;
+	gpu_stats_t base;
+	render_get_stats(render, &render_base);
+	render_get_gpu_stats(render, &base);
+
+	uint64_t submit_ticks = 0;
+	uint64_t start = timer_get_ticks();
+	for (; frame < k_bench_warmup_frames + k_bench_frames; ++frame)
+	{
+		uint64_t push_start = timer_get_ticks();
+		bench_scene_push_frame(render, assets, scene, frame);
+		submit_ticks += timer_get_ticks() - push_start - render_get_push_stall_ticks(render);
+	}
+	render_get_stats(render, &result->render_stats);
+	render_get_gpu_stats(render, &result->stats);
+	uint64_t ticks = timer_get_ticks() - start;
+
+	render_destroy(render);
+
+	bench_stats_subtract(&result->stats, &base);
+	result->render_stats.binds_saved -= render_base.binds_saved;
+	result->render_stats.uniform_bytes_written -= render_base.uniform_bytes_written;
+	result->render_stats.view_bytes_written -= render_base.view_bytes_written;
+	result->render_stats.model_bytes_pushed -= render_base.model_bytes_pushed;
+	result->render_stats.cmd_buffer_count -= render_base.cmd_buffer_count;
+	result->render_stats.record_ticks -= render_base.record_ticks;
+	result->record_ms = (double)result->render_stats.record_ticks * 1000.0 / (double)timer_get_ticks_per_second() / k_bench_frames;
+	result->frame_ms = (double)ticks * 1000.0 / (double)timer_get_ticks_per_second() / k_bench_frames;
+	result->submit_ms = (double)submit_ticks * 1000.0 / (double)timer_get_ticks_per_second() / k_bench_frames;
+}
+
+void render_bench_run(heap_t* heap)
+{
+	bench_assets_t assets;
+	bench_assets_init(&assets);
+
+	const bench_scene_t k_scenes[] =
+	{
+		{ .name = "uniform", .entity_count = 10 * 1000, .mesh_count = 1, .shader_count = 1 },
+		{ .name = "mixed", .entity_count = 10 * 1000, .mesh_count = 3, .shader_count = 2 },
+		{ .name = "mixed+churn", .entity_count = 10 * 1000, .mesh_count = 3, .shader_count = 2, .churn_count = 1000 },
+		{ .name = "mixed+view", .entity_count = 10 * 1000, .mesh_count = 3, .shader_count = 2, .view = true },
+		{ .name = "instanced", .entity_count = 10 * 1000, .mesh_count = 3, .shader_count = 2, .instanced = true },
+		{ .name = "inst+view", .entity_count = 10 * 1000, .mesh_count = 3, .shader_count = 2, .instanced = true, .view = true },
+		{ .name = "instanced", .entity_count = 100 * 1000, .mesh_count = 3, .shader_count = 2, .instanced = true },
+	};
+	for (int i = 0; i < _countof(k_scenes); ++i)
+	{
+		const bench_scene_t* scene = &k_scenes[i];
+		bench_result_t result;
+		bench_scene_run(heap, NULL, &assets, scene, &result);
+
+		double frames = (double)k_bench_frames;
+		debug_print(k_print_info, "  %-12s %6d entities: %7.3f ms/frame, %6.0f draws/frame, %7.0f instances/ms, submit %7.0f cmds/ms\n",
+			scene->name, scene->entity_count,
+			result.frame_ms,
+			result.stats.draw_count / frames,
+			result.stats.instance_count / frames / result.frame_ms,
+			scene->entity_count / result.submit_ms);
+		debug_print(k_print_info, "  %-12s per frame: %6.0f pipeline, %6.0f mesh, %6.0f descriptor binds (%6.0f saved by sorting); %7.1f KB pushed, %7.1f KB uniforms (%4.1f KB views), %7.1f KB instance data; %6.0f uniform updates, %6.0f creates, %6.0f destroys\n",
+			"",
+			result.stats.pipeline_bind_count / frames,
+			result.stats.mesh_bind_count / frames,
+			result.stats.descriptor_bind_count / frames,
+			result.render_stats.binds_saved / frames,
+			result.render_stats.model_bytes_pushed / frames / 1024.0,
+			result.render_stats.uniform_bytes_written / frames / 1024.0,
+			result.render_stats.view_bytes_written / frames / 1024.0,
+			result.stats.instance_bytes_uploaded / frames / 1024.0,
+			result.stats.uniform_update_count / frames,
+			result.stats.object_create_count / frames,
+			result.stats.object_destroy_count / frames);
+	}
+}
+
+void render_cache_bench_run(heap_t* heap)
+{
+	bench_assets_t assets;
+	bench_assets_init(&assets);
+
+	const int k_entity_counts[] = { 1000, 10 * 1000, 50 * 1000 };
+	for (int i = 0; i < _countof(k_entity_counts); ++i)
+	{
+		int count = k_entity_counts[i];
+		bench_scene_t steady = { .entity_count = count, .mesh_count = k_bench_mesh_count, .shader_count = k_bench_shader_count };
+		bench_scene_t churn = steady;
+		churn.churn_count = count / 10;
+
+		bench_result_t steady_result;
+		bench_result_t churn_result;
+		bench_scene_run(heap, NULL, &assets, &steady, &steady_result);
+		bench_scene_run(heap, NULL, &assets, &churn, &churn_result);
+		debug_print(k_print_info, "  %6d instances: %7.3f ms/frame steady, %7.3f ms/frame with 10%% churn\n",
+			count, steady_result.frame_ms, churn_result.frame_ms);
+	}
+}
+
+void render_record_bench_run(heap_t* heap)
+{
+	bench_assets_t assets;
+	bench_assets_init(&assets);
+
+	// Enough shaders and meshes that every command buffer has binds to make, not just draws.
+	const bench_scene_t k_scenes[] =
+	{
+		{ .name = "mixed", .entity_count = 20 * 1000, .mesh_count = k_bench_mesh_count, .shader_count = k_bench_shader_count },
+		{ .name = "mixed", .entity_count = 100 * 1000, .mesh_count = k_bench_mesh_count, .shader_count = k_bench_shader_count },
+	};
+	int max_workers = thread_get_core_count();
+	for (int i = 0; i < _countof(k_scenes); ++i)
+	{
+		const bench_scene_t* scene = &k_scenes[i];
+		double serial_ms = 0.0;
+		for (int workers = 0; workers < max_workers; ++workers)
+		{
+			// No job system for the serial run, so it records the way a single-threaded renderer does.
+			job_system_t* jobs = workers ? job_system_create(heap, workers) : NULL;
+			bench_result_t result;
+			bench_scene_run(heap, jobs, &assets, scene, &result);
+			if (jobs)
+			{
+				job_system_destroy(jobs);
+			}
+			if (workers == 0)
+			{
+				serial_ms = result.record_ms;
+			}
+
+			double frames = (double)k_bench_frames;
+			debug_print(k_print_info, "  %-6s %6d entities, %2d workers: %7.3f ms/frame recording, %4.2fx; %4.1f cmd buffers, %7.0f draws/frame\n",
+				scene->name, scene->entity_count, workers,
+				result.record_ms,
+				serial_ms / result.record_ms,
+				result.render_stats.cmd_buffer_count / frames,
+				result.stats.draw_count / frames);
+		}
+	}
+}
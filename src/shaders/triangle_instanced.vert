@@ -0,0 +1,30 @@
+#version 450
+
+layout (location = 0) in vec3 inPos;
+layout (location = 1) in vec3 inColor;
+
+// Per-view data, shared by every instance drawn for the view.
+layout (binding = 0) uniform View
+{
+	mat4 projectionMatrix;
+	mat4 viewMatrix;
+} view;
+
+// Per-instance data: the top three rows of the model matrix. The bottom row is always 0, 0, 0, 1.
+layout (location = 2) in vec4 inModelRow0;
+layout (location = 3) in vec4 inModelRow1;
+layout (location = 4) in vec4 inModelRow2;
+
+layout (location = 0) out vec3 outColor;
+
+out gl_PerVertex
+{
+    vec4 gl_Position;
+};
+
+void main()
+{
+	mat4 modelMatrix = transpose(mat4(inModelRow0, inModelRow1, inModelRow2, vec4(0.0, 0.0, 0.0, 1.0)));
+	outColor = inColor;
+	gl_Position = view.projectionMatrix * view.viewMatrix * modelMatrix * vec4(inPos.xyz, 1.0);
+}
@@ -74,7 +74,7 @@ static void spawn_camera(simple_game_t* game);
 static void update_players(simple_game_t* game);
 static void draw_models(simple_game_t* game);
 
-simple_game_t* simple_game_create(heap_t* heap, fs_t* fs, wm_window_t* window, render_t* render, int argc, const char** argv)
+simple_game_t* simple_game_create(heap_t* heap, fs_t* fs, job_system_t* jobs, wm_window_t* window, render_t* render, int argc, const char** argv)
 {
 	simple_game_t* game = heap_alloc(heap, sizeof(simple_game_t), 8);
 	game->heap = heap;
@@ -91,7 +91,7 @@ simple_game_t* simple_game_create(heap_t* heap, fs_t* fs, wm_window_t* window, r
 	game->player_type = ecs_register_component_type(game->ecs, "player", sizeof(player_component_t), _Alignof(player_component_t));
 	game->name_type = ecs_register_component_type(game->ecs, "name", sizeof(name_component_t), _Alignof(name_component_t));
 
-	game->net = net_create(heap, game->ecs);
+	game->net = net_create(heap, game->ecs, jobs);
 	if (argc >= 2)
 	{
 		net_address_t server;
@@ -7,11 +7,12 @@ typedef struct simple_game_t simple_game_t;
 
 typedef struct fs_t fs_t;
 typedef struct heap_t heap_t;
+typedef struct job_system_t job_system_t;
 typedef struct render_t render_t;
 typedef struct wm_window_t wm_window_t;
 
 // Create an instance of simple test game.
-simple_game_t* simple_game_create(heap_t* heap, fs_t* fs, wm_window_t* window, render_t* render, int argc, const char** argv);
+simple_game_t* simple_game_create(heap_t* heap, fs_t* fs, job_system_t* jobs, wm_window_t* window, render_t* render, int argc, const char** argv);
 
 // Destroy an instance of simple test game.
 void simple_game_destroy(simple_game_t* game);
@@ -0,0 +1,161 @@
+#include "spsc_queue.h"
+
+#include "atomic.h"
+#include "heap.h"
+
+#include <string.h>
+
+enum
+{
+	k_cache_line_size = 64,
+	k_spin_count = 128,
+};
+
+typedef struct spsc_queue_t
+{
+	heap_t* heap;
+	void** items;
+	int mask;
+
+	// Producer line: staged tail and the producer's view of head.
+	char producer_padding[k_cache_line_size];
+	int staged_tail;
+	int cached_head;
+	int producer_waiting;
+
+	// Published tail, read by the consumer.
+	char tail_padding[k_cache_line_size - 3 * sizeof(int)];
+	int tail;
+
+	// Consumer line: head and the consumer's view of tail.
+	char head_padding[k_cache_line_size - sizeof(int)];
+	int head;
+	int cached_tail;
+	int consumer_waiting;
+	char end_padding[k_cache_line_size - 3 * sizeof(int)];
+} spsc_queue_t;
+
+spsc_queue_t* spsc_queue_create(heap_t* heap, int capacity)
+{
+	int rounded = 1;
+	while (rounded < capacity)
+	{
+		rounded *= 2;
+	}
+
+	spsc_queue_t* queue = heap_alloc(heap, sizeof(spsc_queue_t), k_cache_line_size);
+	memset(queue, 0, sizeof(*queue));
+	queue->heap = heap;
+	queue->items = heap_alloc(heap, sizeof(void*) * rounded, k_cache_line_size);
+	queue->mask = rounded - 1;
+	return queue;
+}
+
+void spsc_queue_destroy(spsc_queue_t* queue)
+{
+	heap_free(queue->heap, queue->items);
+	heap_free(queue->heap, queue);
+}
+
+bool spsc_queue_try_push(spsc_queue_t* queue, void* item)
+{
+	int tail = queue->staged_tail;
+	if (tail - queue->cached_head > queue->mask)
+	{
+		// Only re-read the consumer's head when the cached copy says full.
+		queue->cached_head = atomic_load(&queue->head);
+		if (tail - queue->cached_head > queue->mask)
+		{
+			return false;
+		}
+	}
+	queue->items[tail & queue->mask] = item;
+	queue->staged_tail = tail + 1;
+	return true;
+}
+
+void spsc_queue_publish(spsc_queue_t* queue)
+{
+	if (queue->staged_tail == queue->tail)
+	{
+		return;
+	}
+	// Exchange is a full barrier, so the tail is visible before the waiting flag is read.
+	atomic_exchange(&queue->tail, queue->staged_tail);
+	if (atomic_load(&queue->consumer_waiting))
+	{
+		atomic_wake_one(&queue->tail);
+	}
+}
+
+void spsc_queue_push(spsc_queue_t* queue, void* item)
+{
+	if (spsc_queue_try_push(queue, item))
+	{
+		return;
+	}
+
+	spsc_queue_publish(queue);
+	for (int i = 0; i < k_spin_count; ++i)
+	{
+		if (spsc_queue_try_push(queue, item))
+		{
+			return;
+		}
+	}
+	while (true)
+	{
+		int head = atomic_load(&queue->head);
+		atomic_exchange(&queue->producer_waiting, 1);
+		if (spsc_queue_try_push(queue, item))
+		{
+			atomic_store(&queue->producer_waiting, 0);
+			return;
+		}
+		atomic_wait(&queue->head, head);
+		atomic_store(&queue->producer_waiting, 0);
+	}
+}
+
+void* spsc_queue_try_pop(spsc_queue_t* queue)
+{
+	int head = queue->head;
+	if (head == queue->cached_tail)
+	{
+		queue->cached_tail = atomic_load(&queue->tail);
+		if (head == queue->cached_tail)
+		{
+			return NULL;
+		}
+	}
+	void* item = queue->items[head & queue->mask];
+	atomic_exchange(&queue->head, head + 1);
+	if (atomic_load(&queue->producer_waiting))
+	{
+		atomic_wake_one(&queue->head);
+	}
+	return item;
+}
+
+void* spsc_queue_pop(spsc_queue_t* queue)
+{
+	for (int i = 0; i < k_spin_count; ++i)
+	{
+		if (queue->head != queue->cached_tail || queue->head != atomic_load(&queue->tail))
+		{
+			return spsc_queue_try_pop(queue);
+		}
+	}
+	while (true)
+	{
+		int tail = atomic_load(&queue->tail);
+		atomic_exchange(&queue->consumer_waiting, 1);
+		if (queue->head != atomic_load(&queue->tail))
+		{
+			atomic_store(&queue->consumer_waiting, 0);
+			return spsc_queue_try_pop(queue);
+		}
+		atomic_wait(&queue->tail, tail);
+		atomic_store(&queue->consumer_waiting, 0);
+	}
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Single-producer, single-consumer queue container
+// One thread pushes and one thread pops. Neither side takes a lock,
+// and a push or pop that does not have to wait is wait-free.
+// Pushed items are staged until published, so the producer can
+// make a batch visible with a single store.
+
+// Handle to a single-producer, single-consumer queue.
+typedef struct spsc_queue_t spsc_queue_t;
+
+typedef struct heap_t heap_t;
+
+// Create a queue with the defined capacity.
+// Capacity is rounded up to a power of two.
+spsc_queue_t* spsc_queue_create(heap_t* heap, int capacity);
+
+// Destroy a previously created queue.
+void spsc_queue_destroy(spsc_queue_t* queue);
+
+// Stage an item at the back of the queue if space is available.
+// The item is not visible to the consumer until spsc_queue_publish().
+// If the queue is full, returns false. Producer only.
+bool spsc_queue_try_push(spsc_queue_t* queue, void* item);
+
+// Stage an item at the back of the queue.
+// If the queue is full, publishes staged items and blocks until space is available.
+// Producer only.
+void spsc_queue_push(spsc_queue_t* queue, void* item);
+
+// Make all staged items visible to the consumer.
+// Producer only.
+void spsc_queue_publish(spsc_queue_t* queue);
+
+// Pop an item off the queue (FIFO order).
+// If no published item is available, returns NULL. Consumer only.
+void* spsc_queue_try_pop(spsc_queue_t* queue);
+
+// Pop an item off the queue (FIFO order).
+// If no published item is available, blocks until one is. Consumer only.
+void* spsc_queue_pop(spsc_queue_t* queue);
@@ -0,0 +1,152 @@
+#include "bench.h"
+
+#include "atomic.h"
+#include "debug.h"
+#include "heap.h"
+#include "queue.h"
+#include "spsc_queue.h"
+#include "thread.h"
+#include "timer.h"
+
+#include <stdint.h>
+
+enum
+{
+	k_bench_frames = 60,
+	k_bench_publish_batch = 64,
+	k_bench_frame_depth = 2,
+	k_bench_item_work = 32,
+};
+
+// Replays the render submission pattern: draws followed by an end-of-frame marker.
+// The consumer stands in for the render thread with a little work per draw.
+typedef struct bench_render_t
+{
+	queue_t* queue;
+	spsc_queue_t* spsc;
+	int frames_completed;
+	uint32_t sink;
+} bench_render_t;
+
+static void* const k_bench_frame_marker = (void*)1;
+static void* const k_bench_draw = (void*)2;
+
+static void bench_consume(bench_render_t* bench, void* item)
+{
+	if (item == k_bench_frame_marker)
+	{
+		atomic_increment(&bench->frames_completed);
+		atomic_wake_one(&bench->frames_completed);
+		return;
+	}
+	uint32_t x = bench->sink;
+	for (int i = 0; i < k_bench_item_work; ++i)
+	{
+		x = x * 1664525u + 1013904223u;
+	}
+	bench->sink = x;
+}
+
+static int bench_queue_consumer_func(void* user)
+{
+	bench_render_t* bench = user;
+	for (void* item = queue_pop(bench->queue); item; item = queue_pop(bench->queue))
+	{
+		bench_consume(bench, item);
+	}
+	return 0;
+}
+
+static int bench_spsc_consumer_func(void* user)
+{
+	bench_render_t* bench = user;
+	for (void* item = spsc_queue_pop(bench->spsc); item; item = spsc_queue_pop(bench->spsc))
+	{
+		bench_consume(bench, item);
+	}
+	return 0;
+}
+
+// The original path: a 3-item semaphore queue, pushing one item at a time.
+static double bench_queue_stall_ms(heap_t* heap, int draws_per_frame)
+{
+	bench_render_t bench = { .queue = queue_create_type(heap, 3, k_queue_semaphore) };
+	thread_t* thread = thread_create(bench_queue_consumer_func, &bench);
+
+	uint64_t stall = 0;
+	for (int f = 0; f < k_bench_frames; ++f)
+	{
+		for (int d = 0; d <= draws_per_frame; ++d)
+		{
+			void* item = d < draws_per_frame ? k_bench_draw : k_bench_frame_marker;
+			if (!queue_try_push(bench.queue, item))
+			{
+				uint64_t start = timer_get_ticks();
+				queue_push(bench.queue, item);
+				stall += timer_get_ticks() - start;
+			}
+		}
+	}
+	queue_push(bench.queue, NULL);
+	thread_destroy(thread);
+	queue_destroy(bench.queue);
+
+	return (double)stall * 1000.0 / (double)timer_get_ticks_per_second() / k_bench_frames;
+}
+
+// The render path: a frame-depth limited SPSC ring with batched publish.
+static double bench_spsc_stall_ms(heap_t* heap, int draws_per_frame)
+{
+	bench_render_t bench = { .spsc = spsc_queue_create(heap, 64 * 1024) };
+	thread_t* thread = thread_create(bench_spsc_consumer_func, &bench);
+
+	uint64_t stall = 0;
+	for (int f = 0; f < k_bench_frames; ++f)
+	{
+		for (int d = 0; d <= draws_per_frame; ++d)
+		{
+			void* item = d < draws_per_frame ? k_bench_draw : k_bench_frame_marker;
+			if (!spsc_queue_try_push(bench.spsc, item))
+			{
+				uint64_t start = timer_get_ticks();
+				spsc_queue_push(bench.spsc, item);
+				stall += timer_get_ticks() - start;
+			}
+			if (d % k_bench_publish_batch == 0)
+			{
+				spsc_queue_publish(bench.spsc);
+			}
+		}
+		spsc_queue_publish(bench.spsc);
+
+		int completed = atomic_load(&bench.frames_completed);
+		if (f + 1 - completed > k_bench_frame_depth)
+		{
+			uint64_t start = timer_get_ticks();
+			while (f + 1 - completed > k_bench_frame_depth)
+			{
+				atomic_wait(&bench.frames_completed, completed);
+				completed = atomic_load(&bench.frames_completed);
+			}
+			stall += timer_get_ticks() - start;
+		}
+	}
+	spsc_queue_push(bench.spsc, NULL);
+	spsc_queue_publish(bench.spsc);
+	thread_destroy(thread);
+	spsc_queue_destroy(bench.spsc);
+
+	return (double)stall * 1000.0 / (double)timer_get_ticks_per_second() / k_bench_frames;
+}
+
+void spsc_queue_bench_run(heap_t* heap)
+{
+	const int k_draw_counts[] = { 100, 1000, 10 * 1000 };
+	for (int i = 0; i < _countof(k_draw_counts); ++i)
+	{
+		double queue_ms = bench_queue_stall_ms(heap, k_draw_counts[i]);
+		double spsc_ms = bench_spsc_stall_ms(heap, k_draw_counts[i]);
+		debug_print(k_print_info, "  %6d draws/frame: semaphore queue stall %7.3f ms/frame, spsc stall %7.3f ms/frame\n",
+			k_draw_counts[i], queue_ms, spsc_ms);
+	}
+}
@@ -1,10 +1,14 @@
 #include "thread.h"
 
+#include "atomic.h"
 #include "debug.h"
+#include "mutex.h"
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
+static int s_next_registry_id;
+
 thread_t* thread_create(int (*function)(void*), void* data)
 {
 	HANDLE h = CreateThread(NULL, 0, function, data, CREATE_SUSPENDED, NULL);
@@ -30,3 +34,50 @@ void thread_sleep(uint32_t ms)
 {
 	Sleep(ms);
 }
+
+int thread_get_core_count()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+}
+
+int thread_get_current_id()
+{
+	return (int)GetCurrentThreadId();
+}
+
+void thread_registry_init(thread_registry_t* registry)
+{
+	registry->id = atomic_increment(&s_next_registry_id) + 1;
+	registry->count = 0;
+}
+
+void* thread_registry_lookup(thread_registry_t* registry, thread_registry_slot_t* slot, mutex_t* mutex, void* (*create)(void* user), void* user)
+{
+	int thread_id = thread_get_current_id();
+	void* state = NULL;
+	mutex_lock(mutex);
+	for (int i = 0; i < registry->count && !state; ++i)
+	{
+		if (registry->thread_ids[i] == thread_id)
+		{
+			state = registry->states[i];
+		}
+	}
+	if (!state && registry->count < k_thread_registry_max_threads)
+	{
+		state = create(user);
+		if (state)
+		{
+			registry->thread_ids[registry->count] = thread_id;
+			registry->states[registry->count] = state;
+			registry->count++;
+		}
+	}
+	mutex_unlock(mutex);
+
+	slot->registry_id = registry->id;
+	slot->state = state;
+	return state;
+}
@@ -13,8 +13,62 @@ thread_t* thread_create(int (*function)(void*), void* data);
 
 // Waits for a thread to complete and destroys it.
 // Returns the thread's exit code.
-int thread_destroy(thread);
+int thread_destroy(thread_t* thread);
 
 // Puts the calling thread to sleep for the specified number of milliseconds.
 // Thread will sleep for *approximately* the specified time.
 void thread_sleep(uint32_t ms);
+
+// Get the number of logical processors available to the process.
+int thread_get_core_count();
+
+// Get the calling thread's id. A new thread may be given the id of one that has exited.
+int thread_get_current_id();
+
+// Declares a variable with a separate copy in each thread.
+#define THREAD_LOCAL __declspec(thread)
+
+typedef struct mutex_t mutex_t;
+
+enum
+{
+	// Threads a registry keeps state for. Threads past the limit get none.
+	k_thread_registry_max_threads = 64,
+};
+
+// State an object such as a heap keeps for each thread that uses it, found by thread id.
+// Thread ids are reused, so a new thread takes over the state of an exited thread with its id.
+typedef struct thread_registry_t
+{
+	// Distinguishes this registry from earlier ones at the same address in each thread's slot.
+	int id;
+	int count;
+	int thread_ids[k_thread_registry_max_threads];
+	void* states[k_thread_registry_max_threads];
+} thread_registry_t;
+
+// The registry a thread looked up last, and its state there.
+// Each user of a registry keeps one of these as a THREAD_LOCAL static, so lookups after the first take no lock.
+typedef struct thread_registry_slot_t
+{
+	int registry_id;
+	void* state;
+} thread_registry_slot_t;
+
+// Initialize an empty registry with an id no earlier registry had.
+void thread_registry_init(thread_registry_t* registry);
+
+// Find the calling thread's state under the mutex, creating it with create(user) the first time.
+// Records the result in slot. Returns NULL if the registry is full or create fails.
+// create is called with the mutex held.
+void* thread_registry_lookup(thread_registry_t* registry, thread_registry_slot_t* slot, mutex_t* mutex, void* (*create)(void* user), void* user);
+
+// Get the calling thread's state, from slot if it last looked up this registry.
+__forceinline void* thread_registry_get(thread_registry_t* registry, thread_registry_slot_t* slot, mutex_t* mutex, void* (*create)(void* user), void* user)
+{
+	if (slot->registry_id == registry->id)
+	{
+		return slot->state;
+	}
+	return thread_registry_lookup(registry, slot, mutex, create, user);
+}
@@ -1,4 +1,7 @@
 #include "trace.h"
+#include "debug.h"
+#include "heap.h"
+#include "object_pool.h"
 #include "queue.h"
 #include "semaphore.h"
 #include "timer.h"
@@ -9,24 +12,45 @@
 #define WIN32_LEAN_AND_MEAN
 #include<windows.h>
 
+enum
+{
+	//Longest event name kept, including the terminator; longer names are cut short
+	k_trace_max_name = 64,
+	k_trace_event_pool_chunk_count = 64,
+	//Longest counter event written, with all of its series
+	k_trace_max_counter = 512,
+	//Longest duration event written; room for a full name and track with the JSON around them
+	k_trace_max_event = 256,
+	//Starting size of the event buffer, which doubles when full
+	k_trace_initial_buffer_size = 64 * 1024,
+};
+
 typedef struct trace_t 
 {
 	//Queue to order events
 	queue_t* queue;
 	//The heap that the trace is in
 	heap_t* heap;
+	//Pool for events, which are pushed and popped constantly while capturing
+	object_pool_t* eventPool;
 	//Semaphore for threads
 	semaphore_t* sem;
 	//Timer object
 	timer_object_t* timer;
+	//Ticks when the timer started, to place durations timed elsewhere
+	uint64_t startTicks;
 	//Max number of events the trace can hold
 	int eventCapacity;
 	//0 for false, 1 for start
 	int startCapture;
 	//File name when capture starts
 	char* path;
-	//Buffer for the events
+	//Buffer for the events, grown as a capture fills it
 	char* buffer; 
+	//Bytes written to the buffer, not counting the terminator
+	size_t bufferSize;
+	//Bytes the buffer can hold, including the terminator
+	size_t bufferCapacity;
 } trace_t;
 
 typedef struct event_t
@@ -34,21 +58,28 @@ typedef struct event_t
 	//Thread ID of Event
 	int tid;
 	//Event Name
-	char* name;
+	char name[k_trace_max_name];
 } event_t;
 
+static void trace_append(trace_t* trace, const char* text, size_t length);
+
 trace_t* trace_create(heap_t* heap, int event_capacity)
 {
 	//Make a Trace object
-	trace_t* trace = heap_alloc(heap, sizeof(trace_t), 8);
+	trace_t* trace = heap_alloc_tagged(heap, sizeof(trace_t), 8, k_heap_tag_trace);
 	trace->heap = heap;
 	trace->queue = queue_create(trace->heap, event_capacity);
+	trace->eventPool = object_pool_create(heap, sizeof(event_t), 8, k_trace_event_pool_chunk_count);
 	trace->sem = semaphore_create(1, 1);
+	trace->startTicks = timer_get_ticks();
 	trace->timer = timer_object_create(heap, NULL);
 	trace->eventCapacity = event_capacity;
 	trace->startCapture = 0;
 	trace->path = NULL;
-	trace->buffer = calloc(10000, sizeof(char));
+	trace->bufferCapacity = k_trace_initial_buffer_size;
+	trace->bufferSize = 0;
+	trace->buffer = heap_alloc_tagged(heap, trace->bufferCapacity, 8, k_heap_tag_trace);
+	trace->buffer[0] = '\0';
 	return trace;
 }
 
@@ -56,10 +87,11 @@ void trace_destroy(trace_t* trace)
 {
 	//Clean up memory
 	queue_destroy(trace->queue);
+	object_pool_destroy(trace->eventPool);
 	semaphore_destroy(trace->sem);
 	timer_object_destroy(trace->timer);
 	if (trace->path != NULL) { free(trace->path); }
-	free(trace->buffer);
+	heap_free(trace->heap, trace->buffer);
 	heap_free(trace->heap, trace);
 }
 
@@ -68,15 +100,16 @@ void trace_duration_push(trace_t* trace, const char* name)
 	if (trace->startCapture == 1) //Checks to see if capture is on
 	{
 		//Add a new event to the queue
-		event_t* ev = heap_alloc(trace->heap, sizeof(event_t),8);
-		ev->name = heap_alloc(trace->heap, (strlen(name)+1),8);
-		strcpy_s(ev->name, (strlen(name)+1), name);
+		event_t* ev = object_pool_alloc(trace->eventPool);
+		strncpy_s(ev->name, sizeof(ev->name), name, _TRUNCATE);
+		semaphore_acquire(trace->sem);
 		timer_object_update(trace->timer);
 		UINT64 timeStart = timer_object_get_us(trace->timer);
-		char* tmp = calloc(100, sizeof(char));
-		sprintf_s(tmp, 100, "\n\t\t{\"name\":\"%s\",\"ph\":\"B\",\"pid\":0,\"tid\":\"%d\",\"ts\":\"%I64u\"},",ev->name, GetCurrentThreadId(), timeStart);
-		strcat_s(trace->buffer, 10000, tmp);
-		free(tmp);
+		//Names are cut to k_trace_max_name, so the event always fits
+		char tmp[k_trace_max_event];
+		int length = sprintf_s(tmp, sizeof(tmp), "\n\t\t{\"name\":\"%s\",\"ph\":\"B\",\"pid\":0,\"tid\":\"%d\",\"ts\":\"%I64u\"},",ev->name, GetCurrentThreadId(), timeStart);
+		trace_append(trace, tmp, length);
+		semaphore_release(trace->sem);
 		queue_push(trace->queue, ev);
 	}
 }
@@ -90,13 +123,59 @@ void trace_duration_pop(trace_t* trace)
 		event_t* top = queue_pop(trace->queue);
 		timer_object_update(trace->timer);
 		UINT64 timeEnd = timer_object_get_us(trace->timer);
-		char* tmp = calloc(100, sizeof(char));
-		sprintf_s(tmp, 100, "\n\t\t{\"name\":\"%s\",\"ph\":\"E\",\"pid\":0,\"tid\":\"%d\",\"ts\":\"%I64u\"},", top->name, GetCurrentThreadId(), timeEnd);
-		strcat_s(trace->buffer, 10000, tmp);
-		free(tmp);
+		char tmp[k_trace_max_event];
+		int length = sprintf_s(tmp, sizeof(tmp), "\n\t\t{\"name\":\"%s\",\"ph\":\"E\",\"pid\":0,\"tid\":\"%d\",\"ts\":\"%I64u\"},", top->name, GetCurrentThreadId(), timeEnd);
+		trace_append(trace, tmp, length);
 		//Clear the recently popped item
-		heap_free(trace->heap,top->name);
-		heap_free(trace->heap, top);
+		object_pool_free(trace->eventPool, top);
+		semaphore_release(trace->sem);
+	}
+}
+
+void trace_duration_add(trace_t* trace, const char* track, const char* name, uint64_t start_ticks, uint64_t end_ticks)
+{
+	if (trace->startCapture == 1) //Checks to see if capture is on
+	{
+		semaphore_acquire(trace->sem);
+		//Durations from before the trace was created can't be placed on its timeline
+		if (start_ticks >= trace->startTicks && end_ticks >= start_ticks)
+		{
+			UINT64 timeStart = timer_ticks_to_us(start_ticks - trace->startTicks);
+			UINT64 duration = timer_ticks_to_us(end_ticks - start_ticks);
+			char tmp[k_trace_max_event];
+			//A negative length means the event didn't fit, so it is dropped
+			int length = _snprintf_s(tmp, sizeof(tmp), _TRUNCATE, "\n\t\t{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":\"%s\",\"ts\":\"%I64u\",\"dur\":\"%I64u\"},", name, track, timeStart, duration);
+			if (length >= 0)
+			{
+				trace_append(trace, tmp, length);
+			}
+		}
+		semaphore_release(trace->sem);
+	}
+}
+
+void trace_counter(trace_t* trace, const char* name, int count, const char* const* series, const int64_t* values)
+{
+	if (trace->startCapture == 1) //Checks to see if capture is on
+	{
+		semaphore_acquire(trace->sem);
+		timer_object_update(trace->timer);
+		UINT64 timeNow = timer_object_get_us(trace->timer);
+		char* tmp = calloc(k_trace_max_counter, sizeof(char));
+		//A negative length means the event didn't fit
+		int length = _snprintf_s(tmp, k_trace_max_counter, _TRUNCATE, "\n\t\t{\"name\":\"%s\",\"ph\":\"C\",\"pid\":0,\"ts\":\"%I64u\",\"args\":{", name, timeNow);
+		for (int i = 0; i < count && length >= 0; ++i)
+		{
+			int written = _snprintf_s(tmp + length, k_trace_max_counter - length, _TRUNCATE, "%s\"%s\":%I64d", i ? "," : "", series[i], values[i]);
+			length = written >= 0 ? length + written : -1;
+		}
+		//Drop the event if it didn't fit, leaving room to close it
+		if (length >= 0 && length + 4 <= k_trace_max_counter)
+		{
+			strcat_s(tmp, k_trace_max_counter, "}},");
+			trace_append(trace, tmp, length + 3);
+		}
+		free(tmp);
 		semaphore_release(trace->sem);
 	}
 }
@@ -104,21 +183,52 @@ void trace_duration_pop(trace_t* trace)
 void trace_capture_start(trace_t* trace, const char* path)
 {
 	//Set up the JSON file buffer and path, start timer
-	trace->startCapture = 1;
 	trace->path = calloc(strlen(path)+1, sizeof(char));
 	strncpy_s(trace->path, (strlen(path) + 1), path, strlen(path));
-	strncpy_s(trace->buffer, 51, "{ \n \t \"displayTimeUnit\": \"ns\", \"traceEvents\": [" , 51);
+	const char* header = "{ \n \t \"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+	semaphore_acquire(trace->sem);
+	trace->bufferSize = 0;
+	trace_append(trace, header, strlen(header));
+	semaphore_release(trace->sem);
 	timer_object_update(trace->timer);
+	trace->startCapture = 1;
 }
 
 void trace_capture_stop(trace_t* trace)
 {
 	//Stop the capture and write the JSON
 	trace->startCapture = 0;
-	strcat_s(trace->buffer, 10000, "\n\t]\n}");
-	printf(trace->buffer);
+	const char* footer = "\n\t]\n}";
+	semaphore_acquire(trace->sem);
+	trace_append(trace, footer, strlen(footer));
+	semaphore_release(trace->sem);
 	FILE* fp;
-	fopen_s(&fp,trace->path, "w");
-	fprintf(fp, trace->buffer);
+	if (fopen_s(&fp, trace->path, "w") != 0)
+	{
+		debug_print(k_print_error, "Unable to write trace to %s\n", trace->path);
+		return;
+	}
+	fwrite(trace->buffer, 1, trace->bufferSize, fp);
 	fclose(fp);
 }
+
+//Append to the event buffer, doubling it when full; call with the semaphore held
+static void trace_append(trace_t* trace, const char* text, size_t length)
+{
+	if (trace->bufferSize + length + 1 > trace->bufferCapacity)
+	{
+		size_t capacity = trace->bufferCapacity * 2;
+		while (trace->bufferSize + length + 1 > capacity)
+		{
+			capacity *= 2;
+		}
+		char* buffer = heap_alloc_tagged(trace->heap, capacity, 8, k_heap_tag_trace);
+		memcpy(buffer, trace->buffer, trace->bufferSize + 1);
+		heap_free(trace->heap, trace->buffer);
+		trace->buffer = buffer;
+		trace->bufferCapacity = capacity;
+	}
+	memcpy(trace->buffer + trace->bufferSize, text, length);
+	trace->bufferSize += length;
+	trace->buffer[trace->bufferSize] = '\0';
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdint.h>
+
 typedef struct heap_t heap_t;
 
 typedef struct trace_t trace_t;
@@ -18,6 +20,14 @@ void trace_duration_push(trace_t* trace, const char* name);
 // End tracing the currently active duration on the current thread.
 void trace_duration_pop(trace_t* trace);
 
+// Add a duration that was timed elsewhere, such as on the GPU, to a named track.
+// Start and end are timer_get_ticks() values.
+void trace_duration_add(trace_t* trace, const char* track, const char* name, uint64_t start_ticks, uint64_t end_ticks);
+
+// Add a counter sample, drawn as a graph with one stacked series per value.
+// Series names and values are parallel arrays of count entries.
+void trace_counter(trace_t* trace, const char* name, int count, const char* const* series, const int64_t* values);
+
 // Start recording trace events.
 // A Chrome trace file will be written to path.
 void trace_capture_start(trace_t* trace, const char* path);
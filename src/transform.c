@@ -50,6 +50,19 @@ void transform_to_matrix(const transform_t* transform, mat4f_t* output)
 	output->data[3][3] = 1.0f;
 }
 
+void transform_to_affine_rows(const transform_t* transform, float rows[3][4])
+{
+	mat4f_t matrix;
+	transform_to_matrix(transform, &matrix);
+	for (int row = 0; row < 3; ++row)
+	{
+		for (int column = 0; column < 4; ++column)
+		{
+			rows[row][column] = matrix.data[column][row];
+		}
+	}
+}
+
 void transform_multiply(transform_t* result, const transform_t* t)
 {
 	const vec3f_t scaled_translation = vec3f_mul(result->translation, t->scale);
@@ -21,6 +21,10 @@ void transform_identity(transform_t* transform);
 // Convert a transform to a matrix representation.
 void transform_to_matrix(const transform_t* transform, mat4f_t* output);
 
+// Convert a transform to the top three rows of its matrix representation.
+// The bottom row is always 0, 0, 0, 1, so these 48 bytes are enough to rebuild the matrix.
+void transform_to_affine_rows(const transform_t* transform, float rows[3][4]);
+
 // Combine to transforms -- result and t -- and store the output in result.
 void transform_multiply(transform_t* result, const transform_t* t);
 